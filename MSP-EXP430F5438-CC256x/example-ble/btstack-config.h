@@ -19,6 +19,7 @@
 // 
 
 #define MAX_NO_HCI_CONNECTIONS 1
+#define MAX_NO_SM_CONNECTIONS 1
 #define MAX_NO_L2CAP_SERVICES  0
 #define MAX_NO_L2CAP_CHANNELS  0
 #define MAX_NO_RFCOMM_MULTIPLEXERS 0
@@ -29,5 +30,6 @@
 #define MAX_NO_DB_MEM_DEVICE_LINK_KEYS  2
 #define MAX_NO_DB_MEM_DEVICE_NAMES 0
 #define MAX_NO_DB_MEM_SERVICES 0
+#define MAX_NO_SDP_SERVER_CONNECTIONS 0
 
 #endif
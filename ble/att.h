@@ -150,6 +150,9 @@ extern "C" {
 #define GAP_SERVICE_UUID               0x1800
 #define GAP_DEVICE_NAME_UUID           0x2a00
 
+#define GATT_SERVICE_UUID              0x1801
+#define GATT_SERVICE_CHANGED_UUID      0x2a05
+
 
 typedef struct att_connection {
     uint16_t con_handle;
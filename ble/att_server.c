@@ -50,6 +50,7 @@
 #include "btstack_memory.h"
 #include "hci.h"
 #include "hci_dump.h"
+#include "btstack_stats.h"
 
 #include "l2cap.h"
 
@@ -107,6 +108,12 @@ static void att_handle_value_indication_timeout(timer_source_t *ts){
     att_handle_value_indication_notify_client(ATT_HANDLE_VALUE_INDICATION_TIMEOUT, att_connection.con_handle, att_handle);
 }
 
+// @returns 1 if SM event is about the connected client
+static int att_server_sm_event_for_client(sm_event_t * event){
+    if (event->addr_type != att_client_addr_type) return 0;
+    return memcmp(event->address, att_client_address, 6) == 0;
+}
+
 static void att_event_packet_handler (uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
     
     switch (packet_type) {
@@ -115,6 +122,7 @@ static void att_event_packet_handler (uint8_t packet_type, uint16_t channel, uin
             switch (packet[0]) {
                 
                 case DAEMON_EVENT_HCI_PACKET_SENT:
+                case DAEMON_EVENT_HCI_BATCH_COMPLETE:
                     att_run();
                     break;
                     
@@ -154,16 +162,20 @@ static void att_event_packet_handler (uint8_t packet_type, uint16_t channel, uin
                     break;
                     
                 case SM_IDENTITY_RESOLVING_STARTED:
+                    // lookups for other connections run concurrently
+                    if (!att_server_sm_event_for_client((sm_event_t *) packet)) break;
                     log_info("SM_IDENTITY_RESOLVING_STARTED");
                     att_ir_lookup_active = 1;
                     break;
                 case SM_IDENTITY_RESOLVING_SUCCEEDED:
+                    if (!att_server_sm_event_for_client((sm_event_t *) packet)) break;
                     att_ir_lookup_active = 0;
                     att_ir_central_device_db_index = ((sm_event_t*) packet)->central_device_db_index;
                     log_info("SM_IDENTITY_RESOLVING_SUCCEEDED id %u", att_ir_central_device_db_index);
                     att_run();
                     break;
                 case SM_IDENTITY_RESOLVING_FAILED:
+                    if (!att_server_sm_event_for_client((sm_event_t *) packet)) break;
                     log_info("SM_IDENTITY_RESOLVING_FAILED");
                     att_ir_lookup_active = 0;
                     att_ir_central_device_db_index = -1;
@@ -172,8 +184,7 @@ static void att_event_packet_handler (uint8_t packet_type, uint16_t channel, uin
 
                 case SM_AUTHORIZATION_RESULT: {
                     sm_event_t * event = (sm_event_t *) packet;
-                    if (event->addr_type != att_client_addr_type) break;
-                    if (memcmp(event->address, att_client_address, 6) != 0) break;
+                    if (!att_server_sm_event_for_client(event)) break;
                     att_connection.authorized = event->authorization_result;
                     att_run();
                 	break;
@@ -188,8 +199,9 @@ static void att_event_packet_handler (uint8_t packet_type, uint16_t channel, uin
     }
 }
 
-static void att_signed_write_handle_cmac_result(uint8_t hash[8]){
+static void att_signed_write_handle_cmac_result(uint16_t con_handle, uint8_t hash[8]){
     
+    if (con_handle != att_connection.con_handle) return;
     if (att_server_state != ATT_SERVER_W4_SIGNED_WRITE_VALIDATION) return;
 
     if (memcmp(hash, &att_request_buffer[att_request_size-8], 8)){
@@ -206,6 +218,9 @@ static void att_signed_write_handle_cmac_result(uint8_t hash[8]){
 }
 
 static void att_run(void){
+    // run once at the end of the HCI batch
+    if (hci_batch_active()) return;
+
     switch (att_server_state){
         case ATT_SERVER_IDLE:
         case ATT_SERVER_W4_SIGNED_WRITE_VALIDATION:
@@ -213,7 +228,7 @@ static void att_run(void){
         case ATT_SERVER_REQUEST_RECEIVED:
             if (att_request_buffer[0] == ATT_SIGNED_WRITE_COMMAND){
                 log_info("ATT Signed Write!");
-                if (!sm_cmac_ready()) {
+                if (!sm_cmac_ready(att_connection.con_handle)) {
                     log_info("ATT Signed Write, sm_cmac engine not ready. Abort");
                     att_server_state = ATT_SERVER_IDLE;
                      return;
@@ -248,7 +263,7 @@ static void att_run(void){
                 att_server_state = ATT_SERVER_W4_SIGNED_WRITE_VALIDATION;
                 log_info("Orig Signature: ");
                 hexdump( &att_request_buffer[att_request_size-8], 8);
-                sm_cmac_start(csrk, att_request_size - 8, att_request_buffer, att_signed_write_handle_cmac_result);
+                sm_cmac_start(att_connection.con_handle, csrk, att_request_size - 8, att_request_buffer, att_signed_write_handle_cmac_result);
                 return;
             } 
             // NOTE: fall through for regular commands
@@ -280,6 +295,7 @@ static void att_run(void){
             }
 
             att_server_state = ATT_SERVER_IDLE;
+            STATS_STOP(BTSTACK_STATS_ATT_RESPONSE);
             if (att_response_size == 0) {
                 l2cap_release_packet_buffer();
                 return;
@@ -312,6 +328,8 @@ static void att_packet_handler(uint8_t packet_type, uint16_t handle, uint8_t *pa
     att_server_state = ATT_SERVER_REQUEST_RECEIVED;
     att_request_size = size;
     memcpy(att_request_buffer, packet, size);
+    STATS_SINCE_RX(BTSTACK_STATS_ATT_RX);
+    STATS_START(BTSTACK_STATS_ATT_RESPONSE);
 
     att_run();
 }
@@ -79,6 +79,19 @@ int central_device_db_add(int addr_type, bd_addr_t addr, sm_key_t irk, sm_key_t
  */
 int central_device_db_count(void);
 
+/**
+ * @brief find device by address
+ * @param addr_type, address of the device
+ * @returns index if found, -1 otherwise
+ */
+int central_device_db_lookup(int addr_type, bd_addr_t addr);
+
+/**
+ * @brief get IRKs of all devices for address resolution
+ * @returns table with central_device_db_count() IRKs ordered by index, NULL if not available
+ */
+const sm_key_t * central_device_db_irk_table(void);
+
 /**
  * @brief get device information: addr type and address needed to identify device
  * @param index
@@ -109,7 +122,7 @@ uint32_t central_device_db_counter_get(int index);
 void central_device_db_counter_set(int index, uint32_t counter);
 
 /**
- * @brief free device
+ * @brief free device, index of other devices may change
  * @param index
  */
 void central_device_db_remove(int index);
@@ -35,6 +35,8 @@
  */
 #include  "central_device_db.h"
 
+#include <stddef.h>
+
  // Central Device db interface
 void central_device_db_init(){}
 
@@ -48,6 +50,15 @@ int central_device_db_count(void){
 	return 0;
 }
 
+// @returns index if found, -1 otherwise
+int central_device_db_lookup(int addr_type, bd_addr_t addr){
+	return -1;
+}
+
+const sm_key_t * central_device_db_irk_table(void){
+	return NULL;
+}
+
 // get device information: addr type and address
 void central_device_db_info(int index, int * addr_type, bd_addr_t addr, sm_key_t csrk){}
 
@@ -62,6 +62,19 @@ int central_device_db_count(void){
     return central_devices_count;
 }
 
+int central_device_db_lookup(int addr_type, bd_addr_t addr){
+    int i;
+    for (i=0;i<central_devices_count;i++){
+        if (central_devices[i].addr_type == addr_type && BD_ADDR_CMP(central_devices[i].addr, addr) == 0) return i;
+    }
+    return -1;
+}
+
+// IRKs are stored per device
+const sm_key_t * central_device_db_irk_table(void){
+    return NULL;
+}
+
 // free device - TODO not implemented
 void central_device_db_remove(int index){
 }
@@ -56,6 +56,8 @@
 
 static linked_list_t gatt_client_connections = NULL;
 static uint16_t att_client_start_handle = 0x0001;
+static int gatt_client_run_active = 0;
+static int gatt_client_run_requested = 0;
 
 static void gatt_client_att_packet_handler(uint8_t packet_type, uint16_t handle, uint8_t *packet, uint16_t size);
 static void gatt_client_report_error_if_pending(gatt_client_t *peripheral, uint8_t error_code);
@@ -97,6 +99,8 @@ static void gatt_client_timeout_stop(gatt_client_t * peripheral){
 void gatt_client_init(){
     att_client_start_handle = 0x0000;
     gatt_client_connections = NULL;
+    gatt_client_run_active = 0;
+    gatt_client_run_requested = 0;
     att_dispatch_register_client(gatt_client_att_packet_handler);
 }
 
@@ -109,6 +113,277 @@ void gatt_client_register_packet_handler(void (*gatt_callback)(le_event_t* event
     gatt_client_callback = gatt_callback;
 }
 
+#ifdef HAVE_GATT_CLIENT_CACHE
+
+// Discovery cache entry format, all values little endian:
+// - header: version, flags (GATT_CACHE_FLAG_SERVICES_COMPLETE)
+// - records: type | GATT_CACHE_UUID128 | GATT_CACHE_CHILDREN_COMPLETE, followed by
+//   - service:        start group handle, end group handle, uuid
+//   - characteristic: start handle, value handle, end handle, properties (1 byte), uuid
+//   - descriptor:     handle, uuid
+// with uuid as 16 bit value or 128 bit (GATT_CACHE_UUID128)
+
+#ifndef GATT_CLIENT_CACHE_SIZE
+#define GATT_CLIENT_CACHE_SIZE 512
+#endif
+
+#define GATT_CACHE_VERSION 1
+#define GATT_CACHE_HEADER_SIZE 2
+#define GATT_CACHE_FLAG_SERVICES_COMPLETE 0x01
+
+#define GATT_CACHE_SERVICE         0x01
+#define GATT_CACHE_CHARACTERISTIC  0x02
+#define GATT_CACHE_DESCRIPTOR      0x03
+#define GATT_CACHE_TYPE_MASK       0x0f
+#define GATT_CACHE_CHILDREN_COMPLETE 0x40
+#define GATT_CACHE_UUID128         0x80
+
+typedef enum {
+    GATT_CACHE_QUERY_NONE,
+    GATT_CACHE_QUERY_SERVICES,
+    GATT_CACHE_QUERY_CHARACTERISTICS,
+    GATT_CACHE_QUERY_DESCRIPTORS
+} gatt_cache_query_t;
+
+static const gatt_client_cache_t * gatt_client_cache = NULL;
+
+// entry of one peer is kept in memory while it gets built, and only written back
+// when a discovery completes or when another peer needs the buffer
+static uint8_t  gatt_cache_buffer[GATT_CLIENT_CACHE_SIZE];
+static uint16_t gatt_cache_size;
+static gatt_client_t * gatt_cache_peer = NULL;
+static int      gatt_cache_dirty = 0;
+
+static void gatt_cache_store(gatt_client_t * peripheral){
+    gatt_client_cache->put(peripheral->address_type, peripheral->address, gatt_cache_buffer, gatt_cache_size);
+    gatt_cache_dirty = 0;
+}
+
+static void gatt_cache_flush(void){
+    if (gatt_cache_peer && gatt_cache_dirty && gatt_client_cache){
+        gatt_cache_store(gatt_cache_peer);
+    }
+    gatt_cache_dirty = 0;
+}
+
+// forget buffered entry of peer, e.g. on disconnect or address change
+static void gatt_cache_release(gatt_client_t * peripheral){
+    if (gatt_cache_peer != peripheral) return;
+    gatt_cache_peer  = NULL;
+    gatt_cache_size  = 0;
+    gatt_cache_dirty = 0;
+}
+
+void gatt_client_set_cache(const gatt_client_cache_t * cache){
+    gatt_cache_flush();
+    gatt_cache_release(gatt_cache_peer);
+    gatt_client_cache = cache;
+}
+
+void gatt_client_cache_remove(uint8_t addr_type, bd_addr_t addr){
+    if (!gatt_client_cache) return;
+    if (gatt_cache_peer && gatt_cache_peer->address_type == addr_type && BD_ADDR_CMP(gatt_cache_peer->address, addr) == 0){
+        gatt_cache_release(gatt_cache_peer);
+    }
+    gatt_client_cache->remove(addr_type, addr);
+}
+
+static int gatt_cache_record_size(uint8_t type){
+    int uuid_size = (type & GATT_CACHE_UUID128) ? 16 : 2;
+    switch (type & GATT_CACHE_TYPE_MASK){
+        case GATT_CACHE_SERVICE:
+            return 1 + 4 + uuid_size;
+        case GATT_CACHE_CHARACTERISTIC:
+            return 1 + 7 + uuid_size;
+        case GATT_CACHE_DESCRIPTOR:
+            return 1 + 2 + uuid_size;
+        default:
+            return 0;
+    }
+}
+
+static int gatt_cache_replay_active = 0;
+
+static int gatt_cache_validate(int size){
+    if (size < GATT_CACHE_HEADER_SIZE || size > (int) sizeof(gatt_cache_buffer)) return 0;
+    if (gatt_cache_buffer[0] != GATT_CACHE_VERSION) return 0;
+    int pos = GATT_CACHE_HEADER_SIZE;
+    while (pos < size){
+        int record_size = gatt_cache_record_size(gatt_cache_buffer[pos]);
+        if (!record_size || pos + record_size > size) return 0;
+        pos += record_size;
+    }
+    return 1;
+}
+
+// @returns 1 if a valid entry for this peer is in gatt_cache_buffer, storage is only read when the peer changes
+static int gatt_cache_load(gatt_client_t * peripheral){
+    if (!gatt_client_cache || !peripheral->cache_enabled) return 0;
+    if (gatt_cache_peer != peripheral){
+        gatt_cache_flush();
+        gatt_cache_peer = peripheral;
+        int size = gatt_client_cache->get(peripheral->address_type, peripheral->address, gatt_cache_buffer, sizeof(gatt_cache_buffer));
+        gatt_cache_size = gatt_cache_validate(size) ? size : 0;
+    }
+    return gatt_cache_size >= GATT_CACHE_HEADER_SIZE;
+}
+
+static void gatt_cache_invalidate(gatt_client_t * peripheral){
+    if (!gatt_client_cache || !peripheral->cache_enabled) return;
+    log_info("GATT client cache invalidated, handle 0x%02x", peripheral->handle);
+    if (gatt_cache_peer == peripheral){
+        gatt_cache_size  = 0;
+        gatt_cache_dirty = 0;
+    }
+    // results of a running discovery might be outdated already
+    peripheral->cache_query = GATT_CACHE_QUERY_NONE;
+    gatt_client_cache->remove(peripheral->address_type, peripheral->address);
+}
+
+// @returns offset of record with given type and handles or 0 if not found
+static int gatt_cache_find(uint8_t type, uint16_t first_handle, uint16_t second_handle){
+    int pos = GATT_CACHE_HEADER_SIZE;
+    while (pos < gatt_cache_size){
+        uint8_t * record = &gatt_cache_buffer[pos];
+        if ((record[0] & GATT_CACHE_TYPE_MASK) == type){
+            switch (type){
+                case GATT_CACHE_SERVICE:
+                    if (READ_BT_16(record, 1) == first_handle && READ_BT_16(record, 3) == second_handle) return pos;
+                    break;
+                case GATT_CACHE_CHARACTERISTIC:
+                    if (READ_BT_16(record, 3) == first_handle && READ_BT_16(record, 5) == second_handle) return pos;
+                    break;
+                case GATT_CACHE_DESCRIPTOR:
+                    if (READ_BT_16(record, 1) == first_handle) return pos;
+                    break;
+                default:
+                    break;
+            }
+        }
+        pos += gatt_cache_record_size(record[0]);
+    }
+    return 0;
+}
+
+// @returns 1 if value handle belongs to cached Service Changed characteristic
+static int gatt_cache_is_service_changed(gatt_client_t * peripheral, uint16_t value_handle){
+    if (gatt_cache_replay_active) return 0;
+    if (!gatt_cache_load(peripheral)) return 0;
+    int pos = GATT_CACHE_HEADER_SIZE;
+    while (pos < gatt_cache_size){
+        uint8_t * record = &gatt_cache_buffer[pos];
+        if (record[0] == GATT_CACHE_CHARACTERISTIC || record[0] == (GATT_CACHE_CHARACTERISTIC | GATT_CACHE_CHILDREN_COMPLETE)){
+            if (READ_BT_16(record, 3) == value_handle && READ_BT_16(record, 8) == GATT_SERVICE_CHANGED_UUID) return 1;
+        }
+        pos += gatt_cache_record_size(record[0]);
+    }
+    return 0;
+}
+
+static void gatt_cache_read_uuid(uint8_t * record, int pos, uint16_t * uuid16, uint8_t * uuid128){
+    if (record[0] & GATT_CACHE_UUID128){
+        *uuid16 = 0;
+        memcpy(uuid128, &record[pos], 16);
+    } else {
+        *uuid16 = READ_BT_16(record, pos);
+        sdp_normalize_uuid(uuid128, *uuid16);
+    }
+}
+
+// append record in memory, handles as used by gatt_cache_find, existing records are kept
+static void gatt_cache_add(gatt_client_t * peripheral, uint8_t type, uint16_t * handles, uint8_t properties, uint16_t uuid16, uint8_t * uuid128){
+    if (!gatt_client_cache || !peripheral->cache_enabled || gatt_cache_replay_active) return;
+    if (!gatt_cache_load(peripheral)){
+        gatt_cache_buffer[0] = GATT_CACHE_VERSION;
+        gatt_cache_buffer[1] = 0;
+        gatt_cache_size = GATT_CACHE_HEADER_SIZE;
+    }
+    switch (type){
+        case GATT_CACHE_SERVICE:
+            if (gatt_cache_find(type, handles[0], handles[1])) return;
+            break;
+        case GATT_CACHE_CHARACTERISTIC:
+            if (gatt_cache_find(type, handles[1], handles[2])) return;
+            break;
+        default:
+            if (gatt_cache_find(type, handles[0], 0)) return;
+            break;
+    }
+    if (!uuid16) type |= GATT_CACHE_UUID128;
+    int record_size = gatt_cache_record_size(type);
+    if (gatt_cache_size + record_size > sizeof(gatt_cache_buffer)){
+        log_error("GATT client cache full, handle 0x%02x", peripheral->handle);
+        // incomplete results must not be marked as complete
+        peripheral->cache_query = GATT_CACHE_QUERY_NONE;
+        return;
+    }
+    uint8_t * record = &gatt_cache_buffer[gatt_cache_size];
+    int pos = 0;
+    record[pos++] = type;
+    int num_handles = 1;
+    switch (type & GATT_CACHE_TYPE_MASK){
+        case GATT_CACHE_SERVICE:
+            num_handles = 2;
+            break;
+        case GATT_CACHE_CHARACTERISTIC:
+            num_handles = 3;
+            break;
+        default:
+            break;
+    }
+    int i;
+    for (i = 0; i < num_handles; i++){
+        bt_store_16(record, pos, handles[i]);
+        pos += 2;
+    }
+    if ((type & GATT_CACHE_TYPE_MASK) == GATT_CACHE_CHARACTERISTIC){
+        record[pos++] = properties;
+    }
+    if (uuid16){
+        bt_store_16(record, pos, uuid16);
+    } else {
+        memcpy(&record[pos], uuid128, 16);
+    }
+    gatt_cache_size += record_size;
+    gatt_cache_dirty = 1;
+}
+
+static void gatt_cache_query_complete(gatt_client_t * peripheral){
+    if (peripheral->cache_query == GATT_CACHE_QUERY_NONE) return;
+    gatt_cache_query_t query = (gatt_cache_query_t) peripheral->cache_query;
+    peripheral->cache_query = GATT_CACHE_QUERY_NONE;
+    if (!gatt_client_cache || !peripheral->cache_enabled || gatt_cache_replay_active) return;
+    if (!gatt_cache_load(peripheral)){
+        // nothing found, store empty entry to mark completion
+        gatt_cache_buffer[0] = GATT_CACHE_VERSION;
+        gatt_cache_buffer[1] = 0;
+        gatt_cache_size = GATT_CACHE_HEADER_SIZE;
+    }
+    int pos = 0;
+    switch (query){
+        case GATT_CACHE_QUERY_SERVICES:
+            gatt_cache_buffer[1] |= GATT_CACHE_FLAG_SERVICES_COMPLETE;
+            break;
+        case GATT_CACHE_QUERY_CHARACTERISTICS:
+            pos = gatt_cache_find(GATT_CACHE_SERVICE, peripheral->cache_start_handle, peripheral->end_group_handle);
+            break;
+        case GATT_CACHE_QUERY_DESCRIPTORS:
+            pos = gatt_cache_find(GATT_CACHE_CHARACTERISTIC, peripheral->cache_start_handle - 1, peripheral->end_group_handle);
+            break;
+        default:
+            break;
+    }
+    if (pos){
+        gatt_cache_buffer[pos] |= GATT_CACHE_CHILDREN_COMPLETE;
+    } else if (query != GATT_CACHE_QUERY_SERVICES){
+        // parent not in cache, e.g. not discovered via full discovery
+        return;
+    }
+    gatt_cache_store(peripheral);
+}
+
+#endif
+
 static gatt_client_t * get_gatt_client_context_for_handle(uint16_t handle){
     linked_item_t *it;
     for (it = (linked_item_t *) gatt_client_connections; it ; it = it->next){
@@ -132,6 +407,12 @@ static gatt_client_t * provide_context_for_conn_handle(uint16_t con_handle){
     // init state
     context->handle = con_handle;
     context->mtu_state = SEND_MTU_EXCHANGE;
+    context->pending_requests = NULL;
+#ifdef HAVE_GATT_CLIENT_CACHE
+    // enabled by gatt_client_set_peer_identity
+    context->cache_enabled = 0;
+    context->cache_query = GATT_CACHE_QUERY_NONE;
+#endif
     
     context->gatt_client_state = P_READY;
     gatt_client_timeout_start(context);
@@ -143,10 +424,21 @@ static int is_ready(gatt_client_t * context){
     return context->gatt_client_state == P_READY;
 }
 
+#ifdef HAVE_GATT_CLIENT_CACHE
+void gatt_client_set_peer_identity(uint16_t con_handle, uint8_t addr_type, bd_addr_t addr){
+    gatt_client_t * context = provide_context_for_conn_handle(con_handle);
+    if (!context) return;
+    gatt_cache_release(context);
+    context->address_type = addr_type;
+    BD_ADDR_COPY(context->address, addr);
+    context->cache_enabled = 1;
+}
+#endif
+
 int gatt_client_is_ready(uint16_t handle){
     gatt_client_t * context = provide_context_for_conn_handle(handle);
     if (!context) return 0;
-    return is_ready(context);
+    return is_ready(context) && linked_list_empty(&context->pending_requests);
 }
 
 // precondition: can_send_packet_now == TRUE
@@ -368,6 +660,23 @@ static inline void emit_gatt_complete_event(gatt_client_t * peripheral, uint8_t
     event.handle = peripheral->handle;
     event.attribute_handle = peripheral->attribute_handle;
     event.status = status;
+#ifdef HAVE_GATT_CLIENT_CACHE
+    if (status == 0) {
+        gatt_cache_query_complete(peripheral);
+    } else {
+        peripheral->cache_query = GATT_CACHE_QUERY_NONE;
+    }
+#endif
+    (*gatt_client_callback)((le_event_t*)&event);
+}
+
+static void emit_gatt_stream_progress_event(gatt_client_t * peripheral){
+    gatt_stream_progress_event_t event;
+    event.type = GATT_WRITE_WITHOUT_RESPONSE_STREAM_PROGRESS;
+    event.handle = peripheral->handle;
+    event.value_handle = peripheral->attribute_handle;
+    event.bytes_sent = peripheral->stream_offset;
+    event.total_length = peripheral->stream_length;
     (*gatt_client_callback)((le_event_t*)&event);
 }
 
@@ -394,6 +703,12 @@ static void report_gatt_services(gatt_client_t * peripheral, uint8_t * packet,
         }
         event.service = service;
         // log_info(" report_gatt_services 0x%02x : 0x%02x-0x%02x", service.uuid16, service.start_group_handle, service.end_group_handle);
+#ifdef HAVE_GATT_CLIENT_CACHE
+        if (peripheral->cache_query == GATT_CACHE_QUERY_SERVICES){
+            uint16_t handles[] = { service.start_group_handle, service.end_group_handle };
+            gatt_cache_add(peripheral, GATT_CACHE_SERVICE, handles, 0, service.uuid16, service.uuid128);
+        }
+#endif
         
         (*gatt_client_callback)((le_event_t*)&event);
     }
@@ -437,6 +752,12 @@ static void characteristic_end_found(gatt_client_t * peripheral, uint16_t end_ha
     event.characteristic.properties   = peripheral->characteristic_properties;
     event.characteristic.uuid16       = peripheral->uuid16;
     memcpy(event.characteristic.uuid128, peripheral->uuid128, 16);
+#ifdef HAVE_GATT_CLIENT_CACHE
+    if (peripheral->cache_query == GATT_CACHE_QUERY_CHARACTERISTICS){
+        uint16_t handles[] = { event.characteristic.start_handle, event.characteristic.value_handle, end_handle };
+        gatt_cache_add(peripheral, GATT_CACHE_CHARACTERISTIC, handles, event.characteristic.properties, event.characteristic.uuid16, event.characteristic.uuid128);
+    }
+#endif
     (*gatt_client_callback)((le_event_t*)&event);
     
     peripheral->characteristic_start_handle = 0;
@@ -539,6 +860,11 @@ static void report_gatt_all_characteristic_descriptors(gatt_client_t * periphera
             swap128(&packet[i+2], descriptor.uuid128);
         }
         event.value_length = 0;
+#ifdef HAVE_GATT_CLIENT_CACHE
+        if (peripheral->cache_query == GATT_CACHE_QUERY_DESCRIPTORS){
+            gatt_cache_add(peripheral, GATT_CACHE_DESCRIPTOR, &descriptor.handle, 0, descriptor.uuid16, descriptor.uuid128);
+        }
+#endif
         
         event.characteristic_descriptor = descriptor;
         (*gatt_client_callback)((le_event_t*)&event);
@@ -612,14 +938,212 @@ static int is_value_valid(gatt_client_t *peripheral, uint8_t *packet, uint16_t s
 }
 
 
-static void gatt_client_run(){
+#ifdef HAVE_GATT_CLIENT_CACHE
+// service range lies within a service whose characteristics are cached
+static int gatt_cache_characteristics_complete(uint16_t start_handle, uint16_t end_handle){
+    int pos = GATT_CACHE_HEADER_SIZE;
+    while (pos < gatt_cache_size){
+        uint8_t * record = &gatt_cache_buffer[pos];
+        if ((record[0] & GATT_CACHE_TYPE_MASK) == GATT_CACHE_SERVICE
+        &&  (record[0] & GATT_CACHE_CHILDREN_COMPLETE)
+        &&  READ_BT_16(record, 1) <= start_handle && end_handle <= READ_BT_16(record, 3)) return 1;
+        pos += gatt_cache_record_size(record[0]);
+    }
+    return 0;
+}
+
+static void gatt_cache_emit_records(gatt_client_t * peripheral, uint8_t record_type){
+    uint16_t start_handle = peripheral->start_group_handle;
+    uint16_t end_handle   = peripheral->end_group_handle;
+    int pos = GATT_CACHE_HEADER_SIZE;
+    while (pos < gatt_cache_size){
+        uint8_t * record = &gatt_cache_buffer[pos];
+        pos += gatt_cache_record_size(record[0]);
+        if ((record[0] & GATT_CACHE_TYPE_MASK) != record_type) continue;
+        switch (record_type){
+            case GATT_CACHE_SERVICE: {
+                le_service_event_t event;
+                event.type = GATT_SERVICE_QUERY_RESULT;
+                event.handle = peripheral->handle;
+                event.service.start_group_handle = READ_BT_16(record, 1);
+                event.service.end_group_handle   = READ_BT_16(record, 3);
+                gatt_cache_read_uuid(record, 5, &event.service.uuid16, event.service.uuid128);
+                if (peripheral->gatt_client_state == P_W2_SEND_SERVICE_WITH_UUID_QUERY
+                &&  memcmp(event.service.uuid128, peripheral->uuid128, 16) != 0) break;
+                (*gatt_client_callback)((le_event_t*)&event);
+                break;
+            }
+            case GATT_CACHE_CHARACTERISTIC: {
+                le_characteristic_event_t event;
+                event.type = GATT_CHARACTERISTIC_QUERY_RESULT;
+                event.handle = peripheral->handle;
+                event.characteristic.start_handle = READ_BT_16(record, 1);
+                event.characteristic.value_handle = READ_BT_16(record, 3);
+                event.characteristic.end_handle   = READ_BT_16(record, 5);
+                event.characteristic.properties   = record[7];
+                gatt_cache_read_uuid(record, 8, &event.characteristic.uuid16, event.characteristic.uuid128);
+                if (event.characteristic.start_handle < start_handle || event.characteristic.end_handle > end_handle) break;
+                if (peripheral->filter_with_uuid && memcmp(event.characteristic.uuid128, peripheral->uuid128, 16) != 0) break;
+                (*gatt_client_callback)((le_event_t*)&event);
+                break;
+            }
+            case GATT_CACHE_DESCRIPTOR: {
+                le_characteristic_descriptor_event_t event;
+                event.type = GATT_ALL_CHARACTERISTIC_DESCRIPTORS_QUERY_RESULT;
+                event.handle = peripheral->handle;
+                event.characteristic_descriptor.handle = READ_BT_16(record, 1);
+                gatt_cache_read_uuid(record, 3, &event.characteristic_descriptor.uuid16, event.characteristic_descriptor.uuid128);
+                event.value_length = 0;
+                if (event.characteristic_descriptor.handle < start_handle || event.characteristic_descriptor.handle > end_handle) break;
+                (*gatt_client_callback)((le_event_t*)&event);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
+
+// @returns 1 if discovery has been answered from cache
+static int gatt_cache_replay(gatt_client_t * peripheral){
+    if (gatt_cache_replay_active) return 0;
+    if (!gatt_cache_load(peripheral)) return 0;
+    
+    uint8_t record_type;
+    int pos;
+    switch (peripheral->gatt_client_state){
+        case P_W2_SEND_SERVICE_QUERY:
+        case P_W2_SEND_SERVICE_WITH_UUID_QUERY:
+            if ((gatt_cache_buffer[1] & GATT_CACHE_FLAG_SERVICES_COMPLETE) == 0) return 0;
+            record_type = GATT_CACHE_SERVICE;
+            break;
+        case P_W2_SEND_ALL_CHARACTERISTICS_OF_SERVICE_QUERY:
+        case P_W2_SEND_CHARACTERISTIC_WITH_UUID_QUERY:
+            if (!gatt_cache_characteristics_complete(peripheral->start_group_handle, peripheral->end_group_handle)) return 0;
+            record_type = GATT_CACHE_CHARACTERISTIC;
+            break;
+        case P_W2_SEND_ALL_CHARACTERISTIC_DESCRIPTORS_QUERY:
+            pos = gatt_cache_find(GATT_CACHE_CHARACTERISTIC, peripheral->start_group_handle - 1, peripheral->end_group_handle);
+            if (!pos || (gatt_cache_buffer[pos] & GATT_CACHE_CHILDREN_COMPLETE) == 0) return 0;
+            record_type = GATT_CACHE_DESCRIPTOR;
+            break;
+        default:
+            return 0;
+    }
+
+    log_info("GATT client cache hit, handle 0x%02x, state %u", peripheral->handle, peripheral->gatt_client_state);
+    gatt_cache_replay_active = 1;
+    gatt_cache_emit_records(peripheral, record_type);
+    gatt_cache_replay_active = 0;
+    gatt_client_handle_transaction_complete(peripheral);
+    emit_gatt_complete_event(peripheral, 0);
+    return 1;
+}
+#endif
+
+static void gatt_client_start_request(gatt_client_t * peripheral, gatt_client_request_t * request){
+    peripheral->uuid16 = request->uuid16;
+    memcpy(peripheral->uuid128, request->uuid128, 16);
+    peripheral->filter_with_uuid = request->filter_with_uuid;
+    peripheral->start_group_handle = request->start_group_handle;
+    peripheral->end_group_handle   = request->end_group_handle;
+    peripheral->attribute_handle = request->attribute_handle;
+    peripheral->attribute_offset = request->attribute_offset;
+    peripheral->attribute_length = request->attribute_length;
+    peripheral->attribute_value  = request->attribute_value;
+    memcpy(peripheral->client_characteristic_configuration_value, request->client_characteristic_configuration_value, 2);
+    peripheral->stream_length = request->stream_length;
+    peripheral->stream_offset = 0;
+    peripheral->characteristic_start_handle = 0;
+    peripheral->gatt_client_state = request->gatt_client_state;
+
+#ifdef HAVE_GATT_CLIENT_CACHE
+    peripheral->cache_query = GATT_CACHE_QUERY_NONE;
+    if (gatt_cache_replay(peripheral)) return;
+    peripheral->cache_start_handle = peripheral->start_group_handle;
+    switch (peripheral->gatt_client_state){
+        case P_W2_SEND_SERVICE_QUERY:
+            peripheral->cache_query = GATT_CACHE_QUERY_SERVICES;
+            break;
+        case P_W2_SEND_ALL_CHARACTERISTICS_OF_SERVICE_QUERY:
+            peripheral->cache_query = GATT_CACHE_QUERY_CHARACTERISTICS;
+            break;
+        case P_W2_SEND_ALL_CHARACTERISTIC_DESCRIPTORS_QUERY:
+            peripheral->cache_query = GATT_CACHE_QUERY_DESCRIPTORS;
+            break;
+        default:
+            break;
+    }
+#endif
+
+    // characteristic without descriptors or empty write stream, nothing to send
+    if ((peripheral->gatt_client_state == P_W2_SEND_ALL_CHARACTERISTIC_DESCRIPTORS_QUERY
+    &&   peripheral->start_group_handle > peripheral->end_group_handle)
+    ||  (peripheral->gatt_client_state == P_W2_SEND_WRITE_WITHOUT_RESPONSE_STREAM
+    &&   peripheral->stream_length == 0)){
+        gatt_client_handle_transaction_complete(peripheral);
+        emit_gatt_complete_event(peripheral, 0);
+    }
+}
+
+static void gatt_client_start_next_request(gatt_client_t * peripheral){
+    while (is_ready(peripheral) && !linked_list_empty(&peripheral->pending_requests)){
+        gatt_client_request_t * request = (gatt_client_request_t *) peripheral->pending_requests;
+        linked_list_remove(&peripheral->pending_requests, (linked_item_t *) request);
+        gatt_client_request_t current = *request;
+        btstack_memory_gatt_client_request_free(request);
+        gatt_client_start_request(peripheral, &current);
+    }
+}
+
+static void gatt_client_drop_pending_requests(gatt_client_t * peripheral, uint8_t error_code){
+    while (!linked_list_empty(&peripheral->pending_requests)){
+        gatt_client_request_t * request = (gatt_client_request_t *) peripheral->pending_requests;
+        linked_list_remove(&peripheral->pending_requests, (linked_item_t *) request);
+        peripheral->attribute_handle = request->attribute_handle;
+        btstack_memory_gatt_client_request_free(request);
+        emit_gatt_complete_event(peripheral, error_code);
+    }
+}
 
+// precondition: can_send_packet_now == TRUE
+// sends write commands until the stream is done or no ACL buffer is left, returns nr of PDUs sent
+static int gatt_client_send_write_stream(gatt_client_t * peripheral){
+    int pdus_sent = 0;
+    uint16_t chunk_size = peripheral->mtu - 3;
+    while (1){
+        uint32_t rest_length = peripheral->stream_length - peripheral->stream_offset;
+        uint16_t value_length = rest_length < chunk_size ? rest_length : chunk_size;
+        att_write_request(ATT_WRITE_COMMAND, peripheral->handle, peripheral->attribute_handle, value_length, &peripheral->attribute_value[peripheral->stream_offset]);
+        peripheral->stream_offset += value_length;
+        pdus_sent++;
+        if (peripheral->stream_offset >= peripheral->stream_length) break;
+        if (!l2cap_can_send_fixed_channel_packet_now(peripheral->handle)) break;
+    }
+    
+    if (peripheral->stream_offset < peripheral->stream_length){
+        emit_gatt_stream_progress_event(peripheral);
+        return pdus_sent;
+    }
+    gatt_client_handle_transaction_complete(peripheral);
+    emit_gatt_stream_progress_event(peripheral);
+    emit_gatt_complete_event(peripheral, 0);
+    return pdus_sent;
+}
+
+// sends at most one PDU per connection, connections that cannot send right now are skipped.
+// a write stream uses all ACL buffers available for its connection
+static void gatt_client_run_connections(void){
+
+    int pdus_sent = 0;
     linked_item_t *it;
     for (it = (linked_item_t *) gatt_client_connections; it ; it = it->next){
 
         gatt_client_t * peripheral = (gatt_client_t *) it;
 
-        if (!l2cap_can_send_fixed_channel_packet_now(peripheral->handle)) return;
+        gatt_client_start_next_request(peripheral);
+        
+        if (!l2cap_can_send_fixed_channel_packet_now(peripheral->handle)) continue;
 
         // log_info("- handle_peripheral_list, mtu state %u, client state %u", peripheral->mtu_state, peripheral->gatt_client_state);
         
@@ -633,10 +1157,11 @@ static void gatt_client_run(){
                 request[0] = ATT_EXCHANGE_MTU_REQUEST;
                 bt_store_16(request, 1, mtu);
                 l2cap_send_prepared_connectionless(peripheral->handle, L2CAP_CID_ATTRIBUTE_PROTOCOL, 3);
-                return;
+                pdus_sent++;
+                continue;
             }
             case SENT_MTU_EXCHANGE:
-                return;
+                continue;
             default:
                 break;
         }
@@ -644,7 +1169,8 @@ static void gatt_client_run(){
         if (peripheral->send_confirmation){
             peripheral->send_confirmation = 0;
             att_confirmation(peripheral->handle);
-            return;
+            pdus_sent++;
+            continue;
         }
         
         // check MTU for writes
@@ -654,123 +1180,172 @@ static void gatt_client_run(){
                 if (peripheral->attribute_length < peripheral->mtu - 3) break;
                 gatt_client_handle_transaction_complete(peripheral);
                 emit_gatt_complete_event(peripheral, ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH);
-                return;
+                continue;
             default:
                 break;
         }
 
         // log_info("gatt_client_state %u", peripheral->gatt_client_state);
         switch (peripheral->gatt_client_state){
+            case P_W2_SEND_WRITE_WITHOUT_RESPONSE_STREAM:
+                pdus_sent += gatt_client_send_write_stream(peripheral);
+                continue;
+
             case P_W2_SEND_SERVICE_QUERY:
                 peripheral->gatt_client_state = P_W4_SERVICE_QUERY_RESULT;
                 send_gatt_services_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_SERVICE_WITH_UUID_QUERY:
                 peripheral->gatt_client_state = P_W4_SERVICE_WITH_UUID_RESULT;
                 send_gatt_services_by_uuid_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_ALL_CHARACTERISTICS_OF_SERVICE_QUERY:
                 peripheral->gatt_client_state = P_W4_ALL_CHARACTERISTICS_OF_SERVICE_QUERY_RESULT;
                 send_gatt_characteristic_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_CHARACTERISTIC_WITH_UUID_QUERY:
                 peripheral->gatt_client_state = P_W4_CHARACTERISTIC_WITH_UUID_QUERY_RESULT;
                 send_gatt_characteristic_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_ALL_CHARACTERISTIC_DESCRIPTORS_QUERY:
                 peripheral->gatt_client_state = P_W4_CHARACTERISTIC_WITH_UUID_QUERY_RESULT;
                 send_gatt_characteristic_descriptor_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_INCLUDED_SERVICE_QUERY:
                 peripheral->gatt_client_state = P_W4_INCLUDED_SERVICE_QUERY_RESULT;
                 send_gatt_included_service_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_INCLUDED_SERVICE_WITH_UUID_QUERY:
                 peripheral->gatt_client_state = P_W4_INCLUDED_SERVICE_UUID_WITH_QUERY_RESULT;
                 send_gatt_included_service_uuid_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_READ_CHARACTERISTIC_VALUE_QUERY:
                 peripheral->gatt_client_state = P_W4_READ_CHARACTERISTIC_VALUE_RESULT;
                 send_gatt_read_characteristic_value_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_READ_BLOB_QUERY:
                 peripheral->gatt_client_state = P_W4_READ_BLOB_RESULT;
                 send_gatt_read_blob_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_WRITE_CHARACTERISTIC_VALUE:
                 peripheral->gatt_client_state = P_W4_WRITE_CHARACTERISTIC_VALUE_RESULT;
                 send_gatt_write_attribute_value_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_PREPARE_WRITE:
                 peripheral->gatt_client_state = P_W4_PREPARE_WRITE_RESULT;
                 send_gatt_prepare_write_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_PREPARE_RELIABLE_WRITE:
                 peripheral->gatt_client_state = P_W4_PREPARE_RELIABLE_WRITE_RESULT;
                 send_gatt_prepare_write_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_EXECUTE_PREPARED_WRITE:
                 peripheral->gatt_client_state = P_W4_EXECUTE_PREPARED_WRITE_RESULT;
                 send_gatt_execute_write_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_CANCEL_PREPARED_WRITE:
                 peripheral->gatt_client_state = P_W4_CANCEL_PREPARED_WRITE_RESULT;
                 send_gatt_cancel_prepared_write_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_READ_CLIENT_CHARACTERISTIC_CONFIGURATION_QUERY:
                 peripheral->gatt_client_state = P_W4_READ_CLIENT_CHARACTERISTIC_CONFIGURATION_QUERY_RESULT;
                 send_gatt_read_client_characteristic_configuration_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_READ_CHARACTERISTIC_DESCRIPTOR_QUERY:
                 peripheral->gatt_client_state = P_W4_READ_CHARACTERISTIC_DESCRIPTOR_RESULT;
                 send_gatt_read_characteristic_descriptor_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_READ_BLOB_CHARACTERISTIC_DESCRIPTOR_QUERY:
                 peripheral->gatt_client_state = P_W4_READ_BLOB_CHARACTERISTIC_DESCRIPTOR_RESULT;
                 send_gatt_read_blob_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_SEND_WRITE_CHARACTERISTIC_DESCRIPTOR:
                 peripheral->gatt_client_state = P_W4_WRITE_CHARACTERISTIC_DESCRIPTOR_RESULT;
                 send_gatt_write_attribute_value_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_WRITE_CLIENT_CHARACTERISTIC_CONFIGURATION:
                 peripheral->gatt_client_state = P_W4_CLIENT_CHARACTERISTIC_CONFIGURATION_RESULT;
                 send_gatt_write_client_characteristic_configuration_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_PREPARE_WRITE_CHARACTERISTIC_DESCRIPTOR:
                 peripheral->gatt_client_state = P_W4_PREPARE_WRITE_CHARACTERISTIC_DESCRIPTOR_RESULT;
                 send_gatt_prepare_write_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
                 
             case P_W2_EXECUTE_PREPARED_WRITE_CHARACTERISTIC_DESCRIPTOR:
                 peripheral->gatt_client_state = P_W4_EXECUTE_PREPARED_WRITE_CHARACTERISTIC_DESCRIPTOR_RESULT;
                 send_gatt_execute_write_request(peripheral);
-                return;
+                pdus_sent++;
+                continue;
            
             default:
                 break;
         }
     }
-    
+
+    // round robin: let the next connection go first on the next run
+    if (pdus_sent && gatt_client_connections && gatt_client_connections->next){
+        linked_item_t * first = gatt_client_connections;
+        linked_list_remove(&gatt_client_connections, first);
+        linked_list_add_tail(&gatt_client_connections, first);
+    }
+}
+
+static void gatt_client_run(void){
+
+    // run once at the end of the HCI batch
+    if (hci_batch_active()) return;
+
+    // called from a callback inside the loop: the list might get rotated, just run again afterwards
+    if (gatt_client_run_active){
+        gatt_client_run_requested = 1;
+        return;
+    }
+    gatt_client_run_active = 1;
+    do {
+        gatt_client_run_requested = 0;
+        gatt_client_run_connections();
+    } while (gatt_client_run_requested);
+    gatt_client_run_active = 0;
 }
 
 static void gatt_client_report_error_if_pending(gatt_client_t *peripheral, uint8_t error_code) {
@@ -788,6 +1363,10 @@ static void gatt_client_hci_event_packet_handler(uint8_t packet_type, uint8_t *p
             gatt_client_t * peripheral = get_gatt_client_context_for_handle(con_handle);
             if (!peripheral) break;
             gatt_client_report_error_if_pending(peripheral, ATT_ERROR_HCI_DISCONNECT_RECEIVED);
+            gatt_client_drop_pending_requests(peripheral, ATT_ERROR_HCI_DISCONNECT_RECEIVED);
+#ifdef HAVE_GATT_CLIENT_CACHE
+            gatt_cache_release(peripheral);
+#endif
             
             linked_list_remove(&gatt_client_connections, (linked_item_t *) peripheral);
             btstack_memory_gatt_client_free(peripheral);
@@ -838,6 +1417,11 @@ static void gatt_client_att_packet_handler(uint8_t packet_type, uint16_t handle,
             break;
             
         case ATT_HANDLE_VALUE_INDICATION:
+#ifdef HAVE_GATT_CLIENT_CACHE
+            if (gatt_cache_is_service_changed(peripheral, READ_BT_16(packet,1))){
+                gatt_cache_invalidate(peripheral);
+            }
+#endif
             report_gatt_indication(peripheral, READ_BT_16(packet,1), &packet[3], size-3);
             peripheral->send_confirmation = 1;
             break;
@@ -1065,25 +1649,20 @@ static void gatt_client_att_packet_handler(uint8_t packet_type, uint16_t handle,
     gatt_client_run();
 }
 
-static void att_signed_write_handle_cmac_result(uint8_t hash[8]){
-    linked_list_iterator_t it;
-    linked_list_iterator_init(&it, &gatt_client_connections);
-    while (linked_list_iterator_has_next(&it)){
-        gatt_client_t * peripheral = (gatt_client_t *) linked_list_iterator_next(&it);
-        if (peripheral->gatt_client_state == P_W4_CMAC){
-            gatt_client_handle_transaction_complete(peripheral);
-            memcpy(peripheral->cmac, hash, 8);
-            att_signed_write_request(ATT_SIGNED_WRITE_COMMAND, peripheral->handle, peripheral->attribute_handle, peripheral->attribute_length, peripheral->attribute_value, peripheral->sign_counter, peripheral->cmac);
-            return;
-        }
-    }
+static void att_signed_write_handle_cmac_result(uint16_t con_handle, uint8_t hash[8]){
+    gatt_client_t * peripheral = get_gatt_client_context_for_handle(con_handle);
+    if (!peripheral) return;
+    if (peripheral->gatt_client_state != P_W4_CMAC) return;
+    gatt_client_handle_transaction_complete(peripheral);
+    memcpy(peripheral->cmac, hash, 8);
+    att_signed_write_request(ATT_SIGNED_WRITE_COMMAND, peripheral->handle, peripheral->attribute_handle, peripheral->attribute_length, peripheral->attribute_value, peripheral->sign_counter, peripheral->cmac);
 }
 
 
 le_command_status_t gatt_client_signed_write_without_response(uint16_t con_handle, uint16_t handle, uint16_t message_len, uint8_t * message, sm_key_t csrk, uint32_t sign_counter){
     gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
     if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    if (!sm_cmac_ready()) {
+    if (!sm_cmac_ready(con_handle)) {
         log_info("ATT Signed Write, sm_cmac engine not ready. Abort");
         return BLE_PERIPHERAL_IN_WRONG_STATE;
     } 
@@ -1095,118 +1674,99 @@ le_command_status_t gatt_client_signed_write_without_response(uint16_t con_handl
     peripheral->sign_counter = sign_counter;
     memcpy(peripheral->csrk, csrk, 16);
     
-    sm_cmac_start(peripheral->csrk, peripheral->attribute_length, peripheral->attribute_value, att_signed_write_handle_cmac_result);
+    sm_cmac_start(con_handle, peripheral->csrk, peripheral->attribute_length, peripheral->attribute_value, att_signed_write_handle_cmac_result);
     gatt_client_run();
     return BLE_PERIPHERAL_OK; 
 }
 
-le_command_status_t gatt_client_discover_primary_services(uint16_t handle){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(handle);
+// starts request right away if connection is idle, queues it otherwise
+static le_command_status_t gatt_client_submit_request(uint16_t con_handle, gatt_client_request_t * request){
+    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
     if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
 
-    peripheral->start_group_handle = 0x0001;
-    peripheral->end_group_handle   = 0xffff;
-    peripheral->gatt_client_state = P_W2_SEND_SERVICE_QUERY;
-    peripheral->uuid16 = 0;
+    if (is_ready(peripheral) && linked_list_empty(&peripheral->pending_requests)){
+        gatt_client_start_request(peripheral, request);
+    } else {
+        gatt_client_request_t * pending = btstack_memory_gatt_client_request_get();
+        if (!pending) return BLE_PERIPHERAL_IN_WRONG_STATE;
+        *pending = *request;
+        linked_list_add_tail(&peripheral->pending_requests, (linked_item_t *) pending);
+    }
     gatt_client_run();
     return BLE_PERIPHERAL_OK;
 }
 
+static void gatt_client_request_init(gatt_client_request_t * request, gatt_client_state_t state){
+    memset(request, 0, sizeof(gatt_client_request_t));
+    request->gatt_client_state = state;
+}
 
-le_command_status_t gatt_client_discover_primary_services_by_uuid16(uint16_t con_handle, uint16_t uuid16){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
+le_command_status_t gatt_client_discover_primary_services(uint16_t handle){
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_SERVICE_QUERY);
+    request.start_group_handle = 0x0001;
+    request.end_group_handle   = 0xffff;
+    return gatt_client_submit_request(handle, &request);
+}
 
-    peripheral->start_group_handle = 0x0001;
-    peripheral->end_group_handle   = 0xffff;
-    peripheral->gatt_client_state = P_W2_SEND_SERVICE_WITH_UUID_QUERY;
-    peripheral->uuid16 = uuid16;
-    sdp_normalize_uuid((uint8_t*) &(peripheral->uuid128), peripheral->uuid16);
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+
+le_command_status_t gatt_client_discover_primary_services_by_uuid16(uint16_t con_handle, uint16_t uuid16){
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_SERVICE_WITH_UUID_QUERY);
+    request.start_group_handle = 0x0001;
+    request.end_group_handle   = 0xffff;
+    request.uuid16 = uuid16;
+    sdp_normalize_uuid((uint8_t*) &(request.uuid128), request.uuid16);
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_discover_primary_services_by_uuid128(uint16_t con_handle, const uint8_t * uuid128){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-
-    peripheral->start_group_handle = 0x0001;
-    peripheral->end_group_handle   = 0xffff;
-    peripheral->uuid16 = 0;
-    memcpy(peripheral->uuid128, uuid128, 16);
-    peripheral->gatt_client_state = P_W2_SEND_SERVICE_WITH_UUID_QUERY;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_SERVICE_WITH_UUID_QUERY);
+    request.start_group_handle = 0x0001;
+    request.end_group_handle   = 0xffff;
+    request.uuid16 = 0;
+    memcpy(request.uuid128, uuid128, 16);
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_discover_characteristics_for_service(uint16_t con_handle, le_service_t *service){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-
-    peripheral->start_group_handle = service->start_group_handle;
-    peripheral->end_group_handle   = service->end_group_handle;
-    peripheral->filter_with_uuid = 0;
-    peripheral->characteristic_start_handle = 0;
-    peripheral->gatt_client_state = P_W2_SEND_ALL_CHARACTERISTICS_OF_SERVICE_QUERY;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_ALL_CHARACTERISTICS_OF_SERVICE_QUERY);
+    request.start_group_handle = service->start_group_handle;
+    request.end_group_handle   = service->end_group_handle;
+    request.filter_with_uuid = 0;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_find_included_services_for_service(uint16_t con_handle, le_service_t *service){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->start_group_handle = service->start_group_handle;
-    peripheral->end_group_handle   = service->end_group_handle;
-    peripheral->gatt_client_state = P_W2_SEND_INCLUDED_SERVICE_QUERY;
-    
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_INCLUDED_SERVICE_QUERY);
+    request.start_group_handle = service->start_group_handle;
+    request.end_group_handle   = service->end_group_handle;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_discover_characteristics_for_handle_range_by_uuid16(uint16_t con_handle, uint16_t start_handle, uint16_t end_handle, uint16_t uuid16){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->start_group_handle = start_handle;
-    peripheral->end_group_handle   = end_handle;
-    peripheral->filter_with_uuid = 1;
-    peripheral->uuid16 = uuid16;
-    sdp_normalize_uuid((uint8_t*) &(peripheral->uuid128), uuid16);
-    peripheral->characteristic_start_handle = 0;
-    peripheral->gatt_client_state = P_W2_SEND_CHARACTERISTIC_WITH_UUID_QUERY;
-    
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_CHARACTERISTIC_WITH_UUID_QUERY);
+    request.start_group_handle = start_handle;
+    request.end_group_handle   = end_handle;
+    request.filter_with_uuid = 1;
+    request.uuid16 = uuid16;
+    sdp_normalize_uuid((uint8_t*) &(request.uuid128), uuid16);
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_discover_characteristics_for_handle_range_by_uuid128(uint16_t con_handle, uint16_t start_handle, uint16_t end_handle, uint8_t * uuid128){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->start_group_handle = start_handle;
-    peripheral->end_group_handle   = end_handle;
-    peripheral->filter_with_uuid = 1;
-    peripheral->uuid16 = 0;
-    memcpy(peripheral->uuid128, uuid128, 16);
-    peripheral->characteristic_start_handle = 0;
-    peripheral->gatt_client_state = P_W2_SEND_CHARACTERISTIC_WITH_UUID_QUERY;
-    
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_CHARACTERISTIC_WITH_UUID_QUERY);
+    request.start_group_handle = start_handle;
+    request.end_group_handle   = end_handle;
+    request.filter_with_uuid = 1;
+    request.uuid16 = 0;
+    memcpy(request.uuid128, uuid128, 16);
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 
@@ -1219,34 +1779,20 @@ le_command_status_t gatt_client_discover_characteristics_for_service_by_uuid128(
 }
 
 le_command_status_t gatt_client_discover_characteristic_descriptors(uint16_t con_handle, le_characteristic_t *characteristic){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    if (characteristic->value_handle == characteristic->end_handle){
-        emit_gatt_complete_event(peripheral, 0);
-        return BLE_PERIPHERAL_OK;
-    }
-    peripheral->start_group_handle = characteristic->value_handle + 1;
-    peripheral->end_group_handle   = characteristic->end_handle;
-    peripheral->gatt_client_state = P_W2_SEND_ALL_CHARACTERISTIC_DESCRIPTORS_QUERY;
-    
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    // an empty range (value_handle == end_handle) completes as soon as the request is started
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_ALL_CHARACTERISTIC_DESCRIPTORS_QUERY);
+    request.start_group_handle = characteristic->value_handle + 1;
+    request.end_group_handle   = characteristic->end_handle;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_read_value_of_characteristic_using_value_handle(uint16_t con_handle, uint16_t value_handle){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = value_handle;
-    peripheral->attribute_offset = 0;
-    peripheral->gatt_client_state = P_W2_SEND_READ_CHARACTERISTIC_VALUE_QUERY;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_READ_CHARACTERISTIC_VALUE_QUERY);
+    request.attribute_handle = value_handle;
+    request.attribute_offset = 0;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_read_value_of_characteristic(uint16_t handle, le_characteristic_t *characteristic){
@@ -1255,16 +1801,11 @@ le_command_status_t gatt_client_read_value_of_characteristic(uint16_t handle, le
 
 
 le_command_status_t gatt_client_read_long_value_of_characteristic_using_value_handle(uint16_t con_handle, uint16_t value_handle){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = value_handle;
-    peripheral->attribute_offset = 0;
-    peripheral->gatt_client_state = P_W2_SEND_READ_BLOB_QUERY;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_READ_BLOB_QUERY);
+    request.attribute_handle = value_handle;
+    request.attribute_offset = 0;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_read_long_value_of_characteristic(uint16_t handle, le_characteristic_t *characteristic){
@@ -1283,56 +1824,45 @@ le_command_status_t gatt_client_write_value_of_characteristic_without_response(u
     return BLE_PERIPHERAL_OK;
 }
 
+le_command_status_t gatt_client_write_value_of_characteristic_without_response_stream(uint16_t con_handle, uint16_t value_handle, uint32_t length, uint8_t * data){
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_WRITE_WITHOUT_RESPONSE_STREAM);
+    request.attribute_handle = value_handle;
+    request.attribute_value = data;
+    request.stream_length = length;
+    return gatt_client_submit_request(con_handle, &request);
+}
+
 le_command_status_t gatt_client_write_value_of_characteristic(uint16_t con_handle, uint16_t value_handle, uint16_t value_length, uint8_t * value){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = value_handle;
-    peripheral->attribute_length = value_length;
-    peripheral->attribute_value = value;
-    peripheral->gatt_client_state = P_W2_SEND_WRITE_CHARACTERISTIC_VALUE;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_WRITE_CHARACTERISTIC_VALUE);
+    request.attribute_handle = value_handle;
+    request.attribute_length = value_length;
+    request.attribute_value = value;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_write_long_value_of_characteristic(uint16_t con_handle, uint16_t value_handle, uint16_t value_length, uint8_t * value){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = value_handle;
-    peripheral->attribute_length = value_length;
-    peripheral->attribute_offset = 0;
-    peripheral->attribute_value = value;
-    peripheral->gatt_client_state = P_W2_PREPARE_WRITE;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_PREPARE_WRITE);
+    request.attribute_handle = value_handle;
+    request.attribute_length = value_length;
+    request.attribute_offset = 0;
+    request.attribute_value = value;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_reliable_write_long_value_of_characteristic(uint16_t con_handle, uint16_t value_handle, uint16_t value_length, uint8_t * value){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = value_handle;
-    peripheral->attribute_length = value_length;
-    peripheral->attribute_offset = 0;
-    peripheral->attribute_value = value;
-    peripheral->gatt_client_state = P_W2_PREPARE_RELIABLE_WRITE;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_PREPARE_RELIABLE_WRITE);
+    request.attribute_handle = value_handle;
+    request.attribute_length = value_length;
+    request.attribute_offset = 0;
+    request.attribute_value = value;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_write_client_characteristic_configuration(uint16_t con_handle, le_characteristic_t * characteristic, uint16_t configuration){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
     if ( (configuration & GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION) &&
         (characteristic->properties & ATT_PROPERTY_NOTIFY) == 0) {
         log_info("le_central_write_client_characteristic_configuration: BLE_CHARACTERISTIC_NOTIFICATION_NOT_SUPPORTED");
@@ -1343,73 +1873,47 @@ le_command_status_t gatt_client_write_client_characteristic_configuration(uint16
         return BLE_CHARACTERISTIC_INDICATION_NOT_SUPPORTED;
     }
     
-    peripheral->start_group_handle = characteristic->value_handle;
-    peripheral->end_group_handle = characteristic->end_handle;
-    bt_store_16(peripheral->client_characteristic_configuration_value, 0, configuration);
-    
-    peripheral->gatt_client_state = P_W2_SEND_READ_CLIENT_CHARACTERISTIC_CONFIGURATION_QUERY;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_READ_CLIENT_CHARACTERISTIC_CONFIGURATION_QUERY);
+    request.start_group_handle = characteristic->value_handle;
+    request.end_group_handle = characteristic->end_handle;
+    bt_store_16(request.client_characteristic_configuration_value, 0, configuration);
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_read_characteristic_descriptor(uint16_t con_handle, le_characteristic_descriptor_t * descriptor){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = descriptor->handle;
-    peripheral->uuid16 = descriptor->uuid16;
-    if (!descriptor->uuid16){
-        memcpy(peripheral->uuid128, descriptor->uuid128, 16);
-    }
-    
-    peripheral->gatt_client_state = P_W2_SEND_READ_CHARACTERISTIC_DESCRIPTOR_QUERY;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_READ_CHARACTERISTIC_DESCRIPTOR_QUERY);
+    request.attribute_handle = descriptor->handle;
+    request.uuid16 = descriptor->uuid16;
+    memcpy(request.uuid128, descriptor->uuid128, 16);
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_read_long_characteristic_descriptor(uint16_t con_handle, le_characteristic_descriptor_t * descriptor){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = descriptor->handle;
-    peripheral->attribute_offset = 0;
-    peripheral->gatt_client_state = P_W2_SEND_READ_BLOB_CHARACTERISTIC_DESCRIPTOR_QUERY;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_READ_BLOB_CHARACTERISTIC_DESCRIPTOR_QUERY);
+    request.attribute_handle = descriptor->handle;
+    request.attribute_offset = 0;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_write_characteristic_descriptor(uint16_t con_handle, le_characteristic_descriptor_t * descriptor, uint16_t length, uint8_t * value){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = descriptor->handle;
-    peripheral->attribute_length = length;
-    peripheral->attribute_offset = 0;
-    peripheral->attribute_value = value;
-    peripheral->gatt_client_state = P_W2_SEND_WRITE_CHARACTERISTIC_DESCRIPTOR;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_SEND_WRITE_CHARACTERISTIC_DESCRIPTOR);
+    request.attribute_handle = descriptor->handle;
+    request.attribute_length = length;
+    request.attribute_offset = 0;
+    request.attribute_value = value;
+    return gatt_client_submit_request(con_handle, &request);
 }
 
 le_command_status_t gatt_client_write_long_characteristic_descriptor(uint16_t con_handle, le_characteristic_descriptor_t * descriptor, uint16_t length, uint8_t * value){
-    gatt_client_t * peripheral = provide_context_for_conn_handle(con_handle);
-    
-    if (!peripheral) return (le_command_status_t) BTSTACK_MEMORY_ALLOC_FAILED; 
-    if (!is_ready(peripheral)) return BLE_PERIPHERAL_IN_WRONG_STATE;
-    
-    peripheral->attribute_handle = descriptor->handle;
-    peripheral->attribute_length = length;
-    peripheral->attribute_offset = 0;
-    peripheral->attribute_value = value;
-    peripheral->gatt_client_state = P_W2_PREPARE_WRITE_CHARACTERISTIC_DESCRIPTOR;
-    gatt_client_run();
-    return BLE_PERIPHERAL_OK;
+    gatt_client_request_t request;
+    gatt_client_request_init(&request, P_W2_PREPARE_WRITE_CHARACTERISTIC_DESCRIPTOR);
+    request.attribute_handle = descriptor->handle;
+    request.attribute_length = length;
+    request.attribute_offset = 0;
+    request.attribute_value = value;
+    return gatt_client_submit_request(con_handle, &request);
 }
-
-
@@ -100,6 +100,8 @@ typedef enum {
     P_W2_EXECUTE_PREPARED_WRITE_CHARACTERISTIC_DESCRIPTOR,
     P_W4_EXECUTE_PREPARED_WRITE_CHARACTERISTIC_DESCRIPTOR_RESULT,
 
+    P_W2_SEND_WRITE_WITHOUT_RESPONSE_STREAM,
+
     P_W4_CMAC
 } gatt_client_state_t;
     
@@ -110,6 +112,28 @@ typedef enum{
     MTU_EXCHANGED
 } gatt_client_mtu_t;
 
+// GATT query queued on a busy connection, started once the current query completes
+typedef struct gatt_client_request{
+    linked_item_t    item;
+    gatt_client_state_t gatt_client_state;
+    
+    uint16_t uuid16;
+    uint8_t  uuid128[16];
+    uint8_t  filter_with_uuid;
+    
+    uint16_t start_group_handle;
+    uint16_t end_group_handle;
+    
+    uint16_t attribute_handle;
+    uint16_t attribute_offset;
+    uint16_t attribute_length;
+    uint8_t* attribute_value;
+    
+    uint8_t client_characteristic_configuration_value[2];
+    
+    uint32_t stream_length;
+} gatt_client_request_t;
+
 typedef struct gatt_client{
     linked_item_t    item;
     gatt_client_state_t gatt_client_state;
@@ -144,6 +168,10 @@ typedef struct gatt_client{
     uint16_t client_characteristic_configuration_handle;
     uint8_t client_characteristic_configuration_value[2];
     
+    // write without response stream
+    uint32_t stream_length;
+    uint32_t stream_offset;
+    
     uint8_t  filter_with_uuid;
     uint8_t  send_confirmation;
     
@@ -151,6 +179,16 @@ typedef struct gatt_client{
     uint32_t sign_counter;
     uint8_t  cmac[8];
     timer_source_t gc_timeout;
+    
+    // queries issued while another query is active
+    linked_list_t pending_requests;
+
+#ifdef HAVE_GATT_CLIENT_CACHE
+    // discovery cache, keyed by address/address_type
+    uint8_t  cache_enabled;
+    uint8_t  cache_query;
+    uint16_t cache_start_handle;
+#endif
 } gatt_client_t;
 
 typedef struct le_event {
@@ -165,6 +203,14 @@ typedef struct gatt_complete_event{
     uint8_t status;
 } gatt_complete_event_t;
 
+typedef struct gatt_stream_progress_event{
+    uint8_t  type;
+    uint16_t handle;
+    uint16_t value_handle;
+    uint32_t bytes_sent;
+    uint32_t total_length;
+} gatt_stream_progress_event_t;
+
 typedef struct le_service{
     uint16_t start_group_handle;
     uint16_t end_group_handle;
@@ -218,10 +264,39 @@ typedef struct le_characteristic_descriptor_event{
     uint8_t * value;
 } le_characteristic_descriptor_event_t;
 
+#ifdef HAVE_GATT_CLIENT_CACHE
+// Persistent storage for the discovery cache. An entry is an opaque blob
+// per peer device, see gatt_client.c for its format.
+typedef struct {
+    // returns size of stored entry, 0 if none
+    int  (*get)(uint8_t addr_type, bd_addr_t addr, uint8_t * buffer, uint16_t buffer_size);
+    void (*put)(uint8_t addr_type, bd_addr_t addr, uint8_t * buffer, uint16_t size);
+    void (*remove)(uint8_t addr_type, bd_addr_t addr);
+} gatt_client_cache_t;
+
+extern const gatt_client_cache_t gatt_client_cache_posix;
+#endif
+
 //TODO: define uuid type
 // Set up GATT client.
 void gatt_client_init();
 
+#ifdef HAVE_GATT_CLIENT_CACHE
+// Enable discovery cache. Results of complete primary service, characteristic
+// and characteristic descriptor discoveries are stored per peer and replayed
+// without ATT traffic on the next connection. Entries are removed when
+// the peer indicates a Service Changed.
+void gatt_client_set_cache(const gatt_client_cache_t * cache);
+
+// The cache is only used for connections whose peer identity has been set,
+// typically after bonding and resolving the identity address with the
+// Security Manager. Entries are keyed by this identity address.
+void gatt_client_set_peer_identity(uint16_t con_handle, uint8_t addr_type, bd_addr_t addr);
+
+// Drop cached discovery results for peer
+void gatt_client_cache_remove(uint8_t addr_type, bd_addr_t addr);
+#endif
+
 // Register packet handler.
 void gatt_client_register_packet_handler(void (*le_callback)(le_event_t * event));
 
@@ -231,6 +306,12 @@ void gatt_client_register_packet_handler(void (*le_callback)(le_event_t * event)
 // Returns if the gatt client is ready to receive a query. It is used with daemon.
 int gatt_client_is_ready(uint16_t handle);
 
+// Note: if a query is already active on the connection, the following
+// queries are queued and started in order after the current one has
+// completed. Queueing requires a free gatt_client_request_t, see
+// MAX_NO_GATT_CLIENT_REQUESTS. Without one, BLE_PERIPHERAL_IN_WRONG_STATE
+// is returned and the query has to be retried later.
+
 // Discovers all primary services. For each found service, an
 // le_service_event_t with type set to GATT_SERVICE_QUERY_RESULT
 // will be generated and passed to the registered callback.
@@ -312,6 +393,15 @@ le_command_status_t gatt_client_read_long_value_of_characteristic_using_value_ha
 // performed.
 le_command_status_t gatt_client_write_value_of_characteristic_without_response(uint16_t con_handle, uint16_t characteristic_value_handle, uint16_t length, uint8_t * data);
 
+// Writes a large value to the characteristic using write without
+// response commands of up to MTU-3 bytes. As many commands as the
+// controller has free ACL buffers for are sent per connection event.
+// After each burst, a gatt_stream_progress_event_t with type set to
+// GATT_WRITE_WITHOUT_RESPONSE_STREAM_PROGRESS is emitted. The
+// gatt_complete_event_t with type set to GATT_QUERY_COMPLETE marks
+// the end of the stream. The data must stay valid until then.
+le_command_status_t gatt_client_write_value_of_characteristic_without_response_stream(uint16_t con_handle, uint16_t characteristic_value_handle, uint32_t length, uint8_t * data);
+
 // Writes the authenticated characteristic value using the
 // characteristic's value handle without an acknowledgement
 // that the write was successfully performed.
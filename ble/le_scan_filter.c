@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2011-2013 by BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. This software may not be used in a commercial product
+ *    without an explicit license granted by the copyright holder. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+// *****************************************************************************
+//
+// LE Scan Filter
+//
+// *****************************************************************************
+
+#include <string.h>
+
+#include <btstack/utils.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+
+#include "hci.h"
+#include "ad_parser.h"
+#include "le_scan_filter.h"
+
+#ifdef HAVE_TIME
+#include <sys/time.h>
+#endif
+
+#define LE_SCAN_FILTER_NONE 0xffff
+
+// advertising report event type for scan responses
+#define LE_SCAN_FILTER_SCAN_RSP 4
+
+// filter installed in HCI
+static le_scan_filter_t * le_scan_filter_registered;
+
+// current time in ms or ticks, matching min_interval
+static uint32_t le_scan_filter_now(void){
+#ifdef HAVE_TIME
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+#ifdef HAVE_TICK
+    return embedded_get_ticks();
+#endif
+#if !defined(HAVE_TIME) && !defined(HAVE_TICK)
+    return 0;
+#endif
+}
+
+// FNV-1a
+static uint32_t le_scan_filter_hash(uint32_t hash, const uint8_t * data, int len){
+    int i;
+    for (i = 0; i < len; i++){
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint16_t le_scan_filter_bucket(uint8_t addr_type, bd_addr_t addr){
+    return le_scan_filter_hash(2166136261u ^ addr_type, addr, 6) % LE_SCAN_FILTER_BUCKETS;
+}
+
+static void le_scan_filter_lru_unlink(le_scan_filter_t * filter, uint16_t index){
+    le_scan_filter_device_t * device = &filter->devices[index];
+    if (device->lru_prev == LE_SCAN_FILTER_NONE){
+        filter->lru_head = device->lru_next;
+    } else {
+        filter->devices[device->lru_prev].lru_next = device->lru_next;
+    }
+    if (device->lru_next == LE_SCAN_FILTER_NONE){
+        filter->lru_tail = device->lru_prev;
+    } else {
+        filter->devices[device->lru_next].lru_prev = device->lru_prev;
+    }
+}
+
+static void le_scan_filter_lru_add_front(le_scan_filter_t * filter, uint16_t index){
+    le_scan_filter_device_t * device = &filter->devices[index];
+    device->lru_prev = LE_SCAN_FILTER_NONE;
+    device->lru_next = filter->lru_head;
+    if (filter->lru_head == LE_SCAN_FILTER_NONE){
+        filter->lru_tail = index;
+    } else {
+        filter->devices[filter->lru_head].lru_prev = index;
+    }
+    filter->lru_head = index;
+}
+
+static uint16_t le_scan_filter_find(le_scan_filter_t * filter, uint8_t addr_type, bd_addr_t addr){
+    uint16_t index = filter->buckets[le_scan_filter_bucket(addr_type, addr)];
+    while (index != LE_SCAN_FILTER_NONE){
+        le_scan_filter_device_t * device = &filter->devices[index];
+        if (device->addr_type == addr_type && BD_ADDR_CMP(device->addr, addr) == 0) return index;
+        index = device->hash_next;
+    }
+    return LE_SCAN_FILTER_NONE;
+}
+
+static void le_scan_filter_unlink(le_scan_filter_t * filter, uint16_t index){
+    le_scan_filter_device_t * device = &filter->devices[index];
+    uint16_t * it = &filter->buckets[le_scan_filter_bucket(device->addr_type, device->addr)];
+    while (*it != LE_SCAN_FILTER_NONE){
+        if (*it == index){
+            *it = device->hash_next;
+            return;
+        }
+        it = &filter->devices[*it].hash_next;
+    }
+}
+
+// use free entry or replace least recently seen device
+static uint16_t le_scan_filter_create(le_scan_filter_t * filter, uint8_t addr_type, bd_addr_t addr){
+    uint16_t index;
+    if (filter->num_devices < LE_SCAN_FILTER_MAX_DEVICES){
+        index = filter->num_devices++;
+    } else {
+        index = filter->lru_tail;
+        le_scan_filter_unlink(filter, index);
+        le_scan_filter_lru_unlink(filter, index);
+    }
+    le_scan_filter_device_t * device = &filter->devices[index];
+    memset(device, 0, sizeof(le_scan_filter_device_t));
+    device->addr_type = addr_type;
+    BD_ADDR_COPY(device->addr, addr);
+    uint16_t bucket = le_scan_filter_bucket(addr_type, addr);
+    device->hash_next = filter->buckets[bucket];
+    filter->buckets[bucket] = index;
+    le_scan_filter_lru_add_front(filter, index);
+    return index;
+}
+
+static int le_scan_filter_rule_matches(le_scan_filter_rule_t * rule, uint8_t ad_len, uint8_t * ad_data){
+    ad_context_t context;
+    switch (rule->type){
+        case LE_SCAN_FILTER_RULE_AD_TYPE:
+            for (ad_iterator_init(&context, ad_len, ad_data) ; ad_iterator_has_more(&context) ; ad_iterator_next(&context)){
+                if (ad_iterator_get_data_type(&context) == rule->value) return 1;
+            }
+            return 0;
+        case LE_SCAN_FILTER_RULE_UUID16:
+            return ad_data_contains_uuid16(ad_len, ad_data, rule->value);
+        case LE_SCAN_FILTER_RULE_UUID128:
+            return ad_data_contains_uuid128(ad_len, ad_data, rule->uuid128);
+        default:
+            return 0;
+    }
+}
+
+static int le_scan_filter_rules_match(le_scan_filter_t * filter, uint8_t ad_len, uint8_t * ad_data){
+    int i;
+    for (i = 0; i < filter->num_rules; i++){
+        if (le_scan_filter_rule_matches(&filter->rules[i], ad_len, ad_data)) return 1;
+    }
+    return 0;
+}
+
+static le_scan_filter_rule_t * le_scan_filter_add_rule(le_scan_filter_t * filter, le_scan_filter_rule_type_t type){
+    if (filter->num_rules >= LE_SCAN_FILTER_MAX_RULES) return NULL;
+    le_scan_filter_rule_t * rule = &filter->rules[filter->num_rules++];
+    memset(rule, 0, sizeof(le_scan_filter_rule_t));
+    rule->type = type;
+    // devices have been checked against old rules
+    le_scan_filter_reset(filter);
+    return rule;
+}
+
+static int le_scan_filter_registered_accept(uint8_t * event, uint16_t size){
+    return le_scan_filter_accept(le_scan_filter_registered, event, size);
+}
+
+void le_scan_filter_init(le_scan_filter_t * filter){
+    filter->num_rules = 0;
+    filter->min_interval = 0;
+    filter->rssi_delta = 0;
+    le_scan_filter_reset(filter);
+}
+
+void le_scan_filter_register(le_scan_filter_t * filter){
+    le_scan_filter_registered = filter;
+    le_central_set_advertising_report_filter(filter ? &le_scan_filter_registered_accept : NULL);
+}
+
+void le_scan_filter_set_rate_limit(le_scan_filter_t * filter, uint16_t min_report_interval_ms, uint8_t rssi_delta){
+#ifdef HAVE_TICK
+    filter->min_interval = embedded_ticks_for_ms(min_report_interval_ms);
+#else
+    filter->min_interval = min_report_interval_ms;
+#endif
+    filter->rssi_delta = rssi_delta;
+}
+
+int le_scan_filter_add_ad_type(le_scan_filter_t * filter, uint8_t ad_type){
+    le_scan_filter_rule_t * rule = le_scan_filter_add_rule(filter, LE_SCAN_FILTER_RULE_AD_TYPE);
+    if (!rule) return BTSTACK_MEMORY_ALLOC_FAILED;
+    rule->value = ad_type;
+    return 0;
+}
+
+int le_scan_filter_add_uuid16(le_scan_filter_t * filter, uint16_t uuid16){
+    le_scan_filter_rule_t * rule = le_scan_filter_add_rule(filter, LE_SCAN_FILTER_RULE_UUID16);
+    if (!rule) return BTSTACK_MEMORY_ALLOC_FAILED;
+    rule->value = uuid16;
+    return 0;
+}
+
+int le_scan_filter_add_uuid128(le_scan_filter_t * filter, uint8_t * uuid128){
+    le_scan_filter_rule_t * rule = le_scan_filter_add_rule(filter, LE_SCAN_FILTER_RULE_UUID128);
+    if (!rule) return BTSTACK_MEMORY_ALLOC_FAILED;
+    memcpy(rule->uuid128, uuid128, 16);
+    return 0;
+}
+
+void le_scan_filter_clear_rules(le_scan_filter_t * filter){
+    filter->num_rules = 0;
+    le_scan_filter_reset(filter);
+}
+
+void le_scan_filter_reset(le_scan_filter_t * filter){
+    int i;
+    for (i = 0; i < LE_SCAN_FILTER_BUCKETS; i++){
+        filter->buckets[i] = LE_SCAN_FILTER_NONE;
+    }
+    filter->num_devices = 0;
+    filter->lru_head = LE_SCAN_FILTER_NONE;
+    filter->lru_tail = LE_SCAN_FILTER_NONE;
+}
+
+// event: type, size, event type, address type, address, rssi, data length, data
+int le_scan_filter_accept(le_scan_filter_t * filter, uint8_t * event, uint16_t size){
+    if (!filter->num_rules && !filter->min_interval) return 1;
+    if (size < 12) return 1;
+
+    uint8_t   event_type = event[2];
+    uint8_t   addr_type  = event[3];
+    uint8_t * addr       = &event[4];
+    int8_t    rssi       = (int8_t) event[10];
+    uint8_t   ad_len     = event[11];
+    uint8_t * ad_data    = &event[12];
+    if (12 + ad_len > size) return 1;
+
+    // scan responses pass if the advertisement of the device matched
+    uint16_t index = le_scan_filter_find(filter, addr_type, addr);
+    int matched = index != LE_SCAN_FILTER_NONE && filter->devices[index].matched;
+    if (!matched && filter->num_rules && !le_scan_filter_rules_match(filter, ad_len, ad_data)) return 0;
+
+    uint32_t now = le_scan_filter_now();
+    int      pdu = event_type == LE_SCAN_FILTER_SCAN_RSP ? 1 : 0;
+    uint32_t data_hash = le_scan_filter_hash(2166136261u, ad_data, ad_len);
+
+    if (index == LE_SCAN_FILTER_NONE){
+        index = le_scan_filter_create(filter, addr_type, addr);
+    } else {
+        le_scan_filter_lru_unlink(filter, index);
+        le_scan_filter_lru_add_front(filter, index);
+    }
+    le_scan_filter_device_t * device = &filter->devices[index];
+
+    int report = 1;
+    if (filter->min_interval && device->last_report[pdu]){
+        int rssi_change = rssi - device->rssi;
+        if (rssi_change < 0) rssi_change = -rssi_change;
+        report = (now - device->last_report[pdu]) >= filter->min_interval
+            || device->data_hash[pdu] != data_hash
+            || (filter->rssi_delta && rssi_change >= filter->rssi_delta);
+    }
+    device->matched = 1;
+    if (!report) return 0;
+
+    // 0 marks 'not reported yet'
+    device->last_report[pdu] = now ? now : 1;
+    device->data_hash[pdu] = data_hash;
+    device->rssi = rssi;
+    return 1;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2011-2013 by BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. This software may not be used in a commercial product
+ *    without an explicit license granted by the copyright holder. 
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+// *****************************************************************************
+//
+// LE Scan Filter
+//
+// Drops GAP_LE_ADVERTISING_REPORT events before they reach the packet handler:
+// - match rules on AD types and service UUIDs, a report passes if any rule matches
+// - per device rate limit, repeated reports pass only if the interval elapsed,
+//   the advertising data changed or the RSSI changed by the configured delta
+//
+// *****************************************************************************
+
+#ifndef __LE_SCAN_FILTER_H
+#define __LE_SCAN_FILTER_H
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+
+#include <btstack/utils.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+// max number of tracked devices, least recently seen device is replaced
+#ifndef LE_SCAN_FILTER_MAX_DEVICES
+#define LE_SCAN_FILTER_MAX_DEVICES 64
+#endif
+
+#ifndef LE_SCAN_FILTER_MAX_RULES
+#define LE_SCAN_FILTER_MAX_RULES 8
+#endif
+
+#define LE_SCAN_FILTER_BUCKETS (2 * LE_SCAN_FILTER_MAX_DEVICES)
+
+typedef enum {
+    LE_SCAN_FILTER_RULE_AD_TYPE,
+    LE_SCAN_FILTER_RULE_UUID16,
+    LE_SCAN_FILTER_RULE_UUID128,
+} le_scan_filter_rule_type_t;
+
+typedef struct {
+    le_scan_filter_rule_type_t type;
+    uint16_t value;
+    uint8_t  uuid128[16];
+} le_scan_filter_rule_t;
+
+// index 0: advertisements, index 1: scan responses
+typedef struct {
+    bd_addr_t addr;
+    uint8_t   addr_type;
+    uint8_t   matched;
+    int8_t    rssi;
+    uint32_t  last_report[2];
+    uint32_t  data_hash[2];
+    uint16_t  hash_next;
+    uint16_t  lru_prev;
+    uint16_t  lru_next;
+} le_scan_filter_device_t;
+
+// filter state, e.g. one per receiver of advertising reports
+typedef struct {
+    le_scan_filter_device_t devices[LE_SCAN_FILTER_MAX_DEVICES];
+    uint16_t buckets[LE_SCAN_FILTER_BUCKETS];
+    uint16_t num_devices;
+    uint16_t lru_head;
+    uint16_t lru_tail;
+
+    le_scan_filter_rule_t rules[LE_SCAN_FILTER_MAX_RULES];
+    int      num_rules;
+
+    uint32_t min_interval;
+    uint8_t  rssi_delta;
+} le_scan_filter_t;
+
+/**
+ * @brief init filter. Without rules and rate limit, all reports pass
+ */
+void le_scan_filter_init(le_scan_filter_t * filter);
+
+/**
+ * @brief install filter in HCI, reports that it drops are not emitted at all. NULL to emit all reports
+ */
+void le_scan_filter_register(le_scan_filter_t * filter);
+
+/**
+ * @brief configure per device rate limit
+ * @param min_report_interval_ms between unchanged reports of a device, 0 to report all
+ * @param rssi_delta that lets a report pass early, 0 to ignore RSSI changes
+ */
+void le_scan_filter_set_rate_limit(le_scan_filter_t * filter, uint16_t min_report_interval_ms, uint8_t rssi_delta);
+
+/**
+ * @brief only pass reports that contain an AD structure of the given type
+ * @returns 0 if ok
+ */
+int le_scan_filter_add_ad_type(le_scan_filter_t * filter, uint8_t ad_type);
+
+/**
+ * @brief only pass reports that list the given service UUID
+ * @returns 0 if ok
+ */
+int le_scan_filter_add_uuid16(le_scan_filter_t * filter, uint16_t uuid16);
+int le_scan_filter_add_uuid128(le_scan_filter_t * filter, uint8_t * uuid128);
+
+/**
+ * @brief remove all match rules
+ */
+void le_scan_filter_clear_rules(le_scan_filter_t * filter);
+
+/**
+ * @brief forget all seen devices, e.g. when a new scan is started
+ */
+void le_scan_filter_reset(le_scan_filter_t * filter);
+
+/**
+ * @brief filter GAP_LE_ADVERTISING_REPORT event
+ * @returns 1 if event should be delivered
+ */
+int le_scan_filter_accept(le_scan_filter_t * filter, uint8_t * event, uint16_t size);
+
+#if defined __cplusplus
+}
+#endif
+#endif // __LE_SCAN_FILTER_H
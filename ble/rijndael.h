@@ -6,14 +6,16 @@
 #ifndef H__RIJNDAEL
 #define H__RIJNDAEL
 
+#include <stdint.h>
+
 #if defined __cplusplus
 extern "C" {
 #endif
 
-int rijndaelSetupEncrypt(unsigned long *rk, const unsigned char *key, int keybits);
-int rijndaelSetupDecrypt(unsigned long *rk, const unsigned char *key, int keybits);
-void rijndaelEncrypt(const unsigned long *rk, int nrounds, const unsigned char plaintext[16], unsigned char ciphertext[16]);
-void rijndaelDecrypt(const unsigned long *rk, int nrounds, const unsigned char ciphertext[16], unsigned char plaintext[16]);
+int rijndaelSetupEncrypt(uint32_t *rk, const uint8_t *key, int keybits);
+int rijndaelSetupDecrypt(uint32_t *rk, const uint8_t *key, int keybits);
+void rijndaelEncrypt(const uint32_t *rk, int nrounds, const uint8_t plaintext[16], uint8_t ciphertext[16]);
+void rijndaelDecrypt(const uint32_t *rk, int nrounds, const uint8_t ciphertext[16], uint8_t plaintext[16]);
 	
 #define KEYBITS 128
 
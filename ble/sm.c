@@ -38,105 +38,24 @@
 #include <string.h>
 
 #include "debug.h"
+#include "btstack_memory.h"
 #include "hci.h"
 #include "l2cap.h"
 #include "central_device_db.h"
 #include "sm.h"
 #include "gap_le.h"
+#ifdef HAVE_GATT_CLIENT_CACHE
+#include "gatt_client.h"
+#endif
+
+#ifdef HAVE_SM_HOST_AES
+#include "rijndael.h"
+#endif
 
 //
 // SM internal types and globals
 //
 
-typedef enum {
-
-    // general states
-    SM_GENERAL_IDLE,
-    SM_GENERAL_SEND_PAIRING_FAILED,
-    SM_GENERAL_TIMEOUT, // no other security messages are exchanged
-
-    // Phase 1: Pairing Feature Exchange
-    SM_PH1_W4_USER_RESPONSE,
-
-    // Phase 2: Authenticating and Encrypting
-
-    // get random number for use as TK Passkey if we show it 
-    SM_PH2_GET_RANDOM_TK,
-    SM_PH2_W4_RANDOM_TK,
-
-    // get local random number for confirm c1
-    SM_PH2_C1_GET_RANDOM_A,
-    SM_PH2_C1_W4_RANDOM_A,
-    SM_PH2_C1_GET_RANDOM_B,
-    SM_PH2_C1_W4_RANDOM_B,
-
-    // calculate confirm value for local side
-    SM_PH2_C1_GET_ENC_A,
-    SM_PH2_C1_W4_ENC_A,
-    SM_PH2_C1_GET_ENC_B,
-    SM_PH2_C1_W4_ENC_B,
-
-    // calculate confirm value for remote side
-    SM_PH2_C1_GET_ENC_C,
-    SM_PH2_C1_W4_ENC_C,
-    SM_PH2_C1_GET_ENC_D,
-    SM_PH2_C1_W4_ENC_D,
-
-    SM_PH2_C1_SEND_PAIRING_CONFIRM,
-    SM_PH2_SEND_PAIRING_RANDOM,
-
-    // calc STK
-    SM_PH2_CALC_STK,
-    SM_PH2_W4_STK,
-
-    SM_PH2_W4_CONNECTION_ENCRYPTED,
-
-    // Phase 3: Transport Specific Key Distribution
-    
-    // calculate DHK, Y, EDIV, and LTK
-    SM_PH3_GET_RANDOM,
-    SM_PH3_W4_RANDOM,
-    SM_PH3_GET_DIV,
-    SM_PH3_W4_DIV,
-    SM_PH3_Y_GET_ENC,
-    SM_PH3_Y_W4_ENC,
-    SM_PH3_LTK_GET_ENC,
-    SM_PH3_LTK_W4_ENC,
-    SM_PH3_CSRK_GET_ENC,
-    SM_PH3_CSRK_W4_ENC,
-
-    // exchange keys
-    SM_PH3_DISTRIBUTE_KEYS,
-    SM_PH3_RECEIVE_KEYS,
-
-    // Phase 4: re-establish previously distributed LTK
-    SM_PH4_Y_GET_ENC,
-    SM_PH4_Y_W4_ENC,
-    SM_PH4_LTK_GET_ENC,
-    SM_PH4_LTK_W4_ENC,
-    SM_PH4_SEND_LTK,
-
-    // RESPONDER ROLE
-    SM_RESPONDER_SEND_SECURITY_REQUEST,
-    SM_RESPONDER_SEND_LTK_REQUESTED_NEGATIVE_REPLY,
-    SM_RESPONDER_PH1_W4_PAIRING_REQUEST,
-    SM_RESPONDER_PH1_SEND_PAIRING_RESPONSE,
-    SM_RESPONDER_PH1_W4_PAIRING_CONFIRM,
-    SM_RESPONDER_PH2_W4_PAIRING_RANDOM,
-    SM_RESPONDER_PH2_W4_LTK_REQUEST,
-    SM_RESPONDER_PH2_SEND_LTK_REPLY,
-
-    // INITITIATOR ROLE
-    SM_INITIATOR_CONNECTED,
-    SM_INITIATOR_PH1_SEND_PAIRING_REQUEST,
-    SM_INITIATOR_PH1_W4_PAIRING_RESPONSE,
-    SM_INITIATOR_PH2_W4_PAIRING_CONFIRM,
-    SM_INITIATOR_PH2_W4_PAIRING_RANDOM,
-    SM_INITIATOR_PH3_SEND_START_ENCRYPTION,
-    SM_INITIATOR_PH3_XXXX,
-
-} security_manager_state_t;
-
 typedef enum {
     DKG_W4_WORKING,
     DKG_CALC_IRK,
@@ -155,30 +74,6 @@ typedef enum {
     RAU_SET_ADDRESS,
 } random_address_update_t;
 
-typedef enum {
-    CMAC_IDLE,
-    CMAC_CALC_SUBKEYS,
-    CMAC_W4_SUBKEYS,
-    CMAC_CALC_MI,
-    CMAC_W4_MI,
-    CMAC_CALC_MLAST,
-    CMAC_W4_MLAST
-} cmac_state_t;
-
-typedef enum {
-    CSRK_LOOKUP_IDLE,
-    CSRK_LOOKUP_W4_READY,
-    CSRK_LOOKUP_STARTED,
-} csrk_lookup_state_t;
-
-typedef enum {
-    JUST_WORKS,
-    PK_RESP_INPUT,  // Initiator displays PK, initiator inputs PK 
-    PK_INIT_INPUT,  // Responder displays PK, responder inputs PK
-    OK_BOTH_INPUT,  // Only input on both, both input PK
-    OOB             // OOB available on both sides
-} stk_generation_method_t;
-
 typedef enum {
     SM_USER_RESPONSE_IDLE,
     SM_USER_RESPONSE_PENDING,
@@ -187,20 +82,14 @@ typedef enum {
     SM_USER_RESPONSE_DECLINE
 } sm_user_response_t;
 
+// procedures using the aes128 engine
 typedef enum {
-    SM_AES128_IDLE,
-    SM_AES128_ACTIVE
-} sm_aes128_state_t;
-
-typedef struct sm_pairing_packet {
-    uint8_t code;
-    uint8_t io_capability;
-    uint8_t oob_data_flag;
-    uint8_t auth_req;
-    uint8_t max_encryption_key_size;
-    uint8_t initiator_key_distribution;
-    uint8_t responder_key_distribution;
-} sm_pairing_packet_t;
+    SM_AES128_USER_DKG,
+    SM_AES128_USER_RAU,
+    SM_AES128_USER_SETUP,
+    SM_AES128_USER_CSRK_LOOKUP,
+    SM_AES128_USER_CMAC
+} sm_aes128_user_t;
 
 //
 // GLOBAL DATA
@@ -232,109 +121,57 @@ static derived_key_generation_t dkg_state = DKG_W4_WORKING;
 static random_address_update_t rau_state = RAU_IDLE;
 static bd_addr_t sm_random_address;
 
-// CMAC calculation
-static cmac_state_t sm_cmac_state;
-static sm_key_t     sm_cmac_k;
-static uint16_t     sm_cmac_message_len;
-static uint8_t *    sm_cmac_message;
-static sm_key_t     sm_cmac_m_last;
-static sm_key_t     sm_cmac_x;
-static uint8_t      sm_cmac_block_current;
-static uint8_t      sm_cmac_block_count;
-static void (*sm_cmac_done_handler)(uint8_t hash[8]);
-
-// resolvable private address lookup
-static int       sm_central_device_test;
-static int       sm_central_device_matched;
-static int       sm_central_ah_calculation_active;
-static uint8_t   sm_central_device_addr_type;
-static bd_addr_t sm_central_device_address;
-
-// aes128 crypto engine
-static sm_aes128_state_t sm_aes128_state;
-
-//
-// Volume 3, Part H, Chapter 24
-// "Security shall be initiated by the Security Manager in the device in the master role.
-// The device in the slave role shall be the responding device."
-// -> master := initiator, slave := responder
-//
-
-// data needed for security setup
-typedef struct sm_setup_context {
-
-    // used in all phases
-    uint8_t   sm_pairing_failed_reason;
-
-    // user response, (Phase 1 and/or 2)
-    uint8_t   sm_user_response;
-
-    // defines which keys will be send after connection is encrypted - calculated during Phase 1, used Phase 3
-    int       sm_key_distribution_send_set;
-    int       sm_key_distribution_received_set;
-
-    // Phase 2 (Pairing over SMP)
-    stk_generation_method_t sm_stk_generation_method;
-    sm_key_t  sm_tk;
-
-    sm_key_t  sm_c1_t3_value;   // c1 calculation 
-    sm_pairing_packet_t sm_m_preq; // pairing request - needed only for c1
-    sm_pairing_packet_t sm_s_pres; // pairing response - needed only for c1
-    sm_key_t  sm_local_random;
-    sm_key_t  sm_local_confirm;
-    sm_key_t  sm_peer_random;
-    sm_key_t  sm_peer_confirm;
-    uint8_t   sm_m_addr_type;   // address and type can be removed
-    uint8_t   sm_s_addr_type;   //  '' 
-    bd_addr_t sm_m_address;     //  ''
-    bd_addr_t sm_s_address;     //  ''
-    sm_key_t  sm_ltk;
-
-    // Phase 3
-
-    // key distribution, we generate
-    uint16_t  sm_local_y;
-    uint16_t  sm_local_div;
-    uint16_t  sm_local_ediv;
-    uint8_t   sm_local_rand[8];
-    sm_key_t  sm_local_ltk;
-    sm_key_t  sm_local_csrk;
-    sm_key_t  sm_local_irk;
-    // sm_local_address/addr_type not needed
-
-    // key distribution, received from peer
-    uint16_t  sm_peer_y;
-    uint16_t  sm_peer_div;
-    uint16_t  sm_peer_ediv;
-    uint8_t   sm_peer_rand[8];
-    sm_key_t  sm_peer_ltk;
-    sm_key_t  sm_peer_csrk;
-    sm_key_t  sm_peer_irk;
-    uint8_t   sm_peer_addr_type;
-    bd_addr_t sm_peer_address;
-} sm_setup_context_t;
-
-// connection info available as long as connection exists
-typedef struct sm_connection {
-    uint16_t  sm_handle;
-    uint8_t   sm_role;   // 0 - IamMaster, 1 = IamSlave
-    bd_addr_t sm_peer_address;
-    uint8_t   sm_peer_addr_type;
-    security_manager_state_t sm_engine_state;
-    csrk_lookup_state_t      sm_csrk_lookup_state;
-    uint8_t   sm_connection_encrypted;
-    uint8_t   sm_connection_authenticated;   // [0..1]
-    uint8_t   sm_actual_encryption_key_size;
-    authorization_state_t sm_connection_authorization_state;
-    timer_source_t sm_timeout;
-} sm_connection_t;
-
-// 
-static sm_setup_context_t the_setup;
-static sm_setup_context_t * setup = &the_setup;
-// 
-static sm_connection_t single_connection;
-static sm_connection_t * connection = &single_connection;
+// aes128 crypto engine: requests are sent as long as the controller accepts commands,
+// results arrive in request order
+#ifndef SM_AES128_QUEUE_SIZE
+#define SM_AES128_QUEUE_SIZE 4
+#endif
+typedef struct sm_aes128_request {
+    sm_aes128_user_t  user;
+    sm_connection_t * connection;   // NULL for global procedures or if disconnected meanwhile
+} sm_aes128_request_t;
+static sm_aes128_request_t sm_aes128_queue[SM_AES128_QUEUE_SIZE];
+static int sm_aes128_queue_head;
+static int sm_aes128_queue_count;
+
+#ifdef HAVE_SM_HOST_AES
+// resolved private addresses, oldest entry gets replaced
+#ifndef SM_RESOLVED_ADDRESS_CACHE_SIZE
+#define SM_RESOLVED_ADDRESS_CACHE_SIZE 32
+#endif
+typedef struct sm_resolved_address {
+    bd_addr_t address;
+    int       index;    // central device db index, -1 if address could not be resolved
+} sm_resolved_address_t;
+static sm_resolved_address_t sm_resolved_address_cache[SM_RESOLVED_ADDRESS_CACHE_SIZE];
+static int sm_resolved_address_cache_count;
+static int sm_resolved_address_cache_next;
+
+// expanded AES round keys for the first central device db entries, valid while irk matches
+#ifndef SM_IRK_ROUND_KEYS_SIZE
+#define SM_IRK_ROUND_KEYS_SIZE 32
+#endif
+typedef struct sm_irk_round_keys {
+    sm_key_t irk;
+    uint32_t rk[RKLENGTH(KEYBITS)];
+    uint8_t  valid;
+} sm_irk_round_keys_t;
+static sm_irk_round_keys_t sm_irk_round_keys[SM_IRK_ROUND_KEYS_SIZE];
+#endif
+
+// all LE connections, served in round robin order by sm_run
+static linked_list_t sm_connections;
+
+// connection and its setup context that is currently processed
+static sm_connection_t * connection;
+static sm_setup_context_t * setup;
+
+// connection waiting for a random result, NULL if disconnected meanwhile
+static sm_connection_t * sm_random_context;
+
+// sm_run called from a client callback during sm_run
+static int sm_run_active;
+static int sm_run_requested;
 
 // @returns 1 if oob data is available
 // stores oob data in provided 16 byte buffer if not null
@@ -354,6 +191,7 @@ static const stk_generation_method_t stk_generation_method[5][5] = {
 };
 
 static void sm_run();
+static void sm_run_connection(void);
 static void sm_notify_client(uint8_t type, uint8_t addr_type, bd_addr_t address, uint32_t passkey, uint16_t index);
 
 static void log_info_hex16(const char * name, uint16_t value){
@@ -386,6 +224,31 @@ static void sm_truncate_key(sm_key_t key, int max_encryption_size){
     }
 }
 
+static void sm_connection_activate(sm_connection_t * sm_conn){
+    connection = sm_conn;
+    setup = &sm_conn->sm_setup;
+}
+
+static sm_connection_t * sm_connection_for_handle(uint16_t handle){
+    linked_item_t *it;
+    for (it = (linked_item_t *) sm_connections; it ; it = it->next){
+        sm_connection_t * sm_conn = (sm_connection_t *) it;
+        if (sm_conn->sm_handle == handle) return sm_conn;
+    }
+    return NULL;
+}
+
+static sm_connection_t * sm_connection_for_address(uint8_t addr_type, bd_addr_t address){
+    linked_item_t *it;
+    for (it = (linked_item_t *) sm_connections; it ; it = it->next){
+        sm_connection_t * sm_conn = (sm_connection_t *) it;
+        if (sm_conn->sm_peer_addr_type != addr_type) continue;
+        if (BD_ADDR_CMP(sm_conn->sm_peer_address, address) != 0) continue;
+        return sm_conn;
+    }
+    return NULL;
+}
+
 // SMP Timeout implementation
 
 // Upon transmission of the Pairing Request command or reception of the Pairing Request command,
@@ -399,8 +262,14 @@ static void sm_truncate_key(sm_key_t key, int max_encryption_size){
 // established.
 
 static void sm_2timeout_handler(timer_source_t * timer){
-    log_info("SM timeout");
-    connection->sm_engine_state = SM_GENERAL_TIMEOUT;
+    linked_item_t *it;
+    for (it = (linked_item_t *) sm_connections; it ; it = it->next){
+        sm_connection_t * sm_conn = (sm_connection_t *) it;
+        if (&sm_conn->sm_timeout != timer) continue;
+        log_info("SM timeout, handle 0x%04x", sm_conn->sm_handle);
+        sm_conn->sm_engine_state = SM_GENERAL_TIMEOUT;
+        return;
+    }
 }
 static void sm_2timeout_start(){
     run_loop_remove_timer(&connection->sm_timeout);
@@ -447,9 +316,22 @@ static void gap_random_address_update_stop(){
     run_loop_remove_timer(&gap_random_address_update_timer);
 }
 
-// pre: sm_aes128_state != SM_AES128_ACTIVE, hci_can_send_command == 1
-static void sm_aes128_start(sm_key_t key, sm_key_t plaintext){
-    sm_aes128_state = SM_AES128_ACTIVE;
+static void sm_aes128_queue_reset(void){
+    sm_aes128_queue_head  = 0;
+    sm_aes128_queue_count = 0;
+}
+
+static int sm_aes128_ready(void){
+    return sm_aes128_queue_count < SM_AES128_QUEUE_SIZE && hci_can_send_command_packet_now();
+}
+
+// pre: sm_aes128_ready() == 1
+// the result is delivered to the user for the current connection, if any
+static void sm_aes128_start(sm_aes128_user_t user, sm_key_t key, sm_key_t plaintext){
+    sm_aes128_request_t * request = &sm_aes128_queue[(sm_aes128_queue_head + sm_aes128_queue_count) % SM_AES128_QUEUE_SIZE];
+    request->user = user;
+    request->connection = connection;
+    sm_aes128_queue_count++;
     sm_key_t key_flipped, plaintext_flipped;
     swap128(key, key_flipped);
     swap128(plaintext, plaintext_flipped);
@@ -630,23 +512,205 @@ static void sm_setup_key_distribution(uint8_t key_set){
     setup->sm_key_distribution_send_set = sm_key_distribution_flags_for_set(key_set);
 }
 
-// CSRK Key Lookup
+// CSRK Key Lookup, one per connection
+
+static void sm_csrk_lookup_start(void){
+    connection->sm_csrk_lookup_index = 0;
+    connection->sm_csrk_lookup_matched = -1;
+    connection->sm_csrk_lookup_state = CSRK_LOOKUP_STARTED;
+    sm_notify_client(SM_IDENTITY_RESOLVING_STARTED, connection->sm_peer_addr_type, connection->sm_peer_address, 0, 0);
+}
+
+static void sm_csrk_lookup_found(int index){
+    log_info("Central Device Lookup: found device %u", index);
+    connection->sm_csrk_lookup_matched = index;
+    connection->sm_csrk_lookup_state = CSRK_LOOKUP_IDLE;
+    central_device_db_csrk(index, setup->sm_peer_csrk);
+#ifdef HAVE_GATT_CLIENT_CACHE
+    // GATT client discovery cache is keyed by the identity address of bonded devices
+    int identity_addr_type;
+    bd_addr_t identity_addr;
+    sm_key_t irk;
+    central_device_db_info(index, &identity_addr_type, identity_addr, irk);
+    gatt_client_set_peer_identity(connection->sm_handle, identity_addr_type, identity_addr);
+#endif
+    sm_notify_client(SM_IDENTITY_RESOLVING_SUCCEEDED, connection->sm_peer_addr_type, connection->sm_peer_address, 0, index);
+}
 
-/* static */ int sm_central_device_lookup_active(){
-    return sm_central_device_test >= 0;
+static void sm_csrk_lookup_not_found(void){
+    log_info("Central Device Lookup: not found");
+    connection->sm_csrk_lookup_state = CSRK_LOOKUP_IDLE;
+    sm_notify_client(SM_IDENTITY_RESOLVING_FAILED, connection->sm_peer_addr_type, connection->sm_peer_address, 0, 0);
 }
 
-static void sm_central_device_start_lookup(uint8_t addr_type, bd_addr_t addr){
-    memcpy(sm_central_device_address, addr, 6);
-    sm_central_device_addr_type = addr_type;
-    sm_central_device_test = 0;
-    sm_central_device_matched = -1;
-    sm_notify_client(SM_IDENTITY_RESOLVING_STARTED, addr_type, addr, 0, 0);
+#ifdef HAVE_SM_HOST_AES
+
+// Address resolution using AES in software: all IRKs are tested in one go
+
+// round keys for irk of db entry, key expansion is only done when the irk changes
+static const uint32_t * sm_irk_round_keys_for_index(int index, const uint8_t * irk, uint32_t * scratch){
+    if (index < 0 || index >= SM_IRK_ROUND_KEYS_SIZE){
+        rijndaelSetupEncrypt(scratch, irk, KEYBITS);
+        return scratch;
+    }
+    sm_irk_round_keys_t * entry = &sm_irk_round_keys[index];
+    if (!entry->valid || memcmp(entry->irk, irk, 16) != 0){
+        memcpy(entry->irk, irk, 16);
+        rijndaelSetupEncrypt(entry->rk, irk, KEYBITS);
+        entry->valid = 1;
+    }
+    return entry->rk;
+}
+
+// hash = ah(irk, prand), r_prime from sm_ah_r_prime(address)
+static int sm_address_matches_irk(bd_addr_t address, sm_key_t r_prime, int index, const uint8_t * irk){
+    uint32_t scratch[RKLENGTH(KEYBITS)];
+    sm_key_t ah;
+    const uint32_t * rk = sm_irk_round_keys_for_index(index, irk, scratch);
+    rijndaelEncrypt(rk, NROUNDS(KEYBITS), r_prime, ah);
+    return memcmp(&address[3], &ah[13], 3) == 0;
+}
+
+static int sm_resolved_address_cache_find(bd_addr_t address){
+    int i;
+    for (i=0;i<sm_resolved_address_cache_count;i++){
+        if (BD_ADDR_CMP(sm_resolved_address_cache[i].address, address) == 0) return i;
+    }
+    return -1;
+}
+
+static void sm_resolved_address_cache_add(bd_addr_t address, int index){
+    int pos = sm_resolved_address_cache_find(address);
+    if (pos < 0){
+        pos = sm_resolved_address_cache_next;
+        sm_resolved_address_cache_next = (sm_resolved_address_cache_next + 1) % SM_RESOLVED_ADDRESS_CACHE_SIZE;
+        if (sm_resolved_address_cache_count < SM_RESOLVED_ADDRESS_CACHE_SIZE){
+            sm_resolved_address_cache_count++;
+        }
+    }
+    BD_ADDR_COPY(sm_resolved_address_cache[pos].address, address);
+    sm_resolved_address_cache[pos].index = index;
 }
 
-// TODO use relevant connection structure
-static void sm_central_device_lookup_found(sm_key_t csrk){
-    memcpy(setup->sm_peer_csrk, csrk, 16);
+// new devices could match addresses that failed to resolve before
+static void sm_resolved_address_cache_flush(){
+    sm_resolved_address_cache_count = 0;
+    sm_resolved_address_cache_next  = 0;
+}
+
+int sm_address_resolution_lookup(uint8_t addr_type, bd_addr_t addr){
+    int count = central_device_db_count();
+    int i;
+
+    // identity address
+    i = central_device_db_lookup(addr_type, addr);
+    if (i >= 0) return i;
+
+    // only resolvable private addresses are left
+    if (addr_type == 0 || (addr[0] & 0xc0) != 0x40) return -1;
+
+    sm_key_t irk;
+    sm_key_t r_prime;
+    sm_ah_r_prime(addr, r_prime);
+    int pos = sm_resolved_address_cache_find(addr);
+    if (pos >= 0){
+        int index = sm_resolved_address_cache[pos].index;
+        if (index < 0) return -1;
+        // verify that db entry wasn't replaced meanwhile
+        if (index < count){
+            central_device_db_info(index, NULL, NULL, irk);
+            if (sm_address_matches_irk(addr, r_prime, index, irk)) return index;
+        }
+    }
+
+    int index = -1;
+    const sm_key_t * irk_table = central_device_db_irk_table();
+    for (i=0;i<count;i++){
+        if (irk_table){
+            if (!sm_address_matches_irk(addr, r_prime, i, irk_table[i])) continue;
+        } else {
+            central_device_db_info(i, NULL, NULL, irk);
+            if (!sm_address_matches_irk(addr, r_prime, i, irk)) continue;
+        }
+        index = i;
+        break;
+    }
+    log_info("Address resolution: %s -> %d", bd_addr_to_str(addr), index);
+    sm_resolved_address_cache_add(addr, index);
+    return index;
+}
+#endif
+
+// pre: connection and setup set
+static void sm_csrk_lookup_run(void){
+    switch (connection->sm_csrk_lookup_state){
+        case CSRK_LOOKUP_W4_READY:
+            sm_csrk_lookup_start();
+            break;
+        case CSRK_LOOKUP_STARTED:
+            break;
+        default:
+            return;
+    }
+
+    // by public or resolvable private address
+#ifdef HAVE_SM_HOST_AES
+    int index = sm_address_resolution_lookup(connection->sm_peer_addr_type, connection->sm_peer_address);
+    if (index >= 0){
+        sm_csrk_lookup_found(index);
+    } else {
+        sm_csrk_lookup_not_found();
+    }
+#else
+    log_info("Central Device Lookup: device %u/%u", connection->sm_csrk_lookup_index, central_device_db_count());
+    while (connection->sm_csrk_lookup_index < central_device_db_count()){
+        int addr_type;
+        bd_addr_t addr;
+        sm_key_t irk;
+        central_device_db_info(connection->sm_csrk_lookup_index, &addr_type, addr, irk);
+        log_info("device type %u, addr: %s", addr_type, bd_addr_to_str(addr));
+
+        if (connection->sm_peer_addr_type == addr_type && memcmp(addr, connection->sm_peer_address, 6) == 0){
+            log_info("Central Device Lookup: found CSRK by { addr_type, address} ");
+            sm_csrk_lookup_found(connection->sm_csrk_lookup_index);
+            return;
+        }
+
+        if (connection->sm_peer_addr_type == 0){
+            connection->sm_csrk_lookup_index++;
+            continue;
+        }
+
+        // already busy?
+        if (!sm_aes128_ready()) return;
+
+        log_info("Central Device Lookup: calculate AH");
+        log_key("IRK", irk);
+
+        sm_key_t r_prime;
+        sm_ah_r_prime(connection->sm_peer_address, r_prime);
+        sm_aes128_start(SM_AES128_USER_CSRK_LOOKUP, irk, r_prime);
+        connection->sm_csrk_lookup_state = CSRK_LOOKUP_W4_ENC;
+        return;
+    }
+    sm_csrk_lookup_not_found();
+#endif
+}
+
+// pre: connection and setup set
+static void sm_csrk_lookup_handle_encryption_result(uint8_t * data){
+    if (connection->sm_csrk_lookup_state != CSRK_LOOKUP_W4_ENC) return;
+    connection->sm_csrk_lookup_state = CSRK_LOOKUP_STARTED;
+    // compare calulated address against connecting device
+    uint8_t hash[3];
+    swap24(data, hash);
+    if (memcmp(&connection->sm_peer_address[3], hash, 3) == 0){
+        log_info("Central Device Lookup: matched resolvable private address");
+        sm_csrk_lookup_found(connection->sm_csrk_lookup_index);
+        return;
+    }
+    // no match, test next device
+    connection->sm_csrk_lookup_index++;
 }
 
 // CMAC Implementation using AES128 engine
@@ -670,82 +734,92 @@ static inline void dkg_next_state(){
 static inline void rau_next_state(){
     rau_state = (random_address_update_t) (((int)rau_state) + 1);
 }
-static inline void sm_cmac_next_state(){
-    sm_cmac_state = (cmac_state_t) (((int)sm_cmac_state) + 1);
+static inline void sm_cmac_next_state(sm_cmac_context_t * cmac){
+    cmac->state = (cmac_state_t) (((int)cmac->state) + 1);
 }
-static int sm_cmac_last_block_complete(){
-    if (sm_cmac_message_len == 0) return 0;
-    return (sm_cmac_message_len & 0x0f) == 0;
+static int sm_cmac_last_block_complete(sm_cmac_context_t * cmac){
+    if (cmac->message_len == 0) return 0;
+    return (cmac->message_len & 0x0f) == 0;
 }
 
-void sm_cmac_start(sm_key_t k, uint16_t message_len, uint8_t * message, void (*done_handler)(uint8_t hash[8])){
-    memcpy(sm_cmac_k, k, 16);
-    sm_cmac_message_len = message_len;
-    sm_cmac_message = message;
-    sm_cmac_done_handler = done_handler;
-    sm_cmac_block_current = 0;
-    memset(sm_cmac_x, 0, 16);
+void sm_cmac_start(uint16_t con_handle, sm_key_t k, uint16_t message_len, uint8_t * message, void (*done_handler)(uint16_t con_handle, uint8_t hash[8])){
+    sm_connection_t * sm_conn = sm_connection_for_handle(con_handle);
+    if (!sm_conn) return;
+    sm_cmac_context_t * cmac = &sm_conn->sm_cmac;
+
+    memcpy(cmac->k, k, 16);
+    cmac->message_len = message_len;
+    cmac->message = message;
+    cmac->done_handler = done_handler;
+    cmac->block_current = 0;
+    memset(cmac->x, 0, 16);
 
     // step 2: n := ceil(len/const_Bsize);
-    sm_cmac_block_count = (message_len + 15) / 16;
+    cmac->block_count = (message_len + 15) / 16;
 
     // step 3: ..
-    if (sm_cmac_block_count==0){
-        sm_cmac_block_count = 1;
+    if (cmac->block_count==0){
+        cmac->block_count = 1;
     }
 
     // first, we need to compute l for k1, k2, and m_last
-    sm_cmac_state = CMAC_CALC_SUBKEYS;
+    cmac->state = CMAC_CALC_SUBKEYS;
 
     // let's go
     sm_run();
 }
 
-int sm_cmac_ready(){
-    return sm_cmac_state == CMAC_IDLE;
+int sm_cmac_ready(uint16_t con_handle){
+    sm_connection_t * sm_conn = sm_connection_for_handle(con_handle);
+    if (!sm_conn) return 0;
+    return sm_conn->sm_cmac.state == CMAC_IDLE;
 }
 
+// pre: connection set, sm_aes128_ready() == 1
 static void sm_cmac_handle_aes_engine_ready(){
-    switch (sm_cmac_state){
+    sm_cmac_context_t * cmac = &connection->sm_cmac;
+    switch (cmac->state){
         case CMAC_CALC_SUBKEYS:
             {
             sm_key_t const_zero;
             memset(const_zero, 0, 16);
-            sm_aes128_start(sm_cmac_k, const_zero);
-            sm_cmac_next_state();
+            sm_aes128_start(SM_AES128_USER_CMAC, cmac->k, const_zero);
+            sm_cmac_next_state(cmac);
             break;
             }
         case CMAC_CALC_MI: {
             int j;
             sm_key_t y;
             for (j=0;j<16;j++){
-                y[j] = sm_cmac_x[j] ^ sm_cmac_message[sm_cmac_block_current*16 + j];
+                y[j] = cmac->x[j] ^ cmac->message[cmac->block_current*16 + j];
             }
-            sm_cmac_block_current++;
-            sm_aes128_start(sm_cmac_k, y);
-            sm_cmac_next_state();
+            cmac->block_current++;
+            sm_aes128_start(SM_AES128_USER_CMAC, cmac->k, y);
+            sm_cmac_next_state(cmac);
             break;
         }
         case CMAC_CALC_MLAST: {
             int i;
             sm_key_t y;
             for (i=0;i<16;i++){
-                y[i] = sm_cmac_x[i] ^ sm_cmac_m_last[i]; 
+                y[i] = cmac->x[i] ^ cmac->m_last[i]; 
             }
             log_key("Y", y);
-            sm_cmac_block_current++;
-            sm_aes128_start(sm_cmac_k, y);
-            sm_cmac_next_state();
+            cmac->block_current++;
+            sm_aes128_start(SM_AES128_USER_CMAC, cmac->k, y);
+            sm_cmac_next_state(cmac);
             break;
         }
         default:
-            log_info("sm_cmac_handle_aes_engine_ready called in state %u", sm_cmac_state);
+            log_info("sm_cmac_handle_aes_engine_ready called in state %u", cmac->state);
             break;
     }
 }
 
+// pre: connection set
 static void sm_cmac_handle_encryption_result(sm_key_t data){
-    switch (sm_cmac_state){
+    sm_cmac_context_t * cmac = &connection->sm_cmac;
+    switch (cmac->state){
         case CMAC_W4_SUBKEYS: {
             sm_key_t k1;
             memcpy(k1, data, 16);
@@ -760,47 +834,48 @@ static void sm_cmac_handle_encryption_result(sm_key_t data){
                 k2[15] ^= 0x87;
             } 
 
-            log_key("k", sm_cmac_k);
+            log_key("k", cmac->k);
             log_key("k1", k1);
             log_key("k2", k2);
 
             // step 4: set m_last
             int i;
-            if (sm_cmac_last_block_complete()){
+            if (sm_cmac_last_block_complete(cmac)){
                 for (i=0;i<16;i++){
-                    sm_cmac_m_last[i] = sm_cmac_message[sm_cmac_message_len - 16 + i] ^ k1[i];
+                    cmac->m_last[i] = cmac->message[cmac->message_len - 16 + i] ^ k1[i];
                 }
             } else {
-                int valid_octets_in_last_block = sm_cmac_message_len & 0x0f;
+                int valid_octets_in_last_block = cmac->message_len & 0x0f;
                 for (i=0;i<16;i++){
                     if (i < valid_octets_in_last_block){
-                        sm_cmac_m_last[i] = sm_cmac_message[(sm_cmac_message_len & 0xfff0) + i] ^ k2[i];
+                        cmac->m_last[i] = cmac->message[(cmac->message_len & 0xfff0) + i] ^ k2[i];
                         continue;
                     }
                     if (i == valid_octets_in_last_block){
-                        sm_cmac_m_last[i] = 0x80 ^ k2[i];
+                        cmac->m_last[i] = 0x80 ^ k2[i];
                         continue;
                     }
-                    sm_cmac_m_last[i] = k2[i];
+                    cmac->m_last[i] = k2[i];
                 }
             }
 
 
             // next
-            sm_cmac_state = sm_cmac_block_current < sm_cmac_block_count - 1 ? CMAC_CALC_MI : CMAC_CALC_MLAST;  
+            cmac->state = cmac->block_current < cmac->block_count - 1 ? CMAC_CALC_MI : CMAC_CALC_MLAST;  
             break;
         }
         case CMAC_W4_MI:
-            memcpy(sm_cmac_x, data, 16);
-            sm_cmac_state = sm_cmac_block_current < sm_cmac_block_count - 1 ? CMAC_CALC_MI : CMAC_CALC_MLAST;  
+            memcpy(cmac->x, data, 16);
+            cmac->state = cmac->block_current < cmac->block_count - 1 ? CMAC_CALC_MI : CMAC_CALC_MLAST;  
             break;
         case CMAC_W4_MLAST:
-            // done
+            // done, ready for next calculation
             log_key("CMAC", data);
-            sm_cmac_done_handler(data);
+            cmac->state = CMAC_IDLE;
+            cmac->done_handler(connection->sm_handle, data);
             break;
         default:
-            log_info("sm_cmac_handle_encryption_result called in state %u", sm_cmac_state);
+            log_info("sm_cmac_handle_encryption_result called in state %u", cmac->state);
             break;
     }
 }
@@ -853,39 +928,36 @@ static void sm_pdu_received_in_wrong_state(){
 }
 
 
-static void sm_run(void){
+static void sm_run_procedures(void){
 
     // assert that we can send at least commands
     if (!hci_can_send_command_packet_now()) return;
 
-    sm_key_t plaintext;
-
-    // CSRK lookup
-    if (connection->sm_csrk_lookup_state == CSRK_LOOKUP_W4_READY && !sm_central_device_lookup_active()){
-        sm_central_device_start_lookup(connection->sm_peer_addr_type, connection->sm_peer_address);
-        connection->sm_csrk_lookup_state = CSRK_LOOKUP_STARTED;
-    }
+    // global procedures are not bound to a connection
+    connection = NULL;
+    setup = NULL;
 
     // distributed key generation
     switch (dkg_state){
         case DKG_CALC_IRK:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             {
             // IRK = d1(IR, 1, 0)
             sm_key_t d1_prime;
             sm_d1_d_prime(1, 0, d1_prime);  // plaintext
-            sm_aes128_start(sm_persistent_ir, d1_prime);
+            sm_aes128_start(SM_AES128_USER_DKG, sm_persistent_ir, d1_prime);
             dkg_next_state();
             }
+            return;
         case DKG_CALC_DHK:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             {
             // DHK = d1(IR, 3, 0)
             sm_key_t d1_prime;
             sm_d1_d_prime(3, 0, d1_prime);  // plaintext
-            sm_aes128_start(sm_persistent_ir, d1_prime);
+            sm_aes128_start(SM_AES128_USER_DKG, sm_persistent_ir, d1_prime);
             dkg_next_state();
             }
             return;
@@ -901,11 +973,11 @@ static void sm_run(void){
             return;
         case RAU_GET_ENC:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             {
             sm_key_t r_prime;
             sm_ah_r_prime(sm_random_address, r_prime);
-            sm_aes128_start(sm_persistent_irk, r_prime);
+            sm_aes128_start(SM_AES128_USER_RAU, sm_persistent_irk, r_prime);
             rau_next_state();
             }
             return;
@@ -918,66 +990,72 @@ static void sm_run(void){
             break;
     }
 
-    // CSRK device lookup by public or resolvable private address
-    if (sm_central_device_test >= 0){
-        log_info("Central Device Lookup: device %u/%u", sm_central_device_test, central_device_db_count());
-        while (sm_central_device_test < central_device_db_count()){
-            int addr_type;
-            bd_addr_t addr;
-            sm_key_t irk;
-            central_device_db_info(sm_central_device_test, &addr_type, addr, irk);
-            log_info("device type %u, addr: %s", addr_type, bd_addr_to_str(addr));
-
-            if (sm_central_device_addr_type == addr_type && memcmp(addr, sm_central_device_address, 6) == 0){
-                log_info("Central Device Lookup: found CSRK by { addr_type, address} ");
-                sm_central_device_matched = sm_central_device_test;
-                sm_central_device_test = -1;
-                sm_key_t csrk;
-                central_device_db_csrk(sm_central_device_matched, csrk);
-                sm_central_device_lookup_found(csrk);
-                sm_notify_client(SM_IDENTITY_RESOLVING_SUCCEEDED, sm_central_device_addr_type, sm_central_device_address, 0, sm_central_device_matched);
-                break;
-            }
-
-            if (sm_central_device_addr_type == 0){
-                sm_central_device_test++;
-                continue;
-            }
+    // connections: setup, CSRK lookup and CMAC run independently for each one
+    sm_connection_t * aes128_user = NULL;
+    linked_item_t *it;
+    for (it = (linked_item_t *) sm_connections; it ; it = it->next){
+        if (!hci_can_send_command_packet_now()) break;
+        int aes128_requests = sm_aes128_queue_count;
+        sm_connection_activate((sm_connection_t *) it);
+        sm_run_connection();
+        if (sm_aes128_queue_count > aes128_requests){
+            aes128_user = (sm_connection_t *) it;
+        }
+    }
 
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+    // the aes128 engine is shared: the connections that just got it go to the end of the line
+    if (aes128_user){
+        linked_item_t * head;
+        do {
+            head = (linked_item_t *) sm_connections;
+            linked_list_remove(&sm_connections, head);
+            linked_list_add_tail(&sm_connections, head);
+        } while (head != (linked_item_t *) aes128_user);
+    }
+}
 
-            log_info("Central Device Lookup: calculate AH");
-            log_key("IRK", irk);
+static void sm_run(void){
 
-            sm_key_t r_prime;
-            sm_ah_r_prime(sm_central_device_address, r_prime);
-            sm_aes128_start(irk, r_prime);
-            sm_central_ah_calculation_active = 1;
-            return;
-        }
+    // run once at the end of the HCI batch
+    if (hci_batch_active()) return;
 
-        if (sm_central_device_test >= central_device_db_count()){
-            log_info("Central Device Lookup: not found");
-            sm_central_device_test = -1;
-            sm_notify_client(SM_IDENTITY_RESOLVING_FAILED, sm_central_device_addr_type, sm_central_device_address, 0, 0);
-        }
+    // client callbacks may start new procedures, they are picked up in the next pass
+    if (sm_run_active){
+        sm_run_requested = 1;
+        return;
     }
+    sm_run_active = 1;
+    do {
+        sm_run_requested = 0;
+        sm_run_procedures();
+    } while (sm_run_requested);
+    sm_run_active = 0;
+}
+
+// pre: connection and setup set, hci_can_send_command == 1
+static void sm_run_connection(void){
+
+    sm_key_t plaintext;
 
-    // cmac
-    switch (sm_cmac_state){
+    // CSRK lookup
+    sm_csrk_lookup_run();
+
+    // CMAC calculation for signed writes
+    switch (connection->sm_cmac.state){
         case CMAC_CALC_SUBKEYS:
         case CMAC_CALC_MI:
         case CMAC_CALC_MLAST:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             sm_cmac_handle_aes_engine_ready();
-            return;
+            break;
         default:
             break;
     }
 
+    if (!hci_can_send_command_packet_now()) return;
+
     // assert that we could send a SM PDU - not needed for all of the following
-    if (!connection->sm_handle) return;
     if (!l2cap_can_send_fixed_channel_packet_now(connection->sm_handle)) return;
 
     // responding state
@@ -1052,6 +1130,9 @@ static void sm_run(void){
         case SM_PH2_C1_GET_RANDOM_B:
         case SM_PH3_GET_RANDOM:
         case SM_PH3_GET_DIV:
+            // already busy?
+            if (sm_random_context) break;
+            sm_random_context = connection;
             hci_send_cmd(&hci_le_rand);
             sm_next_responding_state();
             return;
@@ -1059,69 +1140,69 @@ static void sm_run(void){
         case SM_PH2_C1_GET_ENC_B:
         case SM_PH2_C1_GET_ENC_D:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
-            sm_aes128_start(setup->sm_tk, setup->sm_c1_t3_value);
+            if (!sm_aes128_ready()) break;
+            sm_aes128_start(SM_AES128_USER_SETUP, setup->sm_tk, setup->sm_c1_t3_value);
             sm_next_responding_state();
             return;
 
         case SM_PH3_LTK_GET_ENC:
         case SM_PH4_LTK_GET_ENC:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             {
                 sm_key_t d_prime;
                 sm_d1_d_prime(setup->sm_local_div, 0, d_prime);
-                sm_aes128_start(sm_persistent_er, d_prime);
+                sm_aes128_start(SM_AES128_USER_SETUP, sm_persistent_er, d_prime);
             }
             sm_next_responding_state();
             return;
 
         case SM_PH3_CSRK_GET_ENC:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             {
                 sm_key_t d_prime;
                 sm_d1_d_prime(setup->sm_local_div, 1, d_prime);
-                sm_aes128_start(sm_persistent_er, d_prime);
+                sm_aes128_start(SM_AES128_USER_SETUP, sm_persistent_er, d_prime);
             }
             sm_next_responding_state();
             return;
 
         case SM_PH2_C1_GET_ENC_C:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             // calculate m_confirm using aes128 engine - step 1
             sm_c1_t1(setup->sm_peer_random, (uint8_t*) &setup->sm_m_preq, (uint8_t*) &setup->sm_s_pres, setup->sm_m_addr_type, setup->sm_s_addr_type, plaintext);
-            sm_aes128_start(setup->sm_tk, plaintext);
+            sm_aes128_start(SM_AES128_USER_SETUP, setup->sm_tk, plaintext);
             sm_next_responding_state();
             break;
         case SM_PH2_C1_GET_ENC_A:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             // calculate confirm using aes128 engine - step 1
             sm_c1_t1(setup->sm_local_random, (uint8_t*) &setup->sm_m_preq, (uint8_t*) &setup->sm_s_pres, setup->sm_m_addr_type, setup->sm_s_addr_type, plaintext);
-            sm_aes128_start(setup->sm_tk, plaintext);
+            sm_aes128_start(SM_AES128_USER_SETUP, setup->sm_tk, plaintext);
             sm_next_responding_state();
             break;
         case SM_PH2_CALC_STK:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             // calculate STK
             if (connection->sm_role){
                 sm_s1_r_prime(setup->sm_local_random, setup->sm_peer_random, plaintext);
             } else {
                 sm_s1_r_prime(setup->sm_peer_random, setup->sm_local_random, plaintext);
             }
-            sm_aes128_start(setup->sm_tk, plaintext);
+            sm_aes128_start(SM_AES128_USER_SETUP, setup->sm_tk, plaintext);
             sm_next_responding_state();
             break;
         case SM_PH3_Y_GET_ENC:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             // PH3B2 - calculate Y from      - enc
             // Y = dm(DHK, Rand)
             sm_dm_r_prime(setup->sm_local_rand, plaintext);
-            sm_aes128_start(sm_persistent_dhk, plaintext);
+            sm_aes128_start(SM_AES128_USER_SETUP, sm_persistent_dhk, plaintext);
             sm_next_responding_state();
             return;
         case SM_PH2_C1_SEND_PAIRING_CONFIRM: {
@@ -1160,11 +1241,11 @@ static void sm_run(void){
         }
         case SM_PH4_Y_GET_ENC:
             // already busy?
-            if (sm_aes128_state == SM_AES128_ACTIVE) break;
+            if (!sm_aes128_ready()) break;
             log_info("LTK Request: recalculating with ediv 0x%04x", setup->sm_local_ediv);
             // Y = dm(DHK, Rand)
             sm_dm_r_prime(setup->sm_local_rand, plaintext);
-            sm_aes128_start(sm_persistent_dhk, plaintext);
+            sm_aes128_start(SM_AES128_USER_SETUP, sm_persistent_dhk, plaintext);
             sm_next_responding_state();
             return;
 
@@ -1235,55 +1316,40 @@ static void sm_run(void){
     }
 }
 
-// note: aes engine is ready as we just got the aes result
+// results arrive in request order
 static void sm_handle_encryption_result(uint8_t * data){
 
-    sm_aes128_state = SM_AES128_IDLE;
-
-    if (sm_central_ah_calculation_active){
-        sm_central_ah_calculation_active = 0;
-        // compare calulated address against connecting device
-        uint8_t hash[3];
-        swap24(data, hash);
-        if (memcmp(&sm_central_device_address[3], hash, 3) == 0){
-            // found
-            sm_central_device_matched = sm_central_device_test;
-            sm_central_device_test = -1;
-            sm_key_t csrk;
-            central_device_db_csrk(sm_central_device_matched, csrk);
-            sm_central_device_lookup_found(csrk);
-            sm_notify_client(SM_IDENTITY_RESOLVING_SUCCEEDED, sm_central_device_addr_type, sm_central_device_address, 0, sm_central_device_matched);
-            log_info("Central Device Lookup: matched resolvable private address");
-            return;
-        }
-        // no match
-        sm_central_device_test++;
-        return;
-    }
-    switch (dkg_state){
-        case DKG_W4_IRK:
-            swap128(data, sm_persistent_irk);
-            log_key("irk", sm_persistent_irk);
-            dkg_next_state();
-            return;
-        case DKG_W4_DHK:
-            swap128(data, sm_persistent_dhk);
-            log_key("dhk", sm_persistent_dhk);
-            dkg_next_state();
-
-            // SM INIT FINISHED, start application code - TODO untangle that
-            if (sm_client_packet_handler)
-            {
-                uint8_t event[] = { BTSTACK_EVENT_STATE, 0, HCI_STATE_WORKING };
-                sm_client_packet_handler(HCI_EVENT_PACKET, 0, (uint8_t*) event, sizeof(event));
+    // not requested by us
+    if (sm_aes128_queue_count == 0) return;
+    sm_aes128_request_t request = sm_aes128_queue[sm_aes128_queue_head];
+    sm_aes128_queue_head = (sm_aes128_queue_head + 1) % SM_AES128_QUEUE_SIZE;
+    sm_aes128_queue_count--;
+
+    switch (request.user){
+        case SM_AES128_USER_DKG:
+            switch (dkg_state){
+                case DKG_W4_IRK:
+                    swap128(data, sm_persistent_irk);
+                    log_key("irk", sm_persistent_irk);
+                    dkg_next_state();
+                    return;
+                case DKG_W4_DHK:
+                    swap128(data, sm_persistent_dhk);
+                    log_key("dhk", sm_persistent_dhk);
+                    dkg_next_state();
+
+                    // SM INIT FINISHED, start application code - TODO untangle that
+                    if (sm_client_packet_handler)
+                    {
+                        uint8_t event[] = { BTSTACK_EVENT_STATE, 0, HCI_STATE_WORKING };
+                        sm_client_packet_handler(HCI_EVENT_PACKET, 0, (uint8_t*) event, sizeof(event));
+                    }
+                    return;
+                default:
+                    return;
             }
-            return;
-        default:
-            break;
-    }
-
-    switch (rau_state){
-        case RAU_W4_ENC:
+        case SM_AES128_USER_RAU:
+            if (rau_state != RAU_W4_ENC) return;
             swap24(data, &sm_random_address[3]);
             rau_next_state();
             return;
@@ -1291,10 +1357,15 @@ static void sm_handle_encryption_result(uint8_t * data){
             break;
     }
 
-    switch (sm_cmac_state){
-        case CMAC_W4_SUBKEYS:
-        case CMAC_W4_MI:
-        case CMAC_W4_MLAST:
+    // result for a connection, unless it got disconnected meanwhile
+    if (!request.connection) return;
+    sm_connection_activate(request.connection);
+
+    switch (request.user){
+        case SM_AES128_USER_CSRK_LOOKUP:
+            sm_csrk_lookup_handle_encryption_result(data);
+            return;
+        case SM_AES128_USER_CMAC:
             {
             sm_key_t t;
             swap128(data, t);
@@ -1424,6 +1495,11 @@ static void sm_handle_random_result(uint8_t * data){
             break;
     }
 
+    // result for a connection, unless it got disconnected meanwhile
+    if (!sm_random_context) return;
+    sm_connection_activate(sm_random_context);
+    sm_random_context = NULL;
+
     switch (connection->sm_engine_state){
         case SM_PH2_W4_RANDOM_TK:
         {
@@ -1483,6 +1559,8 @@ static void sm_event_packet_handler (uint8_t packet_type, uint16_t channel, uint
 					// bt stack activated, get started
 					if (packet[2] == HCI_STATE_WORKING) {
                         log_info("HCI Working!");
+                        // results for requests sent before a power cycle won't arrive
+                        sm_aes128_queue_reset();
                         dkg_state = sm_persistent_irk_ready ? DKG_CALC_DHK : DKG_CALC_IRK;
 
                         sm_run();
@@ -1498,12 +1576,18 @@ static void sm_event_packet_handler (uint8_t packet_type, uint16_t channel, uint
 
                             if (packet[3]) return; // connection failed
 
-                            // only single connection for peripheral
-                            if (connection->sm_handle){
-                                log_info("Already connected, ignoring incoming connection");
-                                return;
+                            {
+                                sm_connection_t * sm_conn = btstack_memory_sm_connection_get();
+                                if (!sm_conn){
+                                    log_error("sm: no memory for connection context, ignoring incoming connection");
+                                    return;
+                                }
+                                memset(sm_conn, 0, sizeof(sm_connection_t));
+                                linked_list_add_tail(&sm_connections, (linked_item_t *) sm_conn);
+                                sm_connection_activate(sm_conn);
                             }
 
+                            connection->sm_engine_state = SM_GENERAL_IDLE;
                             connection->sm_handle = READ_BT_16(packet, 4);
                             connection->sm_role = packet[6];
                             connection->sm_peer_addr_type = packet[7];
@@ -1561,16 +1645,14 @@ static void sm_event_packet_handler (uint8_t packet_type, uint16_t channel, uint
                                 connection->sm_engine_state = SM_INITIATOR_PH1_SEND_PAIRING_REQUEST;
                             }
 
-                            // prepare CSRK lookup
+                            // CSRK lookup, started by sm_run after the event has been forwarded
                             connection->sm_csrk_lookup_state = CSRK_LOOKUP_W4_READY;
-                            if (!sm_central_device_lookup_active()){
-                                // try to lookup device
-                                sm_central_device_start_lookup(connection->sm_peer_addr_type, connection->sm_peer_address);
-                                connection->sm_csrk_lookup_state = CSRK_LOOKUP_STARTED;
-                            }
+                            connection->sm_csrk_lookup_matched = -1;
                             break;
 
                         case HCI_SUBEVENT_LE_LONG_TERM_KEY_REQUEST:
+                            if (!sm_connection_for_handle(READ_BT_16(packet, 3))) break;
+                            sm_connection_activate(sm_connection_for_handle(READ_BT_16(packet, 3)));
                             log_info("LTK Request: state %u", connection->sm_engine_state);
                             if (connection->sm_engine_state == SM_RESPONDER_PH2_W4_LTK_REQUEST){
                                 connection->sm_engine_state = SM_PH2_CALC_STK;
@@ -1603,8 +1685,19 @@ static void sm_event_packet_handler (uint8_t packet_type, uint16_t channel, uint
                     }
                     break;
 
+#ifdef HAVE_SM_HOST_AES
+                case GAP_LE_ADVERTISING_REPORT:{
+                    // resolve private addresses ahead of connection
+                    bd_addr_t addr;
+                    bt_flip_addr(addr, &packet[4]);
+                    sm_address_resolution_lookup(packet[3], addr);
+                    break;
+                }
+#endif
+
                 case HCI_EVENT_ENCRYPTION_CHANGE: 
-                    if (connection->sm_handle != READ_BT_16(packet, 3)) break;
+                    if (!sm_connection_for_handle(READ_BT_16(packet, 3))) break;
+                    sm_connection_activate(sm_connection_for_handle(READ_BT_16(packet, 3)));
                     connection->sm_connection_encrypted = packet[5];
                     log_info("Eencryption state change: %u", connection->sm_connection_encrypted);
                     if (!connection->sm_connection_encrypted) break;
@@ -1617,10 +1710,23 @@ static void sm_event_packet_handler (uint8_t packet_type, uint16_t channel, uint
                     }
                     break;
 
-                case HCI_EVENT_DISCONNECTION_COMPLETE:
-                    connection->sm_engine_state = SM_GENERAL_IDLE;
-                    connection->sm_handle = 0;
+                case HCI_EVENT_DISCONNECTION_COMPLETE: {
+                    sm_connection_t * sm_conn = sm_connection_for_handle(READ_BT_16(packet, 3));
+                    if (!sm_conn) break;
+                    run_loop_remove_timer(&sm_conn->sm_timeout);
+                    // drop pending results
+                    int i;
+                    for (i = 0; i < sm_aes128_queue_count; i++){
+                        sm_aes128_request_t * request = &sm_aes128_queue[(sm_aes128_queue_head + i) % SM_AES128_QUEUE_SIZE];
+                        if (request->connection == sm_conn) request->connection = NULL;
+                    }
+                    if (sm_random_context  == sm_conn) sm_random_context  = NULL;
+                    linked_list_remove(&sm_connections, (linked_item_t *) sm_conn);
+                    btstack_memory_sm_connection_free(sm_conn);
+                    connection = NULL;
+                    setup = NULL;
                     break;
+                }
                     
 				case HCI_EVENT_COMMAND_COMPLETE:
                     if (COMMAND_COMPLETE_EVENT(packet, hci_le_encrypt)){
@@ -1674,10 +1780,12 @@ static void sm_packet_handler(uint8_t packet_type, uint16_t handle, uint8_t *pac
 
     if (packet_type != SM_DATA_PACKET) return;
 
-    if (handle != connection->sm_handle){
-        log_info("sm_packet_handler: packet from handle %u, but expecting from %u", handle, connection->sm_handle);
+    sm_connection_t * sm_conn = sm_connection_for_handle(handle);
+    if (!sm_conn){
+        log_info("sm_packet_handler: packet from unknown handle %u", handle);
         return;
     }
+    sm_connection_activate(sm_conn);
 
     if (packet[0] == SM_CODE_PAIRING_FAILED){
         connection->sm_engine_state = SM_GENERAL_IDLE;
@@ -1887,7 +1995,13 @@ static void sm_packet_handler(uint8_t packet_type, uint16_t handle, uint8_t *pac
 
                     // store, if: it's a public address, or, we got an IRK
                     if (setup->sm_peer_addr_type == 0 || (setup->sm_key_distribution_received_set & SM_KEYDIST_FLAG_IDENTITY_INFORMATION)) {
-                        sm_central_device_matched =  central_device_db_add(setup->sm_peer_addr_type, setup->sm_peer_address, setup->sm_peer_irk, setup->sm_peer_csrk);
+                        connection->sm_csrk_lookup_matched = central_device_db_add(setup->sm_peer_addr_type, setup->sm_peer_address, setup->sm_peer_irk, setup->sm_peer_csrk);
+#ifdef HAVE_GATT_CLIENT_CACHE
+                        gatt_client_set_peer_identity(connection->sm_handle, setup->sm_peer_addr_type, setup->sm_peer_address);
+#endif
+#ifdef HAVE_SM_HOST_AES
+                        sm_resolved_address_cache_flush();
+#endif
                         break;
                     } 
                     break;
@@ -1965,8 +2079,11 @@ void sm_test_set_irk(sm_key_t irk){
  * @brief Trigger Security Request
  * @note Not used normally. Bonding is triggered by access to protected attributes in ATT Server
  */
-void sm_send_security_request(){
-    connection->sm_engine_state = SM_RESPONDER_SEND_SECURITY_REQUEST;
+void sm_send_security_request(uint16_t con_handle){
+    sm_connection_t * sm_conn = sm_connection_for_handle(con_handle);
+    if (!sm_conn) return;
+    if (sm_conn->sm_engine_state != SM_GENERAL_IDLE) return;
+    sm_conn->sm_engine_state = SM_RESPONDER_SEND_SECURITY_REQUEST;
     sm_run();
 }
 
@@ -1981,7 +2098,12 @@ void sm_init(){
     }
     sm_set_er(er);
     sm_set_ir(ir);
-    connection->sm_engine_state = SM_GENERAL_IDLE;
+    sm_connections = NULL;
+    connection = NULL;
+    setup = NULL;
+    sm_random_context = NULL;
+    sm_run_active = 0;
+    sm_run_requested = 0;
     // defaults
     sm_accepted_stk_generation_methods = SM_STK_GENERATION_METHOD_JUST_WORKS
                                        | SM_STK_GENERATION_METHOD_OOB
@@ -1989,10 +2111,10 @@ void sm_init(){
     sm_max_encryption_key_size = 16;
     sm_min_encryption_key_size = 7;
     
-    sm_cmac_state  = CMAC_IDLE;
-    sm_aes128_state = SM_AES128_IDLE;
-    sm_central_device_test = -1;    // no private address to resolve yet
-    sm_central_ah_calculation_active = 0;
+    sm_aes128_queue_reset();
+#ifdef HAVE_SM_HOST_AES
+    sm_resolved_address_cache_flush();
+#endif
 
     gap_random_adress_update_period = 15 * 60 * 1000L;
 
@@ -2000,8 +2122,11 @@ void sm_init(){
     l2cap_register_fixed_channel(sm_packet_handler, L2CAP_CID_SECURITY_MANAGER_PROTOCOL);
 }
 
+// @returns 1 if connected, makes connection current
 static int sm_get_connection(uint8_t addr_type, bd_addr_t address){
-    // TODO compare to current connection
+    sm_connection_t * sm_conn = sm_connection_for_address(addr_type, address);
+    if (!sm_conn) return 0;
+    sm_connection_activate(sm_conn);
     return 1;
 }
 
@@ -2027,6 +2152,7 @@ authorization_state_t sm_authorization_state(uint8_t addr_type, bd_addr_t addres
 
 // request authorization
 void sm_request_authorization(uint8_t addr_type, bd_addr_t address){
+    if (!sm_get_connection(addr_type, address)) return; // wrong connection
     log_info("sm_request_authorization in role %u, state %u", connection->sm_role, connection->sm_engine_state);
     if (connection->sm_role){
         // code has no effect so far
@@ -39,6 +39,7 @@
 
 #include <btstack/utils.h>
 #include <btstack/btstack.h>
+#include <btstack/linked_list.h>
 #include <stdint.h>
 
 #if defined __cplusplus
@@ -125,6 +126,228 @@ typedef struct sm_event {
     uint8_t   authorization_result; // only use for SM_AUTHORIZATION_RESULT
 } sm_event_t;
 
+//
+// Security Manager connection context, allocated per LE connection via btstack_memory
+//
+
+typedef enum {
+
+    // general states
+    SM_GENERAL_IDLE,
+    SM_GENERAL_SEND_PAIRING_FAILED,
+    SM_GENERAL_TIMEOUT, // no other security messages are exchanged
+
+    // Phase 1: Pairing Feature Exchange
+    SM_PH1_W4_USER_RESPONSE,
+
+    // Phase 2: Authenticating and Encrypting
+
+    // get random number for use as TK Passkey if we show it 
+    SM_PH2_GET_RANDOM_TK,
+    SM_PH2_W4_RANDOM_TK,
+
+    // get local random number for confirm c1
+    SM_PH2_C1_GET_RANDOM_A,
+    SM_PH2_C1_W4_RANDOM_A,
+    SM_PH2_C1_GET_RANDOM_B,
+    SM_PH2_C1_W4_RANDOM_B,
+
+    // calculate confirm value for local side
+    SM_PH2_C1_GET_ENC_A,
+    SM_PH2_C1_W4_ENC_A,
+    SM_PH2_C1_GET_ENC_B,
+    SM_PH2_C1_W4_ENC_B,
+
+    // calculate confirm value for remote side
+    SM_PH2_C1_GET_ENC_C,
+    SM_PH2_C1_W4_ENC_C,
+    SM_PH2_C1_GET_ENC_D,
+    SM_PH2_C1_W4_ENC_D,
+
+    SM_PH2_C1_SEND_PAIRING_CONFIRM,
+    SM_PH2_SEND_PAIRING_RANDOM,
+
+    // calc STK
+    SM_PH2_CALC_STK,
+    SM_PH2_W4_STK,
+
+    SM_PH2_W4_CONNECTION_ENCRYPTED,
+
+    // Phase 3: Transport Specific Key Distribution
+    
+    // calculate DHK, Y, EDIV, and LTK
+    SM_PH3_GET_RANDOM,
+    SM_PH3_W4_RANDOM,
+    SM_PH3_GET_DIV,
+    SM_PH3_W4_DIV,
+    SM_PH3_Y_GET_ENC,
+    SM_PH3_Y_W4_ENC,
+    SM_PH3_LTK_GET_ENC,
+    SM_PH3_LTK_W4_ENC,
+    SM_PH3_CSRK_GET_ENC,
+    SM_PH3_CSRK_W4_ENC,
+
+    // exchange keys
+    SM_PH3_DISTRIBUTE_KEYS,
+    SM_PH3_RECEIVE_KEYS,
+
+    // Phase 4: re-establish previously distributed LTK
+    SM_PH4_Y_GET_ENC,
+    SM_PH4_Y_W4_ENC,
+    SM_PH4_LTK_GET_ENC,
+    SM_PH4_LTK_W4_ENC,
+    SM_PH4_SEND_LTK,
+
+    // RESPONDER ROLE
+    SM_RESPONDER_SEND_SECURITY_REQUEST,
+    SM_RESPONDER_SEND_LTK_REQUESTED_NEGATIVE_REPLY,
+    SM_RESPONDER_PH1_W4_PAIRING_REQUEST,
+    SM_RESPONDER_PH1_SEND_PAIRING_RESPONSE,
+    SM_RESPONDER_PH1_W4_PAIRING_CONFIRM,
+    SM_RESPONDER_PH2_W4_PAIRING_RANDOM,
+    SM_RESPONDER_PH2_W4_LTK_REQUEST,
+    SM_RESPONDER_PH2_SEND_LTK_REPLY,
+
+    // INITITIATOR ROLE
+    SM_INITIATOR_CONNECTED,
+    SM_INITIATOR_PH1_SEND_PAIRING_REQUEST,
+    SM_INITIATOR_PH1_W4_PAIRING_RESPONSE,
+    SM_INITIATOR_PH2_W4_PAIRING_CONFIRM,
+    SM_INITIATOR_PH2_W4_PAIRING_RANDOM,
+    SM_INITIATOR_PH3_SEND_START_ENCRYPTION,
+    SM_INITIATOR_PH3_XXXX,
+
+} security_manager_state_t;
+
+typedef enum {
+    CSRK_LOOKUP_IDLE,
+    CSRK_LOOKUP_W4_READY,
+    CSRK_LOOKUP_STARTED,
+    CSRK_LOOKUP_W4_ENC,
+} csrk_lookup_state_t;
+
+typedef enum {
+    CMAC_IDLE,
+    CMAC_CALC_SUBKEYS,
+    CMAC_W4_SUBKEYS,
+    CMAC_CALC_MI,
+    CMAC_W4_MI,
+    CMAC_CALC_MLAST,
+    CMAC_W4_MLAST
+} cmac_state_t;
+
+typedef enum {
+    JUST_WORKS,
+    PK_RESP_INPUT,  // Initiator displays PK, initiator inputs PK 
+    PK_INIT_INPUT,  // Responder displays PK, responder inputs PK
+    OK_BOTH_INPUT,  // Only input on both, both input PK
+    OOB             // OOB available on both sides
+} stk_generation_method_t;
+
+typedef struct sm_pairing_packet {
+    uint8_t code;
+    uint8_t io_capability;
+    uint8_t oob_data_flag;
+    uint8_t auth_req;
+    uint8_t max_encryption_key_size;
+    uint8_t initiator_key_distribution;
+    uint8_t responder_key_distribution;
+} sm_pairing_packet_t;
+
+//
+// Volume 3, Part H, Chapter 24
+// "Security shall be initiated by the Security Manager in the device in the master role.
+// The device in the slave role shall be the responding device."
+// -> master := initiator, slave := responder
+//
+
+// data needed for security setup
+typedef struct sm_setup_context {
+
+    // used in all phases
+    uint8_t   sm_pairing_failed_reason;
+
+    // user response, (Phase 1 and/or 2)
+    uint8_t   sm_user_response;
+
+    // defines which keys will be send after connection is encrypted - calculated during Phase 1, used Phase 3
+    int       sm_key_distribution_send_set;
+    int       sm_key_distribution_received_set;
+
+    // Phase 2 (Pairing over SMP)
+    stk_generation_method_t sm_stk_generation_method;
+    sm_key_t  sm_tk;
+
+    sm_key_t  sm_c1_t3_value;   // c1 calculation 
+    sm_pairing_packet_t sm_m_preq; // pairing request - needed only for c1
+    sm_pairing_packet_t sm_s_pres; // pairing response - needed only for c1
+    sm_key_t  sm_local_random;
+    sm_key_t  sm_local_confirm;
+    sm_key_t  sm_peer_random;
+    sm_key_t  sm_peer_confirm;
+    uint8_t   sm_m_addr_type;   // address and type can be removed
+    uint8_t   sm_s_addr_type;   //  '' 
+    bd_addr_t sm_m_address;     //  ''
+    bd_addr_t sm_s_address;     //  ''
+    sm_key_t  sm_ltk;
+
+    // Phase 3
+
+    // key distribution, we generate
+    uint16_t  sm_local_y;
+    uint16_t  sm_local_div;
+    uint16_t  sm_local_ediv;
+    uint8_t   sm_local_rand[8];
+    sm_key_t  sm_local_ltk;
+    sm_key_t  sm_local_csrk;
+    sm_key_t  sm_local_irk;
+    // sm_local_address/addr_type not needed
+
+    // key distribution, received from peer
+    uint16_t  sm_peer_y;
+    uint16_t  sm_peer_div;
+    uint16_t  sm_peer_ediv;
+    uint8_t   sm_peer_rand[8];
+    sm_key_t  sm_peer_ltk;
+    sm_key_t  sm_peer_csrk;
+    sm_key_t  sm_peer_irk;
+    uint8_t   sm_peer_addr_type;
+    bd_addr_t sm_peer_address;
+} sm_setup_context_t;
+
+// CMAC calculation for signed writes
+typedef struct sm_cmac_context {
+    cmac_state_t state;
+    sm_key_t     k;
+    uint16_t     message_len;
+    uint8_t *    message;
+    sm_key_t     m_last;
+    sm_key_t     x;
+    uint8_t      block_current;
+    uint8_t      block_count;
+    void (*done_handler)(uint16_t con_handle, uint8_t hash[8]);
+} sm_cmac_context_t;
+
+// connection info available as long as connection exists
+typedef struct sm_connection {
+    linked_item_t item;
+    uint16_t  sm_handle;
+    uint8_t   sm_role;   // 0 - IamMaster, 1 = IamSlave
+    bd_addr_t sm_peer_address;
+    uint8_t   sm_peer_addr_type;
+    security_manager_state_t sm_engine_state;
+    csrk_lookup_state_t      sm_csrk_lookup_state;
+    int       sm_csrk_lookup_index;     // next central device db entry to test
+    int       sm_csrk_lookup_matched;   // central device db index, -1 if not found
+    uint8_t   sm_connection_encrypted;
+    uint8_t   sm_connection_authenticated;   // [0..1]
+    uint8_t   sm_actual_encryption_key_size;
+    authorization_state_t sm_connection_authorization_state;
+    timer_source_t sm_timeout;
+    sm_setup_context_t sm_setup;
+    sm_cmac_context_t  sm_cmac;
+} sm_connection_t;
+
 //
 // Security Manager Client API
 //
@@ -190,9 +413,10 @@ void sm_set_request_security(int enable);
 
 /** 
  * @brief Trigger Security Request
+ * @param con_handle of connection that should get encrypted
  * @note Not used normally. Bonding is triggered by access to protected attributes in ATT Server
  */
-void sm_send_security_request();
+void sm_send_security_request(uint16_t con_handle);
 
 /**
  * @brief Decline bonding triggered by event before
@@ -256,10 +480,20 @@ void sm_authorization_decline(uint8_t addr_type, bd_addr_t address);
  */
 void sm_authorization_grant(uint8_t addr_type, bd_addr_t address);
 
-// Support for signed writes, used by att_server.c
+/**
+ * @brief Find bonded device by identity or resolvable private address
+ * @note Resolves against all IRKs at once using AES in software, results are cached
+ *       until the address changes. Requires HAVE_SM_HOST_AES and ble/rijndael.c
+ * @param addr_type and address
+ * @returns central device db index or -1 if unknown
+ */
+int sm_address_resolution_lookup(uint8_t addr_type, bd_addr_t address);
+
+// Support for signed writes, used by att_server.c and gatt_client.c
 // NOTE: message and result are in little endian to allows passing in ATT PDU without flipping them first
-int  sm_cmac_ready();
-void sm_cmac_start(sm_key_t k, uint16_t message_len, uint8_t * message, void (*done_handler)(uint8_t hash[8]));
+// NOTE: one calculation per connection at a time, the connections share the AES engine
+int  sm_cmac_ready(uint16_t con_handle);
+void sm_cmac_start(uint16_t con_handle, sm_key_t k, uint16_t message_len, uint8_t * message, void (*done_handler)(uint16_t con_handle, uint8_t hash[8]));
 
 // Testing support only
 void sm_test_set_irk(sm_key_t irk);
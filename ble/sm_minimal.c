@@ -54,13 +54,13 @@ typedef enum {
     SM_STATE_SEND_PAIRING_FAILED,
     SM_STATE_PAIRING_FAILED
 
-} security_manager_state_t;
+} sm_minimal_state_t;
 
 static void sm_run();
 
 // used to notify applicationss that user interaction is neccessary, see sm_notify_t below
 static btstack_packet_handler_t sm_client_packet_handler = NULL;
-static security_manager_state_t sm_state_responding = SM_STATE_IDLE;
+static sm_minimal_state_t sm_state_responding = SM_STATE_IDLE;
 static uint16_t sm_response_handle = 0;
 static uint8_t  sm_pairing_failed_reason = 0;
 
@@ -76,7 +76,7 @@ void sm_set_accepted_stk_generation_methods(uint8_t accepted_stk_generation_meth
 void sm_set_encryption_key_size_range(uint8_t min_size, uint8_t max_size){}
 void sm_set_authentication_requirements(uint8_t auth_req){}
 void sm_set_io_capabilities(io_capability_t io_capability){}
-void sm_send_security_request(){}
+void sm_send_security_request(uint16_t con_handle){}
 
 void sm_bonding_decline(uint8_t addr_type, bd_addr_t address){}
 void sm_just_works_confirm(uint8_t addr_type, bd_addr_t address){}
@@ -92,6 +92,11 @@ int sm_authenticated(uint8_t addr_type, bd_addr_t address){
 	return 0;
 }
 
+// @returns central device db index or -1 if unknown
+int sm_address_resolution_lookup(uint8_t addr_type, bd_addr_t address){
+	return -1;
+}
+
 // @returns authorization_state for the current session
 authorization_state_t sm_authorization_state(uint8_t addr_type, bd_addr_t address){
 	return AUTHORIZATION_DECLINED;
@@ -105,11 +110,11 @@ void sm_authorization_decline(uint8_t addr_type, bd_addr_t address){}
 void sm_authorization_grant(uint8_t addr_type, bd_addr_t address){}
 
 // Support for signed writes
-int  sm_cmac_ready(){
+int  sm_cmac_ready(uint16_t con_handle){
 	return 0;
 }
 
-void sm_cmac_start(sm_key_t k, uint16_t message_len, uint8_t * message, void (*done_handler)(uint8_t hash[8])){}
+void sm_cmac_start(uint16_t con_handle, sm_key_t k, uint16_t message_len, uint8_t * message, void (*done_handler)(uint16_t con_handle, uint8_t hash[8])){}
 
 void sm_register_packet_handler(btstack_packet_handler_t handler){
     sm_client_packet_handler = handler;    
@@ -199,6 +204,9 @@ static void sm_event_packet_handler (void * connection, uint8_t packet_type, uin
 
 static void sm_run(void){
 
+    // run once at the end of the HCI batch
+    if (hci_batch_active()) return;
+
     // assert that we can send either one
     switch (sm_state_responding){
         case SM_STATE_SEND_LTK_REQUESTED_NEGATIVE_REPLY:
@@ -30,5 +30,6 @@
 #define MAX_NO_DB_MEM_DEVICE_LINK_KEYS  2
 #define MAX_NO_DB_MEM_DEVICE_NAMES 0
 #define MAX_NO_DB_MEM_SERVICES 1
+#define MAX_NO_SDP_SERVER_CONNECTIONS 1
 
 #endif
\ No newline at end of file
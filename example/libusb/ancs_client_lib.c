@@ -288,7 +288,7 @@ void ancs_client_hci_event_handler (uint8_t packet_type, uint16_t channel, uint8
 
                             // we need to be paired to enable notifications
                             tc_state = TC_W4_ENCRYPTED_CONNECTION;
-                            sm_send_security_request();
+                            sm_send_security_request(gc_handle);
                             break;
 
                         default:
@@ -5,6 +5,7 @@
 
 #define HAVE_TRANSPORT_USB
 #define HAVE_BLE
+#define HAVE_SM_HOST_AES
 #define USE_POSIX_RUN_LOOP
 #define HAVE_SDP
 #define HAVE_RFCOMM
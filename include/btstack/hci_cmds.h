@@ -243,6 +243,12 @@ extern "C" {
 // data: discoverable enabled (bool)
 #define BTSTACK_EVENT_DISCOVERABLE_ENABLED			       0x66
 
+// data: event(8), len(8), histogram id(8), count(32), sum_us(32), max_us(32), log2 us buckets(32 each), see btstack_stats.h
+#define BTSTACK_EVENT_STATS_HISTOGRAM                      0x67
+
+// data: event(8), len(8), num counters(8), counters(32 each), see btstack_stats.h
+#define BTSTACK_EVENT_STATS_COUNTERS                       0x68
+
 // L2CAP EVENTS
 	
 // data: event (8), len(8), status (8), address(48), handle (16), psm (16), local_cid(16), remote_cid (16), local_mtu(16), remote_mtu(16), flush_timeout(16)
@@ -387,6 +393,15 @@ extern "C" {
 
 #define GATT_CHARACTERISTIC_DESCRIPTOR_QUERY_RESULT        0xA9
 #define GATT_LONG_CHARACTERISTIC_DESCRIPTOR_QUERY_RESULT   0xAA
+
+/**
+ * @format H244
+ * @param handle
+ * @param value_handle
+ * @param bytes_sent
+ * @param total_length
+ */
+#define GATT_WRITE_WITHOUT_RESPONSE_STREAM_PROGRESS        0xAB
     
 // data: event(8), len(8), status (8), hci_handle (16), attribute_handle (16)
 #define ATT_HANDLE_VALUE_INDICATION_COMPLETE        	   0xB6
@@ -460,6 +475,7 @@ extern "C" {
 #define L2CAP_CONNECTION_RESPONSE_RESULT_RTX_TIMEOUT       0x68
 
 #define L2CAP_SERVICE_ALREADY_REGISTERED                   0x69
+#define L2CAP_DATA_LEN_EXCEEDS_REMOTE_MTU                  0x6A
     
 #define RFCOMM_MULTIPLEXER_STOPPED                         0x70
 #define RFCOMM_CHANNEL_ALREADY_REGISTERED                  0x71
@@ -572,6 +588,7 @@ extern const hci_cmd_t btstack_get_system_bluetooth_enabled;
 extern const hci_cmd_t btstack_set_system_bluetooth_enabled;
 extern const hci_cmd_t btstack_set_discoverable;
 extern const hci_cmd_t btstack_set_bluetooth_enabled;    // only used by btstack config
+extern const hci_cmd_t btstack_get_stats;
 	
 extern const hci_cmd_t hci_accept_connection_request;
 extern const hci_cmd_t hci_authentication_requested;
@@ -697,6 +714,9 @@ extern const hci_cmd_t gap_le_scan_stop;
 extern const hci_cmd_t gap_le_set_scan_parameters;
 extern const hci_cmd_t gap_le_connect_cmd;
 extern const hci_cmd_t gap_le_connect_cancel_cmd;
+extern const hci_cmd_t gap_le_set_scan_filter;
+extern const hci_cmd_t gap_le_scan_filter_add_uuid16;
+extern const hci_cmd_t gap_le_scan_filter_clear;
 extern const hci_cmd_t gatt_discover_primary_services_cmd;
 
 #if defined __cplusplus
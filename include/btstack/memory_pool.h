@@ -47,7 +47,15 @@
 extern "C" {
 #endif
 
-typedef void * memory_pool_t;
+#include <stdint.h>
+
+typedef struct {
+    void *   free_blocks;   // assert: first field
+    // usage statistics
+    uint16_t blocks_in_use;
+    uint16_t max_blocks_in_use;
+    uint16_t failed_allocations;
+} memory_pool_t;
 
 // initialize memory pool with with given storage, block size and count
 void   memory_pool_create(memory_pool_t *pool, void * storage, int count, int block_size);
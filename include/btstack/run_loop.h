@@ -55,7 +55,8 @@ extern "C" {
 typedef enum {
 	RUN_LOOP_POSIX = 1,
 	RUN_LOOP_COCOA,
-	RUN_LOOP_EMBEDDED
+	RUN_LOOP_EMBEDDED,
+	RUN_LOOP_DISPATCH
 } RUN_LOOP_TYPE;
 
 typedef struct data_source {
@@ -98,6 +99,11 @@ void run_loop_set_data_source_handler(data_source_t *ds, int (*process)(data_sou
 void run_loop_add_data_source(data_source_t *dataSource);
 int  run_loop_remove_data_source(data_source_t *dataSource);
 
+// Suspend/Resume data source. A suspended data source is not in the run loop,
+// its linked_item can be used by the caller. Remove also works for a suspended data source.
+void run_loop_suspend_data_source(data_source_t *dataSource);
+void run_loop_resume_data_source(data_source_t *dataSource);
+
 
 // Execute configured run loop. This function does not return.
 void run_loop_execute(void);
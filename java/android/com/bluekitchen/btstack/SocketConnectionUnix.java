@@ -13,8 +13,6 @@ public class SocketConnectionUnix extends SocketConnection {
 	private String unixSocketName = "/data/btstack/BTstack";
 	private InputStream in;
 	private OutputStream out;
-	private byte inHeader[]  = new byte[6];
-	private byte inPayload[] = new byte[2000];
 
 	public SocketConnectionUnix(){
 		socket = null;
@@ -29,6 +27,7 @@ public class SocketConnectionUnix extends SocketConnection {
 			socket = new LocalSocket();
 			LocalSocketAddress socketAddress = new LocalSocketAddress(unixSocketName, LocalSocketAddress.Namespace.FILESYSTEM);
 			socket.connect(socketAddress);
+			resetBuffers();
 			in = socket.getInputStream();
 			out = socket.getOutputStream();
 			return true;
@@ -46,16 +45,7 @@ public class SocketConnectionUnix extends SocketConnection {
 		
 		if (out == null) return false;
 
-		try {
-			System.out.println("Send "); Util.hexdump(packet.getBuffer(), packet.getPayloadLen());
-			out.write(headerForPacket(packet));
-			out.write(packet.getBuffer());
-			out.flush();
-			return true;
-		} catch (IOException e) {
-			e.printStackTrace();
-			return false;
-		}
+		return writePacket(out, packet);
 	}
 
 	/* (non-Javadoc)
@@ -64,19 +54,7 @@ public class SocketConnectionUnix extends SocketConnection {
 	@Override
 	public Packet receivePacket() {
 
-		if (in == null) return null;
-				
-		int bytes_read = Util.readExactly(in, inHeader, 0, 6);
-		if (bytes_read != 6) return null;
-
-		int packetType = Util.readBt16(inHeader, 0);
-		int channel    = Util.readBt16(inHeader, 2);
-		int len        = Util.readBt16(inHeader, 4);
-		
-		Util.readExactly(in, inPayload, 0, len);
-
-		Packet packet = new Packet(packetType, channel ,inPayload, len);
-		return packet;
+		return readPacket(in);
 	}
 	
 	/* (non-Javadoc)
@@ -92,12 +70,4 @@ public class SocketConnectionUnix extends SocketConnection {
 			}
 		}
 	}
-
-	private byte[] headerForPacket(Packet packet) {
-		byte header[]  = new byte[6];
-		Util.storeBt16(header, 0, packet.getPacketType());
-		Util.storeBt16(header, 2, packet.getChannel());
-		Util.storeBt16(header, 4, packet.getBuffer().length);
-		return header;
-	}
 }
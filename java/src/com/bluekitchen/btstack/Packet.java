@@ -29,8 +29,7 @@ public class Packet {
 	public Packet(int packetType, int channel, byte[] buffer, int payloadLen){
 		this.packetType = packetType;
 		this.channel = channel;
-		this.data = new byte[payloadLen];
-		System.arraycopy(buffer, 0, this.data, 0, payloadLen);
+		// no copy, received packets share the connection's payload buffer
 		this.data = buffer;
 		this.payloadLen = payloadLen;
 	}
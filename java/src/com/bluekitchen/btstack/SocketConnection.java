@@ -1,7 +1,24 @@
 package com.bluekitchen.btstack;
 
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+
 public abstract class SocketConnection {
 
+	private static final int HEADER_SIZE = 6;
+	private static final int RX_BUFFER_SIZE = 8192;
+	private static final int PAYLOAD_BUFFER_SIZE = 2000;
+
+	// frames are parsed from rxBuffer[rxStart..rxEnd), one read() usually delivers several of them
+	private byte rxBuffer[] = new byte[RX_BUFFER_SIZE];
+	private int rxStart = 0;
+	private int rxEnd = 0;
+	// payload of the last received packet, only valid until the next receivePacket()
+	private byte inPayload[] = new byte[PAYLOAD_BUFFER_SIZE];
+	// header and payload are sent with a single write
+	private byte txBuffer[] = new byte[HEADER_SIZE + PAYLOAD_BUFFER_SIZE];
+
 	public abstract boolean connect();
 
 	public abstract boolean sendPacket(Packet packet);
@@ -15,4 +32,77 @@ public abstract class SocketConnection {
 
 	public void setTcpPort(int port) {
 	}
-}
\ No newline at end of file
+
+	protected synchronized boolean writePacket(OutputStream out, Packet packet) {
+
+		if (out == null) return false;
+
+		byte payload[] = packet.getBuffer();
+		int len = payload.length;
+		if (txBuffer.length < HEADER_SIZE + len){
+			txBuffer = new byte[HEADER_SIZE + len];
+		}
+		Util.storeBt16(txBuffer, 0, packet.getPacketType());
+		Util.storeBt16(txBuffer, 2, packet.getChannel());
+		Util.storeBt16(txBuffer, 4, len);
+		System.arraycopy(payload, 0, txBuffer, HEADER_SIZE, len);
+
+		try {
+			out.write(txBuffer, 0, HEADER_SIZE + len);
+			out.flush();
+			return true;
+		} catch (IOException e) {
+			e.printStackTrace();
+			return false;
+		}
+	}
+
+	protected Packet readPacket(InputStream in) {
+
+		if (in == null) return null;
+
+		if (!fillRxBuffer(in, HEADER_SIZE)) return null;
+		int len = Util.readBt16(rxBuffer, rxStart + 4);
+		if (!fillRxBuffer(in, HEADER_SIZE + len)) return null;
+
+		int packetType = Util.readBt16(rxBuffer, rxStart);
+		int channel    = Util.readBt16(rxBuffer, rxStart + 2);
+		if (inPayload.length < len){
+			inPayload = new byte[len];
+		}
+		System.arraycopy(rxBuffer, rxStart + HEADER_SIZE, inPayload, 0, len);
+		rxStart += HEADER_SIZE + len;
+
+		return new Packet(packetType, channel, inPayload, len);
+	}
+
+	protected void resetBuffers() {
+		rxStart = 0;
+		rxEnd = 0;
+	}
+
+	// make sure that at least 'needed' bytes are available at rxStart
+	private boolean fillRxBuffer(InputStream in, int needed) {
+		if (rxEnd - rxStart >= needed) return true;
+		if (rxStart + needed > rxBuffer.length){
+			byte buffer[] = rxBuffer;
+			if (needed > rxBuffer.length){
+				buffer = new byte[needed];
+			}
+			System.arraycopy(rxBuffer, rxStart, buffer, 0, rxEnd - rxStart);
+			rxBuffer = buffer;
+			rxEnd -= rxStart;
+			rxStart = 0;
+		}
+		try {
+			while (rxEnd - rxStart < needed){
+				int read = in.read(rxBuffer, rxEnd, rxBuffer.length - rxEnd);
+				if (read < 0) return false;
+				rxEnd += read;
+			}
+		} catch (IOException e) {
+			return false;
+		}
+		return true;
+	}
+}
@@ -44,6 +44,8 @@ public class Util {
 		return new GATTCharacteristicDescriptor(Arrays.copyOfRange(buffer, offset, offset + GATTCharacteristicDescriptor.LEN));
 	}
 
+	// not used by SocketConnection anymore, which reads into its own receive buffer
+	@Deprecated
 	public static int readExactly(InputStream in, byte[] buffer, int offset, int len){
 		int readTotal = 0;
 		try {
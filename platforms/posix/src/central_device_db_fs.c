@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2011-2014 by BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. This software may not be used in a commercial product
+ *    without an explicit license granted by the copyright holder.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ *  central_device_db_fs.c
+ *
+ *  Central device db with address lookup and contiguous IRK table,
+ *  persisted in a memory-mapped file
+ *
+ */
+
+#include "btstack-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "central_device_db.h"
+#include "debug.h"
+
+#include <btstack/utils.h>
+
+#ifndef BTSTACK_STATE_DIR
+#define BTSTACK_STATE_DIR "/var/lib/btstack"
+#endif
+
+#ifndef CENTRAL_DEVICE_DB_FS_DIR
+#define CENTRAL_DEVICE_DB_FS_DIR BTSTACK_STATE_DIR
+#endif
+
+#define CENTRAL_DEVICE_DB_FS_PATH CENTRAL_DEVICE_DB_FS_DIR "/btstack_central_device_db.bin"
+
+#ifndef CENTRAL_DEVICE_DB_FS_MAX_DEVICES
+#define CENTRAL_DEVICE_DB_FS_MAX_DEVICES 64
+#endif
+
+#define CENTRAL_DEVICE_DB_FS_BUCKETS (2 * CENTRAL_DEVICE_DB_FS_MAX_DEVICES)
+#define CENTRAL_DEVICE_DB_FS_MAGIC   0x42444443  // 'CDDB'
+#define CENTRAL_DEVICE_DB_FS_VERSION 1
+
+#define DB_FS_NONE 0xffff
+
+typedef struct {
+    uint32_t  signing_counter;
+    uint8_t   addr_type;
+    bd_addr_t addr;
+    sm_key_t  csrk;
+} db_fs_device_t;
+
+// file layout, IRKs are kept in a separate table to allow resolving a
+// private address against all devices without touching the other fields
+typedef struct {
+    uint32_t       magic;
+    uint32_t       version;
+    uint32_t       capacity;
+    uint32_t       count;
+    sm_key_t       irk[CENTRAL_DEVICE_DB_FS_MAX_DEVICES];
+    db_fs_device_t devices[CENTRAL_DEVICE_DB_FS_MAX_DEVICES];
+} db_fs_file_t;
+
+// used if file cannot be mapped
+static db_fs_file_t   db_fs_ram;
+
+static db_fs_file_t * db_fs;
+static int            db_fs_fd = -1;
+
+// address index, rebuilt on init
+static uint16_t db_fs_buckets[CENTRAL_DEVICE_DB_FS_BUCKETS];
+static uint16_t db_fs_hash_next[CENTRAL_DEVICE_DB_FS_MAX_DEVICES];
+
+// FNV-1a over address type and address
+static uint16_t db_fs_hash(int addr_type, bd_addr_t addr){
+    uint32_t hash = (2166136261u ^ (uint8_t) addr_type) * 16777619u;
+    int i;
+    for (i = 0; i < 6; i++){
+        hash = (hash ^ addr[i]) * 16777619u;
+    }
+    return hash % CENTRAL_DEVICE_DB_FS_BUCKETS;
+}
+
+static void db_fs_sync(int flags){
+    if (db_fs == &db_fs_ram) return;
+    msync(db_fs, sizeof(db_fs_file_t), flags);
+}
+
+// sync only the page(s) holding [data, data + len)
+static void db_fs_sync_range(void * data, size_t len){
+    if (db_fs == &db_fs_ram) return;
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) data & ~(page_size - 1);
+    msync((void *) start, (uintptr_t) data + len - start, MS_SYNC);
+}
+
+static int db_fs_find(int addr_type, bd_addr_t addr){
+    uint16_t index = db_fs_buckets[db_fs_hash(addr_type, addr)];
+    while (index != DB_FS_NONE){
+        db_fs_device_t * device = &db_fs->devices[index];
+        if (device->addr_type == addr_type && BD_ADDR_CMP(device->addr, addr) == 0) return index;
+        index = db_fs_hash_next[index];
+    }
+    return -1;
+}
+
+static void db_fs_link(int index){
+    db_fs_device_t * device = &db_fs->devices[index];
+    uint16_t bucket = db_fs_hash(device->addr_type, device->addr);
+    db_fs_hash_next[index] = db_fs_buckets[bucket];
+    db_fs_buckets[bucket] = index;
+}
+
+static void db_fs_unlink(int index){
+    db_fs_device_t * device = &db_fs->devices[index];
+    uint16_t * it = &db_fs_buckets[db_fs_hash(device->addr_type, device->addr)];
+    while (*it != DB_FS_NONE){
+        if (*it == index){
+            *it = db_fs_hash_next[index];
+            return;
+        }
+        it = &db_fs_hash_next[*it];
+    }
+}
+
+static void db_fs_format(void){
+    memset(db_fs, 0, sizeof(db_fs_file_t));
+    db_fs->magic    = CENTRAL_DEVICE_DB_FS_MAGIC;
+    db_fs->version  = CENTRAL_DEVICE_DB_FS_VERSION;
+    db_fs->capacity = CENTRAL_DEVICE_DB_FS_MAX_DEVICES;
+    db_fs_sync(MS_SYNC);
+}
+
+static db_fs_file_t * db_fs_map(void){
+    if (mkdir(CENTRAL_DEVICE_DB_FS_DIR, 0700) < 0 && errno != EEXIST) return NULL;
+    db_fs_fd = open(CENTRAL_DEVICE_DB_FS_PATH, O_RDWR | O_CREAT | O_NOFOLLOW, 0600);
+    if (db_fs_fd < 0) return NULL;
+    struct stat st;
+    if (fstat(db_fs_fd, &st) < 0 || ((size_t) st.st_size < sizeof(db_fs_file_t) && ftruncate(db_fs_fd, sizeof(db_fs_file_t)) < 0)){
+        close(db_fs_fd);
+        db_fs_fd = -1;
+        return NULL;
+    }
+    void * mapping = mmap(NULL, sizeof(db_fs_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, db_fs_fd, 0);
+    if (mapping == MAP_FAILED){
+        close(db_fs_fd);
+        db_fs_fd = -1;
+        return NULL;
+    }
+    return (db_fs_file_t *) mapping;
+}
+
+static void db_fs_unmap(void){
+    if (db_fs && db_fs != &db_fs_ram){
+        munmap(db_fs, sizeof(db_fs_file_t));
+    }
+    if (db_fs_fd >= 0){
+        close(db_fs_fd);
+        db_fs_fd = -1;
+    }
+    db_fs = NULL;
+}
+
+void central_device_db_init(){
+    db_fs_unmap();
+    db_fs = db_fs_map();
+    if (!db_fs){
+        log_error("central_device_db_fs: cannot map %s, bonding information will not be stored", CENTRAL_DEVICE_DB_FS_PATH);
+        db_fs = &db_fs_ram;
+        db_fs_format();
+    }
+
+    if (db_fs->magic != CENTRAL_DEVICE_DB_FS_MAGIC || db_fs->version != CENTRAL_DEVICE_DB_FS_VERSION
+    ||  db_fs->capacity != CENTRAL_DEVICE_DB_FS_MAX_DEVICES || db_fs->count > CENTRAL_DEVICE_DB_FS_MAX_DEVICES){
+        db_fs_format();
+    }
+
+    int i;
+    for (i = 0; i < CENTRAL_DEVICE_DB_FS_BUCKETS; i++){
+        db_fs_buckets[i] = DB_FS_NONE;
+    }
+    // entries are copied before count is lowered on remove, drop duplicate left by an interrupted remove
+    i = 0;
+    while (i < (int) db_fs->count){
+        db_fs_device_t * device = &db_fs->devices[i];
+        if (db_fs_find(device->addr_type, device->addr) >= 0){
+            log_info("central_device_db_fs: dropping duplicate %s", bd_addr_to_str(device->addr));
+            central_device_db_remove(i);
+            continue;
+        }
+        db_fs_link(i);
+        i++;
+    }
+    log_info("central_device_db_fs: %u devices from %s", db_fs->count, CENTRAL_DEVICE_DB_FS_PATH);
+}
+
+// @returns number of device in db
+int central_device_db_count(void){
+    return db_fs->count;
+}
+
+int central_device_db_lookup(int addr_type, bd_addr_t addr){
+    return db_fs_find(addr_type, addr);
+}
+
+const sm_key_t * central_device_db_irk_table(void){
+    return db_fs->irk;
+}
+
+// free device, last device takes its index
+void central_device_db_remove(int index){
+    if (index < 0 || index >= (int) db_fs->count) return;
+    int last = db_fs->count - 1;
+    // not linked if called for a duplicate during init
+    db_fs_unlink(index);
+    if (index != last){
+        int last_linked = db_fs_find(db_fs->devices[last].addr_type, db_fs->devices[last].addr) == last;
+        if (last_linked) db_fs_unlink(last);
+        memcpy(db_fs->irk[index], db_fs->irk[last], 16);
+        db_fs->devices[index] = db_fs->devices[last];
+        db_fs_sync(MS_SYNC);
+        if (last_linked) db_fs_link(index);
+    }
+    db_fs->count = last;
+    db_fs_sync(MS_SYNC);
+}
+
+int central_device_db_add(int addr_type, bd_addr_t addr, sm_key_t irk, sm_key_t csrk){
+    int index = db_fs_find(addr_type, addr);
+    if (index < 0){
+        if (db_fs->count >= CENTRAL_DEVICE_DB_FS_MAX_DEVICES) return -1;
+        index = db_fs->count;
+    }
+
+    log_info("Central Device DB adding type %u - %s", addr_type, bd_addr_to_str(addr));
+    log_key("irk", irk);
+    log_key("csrk", csrk);
+
+    db_fs_device_t * device = &db_fs->devices[index];
+    device->addr_type = addr_type;
+    memcpy(device->addr, addr, 6);
+    memcpy(device->csrk, csrk, 16);
+    memcpy(db_fs->irk[index], irk, 16);
+    device->signing_counter = 0;
+    db_fs_sync(MS_SYNC);
+
+    // new entry becomes valid when count covers it
+    if (index == (int) db_fs->count){
+        db_fs->count++;
+        db_fs_sync(MS_SYNC);
+        db_fs_link(index);
+    }
+    return index;
+}
+
+// get device information: addr type and address
+void central_device_db_info(int index, int * addr_type, bd_addr_t addr, sm_key_t irk){
+    if (addr_type) *addr_type = db_fs->devices[index].addr_type;
+    if (addr) memcpy(addr, db_fs->devices[index].addr, 6);
+    if (irk) memcpy(irk, db_fs->irk[index], 16);
+}
+
+// get signature key
+void central_device_db_csrk(int index, sm_key_t csrk){
+    if (csrk) memcpy(csrk, db_fs->devices[index].csrk, 16);
+}
+
+// query last used/seen signing counter
+uint32_t central_device_db_counter_get(int index){
+    return db_fs->devices[index].signing_counter;
+}
+
+// update signing counter, synced before returning so a counter value is never reused after power loss
+void central_device_db_counter_set(int index, uint32_t counter){
+    db_fs->devices[index].signing_counter = counter;
+    db_fs_sync_range(&db_fs->devices[index].signing_counter, sizeof(uint32_t));
+}
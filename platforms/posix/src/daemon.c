@@ -63,6 +63,7 @@
 #include "debug.h"
 #include "hci.h"
 #include "hci_dump.h"
+#include "btstack_stats.h"
 #include "hci_transport.h"
 #include "l2cap.h"
 #include "rfcomm.h"
@@ -78,6 +79,7 @@
 #include "att_server.h"
 #include "att.h"
 #include "central_device_db.h"
+#include "le_scan_filter.h"
 #include "sm.h"
 #endif
 
@@ -103,6 +105,11 @@
 
 #define DAEMON_NO_ACTIVE_CLIENT_TIMEOUT 10000
 
+// client connection is parked while it has this many HCI commands queued or in flight
+#ifndef DAEMON_MAX_HCI_CMDS_OUTSTANDING
+#define DAEMON_MAX_HCI_CMDS_OUTSTANDING 4
+#endif
+
 #define ATT_MAX_LONG_ATTRIBUTE_SIZE 512
 
 
@@ -113,6 +120,12 @@
 // ATT_MTU - 1
 #define ATT_MAX_ATTRIBUTE_SIZE 22
 
+// raw HCI command from a client, connection is NULL after client disconnected
+typedef struct {
+    hci_cmd_request_t request;  // assert: first field
+    connection_t    * connection;
+} daemon_hci_cmd_request_t;
+
 typedef struct {
     // linked list - assert: first field
     linked_item_t    item;
@@ -120,6 +133,9 @@ typedef struct {
     // connection
     connection_t * connection;
 
+    // HCI commands queued or in flight
+    daemon_hci_cmd_request_t * hci_cmd_requests[DAEMON_MAX_HCI_CMDS_OUTSTANDING];
+
     linked_list_t rfcomm_cids;
     linked_list_t rfcomm_services;
     linked_list_t l2cap_cids;
@@ -131,7 +147,12 @@ typedef struct {
     
     // discoverable
     uint8_t        discoverable;
-    
+
+#ifdef HAVE_BLE
+    // advertising reports for this client, NULL if not configured
+    le_scan_filter_t * le_scan_filter;
+#endif
+
 } client_state_t;
 
 typedef struct linked_list_uint32 {
@@ -156,6 +177,7 @@ typedef struct linked_list_gatt_client_helper{
 // MARK: prototypes
 static void handle_sdp_rfcomm_service_result(sdp_query_event_t * event, void * context);
 static void handle_sdp_client_query_result(sdp_query_event_t * event);
+static void sdp_emit_query_busy(connection_t * connection);
 static void dummy_bluetooth_status_handler(BLUETOOTH_STATE state);
 static client_state_t * client_for_connection(connection_t *connection);
 static int              clients_require_power_on(void);
@@ -498,6 +520,34 @@ static void daemon_sdp_close_connection(client_state_t * gatt_client){
 }
 
 #ifdef HAVE_BLE
+// each client has its own scan filter, advertising reports are filtered when forwarded
+static le_scan_filter_t * daemon_le_scan_filter_for_connection(connection_t * connection){
+    client_state_t * client = client_for_connection(connection);
+    if (!client) return NULL;
+    if (!client->le_scan_filter){
+        client->le_scan_filter = malloc(sizeof(le_scan_filter_t));
+        if (!client->le_scan_filter) return NULL;
+        le_scan_filter_init(client->le_scan_filter);
+    }
+    return client->le_scan_filter;
+}
+
+static void daemon_le_scan_filter_free(connection_t * connection){
+    client_state_t * client = client_for_connection(connection);
+    if (!client) return;
+    free(client->le_scan_filter);
+    client->le_scan_filter = NULL;
+}
+
+static void daemon_send_advertising_report(uint8_t *packet, uint16_t size){
+    linked_item_t *it;
+    for (it = (linked_item_t *) clients; it ; it = it->next){
+        client_state_t * client_state = (client_state_t *) it;
+        if (client_state->le_scan_filter && !le_scan_filter_accept(client_state->le_scan_filter, packet, size)) continue;
+        socket_connection_send_packet(client_state->connection, HCI_EVENT_PACKET, 0, packet, size);
+    }
+}
+
 static void daemon_gatt_client_close_connection(connection_t * connection){
     client_state_t * client = client_for_connection(connection);
     if (!client) return;
@@ -524,8 +574,17 @@ static void daemon_disconnect_client(connection_t * connection){
     // NOTE: experimental - disconnect all LE connections where GATT Client was used
     // gatt_client_disconnect_connection(connection);
     daemon_gatt_client_close_connection(connection);
+    daemon_le_scan_filter_free(connection);
 #endif
 
+    // queued HCI commands are still sent, but don't refer to the client anymore
+    int i;
+    for (i = 0; i < DAEMON_MAX_HCI_CMDS_OUTSTANDING; i++){
+        if (client->hci_cmd_requests[i]){
+            client->hci_cmd_requests[i]->connection = NULL;
+        }
+    }
+
     linked_list_remove(&clients, (linked_item_t *) client);
     free(client); 
 }
@@ -678,6 +737,29 @@ void daemon_setup_characteristic_value_event(le_event_t *le_event, uint8_t* even
 
 #endif
 
+static void daemon_send_stats(connection_t * connection, int reset){
+#ifdef HAVE_STATS
+    uint8_t event[BTSTACK_STATS_HISTOGRAM_EVENT_SIZE];
+    int i;
+    for (i = 0; i < BTSTACK_STATS_NUM_HISTOGRAMS; i++){
+        int event_len = btstack_stats_create_histogram_event(event, (btstack_stats_histogram_id_t) i);
+        socket_connection_send_packet(connection, HCI_EVENT_PACKET, 0, event, event_len);
+    }
+    int event_len = btstack_stats_create_counters_event(event);
+    socket_connection_send_packet(connection, HCI_EVENT_PACKET, 0, event, event_len);
+    if (reset){
+        btstack_stats_reset();
+    }
+#else
+    // built without HAVE_STATS: no histograms, no counters
+    uint8_t event[3];
+    event[0] = BTSTACK_EVENT_STATS_COUNTERS;
+    event[1] = sizeof(event) - 2;
+    event[2] = 0;
+    socket_connection_send_packet(connection, HCI_EVENT_PACKET, 0, event, sizeof(event));
+#endif
+}
+
 static int btstack_command_handler(connection_t *connection, uint8_t *packet, uint16_t size){
     
     bd_addr_t addr;
@@ -693,6 +775,10 @@ static int btstack_command_handler(connection_t *connection, uint8_t *packet, ui
     uint32_t service_record_handle;
     client_state_t *client;
 
+#ifdef HAVE_BLE
+    le_scan_filter_t * filter;
+#endif
+
 #if defined(HAVE_MALLOC) && defined(HAVE_BLE)
     uint8_t uuid128[16];
     le_service_t service;
@@ -771,6 +857,10 @@ static int btstack_command_handler(connection_t *connection, uint8_t *packet, ui
                 hci_power_control(HCI_POWER_OFF);
             }
             break;
+        case BTSTACK_GET_STATS:
+            log_info("BTSTACK_GET_STATS reset %u", packet[3]);
+            daemon_send_stats(connection, packet[3]);
+            break;
         case L2CAP_CREATE_CHANNEL_MTU:
             bt_flip_addr(addr, &packet[3]);
             psm = READ_BT_16(packet, 9);
@@ -884,6 +974,11 @@ static int btstack_command_handler(connection_t *connection, uint8_t *packet, ui
             daemon_remove_client_sdp_service_record_handle(connection, service_record_handle);
             break;
         case SDP_CLIENT_QUERY_RFCOMM_SERVICES: 
+            // callback and parser belong to the active query
+            if (!sdp_client_ready()){
+                sdp_emit_query_busy(connection);
+                break;
+            }
             bt_flip_addr(addr, &packet[3]);
 
             serviceSearchPatternLen = de_get_len(&packet[9]);
@@ -894,6 +989,10 @@ static int btstack_command_handler(connection_t *connection, uint8_t *packet, ui
 
             break;
         case SDP_CLIENT_QUERY_SERVICES:
+            if (!sdp_client_ready()){
+                sdp_emit_query_busy(connection);
+                break;
+            }
             bt_flip_addr(addr, &packet[3]);
             sdp_parser_init();
             sdp_client_query_connection = connection;
@@ -926,6 +1025,21 @@ static int btstack_command_handler(connection_t *connection, uint8_t *packet, ui
         case GAP_LE_CONNECT_CANCEL:
             le_central_connect_cancel();
             break;
+#ifdef HAVE_BLE
+        case GAP_LE_SET_SCAN_FILTER:
+            filter = daemon_le_scan_filter_for_connection(connection);
+            if (!filter) break;
+            le_scan_filter_set_rate_limit(filter, READ_BT_16(packet, 3), packet[5]);
+            break;
+        case GAP_LE_SCAN_FILTER_ADD_UUID16:
+            filter = daemon_le_scan_filter_for_connection(connection);
+            if (!filter) break;
+            le_scan_filter_add_uuid16(filter, READ_BT_16(packet, 3));
+            break;
+        case GAP_LE_SCAN_FILTER_CLEAR:
+            daemon_le_scan_filter_free(connection);
+            break;
+#endif
         case GAP_DISCONNECT:
             handle = READ_BT_16(packet, 3);
             gap_disconnect(handle);
@@ -1071,6 +1185,42 @@ static int btstack_command_handler(connection_t *connection, uint8_t *packet, ui
     return 0;
 }
 
+static void daemon_hci_cmd_done(hci_cmd_request_t * hci_cmd_request, uint8_t * event, uint16_t size){
+    // Command Complete/Status is forwarded to clients by the packet handler
+    daemon_hci_cmd_request_t * request = (daemon_hci_cmd_request_t *) hci_cmd_request;
+    client_state_t * client = client_for_connection(request->connection);
+    if (client){
+        int i;
+        for (i = 0; i < DAEMON_MAX_HCI_CMDS_OUTSTANDING; i++){
+            if (client->hci_cmd_requests[i] == request){
+                client->hci_cmd_requests[i] = NULL;
+            }
+        }
+    }
+    free(request);
+}
+
+// @returns 0 if ok, BTSTACK_BUSY parks the client connection until a command completes
+static int daemon_queue_hci_cmd(connection_t * connection, uint8_t * data, uint16_t length){
+    client_state_t * client = client_for_connection(connection);
+    if (!client) return 0;
+    int slot;
+    for (slot = 0; slot < DAEMON_MAX_HCI_CMDS_OUTSTANDING; slot++){
+        if (!client->hci_cmd_requests[slot]) break;
+    }
+    if (slot == DAEMON_MAX_HCI_CMDS_OUTSTANDING) return BTSTACK_BUSY;
+    daemon_hci_cmd_request_t * request = malloc(sizeof(daemon_hci_cmd_request_t));
+    if (!request) return BTSTACK_BUSY;
+    request->connection = connection;
+    // callback can be called right away if the command is not sent
+    client->hci_cmd_requests[slot] = request;
+    if (hci_queue_cmd_packet(&request->request, &daemon_hci_cmd_done, data, length)){
+        client->hci_cmd_requests[slot] = NULL;
+        free(request);
+    }
+    return 0;
+}
+
 static int daemon_client_handler(connection_t *connection, uint16_t packet_type, uint16_t channel, uint8_t *data, uint16_t length){
     
     int err = 0;
@@ -1079,10 +1229,9 @@ static int daemon_client_handler(connection_t *connection, uint16_t packet_type,
     switch (packet_type){
         case HCI_COMMAND_DATA_PACKET:
             if (READ_CMD_OGF(data) != OGF_BTSTACK) { 
-                // HCI Command
-                if (!hci_can_send_command_packet_now())
-                    return BTSTACK_BUSY;    // HACK: park the connection
-                hci_send_cmd_packet(data, length);
+                // HCI Command, queued until the controller accepts it
+                err = daemon_queue_hci_cmd(connection, data, length);
+                if (err) return err;    // HACK: park the connection
             } else {
                 // BTstack command
                 btstack_command_handler(connection, data, length);
@@ -1207,6 +1356,9 @@ static void daemon_retry_parked(void){
     // socket_connection_retry_parked is not reentrant
     static int retry_mutex = 0;
 
+    // retry once at the end of the HCI batch
+    if (hci_batch_active()) return;
+
     // lock mutex
     if (retry_mutex) return;
     retry_mutex = 1;
@@ -1292,11 +1444,17 @@ static void daemon_packet_handler(void * connection, uint8_t packet_type, uint16
                     daemon_retry_parked();
                     // no need to tell clients
                     return;
+                case DAEMON_EVENT_HCI_BATCH_COMPLETE:
+                    // retry once per batch of received packets
+                    daemon_retry_parked();
+                    // no need to tell clients
+                    return;
                 case RFCOMM_EVENT_CREDITS:
                     // RFCOMM CREDITS received...
                     daemon_retry_parked();
                     break;
                 case HCI_EVENT_COMMAND_COMPLETE:
+                case HCI_EVENT_COMMAND_STATUS:
                     daemon_retry_parked();
                     break;
                  case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
@@ -1321,6 +1479,12 @@ static void daemon_packet_handler(void * connection, uint8_t packet_type, uint16
                     if (packet[2]) break;
                     daemon_add_client_l2cap_service(connection, READ_BT_16(packet, 3));
                     break;
+#ifdef HAVE_BLE
+                case GAP_LE_ADVERTISING_REPORT:
+                    if (connection) break;
+                    daemon_send_advertising_report(packet, size);
+                    return;
+#endif
 #if defined(HAVE_BLE) && defined(HAVE_MALLOC)
                 case HCI_EVENT_DISCONNECTION_COMPLETE:
                     log_info("daemon : ignore HCI_EVENT_DISCONNECTION_COMPLETE ingnoring.");
@@ -1374,6 +1538,13 @@ static void handle_sdp_rfcomm_service_result(sdp_query_event_t * rfcomm_event, v
     }
 }
 
+// only one SDP query can be active, refuse others right away
+static void sdp_emit_query_busy(connection_t * connection){
+    uint8_t event[] = { SDP_QUERY_COMPLETE, 1, BTSTACK_BUSY};
+    hci_dump_packet(HCI_EVENT_PACKET, 0, event, sizeof(event));
+    socket_connection_send_packet(connection, HCI_EVENT_PACKET, 0, event, sizeof(event));
+}
+
 static void sdp_client_assert_buffer(int size){
     if (size > attribute_value_buffer_size){
         log_error("SDP attribute value buffer size exceeded: available %d, required %d", attribute_value_buffer_size, size);
@@ -1755,7 +1926,11 @@ int main (int argc,  char * const * argv){
     remote_device_db = &REMOTE_DEVICE_DB;
 #endif
 
+#ifdef USE_DISPATCH_RUN_LOOP
+    run_loop_init(RUN_LOOP_DISPATCH);
+#else
     run_loop_init(RUN_LOOP_POSIX);
+#endif
     
     // init power management notifications
     if (control && control->register_for_power_notifications){
@@ -1804,9 +1979,17 @@ int main (int argc,  char * const * argv){
     gatt_client_init();
     gatt_client_register_packet_handler(&handle_gatt_client_event);
 
+#ifdef HAVE_GATT_CLIENT_CACHE
+    // discovery cache is used for bonded peers, SM provides their identity address
+    sm_init();
+    sm_set_io_capabilities(IO_CAPABILITY_NO_INPUT_NO_OUTPUT);
+    sm_set_authentication_requirements(SM_AUTHREQ_BONDING);
+    gatt_client_set_cache(&gatt_client_cache_posix);
+#else
     // sm_init();
     // sm_set_io_capabilities(IO_CAPABILITY_DISPLAY_ONLY);
     // sm_set_authentication_requirements( SM_AUTHREQ_BONDING | SM_AUTHREQ_MITM_PROTECTION); 
+#endif
 
     // GATT Server - empty attribute database
     central_device_db_init();
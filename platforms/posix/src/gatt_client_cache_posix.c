@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2011-2014 by BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. This software may not be used in a commercial product
+ *    without an explicit license granted by the copyright holder.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ *  gatt_client_cache_posix.c
+ *
+ *  File based storage for the GATT client discovery cache, one file per peer
+ *
+ */
+
+#include "btstack-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "gatt_client.h"
+#include "debug.h"
+
+#ifdef HAVE_GATT_CLIENT_CACHE
+
+#ifndef BTSTACK_STATE_DIR
+#define BTSTACK_STATE_DIR "/var/lib/btstack"
+#endif
+
+#ifndef GATT_CLIENT_CACHE_POSIX_PATH
+#define GATT_CLIENT_CACHE_POSIX_PATH BTSTACK_STATE_DIR
+#endif
+
+#define GATT_CLIENT_CACHE_POSIX_PATH_LEN 200
+
+static void gatt_client_cache_posix_path(char * path, uint8_t addr_type, bd_addr_t addr){
+    snprintf(path, GATT_CLIENT_CACHE_POSIX_PATH_LEN, "%s/btstack_gatt_%u_%02x%02x%02x%02x%02x%02x.cache",
+             GATT_CLIENT_CACHE_POSIX_PATH, addr_type, addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+}
+
+static int gatt_client_cache_posix_get(uint8_t addr_type, bd_addr_t addr, uint8_t * buffer, uint16_t buffer_size){
+    char path[GATT_CLIENT_CACHE_POSIX_PATH_LEN];
+    gatt_client_cache_posix_path(path, addr_type, addr);
+    FILE * file = fopen(path, "rb");
+    if (!file) return 0;
+    size_t size = fread(buffer, 1, buffer_size, file);
+    // larger than buffer -> ignore
+    if (fgetc(file) != EOF) size = 0;
+    fclose(file);
+    return size;
+}
+
+static void gatt_client_cache_posix_put(uint8_t addr_type, bd_addr_t addr, uint8_t * buffer, uint16_t size){
+    char path[GATT_CLIENT_CACHE_POSIX_PATH_LEN];
+    char path_tmp[GATT_CLIENT_CACHE_POSIX_PATH_LEN + 4];
+    gatt_client_cache_posix_path(path, addr_type, addr);
+    snprintf(path_tmp, sizeof(path_tmp), "%s.tmp", path);
+    if (mkdir(GATT_CLIENT_CACHE_POSIX_PATH, 0700) != 0 && errno != EEXIST){
+        log_error("gatt_client_cache_posix: cannot create %s", GATT_CLIENT_CACHE_POSIX_PATH);
+        return;
+    }
+    // write to temp file and rename, so a crash never leaves a partial entry
+    unlink(path_tmp);
+    int fd = open(path_tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        log_error("gatt_client_cache_posix: cannot create %s", path_tmp);
+        return;
+    }
+    int ok = write(fd, buffer, size) == size;
+    if (fsync(fd) != 0) ok = 0;
+    if (close(fd) != 0) ok = 0;
+    if (!ok || rename(path_tmp, path) != 0){
+        log_error("gatt_client_cache_posix: cannot write %s", path);
+        unlink(path_tmp);
+        return;
+    }
+    int dir_fd = open(GATT_CLIENT_CACHE_POSIX_PATH, O_RDONLY);
+    if (dir_fd < 0) return;
+    fsync(dir_fd);
+    close(dir_fd);
+}
+
+static void gatt_client_cache_posix_remove(uint8_t addr_type, bd_addr_t addr){
+    char path[GATT_CLIENT_CACHE_POSIX_PATH_LEN];
+    gatt_client_cache_posix_path(path, addr_type, addr);
+    unlink(path);
+}
+
+const gatt_client_cache_t gatt_client_cache_posix = {
+    gatt_client_cache_posix_get,
+    gatt_client_cache_posix_put,
+    gatt_client_cache_posix_remove,
+};
+
+#endif
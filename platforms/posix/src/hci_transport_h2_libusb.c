@@ -329,7 +329,8 @@ static int usb_process_ds(struct data_source *ds) {
     memset(&tv, 0, sizeof(struct timeval));
     libusb_handle_events_timeout(NULL, &tv);
 
-    // Handle any packet in the order that they were received
+    // Handle any packet in the order that they were received, as one batch
+    hci_batch_begin();
     while (handle_packet) {
 
         // log_info("handle packet %p, endpoint %x, status %x", handle_packet, handle_packet->endpoint, handle_packet->status);
@@ -339,7 +340,10 @@ static int usb_process_ds(struct data_source *ds) {
         handle_completed_transfer(handle_packet);
 
         // handle case where libusb_close might be called by hci packet handler        
-        if (libusb_state != LIB_USB_TRANSFERS_ALLOCATED) return -1;
+        if (libusb_state != LIB_USB_TRANSFERS_ALLOCATED) {
+            hci_batch_end();
+            return -1;
+        }
 
         // Move to next in the list of packets to handle
         if (next) {
@@ -349,6 +353,8 @@ static int usb_process_ds(struct data_source *ds) {
         }
     }
 
+    hci_batch_end();
+
     // log_info("end usb_process_ds");
 
     return 0;
@@ -46,6 +46,7 @@
 
 #include <termios.h>  /* POSIX terminal control definitions */
 #include <fcntl.h>    /* File control definitions */
+#include <errno.h>
 #include <unistd.h>   /* UNIX standard function definitions */
 #include <stdio.h>
 #include <string.h>
@@ -56,6 +57,11 @@
 #include "hci_transport.h"
 #include "hci_dump.h"
 
+// max number of packets delivered per UART wakeup
+#ifndef H4_MAX_PACKETS_PER_WAKEUP
+#define H4_MAX_PACKETS_PER_WAKEUP 8
+#endif
+
 static int  h4_process(struct data_source *ds);
 static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size); 
 static      hci_uart_config_t *hci_uart_config;
@@ -258,25 +264,37 @@ static void h4_statemachine(void){
 static int    h4_process(struct data_source *ds) {
     if (hci_transport_h4->uart_fd == 0) return -1;
 
-    int read_now = bytes_to_read;
-    
-    // read up to bytes_to_read data in
-    ssize_t bytes_read = read(hci_transport_h4->uart_fd, &hci_packet[read_pos], read_now);
-    // log_info("h4_process: bytes read %u", bytes_read);
-    if (bytes_read < 0) {
-        return bytes_read;
-    }
-    
-    // hexdump(&hci_packet[read_pos], bytes_read);
-    
-    bytes_to_read -= bytes_read;
-    read_pos      += bytes_read;
-    if (bytes_to_read > 0) {
-        return 0;
+    // deliver packets available in the UART as one batch, at most H4_MAX_PACKETS_PER_WAKEUP.
+    // select() reports the UART as readable again if more data is pending
+    int err = 0;
+    int packets = 0;
+    hci_batch_begin();
+    while (packets < H4_MAX_PACKETS_PER_WAKEUP) {
+        // payload can be empty
+        if (bytes_to_read > 0){
+            // read up to bytes_to_read data in, uart is non-blocking
+            ssize_t bytes_read = read(hci_transport_h4->uart_fd, &hci_packet[read_pos], bytes_to_read);
+            // log_info("h4_process: bytes read %u", bytes_read);
+            if (bytes_read < 0 && errno != EAGAIN) {
+                err = bytes_read;
+            }
+            if (bytes_read <= 0) break;
+
+            // hexdump(&hci_packet[read_pos], bytes_read);
+
+            bytes_to_read -= bytes_read;
+            read_pos      += bytes_read;
+            if (bytes_to_read > 0) continue;
+        }
+
+        if (h4_state == H4_W4_PAYLOAD) packets++;
+        h4_statemachine();
+
+        // transport closed by packet handler
+        if (!hci_transport_h4->ds) break;
     }
-    
-    h4_statemachine();
-    return 0;
+    hci_batch_end();
+    return err;
 }
 
 static const char * h4_get_transport_name(void){
@@ -0,0 +1,615 @@
+/*
+ * Copyright (C) 2009-2012 by Matthias Ringwald
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at btstack@ringwald.ch
+ *
+ */
+
+/*
+ *  hci_transport_virtual.c
+ *
+ *  HCI Transport API implementation that emulates a Bluetooth controller
+ *
+ *  Two BTstack instances are connected back-to-back by handing each one end
+ *  of a socketpair. Each transport answers HCI commands like a controller
+ *  and forwards connection setup and ACL data to its peer, so L2CAP and the
+ *  protocols on top can be exercised without radio hardware.
+ *
+ *  Supports a single ACL link (Classic or LE) at a time.
+ */
+
+#include "btstack-config.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "debug.h"
+#include "hci.h"
+#include "hci_transport.h"
+#include "hci_dump.h"
+
+// controller properties
+#define VIRTUAL_ACL_PACKET_LENGTH   1021
+#define VIRTUAL_ACL_PACKETS         8
+#define VIRTUAL_CON_HANDLE_CLASSIC  0x0001
+#define VIRTUAL_CON_HANDLE_LE       0x0040
+
+// host queue size, holds events and up to VIRTUAL_ACL_PACKETS from peer
+#define VIRTUAL_QUEUE_SIZE          (4 * VIRTUAL_ACL_PACKETS * (HCI_ACL_HEADER_SIZE + VIRTUAL_ACL_PACKET_LENGTH))
+
+// peer protocol: [type][len 16][payload]
+#define VIRTUAL_PEER_HEADER_SIZE    3
+typedef enum {
+    VIRTUAL_PEER_CONNECT_REQUEST = 1,   // bd_addr, link type
+    VIRTUAL_PEER_CONNECT_RESPONSE,      // status
+    VIRTUAL_PEER_ACL,                   // hci acl packet
+    VIRTUAL_PEER_ACL_ACK,               // num packets (16)
+    VIRTUAL_PEER_DISCONNECT,            // reason
+} VIRTUAL_PEER_TYPE;
+
+#define VIRTUAL_LINK_TYPE_ACL 0x01
+#define VIRTUAL_LINK_TYPE_LE  0xff
+
+typedef enum {
+    VIRTUAL_LINK_IDLE,
+    VIRTUAL_LINK_W4_PEER_RESPONSE,
+    VIRTUAL_LINK_W4_HOST_ACCEPT,
+    VIRTUAL_LINK_OPEN,
+} VIRTUAL_LINK_STATE;
+
+static int  virtual_process_peer(struct data_source *ds);
+static int  virtual_process_wakeup(struct data_source *ds);
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size);
+
+static  void (*packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size) = dummy_handler;
+
+static hci_transport_t   virtual_transport;
+static hci_virtual_config_t * virtual_config;
+
+static data_source_t virtual_peer_ds;
+static data_source_t virtual_wakeup_ds;
+static int           virtual_wakeup_fd[2] = { -1, -1 };
+static int           virtual_wakeup_armed;
+
+// packets for host: [type][len 16][packet]
+static uint8_t  virtual_queue[VIRTUAL_QUEUE_SIZE];
+static int      virtual_queue_read_pos;
+static int      virtual_queue_write_pos;
+static int      virtual_queue_delivering;
+
+// data from peer
+static uint8_t  virtual_peer_buffer[VIRTUAL_PEER_HEADER_SIZE + HCI_ACL_HEADER_SIZE + VIRTUAL_ACL_PACKET_LENGTH];
+static int      virtual_peer_read_pos;
+static uint16_t virtual_peer_acks_pending;
+
+// single link
+static VIRTUAL_LINK_STATE virtual_link_state;
+static uint8_t            virtual_link_type;
+static hci_con_handle_t   virtual_link_handle;
+static bd_addr_t          virtual_link_addr;
+static uint8_t            virtual_link_addr_type;
+
+static void virtual_wakeup(void){
+    if (virtual_wakeup_armed) return;
+    uint8_t dummy = 0;
+    if (write(virtual_wakeup_fd[1], &dummy, 1) != 1) return;
+    virtual_wakeup_armed = 1;
+}
+
+static void virtual_queue_packet(uint8_t packet_type, uint8_t * packet, uint16_t size){
+    // packets are handed out in place, don't move them during delivery
+    if (virtual_queue_write_pos + 3 + size > VIRTUAL_QUEUE_SIZE && !virtual_queue_delivering){
+        memmove(virtual_queue, &virtual_queue[virtual_queue_read_pos], virtual_queue_write_pos - virtual_queue_read_pos);
+        virtual_queue_write_pos -= virtual_queue_read_pos;
+        virtual_queue_read_pos = 0;
+    }
+    if (virtual_queue_write_pos + 3 + size > VIRTUAL_QUEUE_SIZE){
+        log_error("virtual: host queue full, dropping packet type %u", packet_type);
+        return;
+    }
+    virtual_queue[virtual_queue_write_pos] = packet_type;
+    bt_store_16(virtual_queue, virtual_queue_write_pos + 1, size);
+    memcpy(&virtual_queue[virtual_queue_write_pos + 3], packet, size);
+    virtual_queue_write_pos += 3 + size;
+    virtual_wakeup();
+}
+
+static void virtual_emit_event(uint8_t * event, uint16_t size){
+    event[1] = size - 2;
+    virtual_queue_packet(HCI_EVENT_PACKET, event, size);
+}
+
+static void virtual_emit_command_complete(uint16_t opcode, uint8_t * params, int params_len){
+    uint8_t event[5 + 16];
+    event[0] = HCI_EVENT_COMMAND_COMPLETE;
+    event[2] = 1;
+    bt_store_16(event, 3, opcode);
+    memcpy(&event[5], params, params_len);
+    virtual_emit_event(event, 5 + params_len);
+}
+
+static void virtual_emit_command_status(uint16_t opcode, uint8_t status){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_COMMAND_STATUS;
+    event[2] = status;
+    event[3] = 1;
+    bt_store_16(event, 4, opcode);
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_connection_complete(uint8_t status){
+    uint8_t event[13];
+    event[0] = HCI_EVENT_CONNECTION_COMPLETE;
+    event[2] = status;
+    bt_store_16(event, 3, VIRTUAL_CON_HANDLE_CLASSIC);
+    bt_flip_addr(&event[5], virtual_link_addr);
+    event[11] = VIRTUAL_LINK_TYPE_ACL;
+    event[12] = 0;
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_le_connection_complete(uint8_t status, uint8_t role){
+    uint8_t event[21];
+    event[0] = HCI_EVENT_LE_META;
+    event[2] = HCI_SUBEVENT_LE_CONNECTION_COMPLETE;
+    event[3] = status;
+    bt_store_16(event, 4, VIRTUAL_CON_HANDLE_LE);
+    event[6] = role;
+    event[7] = virtual_link_addr_type;
+    bt_flip_addr(&event[8], virtual_link_addr);
+    bt_store_16(event, 14, 0x0018); // interval
+    bt_store_16(event, 16, 0);      // latency
+    bt_store_16(event, 18, 0x0048); // supervision timeout
+    event[20] = 0;
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_emit_disconnection_complete(uint8_t reason){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_DISCONNECTION_COMPLETE;
+    event[2] = 0;
+    bt_store_16(event, 3, virtual_link_handle);
+    event[5] = reason;
+    virtual_emit_event(event, sizeof(event));
+    virtual_link_state = VIRTUAL_LINK_IDLE;
+}
+
+static void virtual_emit_handle_status_event(uint8_t event_code, uint16_t handle, int with_flag){
+    uint8_t event[6];
+    event[0] = event_code;
+    event[2] = 0;
+    bt_store_16(event, 3, handle);
+    event[5] = 1;
+    virtual_emit_event(event, with_flag ? 6 : 5);
+}
+
+static void virtual_emit_number_of_completed_packets(uint16_t num_packets){
+    uint8_t event[7];
+    event[0] = HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS;
+    event[2] = 1;
+    bt_store_16(event, 3, virtual_link_handle);
+    bt_store_16(event, 5, num_packets);
+    virtual_emit_event(event, sizeof(event));
+}
+
+static void virtual_peer_send(uint8_t type, uint8_t * data, uint16_t len){
+    uint8_t header[VIRTUAL_PEER_HEADER_SIZE];
+    header[0] = type;
+    bt_store_16(header, 1, len);
+    // flow control bounds data in flight well below the socket buffer size
+    uint8_t * chunks[2] = { header, data };
+    int sizes[2] = { VIRTUAL_PEER_HEADER_SIZE, len };
+    int i;
+    for (i = 0; i < 2; i++){
+        uint8_t * pos = chunks[i];
+        int size = sizes[i];
+        while (size > 0){
+#ifdef MSG_NOSIGNAL
+            // Linux
+            int bytes_written = send(virtual_config->peer_fd, pos, size, MSG_NOSIGNAL);
+#else
+            // BSD Variants like Darwin and iOS, see SO_NOSIGPIPE
+            int bytes_written = write(virtual_config->peer_fd, pos, size);
+#endif
+            if (bytes_written < 0) {
+                // peer gone, reported when reading
+                log_info("virtual: peer write failed");
+                return;
+            }
+            pos  += bytes_written;
+            size -= bytes_written;
+        }
+    }
+}
+
+static void virtual_peer_send_status(uint8_t type, uint8_t status){
+    virtual_peer_send(type, &status, 1);
+}
+
+static void virtual_handle_command(uint8_t * packet, int size){
+    uint16_t opcode = READ_BT_16(packet, 0);
+    uint8_t  params[16];
+    
+    memset(params, 0, sizeof(params));
+
+    if (IS_COMMAND(packet, hci_read_bd_addr)){
+        bt_flip_addr(&params[1], virtual_config->bd_addr);
+        virtual_emit_command_complete(opcode, params, 7);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_buffer_size)){
+        bt_store_16(params, 1, VIRTUAL_ACL_PACKET_LENGTH);
+        params[3] = 0;
+        bt_store_16(params, 4, VIRTUAL_ACL_PACKETS);
+        bt_store_16(params, 6, 0);
+        virtual_emit_command_complete(opcode, params, 8);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_local_supported_features)){
+        params[1 + 0] = 0x0f;           // 3/5 slot packets, encryption, slot offset
+        params[1 + 3] = 0x02 | 0x04;    // EDR 2/3 Mbps
+        params[1 + 4] = 1 << 6;         // LE supported (controller)
+        params[1 + 6] = 1 << 3;         // secure simple pairing
+        virtual_emit_command_complete(opcode, params, 9);
+        return;
+    }
+#ifdef HAVE_BLE
+    if (IS_COMMAND(packet, hci_le_read_buffer_size)){
+        // length 0: LE shares the ACL buffers
+        virtual_emit_command_complete(opcode, params, 4);
+        return;
+    }
+#endif
+    if (IS_COMMAND(packet, hci_create_connection)){
+        if (virtual_link_state != VIRTUAL_LINK_IDLE) {
+            virtual_emit_command_status(opcode, 0x0c); // command disallowed
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        bt_flip_addr(virtual_link_addr, &packet[3]);
+        virtual_link_type   = VIRTUAL_LINK_TYPE_ACL;
+        virtual_link_handle = VIRTUAL_CON_HANDLE_CLASSIC;
+        virtual_link_state  = VIRTUAL_LINK_W4_PEER_RESPONSE;
+        uint8_t request[7];
+        BD_ADDR_COPY(request, virtual_config->bd_addr);
+        request[6] = VIRTUAL_LINK_TYPE_ACL;
+        virtual_peer_send(VIRTUAL_PEER_CONNECT_REQUEST, request, sizeof(request));
+        return;
+    }
+    if (IS_COMMAND(packet, hci_accept_connection_request)){
+        if (virtual_link_state != VIRTUAL_LINK_W4_HOST_ACCEPT){
+            virtual_emit_command_status(opcode, 0x02); // unknown connection identifier
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        virtual_link_state = VIRTUAL_LINK_OPEN;
+        virtual_emit_connection_complete(0);
+        virtual_peer_send_status(VIRTUAL_PEER_CONNECT_RESPONSE, 0);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_reject_connection_request)){
+        if (virtual_link_state != VIRTUAL_LINK_W4_HOST_ACCEPT){
+            virtual_emit_command_status(opcode, 0x02); // unknown connection identifier
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        virtual_link_state = VIRTUAL_LINK_IDLE;
+        virtual_emit_connection_complete(packet[9]);
+        virtual_peer_send_status(VIRTUAL_PEER_CONNECT_RESPONSE, packet[9]);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_disconnect)){
+        if (virtual_link_state != VIRTUAL_LINK_OPEN || READ_BT_16(packet, 3) != virtual_link_handle){
+            virtual_emit_command_status(opcode, 0x02); // unknown connection identifier
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        virtual_peer_send_status(VIRTUAL_PEER_DISCONNECT, packet[5]);
+        virtual_emit_disconnection_complete(0x16);  // connection terminated by local host
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_remote_supported_features_command)){
+        virtual_emit_command_status(opcode, 0);
+        uint8_t event[13];
+        memset(event, 0, sizeof(event));
+        event[0] = HCI_EVENT_READ_REMOTE_SUPPORTED_FEATURES_COMPLETE;
+        bt_store_16(event, 3, READ_BT_16(packet, 3));
+        // peer reported without SSP, links are not encrypted and services don't require pairing
+        event[5 + 0] = 0x0f;
+        virtual_emit_event(event, sizeof(event));
+        return;
+    }
+    if (IS_COMMAND(packet, hci_authentication_requested)){
+        virtual_emit_command_status(opcode, 0);
+        virtual_emit_handle_status_event(HCI_EVENT_AUTHENTICATION_COMPLETE_EVENT, READ_BT_16(packet, 3), 0);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_set_connection_encryption)){
+        virtual_emit_command_status(opcode, 0);
+        virtual_emit_handle_status_event(HCI_EVENT_ENCRYPTION_CHANGE, READ_BT_16(packet, 3), 1);
+        return;
+    }
+#ifdef HAVE_BLE
+    if (IS_COMMAND(packet, hci_le_create_connection)){
+        if (virtual_link_state != VIRTUAL_LINK_IDLE) {
+            virtual_emit_command_status(opcode, 0x0c); // command disallowed
+            return;
+        }
+        virtual_emit_command_status(opcode, 0);
+        virtual_link_addr_type = packet[8];
+        bt_flip_addr(virtual_link_addr, &packet[9]);
+        virtual_link_type   = VIRTUAL_LINK_TYPE_LE;
+        virtual_link_handle = VIRTUAL_CON_HANDLE_LE;
+        virtual_link_state  = VIRTUAL_LINK_W4_PEER_RESPONSE;
+        uint8_t request[7];
+        BD_ADDR_COPY(request, virtual_config->bd_addr);
+        request[6] = VIRTUAL_LINK_TYPE_LE;
+        virtual_peer_send(VIRTUAL_PEER_CONNECT_REQUEST, request, sizeof(request));
+        return;
+    }
+    if (IS_COMMAND(packet, hci_le_connection_update)){
+        virtual_emit_command_status(opcode, 0);
+        uint8_t event[10];
+        event[0] = HCI_EVENT_LE_META;
+        event[2] = HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE;
+        event[3] = 0;
+        bt_store_16(event, 4, READ_BT_16(packet, 3));
+        bt_store_16(event, 6, READ_BT_16(packet, 7));   // interval max
+        bt_store_16(event, 8, READ_BT_16(packet, 9));   // latency
+        virtual_emit_event(event, sizeof(event));
+        return;
+    }
+#endif
+    // everything else, incl. reset and configuration, just succeeds
+    virtual_emit_command_complete(opcode, params, 1);
+}
+
+static void virtual_handle_peer_packet(uint8_t type, uint8_t * data, uint16_t len){
+    switch (type){
+        case VIRTUAL_PEER_CONNECT_REQUEST:
+            if (virtual_link_state != VIRTUAL_LINK_IDLE){
+                virtual_peer_send_status(VIRTUAL_PEER_CONNECT_RESPONSE, 0x0d); // limited resources
+                break;
+            }
+            BD_ADDR_COPY(virtual_link_addr, data);
+            virtual_link_type = data[6];
+            if (virtual_link_type == VIRTUAL_LINK_TYPE_LE){
+                // LE connections are accepted by the controller
+                virtual_link_addr_type = 0;
+                virtual_link_handle = VIRTUAL_CON_HANDLE_LE;
+                virtual_link_state  = VIRTUAL_LINK_OPEN;
+                virtual_emit_le_connection_complete(0, 1);  // slave
+                virtual_peer_send_status(VIRTUAL_PEER_CONNECT_RESPONSE, 0);
+                break;
+            }
+            virtual_link_handle = VIRTUAL_CON_HANDLE_CLASSIC;
+            virtual_link_state  = VIRTUAL_LINK_W4_HOST_ACCEPT;
+            uint8_t event[12];
+            event[0] = HCI_EVENT_CONNECTION_REQUEST;
+            bt_flip_addr(&event[2], virtual_link_addr);
+            event[8]  = 0x0c;   // class of device: laptop
+            event[9]  = 0x01;
+            event[10] = 0x00;
+            event[11] = VIRTUAL_LINK_TYPE_ACL;
+            virtual_emit_event(event, sizeof(event));
+            break;
+        case VIRTUAL_PEER_CONNECT_RESPONSE:
+            if (virtual_link_state != VIRTUAL_LINK_W4_PEER_RESPONSE) break;
+            virtual_link_state = data[0] ? VIRTUAL_LINK_IDLE : VIRTUAL_LINK_OPEN;
+            if (virtual_link_type == VIRTUAL_LINK_TYPE_LE){
+                virtual_emit_le_connection_complete(data[0], 0);    // master
+            } else {
+                virtual_emit_connection_complete(data[0]);
+            }
+            break;
+        case VIRTUAL_PEER_ACL:
+            if (virtual_link_state != VIRTUAL_LINK_OPEN) break;
+            // use local handle, keep flags
+            bt_store_16(data, 0, (READ_BT_16(data, 0) & 0xf000) | virtual_link_handle);
+            virtual_queue_packet(HCI_ACL_DATA_PACKET, data, len);
+            virtual_peer_acks_pending++;
+            break;
+        case VIRTUAL_PEER_ACL_ACK:
+            if (virtual_link_state != VIRTUAL_LINK_OPEN) break;
+            virtual_emit_number_of_completed_packets(READ_BT_16(data, 0));
+            break;
+        case VIRTUAL_PEER_DISCONNECT:
+            if (virtual_link_state != VIRTUAL_LINK_OPEN) break;
+            virtual_emit_disconnection_complete(data[0]);
+            break;
+        default:
+            log_error("virtual: unknown peer packet type %u", type);
+            break;
+    }
+}
+
+static void virtual_deliver_packets(void){
+    virtual_queue_delivering = 1;
+    while (virtual_queue_read_pos < virtual_queue_write_pos){
+        // deliver queued packets as one batch, the stack may queue more when the batch ends
+        hci_batch_begin();
+        while (virtual_queue_read_pos < virtual_queue_write_pos){
+            uint8_t * entry = &virtual_queue[virtual_queue_read_pos];
+            uint16_t  size  = READ_BT_16(entry, 1);
+            virtual_queue_read_pos += 3 + size;
+            hci_dump_packet(entry[0], 1, &entry[3], size);
+            packet_handler(entry[0], &entry[3], size);
+        }
+        hci_batch_end();
+    }
+    virtual_queue_read_pos  = 0;
+    virtual_queue_write_pos = 0;
+    virtual_queue_delivering = 0;
+
+    // acknowledge delivered ACL packets in one go
+    if (virtual_peer_acks_pending){
+        uint8_t ack[2];
+        bt_store_16(ack, 0, virtual_peer_acks_pending);
+        virtual_peer_acks_pending = 0;
+        virtual_peer_send(VIRTUAL_PEER_ACL_ACK, ack, sizeof(ack));
+    }
+}
+
+static int virtual_process_wakeup(struct data_source *ds){
+    uint8_t dummy[16];
+    read(ds->fd, dummy, sizeof(dummy));
+    virtual_wakeup_armed = 0;
+    virtual_deliver_packets();
+    return 0;
+}
+
+static int virtual_process_peer(struct data_source *ds){
+    int bytes_read = read(ds->fd, &virtual_peer_buffer[virtual_peer_read_pos], sizeof(virtual_peer_buffer) - virtual_peer_read_pos);
+    if (bytes_read <= 0){
+        // peer gone
+        log_info("virtual: peer closed connection");
+        run_loop_remove_data_source(ds);
+        if (virtual_link_state == VIRTUAL_LINK_OPEN){
+            virtual_emit_disconnection_complete(0x08);   // connection timeout
+        }
+        virtual_deliver_packets();
+        return 0;
+    }
+    virtual_peer_read_pos += bytes_read;
+
+    // process complete peer packets
+    int pos = 0;
+    while (virtual_peer_read_pos - pos >= VIRTUAL_PEER_HEADER_SIZE){
+        uint16_t len = READ_BT_16(virtual_peer_buffer, pos + 1);
+        if (virtual_peer_read_pos - pos < VIRTUAL_PEER_HEADER_SIZE + len) break;
+        virtual_handle_peer_packet(virtual_peer_buffer[pos], &virtual_peer_buffer[pos + VIRTUAL_PEER_HEADER_SIZE], len);
+        pos += VIRTUAL_PEER_HEADER_SIZE + len;
+    }
+    memmove(virtual_peer_buffer, &virtual_peer_buffer[pos], virtual_peer_read_pos - pos);
+    virtual_peer_read_pos -= pos;
+
+    virtual_deliver_packets();
+    return 0;
+}
+
+static int virtual_open(void *transport_config){
+    virtual_config = (hci_virtual_config_t*) transport_config;
+    if (!virtual_config) return -1;
+
+    if (pipe(virtual_wakeup_fd)) return -1;
+    fcntl(virtual_wakeup_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(virtual_wakeup_fd[1], F_SETFL, O_NONBLOCK);
+    virtual_wakeup_armed = 0;
+
+    virtual_queue_read_pos  = 0;
+    virtual_queue_write_pos = 0;
+    virtual_peer_read_pos   = 0;
+    virtual_peer_acks_pending = 0;
+    virtual_link_state      = VIRTUAL_LINK_IDLE;
+
+    virtual_wakeup_ds.fd      = virtual_wakeup_fd[0];
+    virtual_wakeup_ds.process = virtual_process_wakeup;
+    run_loop_add_data_source(&virtual_wakeup_ds);
+
+#ifdef SO_NOSIGPIPE
+    int set = 1;
+    setsockopt(virtual_config->peer_fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&set, sizeof(int));
+#endif
+
+    virtual_peer_ds.fd      = virtual_config->peer_fd;
+    virtual_peer_ds.process = virtual_process_peer;
+    run_loop_add_data_source(&virtual_peer_ds);
+    return 0;
+}
+
+static int virtual_close(void *transport_config){
+    run_loop_remove_data_source(&virtual_wakeup_ds);
+    run_loop_remove_data_source(&virtual_peer_ds);
+    close(virtual_wakeup_fd[0]);
+    close(virtual_wakeup_fd[1]);
+    virtual_wakeup_fd[0] = -1;
+    virtual_wakeup_fd[1] = -1;
+    return 0;
+}
+
+static int virtual_send_packet(uint8_t packet_type, uint8_t * packet, int size){
+    if (virtual_wakeup_fd[0] < 0) return -1;
+    hci_dump_packet(packet_type, 0, packet, size);
+
+    // packet is processed right away, report buffer as free before any response
+    uint8_t event[] = { DAEMON_EVENT_HCI_PACKET_SENT, 0};
+    virtual_queue_packet(HCI_EVENT_PACKET, event, sizeof(event));
+
+    switch (packet_type){
+        case HCI_COMMAND_DATA_PACKET:
+            virtual_handle_command(packet, size);
+            break;
+        case HCI_ACL_DATA_PACKET:
+            if (virtual_link_state != VIRTUAL_LINK_OPEN || READ_ACL_CONNECTION_HANDLE(packet) != virtual_link_handle){
+                log_info("virtual: ACL packet for unknown handle 0x%04x", READ_ACL_CONNECTION_HANDLE(packet));
+                return -1;
+            }
+            virtual_peer_send(VIRTUAL_PEER_ACL, packet, size);
+            break;
+        default:
+            log_error("virtual: unsupported packet type %u", packet_type);
+            return -1;
+    }
+    return 0;
+}
+
+// packets are copied, so the transport is always ready
+static int virtual_can_send_packet_now(uint8_t packet_type){
+    return 1;
+}
+
+static void virtual_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    packet_handler = handler;
+}
+
+static const char * virtual_get_transport_name(void){
+    return "VIRTUAL";
+}
+
+static void dummy_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+}
+
+// get virtual singleton
+hci_transport_t * hci_transport_virtual_instance(void) {
+    virtual_transport.open                          = virtual_open;
+    virtual_transport.close                         = virtual_close;
+    virtual_transport.send_packet                   = virtual_send_packet;
+    virtual_transport.register_packet_handler       = virtual_register_packet_handler;
+    virtual_transport.get_transport_name            = virtual_get_transport_name;
+    virtual_transport.set_baudrate                  = NULL;
+    virtual_transport.can_send_packet_now           = virtual_can_send_packet_now;
+    return &virtual_transport;
+}
@@ -0,0 +1,607 @@
+/*
+ * Copyright (C) 2011-2014 by BlueKitchen GmbH
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. This software may not be used in a commercial product
+ *    without an explicit license granted by the copyright holder.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/*
+ *  remote_device_db_fs.c
+ *
+ *  Link key and remote name storage with hash lookup and LRU eviction,
+ *  persisted as append-only log that is compacted when it grows too large.
+ *  Bonded devices and devices with only a name are kept in separate LRU lists
+ *  with their own capacity, so names of discovered devices never evict a link key.
+ *
+ */
+
+#include "btstack-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "remote_device_db.h"
+#include "debug.h"
+
+#include <btstack/utils.h>
+
+#ifndef BTSTACK_STATE_DIR
+#define BTSTACK_STATE_DIR "/var/lib/btstack"
+#endif
+
+#ifndef REMOTE_DEVICE_DB_FS_DIR
+#define REMOTE_DEVICE_DB_FS_DIR BTSTACK_STATE_DIR
+#endif
+
+#define REMOTE_DEVICE_DB_FS_PATH REMOTE_DEVICE_DB_FS_DIR "/btstack_remote_device_db.log"
+
+#ifndef REMOTE_DEVICE_DB_FS_MAX_LINK_KEYS
+#define REMOTE_DEVICE_DB_FS_MAX_LINK_KEYS 256
+#endif
+
+// devices without link key
+#ifndef REMOTE_DEVICE_DB_FS_MAX_NAMES
+#define REMOTE_DEVICE_DB_FS_MAX_NAMES 256
+#endif
+
+// name and service records are flushed but only synced to disk every N records, link keys are synced right away
+#ifndef REMOTE_DEVICE_DB_FS_SYNC_RECORDS
+#define REMOTE_DEVICE_DB_FS_SYNC_RECORDS 16
+#endif
+
+#define REMOTE_DEVICE_DB_FS_MAX_DEVICES  (REMOTE_DEVICE_DB_FS_MAX_LINK_KEYS + REMOTE_DEVICE_DB_FS_MAX_NAMES)
+#define REMOTE_DEVICE_DB_FS_MAX_SERVICES 32
+#define REMOTE_DEVICE_DB_FS_BUCKETS (2 * REMOTE_DEVICE_DB_FS_MAX_DEVICES)
+#define REMOTE_DEVICE_DB_FS_PATH_LEN 200
+
+#define DB_FS_NONE 0xffff
+
+// device flags
+#define DB_FS_FLAG_LINK_KEY 1
+#define DB_FS_FLAG_NAME     2
+
+// LRU lists
+#define DB_FS_LIST_LINK_KEY 0
+#define DB_FS_LIST_NAME     1
+#define DB_FS_NUM_LISTS     2
+
+// log records: type, payload
+#define DB_FS_RECORD_LINK_KEY        1  // bd_addr, link key, link key type
+#define DB_FS_RECORD_DELETE_LINK_KEY 2  // bd_addr
+#define DB_FS_RECORD_NAME            3  // bd_addr, len, name
+#define DB_FS_RECORD_DELETE_NAME     4  // bd_addr
+#define DB_FS_RECORD_SERVICE         5  // channel, len, service name
+
+typedef struct {
+    bd_addr_t       bd_addr;
+    uint8_t         flags;
+    link_key_t      link_key;
+    link_key_type_t link_key_type;
+    char            name[MAX_NAME_LEN + 1];
+    // hash chain or free list
+    uint16_t        hash_next;
+    // most recently used first, in DB_FS_LIST_LINK_KEY if device has a link key
+    uint8_t         lru_list;
+    uint16_t        lru_prev;
+    uint16_t        lru_next;
+} db_fs_device_t;
+
+typedef struct {
+    char    service_name[MAX_NAME_LEN + 1];
+    uint8_t channel;
+} db_fs_service_t;
+
+static db_fs_device_t  db_fs_devices[REMOTE_DEVICE_DB_FS_MAX_DEVICES];
+static uint16_t        db_fs_buckets[REMOTE_DEVICE_DB_FS_BUCKETS];
+static uint16_t        db_fs_free;
+static uint16_t        db_fs_lru_head[DB_FS_NUM_LISTS];
+static uint16_t        db_fs_lru_tail[DB_FS_NUM_LISTS];
+static uint16_t        db_fs_lru_count[DB_FS_NUM_LISTS];
+static const uint16_t  db_fs_lru_max[DB_FS_NUM_LISTS] = { REMOTE_DEVICE_DB_FS_MAX_LINK_KEYS, REMOTE_DEVICE_DB_FS_MAX_NAMES };
+static uint16_t        db_fs_num_devices;
+
+static db_fs_service_t db_fs_services[REMOTE_DEVICE_DB_FS_MAX_SERVICES];
+static int             db_fs_num_services;
+
+static FILE *          db_fs_log;
+static int             db_fs_log_records;
+static int             db_fs_log_unsynced;
+
+// MARK: hash + LRU index
+
+static uint16_t db_fs_hash(bd_addr_t bd_addr){
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    int i;
+    for (i = 0; i < BD_ADDR_LEN; i++){
+        hash = (hash ^ bd_addr[i]) * 16777619u;
+    }
+    return hash % REMOTE_DEVICE_DB_FS_BUCKETS;
+}
+
+static void db_fs_reset(void){
+    int i;
+    for (i = 0; i < REMOTE_DEVICE_DB_FS_BUCKETS; i++){
+        db_fs_buckets[i] = DB_FS_NONE;
+    }
+    for (i = 0; i < REMOTE_DEVICE_DB_FS_MAX_DEVICES; i++){
+        db_fs_devices[i].flags = 0;
+        db_fs_devices[i].hash_next = i + 1 < REMOTE_DEVICE_DB_FS_MAX_DEVICES ? i + 1 : DB_FS_NONE;
+    }
+    db_fs_free = 0;
+    for (i = 0; i < DB_FS_NUM_LISTS; i++){
+        db_fs_lru_head[i] = DB_FS_NONE;
+        db_fs_lru_tail[i] = DB_FS_NONE;
+        db_fs_lru_count[i] = 0;
+    }
+    db_fs_num_devices = 0;
+    db_fs_num_services = 0;
+}
+
+static uint16_t db_fs_find(bd_addr_t bd_addr){
+    uint16_t index = db_fs_buckets[db_fs_hash(bd_addr)];
+    while (index != DB_FS_NONE){
+        if (BD_ADDR_CMP(db_fs_devices[index].bd_addr, bd_addr) == 0) return index;
+        index = db_fs_devices[index].hash_next;
+    }
+    return DB_FS_NONE;
+}
+
+static void db_fs_lru_unlink(uint16_t index){
+    db_fs_device_t * device = &db_fs_devices[index];
+    int list = device->lru_list;
+    if (device->lru_prev == DB_FS_NONE){
+        db_fs_lru_head[list] = device->lru_next;
+    } else {
+        db_fs_devices[device->lru_prev].lru_next = device->lru_next;
+    }
+    if (device->lru_next == DB_FS_NONE){
+        db_fs_lru_tail[list] = device->lru_prev;
+    } else {
+        db_fs_devices[device->lru_next].lru_prev = device->lru_prev;
+    }
+    db_fs_lru_count[list]--;
+}
+
+static void db_fs_lru_add_front(uint16_t index, int list){
+    db_fs_device_t * device = &db_fs_devices[index];
+    device->lru_list = list;
+    device->lru_prev = DB_FS_NONE;
+    device->lru_next = db_fs_lru_head[list];
+    if (db_fs_lru_head[list] == DB_FS_NONE){
+        db_fs_lru_tail[list] = index;
+    } else {
+        db_fs_devices[db_fs_lru_head[list]].lru_prev = index;
+    }
+    db_fs_lru_head[list] = index;
+    db_fs_lru_count[list]++;
+}
+
+static void db_fs_touch(uint16_t index){
+    if (index == db_fs_lru_head[db_fs_devices[index].lru_list]) return;
+    db_fs_lru_unlink(index);
+    db_fs_lru_add_front(index, db_fs_devices[index].lru_list);
+}
+
+static void db_fs_remove(uint16_t index){
+    db_fs_device_t * device = &db_fs_devices[index];
+    uint16_t * link = &db_fs_buckets[db_fs_hash(device->bd_addr)];
+    while (*link != index){
+        link = &db_fs_devices[*link].hash_next;
+    }
+    *link = device->hash_next;
+    db_fs_lru_unlink(index);
+    device->flags = 0;
+    device->hash_next = db_fs_free;
+    db_fs_free = index;
+    db_fs_num_devices--;
+}
+
+static void db_fs_lru_make_room(int list);
+
+// move device to front of list, evicts least recently used device of that list if full
+static void db_fs_lru_move(uint16_t index, int list){
+    db_fs_lru_unlink(index);
+    db_fs_lru_make_room(list);
+    db_fs_lru_add_front(index, list);
+}
+
+static void db_fs_lru_make_room(int list){
+    if (db_fs_lru_count[list] < db_fs_lru_max[list]) return;
+    uint16_t victim = db_fs_lru_tail[list];
+    db_fs_device_t * device = &db_fs_devices[victim];
+    log_info("remote_device_db_fs: full, drop %s from list %u", bd_addr_to_str(device->bd_addr), list);
+    // evicted link key, keep name
+    if (list == DB_FS_LIST_LINK_KEY && (device->flags & DB_FS_FLAG_NAME)){
+        device->flags &= ~DB_FS_FLAG_LINK_KEY;
+        db_fs_lru_move(victim, DB_FS_LIST_NAME);
+        return;
+    }
+    db_fs_remove(victim);
+}
+
+// get entry for device, a new device is added to the given list
+static uint16_t db_fs_get_or_create(bd_addr_t bd_addr, int list){
+    uint16_t index = db_fs_find(bd_addr);
+    if (index != DB_FS_NONE) {
+        db_fs_touch(index);
+        return index;
+    }
+    db_fs_lru_make_room(list);
+    index = db_fs_free;
+    db_fs_device_t * device = &db_fs_devices[index];
+    db_fs_free = device->hash_next;
+    BD_ADDR_COPY(device->bd_addr, bd_addr);
+    device->flags = 0;
+    uint16_t bucket = db_fs_hash(bd_addr);
+    device->hash_next = db_fs_buckets[bucket];
+    db_fs_buckets[bucket] = index;
+    db_fs_lru_add_front(index, list);
+    db_fs_num_devices++;
+    return index;
+}
+
+// MARK: operations shared by API and log replay
+
+// names are truncated to MAX_NAME_LEN
+static void db_fs_copy_name(char * dest, const char * name){
+    size_t len = strnlen(name, MAX_NAME_LEN);
+    memcpy(dest, name, len);
+    dest[len] = 0;
+}
+
+// @returns index of device
+static uint16_t db_fs_apply_link_key(bd_addr_t bd_addr, link_key_t link_key, link_key_type_t link_key_type){
+    uint16_t index = db_fs_get_or_create(bd_addr, DB_FS_LIST_LINK_KEY);
+    db_fs_device_t * device = &db_fs_devices[index];
+    if (device->lru_list != DB_FS_LIST_LINK_KEY){
+        db_fs_lru_move(index, DB_FS_LIST_LINK_KEY);
+    }
+    memcpy(device->link_key, link_key, LINK_KEY_LEN);
+    device->link_key_type = link_key_type;
+    device->flags |= DB_FS_FLAG_LINK_KEY;
+    return index;
+}
+
+// @returns index of device
+static uint16_t db_fs_apply_name(bd_addr_t bd_addr, const char * name){
+    uint16_t index = db_fs_get_or_create(bd_addr, DB_FS_LIST_NAME);
+    db_fs_device_t * device = &db_fs_devices[index];
+    db_fs_copy_name(device->name, name);
+    device->flags |= DB_FS_FLAG_NAME;
+    return index;
+}
+
+static void db_fs_apply_delete(bd_addr_t bd_addr, uint8_t flag){
+    uint16_t index = db_fs_find(bd_addr);
+    if (index == DB_FS_NONE) return;
+    db_fs_devices[index].flags &= ~flag;
+    if (!db_fs_devices[index].flags){
+        db_fs_remove(index);
+        return;
+    }
+    // name only
+    if (flag == DB_FS_FLAG_LINK_KEY){
+        db_fs_lru_move(index, DB_FS_LIST_NAME);
+    }
+}
+
+static void db_fs_apply_service(const char * service_name, uint8_t channel){
+    if (db_fs_num_services >= REMOTE_DEVICE_DB_FS_MAX_SERVICES) return;
+    db_fs_service_t * service = &db_fs_services[db_fs_num_services++];
+    db_fs_copy_name(service->service_name, service_name);
+    service->channel = channel;
+}
+
+// MARK: log file
+
+static void db_fs_write_string(FILE * file, const char * string){
+    uint8_t len = strnlen(string, MAX_NAME_LEN);
+    fputc(len, file);
+    fwrite(string, 1, len, file);
+}
+
+static int db_fs_read_string(FILE * file, char * string){
+    int len = fgetc(file);
+    if (len == EOF || len > MAX_NAME_LEN) return 0;
+    memset(string, 0, MAX_NAME_LEN + 1);
+    return fread(string, 1, len, file) == (size_t) len;
+}
+
+static void db_fs_write_link_key(FILE * file, db_fs_device_t * device){
+    fputc(DB_FS_RECORD_LINK_KEY, file);
+    fwrite(device->bd_addr, 1, BD_ADDR_LEN, file);
+    fwrite(device->link_key, 1, LINK_KEY_LEN, file);
+    fputc(device->link_key_type, file);
+}
+
+static void db_fs_write_name(FILE * file, db_fs_device_t * device){
+    fputc(DB_FS_RECORD_NAME, file);
+    fwrite(device->bd_addr, 1, BD_ADDR_LEN, file);
+    db_fs_write_string(file, device->name);
+}
+
+static void db_fs_write_delete(FILE * file, uint8_t record_type, bd_addr_t bd_addr){
+    fputc(record_type, file);
+    fwrite(bd_addr, 1, BD_ADDR_LEN, file);
+}
+
+static void db_fs_write_service(FILE * file, db_fs_service_t * service){
+    fputc(DB_FS_RECORD_SERVICE, file);
+    fputc(service->channel, file);
+    db_fs_write_string(file, service->service_name);
+}
+
+// @returns 0 if log was complete
+static int db_fs_replay(FILE * file){
+    bd_addr_t bd_addr;
+    link_key_t link_key;
+    char name[MAX_NAME_LEN + 1];
+    int record_type;
+    int channel;
+    while ((record_type = fgetc(file)) != EOF){
+        if (record_type != DB_FS_RECORD_SERVICE){
+            if (fread(bd_addr, 1, BD_ADDR_LEN, file) != BD_ADDR_LEN) return 1;
+        }
+        switch (record_type){
+            case DB_FS_RECORD_LINK_KEY: {
+                if (fread(link_key, 1, LINK_KEY_LEN, file) != LINK_KEY_LEN) return 1;
+                int link_key_type = fgetc(file);
+                if (link_key_type == EOF) return 1;
+                db_fs_apply_link_key(bd_addr, link_key, (link_key_type_t) link_key_type);
+                break;
+            }
+            case DB_FS_RECORD_DELETE_LINK_KEY:
+                db_fs_apply_delete(bd_addr, DB_FS_FLAG_LINK_KEY);
+                break;
+            case DB_FS_RECORD_NAME:
+                if (!db_fs_read_string(file, name)) return 1;
+                db_fs_apply_name(bd_addr, name);
+                break;
+            case DB_FS_RECORD_DELETE_NAME:
+                db_fs_apply_delete(bd_addr, DB_FS_FLAG_NAME);
+                break;
+            case DB_FS_RECORD_SERVICE:
+                channel = fgetc(file);
+                if (channel == EOF) return 1;
+                if (!db_fs_read_string(file, name)) return 1;
+                db_fs_apply_service(name, channel);
+                break;
+            default:
+                return 1;
+        }
+        db_fs_log_records++;
+    }
+    return 0;
+}
+
+static void db_fs_open_log(void){
+    int fd = open(REMOTE_DEVICE_DB_FS_PATH, O_WRONLY | O_APPEND | O_NOFOLLOW);
+    db_fs_log = fd < 0 ? NULL : fdopen(fd, "ab");
+    if (db_fs_log) return;
+    log_error("remote_device_db_fs: cannot open %s", REMOTE_DEVICE_DB_FS_PATH);
+    if (fd >= 0) close(fd);
+}
+
+// write current state to new log, oldest device first to restore LRU order on replay.
+// The log is only ever created here: exclusive, not following symlinks, owner-only.
+static void db_fs_compact(void){
+    char path_tmp[REMOTE_DEVICE_DB_FS_PATH_LEN];
+    snprintf(path_tmp, sizeof(path_tmp), "%s.tmp", REMOTE_DEVICE_DB_FS_PATH);
+    if (db_fs_log) {
+        fclose(db_fs_log);
+        db_fs_log = NULL;
+    }
+    if (mkdir(REMOTE_DEVICE_DB_FS_DIR, 0700) != 0 && errno != EEXIST){
+        log_error("remote_device_db_fs: cannot create %s", REMOTE_DEVICE_DB_FS_DIR);
+        return;
+    }
+    unlink(path_tmp);
+    int fd = open(path_tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    FILE * file = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (!file) {
+        log_error("remote_device_db_fs: cannot create %s", path_tmp);
+        if (fd >= 0) close(fd);
+        return;
+    }
+    db_fs_log_records = 0;
+    db_fs_log_unsynced = 0;
+    int i;
+    for (i = 0; i < DB_FS_NUM_LISTS; i++){
+        uint16_t index;
+        for (index = db_fs_lru_tail[i]; index != DB_FS_NONE; index = db_fs_devices[index].lru_prev){
+            db_fs_device_t * device = &db_fs_devices[index];
+            if (device->flags & DB_FS_FLAG_LINK_KEY){
+                db_fs_write_link_key(file, device);
+                db_fs_log_records++;
+            }
+            if (device->flags & DB_FS_FLAG_NAME){
+                db_fs_write_name(file, device);
+                db_fs_log_records++;
+            }
+        }
+    }
+    for (i = 0; i < db_fs_num_services; i++){
+        db_fs_write_service(file, &db_fs_services[i]);
+        db_fs_log_records++;
+    }
+    // new log has to be on disk before it replaces the old one, and the rename before we append to it
+    int ok = fflush(file) == 0 && fsync(fd) == 0;
+    if (fclose(file) != 0) ok = 0;
+    if (!ok || rename(path_tmp, REMOTE_DEVICE_DB_FS_PATH) != 0){
+        log_error("remote_device_db_fs: cannot write %s", REMOTE_DEVICE_DB_FS_PATH);
+        unlink(path_tmp);
+    }
+    int dir_fd = open(REMOTE_DEVICE_DB_FS_DIR, O_RDONLY);
+    if (dir_fd >= 0){
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    db_fs_open_log();
+}
+
+static void db_fs_log_sync(void){
+    if (!db_fs_log || !db_fs_log_unsynced) return;
+    fsync(fileno(db_fs_log));
+    db_fs_log_unsynced = 0;
+}
+
+// flush record, sync if requested or enough records are pending, and compact if log contains mostly stale records
+static void db_fs_log_written(int sync){
+    if (!db_fs_log) return;
+    fflush(db_fs_log);
+    db_fs_log_unsynced++;
+    if (sync || db_fs_log_unsynced >= REMOTE_DEVICE_DB_FS_SYNC_RECORDS){
+        db_fs_log_sync();
+    }
+    db_fs_log_records++;
+    if (db_fs_log_records < 2 * (db_fs_num_devices + db_fs_num_services) + 64) return;
+    db_fs_compact();
+}
+
+// MARK: remote_device_db_t
+
+static void db_open(void){
+    db_fs_reset();
+    db_fs_log_records = 0;
+    int truncated = 0;
+    int fd = open(REMOTE_DEVICE_DB_FS_PATH, O_RDONLY | O_NOFOLLOW);
+    FILE * file = fd < 0 ? NULL : fdopen(fd, "rb");
+    if (file){
+        truncated = db_fs_replay(file);
+        fclose(file);
+    } else if (fd >= 0){
+        close(fd);
+    }
+    log_info("remote_device_db_fs: %u devices, %u services from %s", db_fs_num_devices, db_fs_num_services, REMOTE_DEVICE_DB_FS_PATH);
+    // missing log is created by compaction
+    if (!file || truncated || db_fs_log_records > 2 * (db_fs_num_devices + db_fs_num_services) + 64){
+        db_fs_compact();
+        return;
+    }
+    db_fs_open_log();
+}
+
+static void db_close(void){
+    if (!db_fs_log) return;
+    db_fs_log_sync();
+    fclose(db_fs_log);
+    db_fs_log = NULL;
+}
+
+static int get_link_key(bd_addr_t *bd_addr, link_key_t *link_key, link_key_type_t * link_key_type) {
+    uint16_t index = db_fs_find(*bd_addr);
+    if (index == DB_FS_NONE) return 0;
+    db_fs_device_t * device = &db_fs_devices[index];
+    if ((device->flags & DB_FS_FLAG_LINK_KEY) == 0) return 0;
+    memcpy(link_key, device->link_key, LINK_KEY_LEN);
+    if (link_key_type) {
+        *link_key_type = device->link_key_type;
+    }
+    db_fs_touch(index);
+    return 1;
+}
+
+static void put_link_key(bd_addr_t *bd_addr, link_key_t *link_key, link_key_type_t link_key_type){
+    uint16_t index = db_fs_apply_link_key(*bd_addr, *link_key, link_key_type);
+    if (!db_fs_log) return;
+    db_fs_write_link_key(db_fs_log, &db_fs_devices[index]);
+    db_fs_log_written(1);
+}
+
+static void delete_link_key(bd_addr_t *bd_addr){
+    if (db_fs_find(*bd_addr) == DB_FS_NONE) return;
+    db_fs_apply_delete(*bd_addr, DB_FS_FLAG_LINK_KEY);
+    if (!db_fs_log) return;
+    db_fs_write_delete(db_fs_log, DB_FS_RECORD_DELETE_LINK_KEY, *bd_addr);
+    db_fs_log_written(1);
+}
+
+static int get_name(bd_addr_t *bd_addr, device_name_t *device_name) {
+    uint16_t index = db_fs_find(*bd_addr);
+    if (index == DB_FS_NONE) return 0;
+    db_fs_device_t * device = &db_fs_devices[index];
+    if ((device->flags & DB_FS_FLAG_NAME) == 0) return 0;
+    db_fs_copy_name((char*)device_name, device->name);
+    db_fs_touch(index);
+    return 1;
+}
+
+static void put_name(bd_addr_t *bd_addr, device_name_t *device_name){
+    uint16_t index = db_fs_apply_name(*bd_addr, (const char *) device_name);
+    if (!db_fs_log) return;
+    db_fs_write_name(db_fs_log, &db_fs_devices[index]);
+    db_fs_log_written(0);
+}
+
+static void delete_name(bd_addr_t *bd_addr){
+    if (db_fs_find(*bd_addr) == DB_FS_NONE) return;
+    db_fs_apply_delete(*bd_addr, DB_FS_FLAG_NAME);
+    if (!db_fs_log) return;
+    db_fs_write_delete(db_fs_log, DB_FS_RECORD_DELETE_NAME, *bd_addr);
+    db_fs_log_written(0);
+}
+
+static uint8_t persistent_rfcomm_channel(char *serviceName){
+    uint8_t max_channel = 1;
+    int i;
+    for (i = 0; i < db_fs_num_services; i++){
+        db_fs_service_t * service = &db_fs_services[i];
+        if (strncmp(service->service_name, serviceName, MAX_NAME_LEN) == 0) {
+            // Match found
+            return service->channel;
+        }
+        if (service->channel >= max_channel) max_channel = service->channel + 1;
+    }
+    
+    // Allocate new persistant channel
+    if (db_fs_num_services >= REMOTE_DEVICE_DB_FS_MAX_SERVICES) return 0;
+    db_fs_apply_service(serviceName, max_channel);
+    if (db_fs_log) {
+        db_fs_write_service(db_fs_log, &db_fs_services[db_fs_num_services-1]);
+        db_fs_log_written(0);
+    }
+    return max_channel;
+}
+
+const remote_device_db_t remote_device_db_fs = {
+    db_open,
+    db_close,
+    get_link_key,
+    put_link_key,
+    delete_link_key,
+    get_name,
+    put_name,
+    delete_name,
+    persistent_rfcomm_channel
+};
@@ -0,0 +1,281 @@
+/*
+ * Copyright (C) 2009-2012 by Matthias Ringwald
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at btstack@ringwald.ch
+ *
+ */
+
+/*
+ *  run_loop_dispatch.c
+ *
+ *  libdispatch based run loop - builds on Darwin and on Linux with libdispatch
+ *
+ *  - all sources target the main queue, so handlers run serialized as with the other run loops
+ *  - timers are kept in a sorted list and served by a single dispatch timer source that is
+ *    re-armed to the earliest timeout, adding or removing a timer does not allocate
+ *  - each data source gets a dispatch read source on a dup of its fd, stored in item.user_data.
+ *    cancel is asynchronous, the cancel handler closes the dup, so the caller can close its fd
+ *    right after removing the data source
+ *  - suspended data sources keep their dispatch source, it is resumed on resume/remove
+ */
+
+#include <btstack/run_loop.h>
+#include <btstack/linked_list.h>
+
+#include "debug.h"
+#include "run_loop_private.h"
+
+#include <dispatch/dispatch.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+
+static int run_loop_dispatch_timer_compare(timer_source_t *a, timer_source_t *b);
+static void run_loop_dispatch_dump_timer(void);
+
+// the run loop
+static linked_list_t data_sources;
+static linked_list_t timers;
+
+// single timer source for all timers
+static dispatch_source_t timer_source;
+static struct timeval    timer_source_timeout;
+static int               timer_source_armed;
+
+// arm timer source for first timer in list
+static void run_loop_dispatch_timer_source_update(void){
+    timer_source_t * ts = (timer_source_t *) timers;
+    if (!ts){
+        if (!timer_source_armed) return;
+        timer_source_armed = 0;
+        dispatch_source_set_timer(timer_source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        return;
+    }
+    if (timer_source_armed
+    && timer_source_timeout.tv_sec  == ts->timeout.tv_sec
+    && timer_source_timeout.tv_usec == ts->timeout.tv_usec) return;
+    
+    timer_source_armed   = 1;
+    timer_source_timeout = ts->timeout;
+    struct timespec when;
+    when.tv_sec  = ts->timeout.tv_sec;
+    when.tv_nsec = ts->timeout.tv_usec * 1000;
+    dispatch_source_set_timer(timer_source, dispatch_walltime(&when, 0), DISPATCH_TIME_FOREVER, 0);
+}
+
+static void run_loop_dispatch_timer_source_handler(void *context){
+    struct timeval current_tv;
+    timer_source_armed = 0;
+    
+    // process timers
+    // pre: 0 <= tv_usec < 1000000
+    while (timers) {
+        gettimeofday(&current_tv, NULL);
+        timer_source_t * ts = (timer_source_t *) timers;
+        if (ts->timeout.tv_sec  > current_tv.tv_sec) break;
+        if (ts->timeout.tv_sec == current_tv.tv_sec && ts->timeout.tv_usec > current_tv.tv_usec) break;
+        
+        // remove timer before processing it to allow handler to re-register with run loop
+        run_loop_remove_timer(ts);
+        ts->process(ts);
+    }
+    run_loop_dispatch_timer_source_update();
+}
+
+static void run_loop_dispatch_data_source_handler(void *context){
+    data_source_t * ds = (data_source_t *) context;
+    ds->process(ds);
+}
+
+static void run_loop_dispatch_data_source_cancel_handler(void *context){
+    close((int) (intptr_t) context);
+}
+
+/**
+ * Add data_source to run_loop
+ */
+static void run_loop_dispatch_add_data_source(data_source_t *ds){
+    int fd = dup(ds->fd);
+    if (fd < 0){
+        log_error("run_loop_dispatch_add_data_source: cannot dup fd %u", ds->fd);
+        return;
+    }
+    dispatch_source_t source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, fd, 0, dispatch_get_main_queue());
+    if (!source){
+        log_error("run_loop_dispatch_add_data_source: cannot create source for fd %u", ds->fd);
+        close(fd);
+        return;
+    }
+    dispatch_set_context(source, ds);
+    dispatch_source_set_event_handler_f(source, &run_loop_dispatch_data_source_handler);
+    dispatch_source_set_cancel_handler_f(source, &run_loop_dispatch_data_source_cancel_handler);
+    ds->item.user_data = source;
+    linked_list_add(&data_sources, (linked_item_t *) ds);
+    dispatch_resume(source);
+}
+
+/**
+ * Remove data_source from run loop
+ */
+static int run_loop_dispatch_remove_data_source(data_source_t *ds){
+    dispatch_source_t source = (dispatch_source_t) ds->item.user_data;
+    // linked_list_remove returns 0 on success, a suspended data source is not in the list
+    int suspended = linked_list_remove(&data_sources, (linked_item_t *) ds) != 0;
+    if (!source) return -1;
+    ds->item.user_data = NULL;
+    // no further event handler calls after cancel, even if already pending on the queue
+    // context is only used by the cancel handler from now on
+    dispatch_source_cancel(source);
+    dispatch_set_context(source, (void *) (intptr_t) dispatch_source_get_handle(source));
+    // cancel handler runs only after resume
+    if (suspended){
+        dispatch_resume(source);
+    }
+    dispatch_release(source);
+    return 0;
+}
+
+/**
+ * Suspend data_source, keep its dispatch source for resume
+ */
+static void run_loop_dispatch_suspend_data_source(data_source_t *ds){
+    if (linked_list_remove(&data_sources, (linked_item_t *) ds) != 0) return;
+    dispatch_suspend((dispatch_source_t) ds->item.user_data);
+}
+
+/**
+ * Resume suspended data_source
+ */
+static void run_loop_dispatch_resume_data_source(data_source_t *ds){
+    if (!ds->item.user_data) return;
+    linked_list_add(&data_sources, (linked_item_t *) ds);
+    dispatch_resume((dispatch_source_t) ds->item.user_data);
+}
+
+/**
+ * Add timer to run_loop (keep list sorted)
+ */
+static void run_loop_dispatch_add_timer(timer_source_t *ts){
+    linked_item_t *it;
+    for (it = (linked_item_t *) &timers; it->next ; it = it->next){
+        if ((timer_source_t *) it->next == ts){
+            log_error( "run_loop_timer_add error: timer to add already in list!");
+            return;
+        }
+        if (run_loop_dispatch_timer_compare( (timer_source_t *) it->next, ts) > 0) {
+            break;
+        }
+    }
+    ts->item.next = it->next;
+    it->next = (linked_item_t *) ts;
+    if ((timer_source_t *) timers == ts){
+        run_loop_dispatch_timer_source_update();
+    }
+}
+
+/**
+ * Remove timer from run loop
+ */
+static int run_loop_dispatch_remove_timer(timer_source_t *ts){
+    int was_first = (timer_source_t *) timers == ts;
+    int removed = linked_list_remove(&timers, (linked_item_t *) ts);
+    if (was_first){
+        run_loop_dispatch_timer_source_update();
+    }
+    return removed;
+}
+
+static void run_loop_dispatch_dump_timer(void){
+    linked_item_t *it;
+    int i = 0;
+    for (it = (linked_item_t *) timers; it ; it = it->next){
+        timer_source_t *ts = (timer_source_t*) it;
+        log_info("timer %u, timeout %u\n", i++, (unsigned int) ts->timeout.tv_sec);
+    }
+}
+
+/**
+ * Execute run_loop
+ */
+static void run_loop_dispatch_execute(void) {
+    // does not return
+    dispatch_main();
+}
+
+// set timer
+static void run_loop_dispatch_set_timer(timer_source_t *a, uint32_t timeout_in_ms){
+    gettimeofday(&a->timeout, NULL);
+    a->timeout.tv_sec  +=  timeout_in_ms / 1000;
+    a->timeout.tv_usec += (timeout_in_ms % 1000) * 1000;
+    if (a->timeout.tv_usec >= 1000000) {
+        a->timeout.tv_usec -= 1000000;
+        a->timeout.tv_sec++;
+    }
+}
+
+// compare timers - NULL is assumed to be before the Big Bang
+// pre: 0 <= tv_usec < 1000000
+static int run_loop_dispatch_timer_compare(timer_source_t *a, timer_source_t *b){
+    if (!a && !b) return 0;
+    if (!a) return -1;
+    if (!b) return 1;
+    if (a->timeout.tv_sec  < b->timeout.tv_sec)  return -1;
+    if (a->timeout.tv_sec  > b->timeout.tv_sec)  return 1;
+    if (a->timeout.tv_usec < b->timeout.tv_usec) return -1;
+    if (a->timeout.tv_usec > b->timeout.tv_usec) return 1;
+    return 0;
+}
+
+static void run_loop_dispatch_init(void){
+    data_sources = NULL;
+    timers = NULL;
+    timer_source_armed = 0;
+    timer_source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+    dispatch_source_set_event_handler_f(timer_source, &run_loop_dispatch_timer_source_handler);
+    dispatch_source_set_timer(timer_source, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    dispatch_resume(timer_source);
+}
+
+run_loop_t run_loop_dispatch = {
+    &run_loop_dispatch_init,
+    &run_loop_dispatch_add_data_source,
+    &run_loop_dispatch_remove_data_source,
+    &run_loop_dispatch_set_timer,
+    &run_loop_dispatch_add_timer,
+    &run_loop_dispatch_remove_timer,
+    &run_loop_dispatch_execute,
+    &run_loop_dispatch_dump_timer,
+    &run_loop_dispatch_suspend_data_source,
+    &run_loop_dispatch_resume_data_source,
+};
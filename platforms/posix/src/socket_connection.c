@@ -133,6 +133,9 @@ void socket_connection_free_connection(connection_t *conn){
     // remove from run_loop 
     run_loop_remove_data_source(&conn->ds);
     
+    // from parked list
+    linked_list_remove(&parked, (linked_item_t *) &conn->ds);
+    
     // and from connection list
     linked_list_remove(&connections, &conn->item);
     
@@ -239,7 +242,7 @@ int socket_connection_hci_process(struct data_source *ds) {
         // "park" if dispatch failed
         if (dispatch_err) {
             log_info("socket_connection_hci_process dispatch failed -> park connection");
-            run_loop_remove_data_source(ds);
+            run_loop_suspend_data_source(ds);
             linked_list_add_tail(&parked, (linked_item_t *) ds);
         }
     }
@@ -265,7 +268,7 @@ void socket_connection_retry_parked(){
         if (!dispatch_err) {
             log_info("socket_connection_hci_process dispatch succeeded -> un-park connection %p", conn);
             it->next = it->next->next;
-            run_loop_add_data_source( (data_source_t *) conn);
+            run_loop_resume_data_source( (data_source_t *) conn);
         } else {
             it = it->next;
         }
@@ -19,6 +19,8 @@
 // 
 #define MAX_SPP_CONNECTIONS 1
 #define MAX_NO_GATT_CLIENTS 0
+#define MAX_NO_GATT_CLIENT_REQUESTS 0
+#define MAX_NO_SM_CONNECTIONS 1
 #define MAX_NO_HCI_CONNECTIONS MAX_SPP_CONNECTIONS
 #define MAX_NO_L2CAP_SERVICES  2
 #define MAX_NO_L2CAP_CHANNELS  (1+MAX_SPP_CONNECTIONS)
@@ -28,6 +30,7 @@
 #define MAX_NO_DB_MEM_DEVICE_LINK_KEYS  2
 #define MAX_NO_DB_MEM_DEVICE_NAMES 0
 #define MAX_NO_DB_MEM_SERVICES 1
+#define MAX_NO_SDP_SERVER_CONNECTIONS 1
 #define MAX_NO_BNEP_SERVICES 0
 #define MAX_NO_BNEP_CHANNELS 0
 
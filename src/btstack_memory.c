@@ -52,11 +52,21 @@
 #include "hci.h"
 #include "l2cap.h"
 #include "rfcomm.h"
+#include "debug.h"
+
+#ifdef BTSTACK_MEMORY_ALIGNMENT
+// blocks are padded to a multiple of BTSTACK_MEMORY_ALIGNMENT and stored back to back starting at an aligned address
+#define BTSTACK_MEMORY_BLOCK_SIZE(type) ((sizeof(type) + BTSTACK_MEMORY_ALIGNMENT - 1) & ~(BTSTACK_MEMORY_ALIGNMENT - 1))
+#define BTSTACK_MEMORY_STORAGE(type, name, count) static uint8_t name[(count) * BTSTACK_MEMORY_BLOCK_SIZE(type)] __attribute__ ((aligned (BTSTACK_MEMORY_ALIGNMENT)))
+#else
+#define BTSTACK_MEMORY_BLOCK_SIZE(type) sizeof(type)
+#define BTSTACK_MEMORY_STORAGE(type, name, count) static type name[count]
+#endif
 
 // MARK: hci_connection_t
 #ifdef MAX_NO_HCI_CONNECTIONS
 #if MAX_NO_HCI_CONNECTIONS > 0
-static hci_connection_t hci_connection_storage[MAX_NO_HCI_CONNECTIONS];
+BTSTACK_MEMORY_STORAGE(hci_connection_t, hci_connection_storage, MAX_NO_HCI_CONNECTIONS);
 static memory_pool_t hci_connection_pool;
 hci_connection_t * btstack_memory_hci_connection_get(void){
     return memory_pool_get(&hci_connection_pool);
@@ -88,7 +98,7 @@ void btstack_memory_hci_connection_free(hci_connection_t *hci_connection){
 // MARK: l2cap_service_t
 #ifdef MAX_NO_L2CAP_SERVICES
 #if MAX_NO_L2CAP_SERVICES > 0
-static l2cap_service_t l2cap_service_storage[MAX_NO_L2CAP_SERVICES];
+BTSTACK_MEMORY_STORAGE(l2cap_service_t, l2cap_service_storage, MAX_NO_L2CAP_SERVICES);
 static memory_pool_t l2cap_service_pool;
 l2cap_service_t * btstack_memory_l2cap_service_get(void){
     return memory_pool_get(&l2cap_service_pool);
@@ -120,7 +130,7 @@ void btstack_memory_l2cap_service_free(l2cap_service_t *l2cap_service){
 // MARK: l2cap_channel_t
 #ifdef MAX_NO_L2CAP_CHANNELS
 #if MAX_NO_L2CAP_CHANNELS > 0
-static l2cap_channel_t l2cap_channel_storage[MAX_NO_L2CAP_CHANNELS];
+BTSTACK_MEMORY_STORAGE(l2cap_channel_t, l2cap_channel_storage, MAX_NO_L2CAP_CHANNELS);
 static memory_pool_t l2cap_channel_pool;
 l2cap_channel_t * btstack_memory_l2cap_channel_get(void){
     return memory_pool_get(&l2cap_channel_pool);
@@ -152,7 +162,7 @@ void btstack_memory_l2cap_channel_free(l2cap_channel_t *l2cap_channel){
 // MARK: rfcomm_multiplexer_t
 #ifdef MAX_NO_RFCOMM_MULTIPLEXERS
 #if MAX_NO_RFCOMM_MULTIPLEXERS > 0
-static rfcomm_multiplexer_t rfcomm_multiplexer_storage[MAX_NO_RFCOMM_MULTIPLEXERS];
+BTSTACK_MEMORY_STORAGE(rfcomm_multiplexer_t, rfcomm_multiplexer_storage, MAX_NO_RFCOMM_MULTIPLEXERS);
 static memory_pool_t rfcomm_multiplexer_pool;
 rfcomm_multiplexer_t * btstack_memory_rfcomm_multiplexer_get(void){
     return memory_pool_get(&rfcomm_multiplexer_pool);
@@ -184,7 +194,7 @@ void btstack_memory_rfcomm_multiplexer_free(rfcomm_multiplexer_t *rfcomm_multipl
 // MARK: rfcomm_service_t
 #ifdef MAX_NO_RFCOMM_SERVICES
 #if MAX_NO_RFCOMM_SERVICES > 0
-static rfcomm_service_t rfcomm_service_storage[MAX_NO_RFCOMM_SERVICES];
+BTSTACK_MEMORY_STORAGE(rfcomm_service_t, rfcomm_service_storage, MAX_NO_RFCOMM_SERVICES);
 static memory_pool_t rfcomm_service_pool;
 rfcomm_service_t * btstack_memory_rfcomm_service_get(void){
     return memory_pool_get(&rfcomm_service_pool);
@@ -216,7 +226,7 @@ void btstack_memory_rfcomm_service_free(rfcomm_service_t *rfcomm_service){
 // MARK: rfcomm_channel_t
 #ifdef MAX_NO_RFCOMM_CHANNELS
 #if MAX_NO_RFCOMM_CHANNELS > 0
-static rfcomm_channel_t rfcomm_channel_storage[MAX_NO_RFCOMM_CHANNELS];
+BTSTACK_MEMORY_STORAGE(rfcomm_channel_t, rfcomm_channel_storage, MAX_NO_RFCOMM_CHANNELS);
 static memory_pool_t rfcomm_channel_pool;
 rfcomm_channel_t * btstack_memory_rfcomm_channel_get(void){
     return memory_pool_get(&rfcomm_channel_pool);
@@ -247,7 +257,7 @@ void btstack_memory_rfcomm_channel_free(rfcomm_channel_t *rfcomm_channel){
 // MARK: bnepservice_t
 #ifdef MAX_NO_BNEP_SERVICES
 #if MAX_NO_BNEP_SERVICES > 0
-static bnep_service_t bnep_service_storage[MAX_NO_BNEP_SERVICES];
+BTSTACK_MEMORY_STORAGE(bnep_service_t, bnep_service_storage, MAX_NO_BNEP_SERVICES);
 static memory_pool_t bnep_service_pool;
 bnep_service_t * btstack_memory_bnep_service_get(void){
     return memory_pool_get(&bnep_service_pool);
@@ -277,7 +287,7 @@ void btstack_memory_bnep_service_free(bnep_service_t *bnep_service){
 // MARK: bnep_channel_t
 #ifdef MAX_NO_BNEP_CHANNELS
 #if MAX_NO_BNEP_CHANNELS > 0
-static bnep_channel_t bnep_channel_storage[MAX_NO_BNEP_CHANNELS];
+BTSTACK_MEMORY_STORAGE(bnep_channel_t, bnep_channel_storage, MAX_NO_BNEP_CHANNELS);
 static memory_pool_t bnep_channel_pool;
 bnep_channel_t * btstack_memory_bnep_channel_get(void){
     return memory_pool_get(&bnep_channel_pool);
@@ -307,7 +317,7 @@ void btstack_memory_bnep_channel_free(bnep_channel_t *bnep_channel){
 // MARK: db_mem_device_name_t
 #ifdef MAX_NO_DB_MEM_DEVICE_NAMES
 #if MAX_NO_DB_MEM_DEVICE_NAMES > 0
-static db_mem_device_name_t db_mem_device_name_storage[MAX_NO_DB_MEM_DEVICE_NAMES];
+BTSTACK_MEMORY_STORAGE(db_mem_device_name_t, db_mem_device_name_storage, MAX_NO_DB_MEM_DEVICE_NAMES);
 static memory_pool_t db_mem_device_name_pool;
 db_mem_device_name_t * btstack_memory_db_mem_device_name_get(void){
     return memory_pool_get(&db_mem_device_name_pool);
@@ -339,7 +349,7 @@ void btstack_memory_db_mem_device_name_free(db_mem_device_name_t *db_mem_device_
 // MARK: db_mem_device_link_key_t
 #ifdef MAX_NO_DB_MEM_DEVICE_LINK_KEYS
 #if MAX_NO_DB_MEM_DEVICE_LINK_KEYS > 0
-static db_mem_device_link_key_t db_mem_device_link_key_storage[MAX_NO_DB_MEM_DEVICE_LINK_KEYS];
+BTSTACK_MEMORY_STORAGE(db_mem_device_link_key_t, db_mem_device_link_key_storage, MAX_NO_DB_MEM_DEVICE_LINK_KEYS);
 static memory_pool_t db_mem_device_link_key_pool;
 db_mem_device_link_key_t * btstack_memory_db_mem_device_link_key_get(void){
     return memory_pool_get(&db_mem_device_link_key_pool);
@@ -371,7 +381,7 @@ void btstack_memory_db_mem_device_link_key_free(db_mem_device_link_key_t *db_mem
 // MARK: db_mem_service_t
 #ifdef MAX_NO_DB_MEM_SERVICES
 #if MAX_NO_DB_MEM_SERVICES > 0
-static db_mem_service_t db_mem_service_storage[MAX_NO_DB_MEM_SERVICES];
+BTSTACK_MEMORY_STORAGE(db_mem_service_t, db_mem_service_storage, MAX_NO_DB_MEM_SERVICES);
 static memory_pool_t db_mem_service_pool;
 db_mem_service_t * btstack_memory_db_mem_service_get(void){
     return memory_pool_get(&db_mem_service_pool);
@@ -399,11 +409,43 @@ void btstack_memory_db_mem_service_free(db_mem_service_t *db_mem_service){
 #error "Neither HAVE_MALLOC nor MAX_NO_DB_MEM_SERVICES for struct db_mem_service is defined. Please, edit the config file."
 #endif
 
+
+// MARK: sdp_server_connection_t
+#ifdef MAX_NO_SDP_SERVER_CONNECTIONS
+#if MAX_NO_SDP_SERVER_CONNECTIONS > 0
+BTSTACK_MEMORY_STORAGE(sdp_server_connection_t, sdp_server_connection_storage, MAX_NO_SDP_SERVER_CONNECTIONS);
+static memory_pool_t sdp_server_connection_pool;
+sdp_server_connection_t * btstack_memory_sdp_server_connection_get(void){
+    return memory_pool_get(&sdp_server_connection_pool);
+}
+void btstack_memory_sdp_server_connection_free(sdp_server_connection_t *sdp_server_connection){
+    memory_pool_free(&sdp_server_connection_pool, sdp_server_connection);
+}
+#else
+sdp_server_connection_t * btstack_memory_sdp_server_connection_get(void){
+    return NULL;
+}
+void btstack_memory_sdp_server_connection_free(sdp_server_connection_t *sdp_server_connection){
+    // silence compiler warning about unused parameter in a portable way
+    (void) sdp_server_connection;
+};
+#endif
+#elif defined(HAVE_MALLOC)
+sdp_server_connection_t * btstack_memory_sdp_server_connection_get(void){
+    return (sdp_server_connection_t*) malloc(sizeof(sdp_server_connection_t));
+}
+void btstack_memory_sdp_server_connection_free(sdp_server_connection_t *sdp_server_connection){
+    free(sdp_server_connection);
+}
+#else
+#error "Neither HAVE_MALLOC nor MAX_NO_SDP_SERVER_CONNECTIONS for struct sdp_server_connection is defined. Please, edit the config file."
+#endif
+
 // MARK: gatt_client_t
 #ifdef HAVE_BLE
 #ifdef MAX_NO_GATT_CLIENTS
 #if MAX_NO_GATT_CLIENTS > 0
-static gatt_client_t gatt_client_storage[MAX_NO_GATT_CLIENTS];
+BTSTACK_MEMORY_STORAGE(gatt_client_t, gatt_client_storage, MAX_NO_GATT_CLIENTS);
 static memory_pool_t gatt_client_pool;
 gatt_client_t * btstack_memory_gatt_client_get(void){
     return memory_pool_get(&gatt_client_pool);
@@ -432,39 +474,173 @@ void btstack_memory_gatt_client_free(gatt_client_t *gatt_client){
 #endif
 #endif
 
+// MARK: gatt_client_request_t
+#ifdef HAVE_BLE
+#ifdef MAX_NO_GATT_CLIENT_REQUESTS
+#if MAX_NO_GATT_CLIENT_REQUESTS > 0
+BTSTACK_MEMORY_STORAGE(gatt_client_request_t, gatt_client_request_storage, MAX_NO_GATT_CLIENT_REQUESTS);
+static memory_pool_t gatt_client_request_pool;
+gatt_client_request_t * btstack_memory_gatt_client_request_get(void){
+    return memory_pool_get(&gatt_client_request_pool);
+}
+void btstack_memory_gatt_client_request_free(gatt_client_request_t *gatt_client_request){
+    memory_pool_free(&gatt_client_request_pool, gatt_client_request);
+}
+#else
+gatt_client_request_t * btstack_memory_gatt_client_request_get(void){
+    return NULL;
+}
+void btstack_memory_gatt_client_request_free(gatt_client_request_t *gatt_client_request){
+    // silence compiler warning about unused parameter in a portable way
+    (void) gatt_client_request;
+};
+#endif
+#elif defined(HAVE_MALLOC)
+gatt_client_request_t * btstack_memory_gatt_client_request_get(void){
+    return (gatt_client_request_t*) malloc(sizeof(gatt_client_request_t));
+}
+void btstack_memory_gatt_client_request_free(gatt_client_request_t *gatt_client_request){
+    free(gatt_client_request);
+}
+#else
+#error "Neither HAVE_MALLOC nor MAX_NO_GATT_CLIENT_REQUESTS for struct gatt_client_request is defined. Please, edit the config file."
+#endif
+#endif
+
+// MARK: sm_connection_t
+#ifdef HAVE_BLE
+#ifdef MAX_NO_SM_CONNECTIONS
+#if MAX_NO_SM_CONNECTIONS > 0
+BTSTACK_MEMORY_STORAGE(sm_connection_t, sm_connection_storage, MAX_NO_SM_CONNECTIONS);
+static memory_pool_t sm_connection_pool;
+sm_connection_t * btstack_memory_sm_connection_get(void){
+    return memory_pool_get(&sm_connection_pool);
+}
+void btstack_memory_sm_connection_free(sm_connection_t *sm_connection){
+    memory_pool_free(&sm_connection_pool, sm_connection);
+}
+#else
+sm_connection_t * btstack_memory_sm_connection_get(void){
+    return NULL;
+}
+void btstack_memory_sm_connection_free(sm_connection_t *sm_connection){
+    // silence compiler warning about unused parameter in a portable way
+    (void) sm_connection;
+};
+#endif
+#elif defined(HAVE_MALLOC)
+sm_connection_t * btstack_memory_sm_connection_get(void){
+    return (sm_connection_t*) malloc(sizeof(sm_connection_t));
+}
+void btstack_memory_sm_connection_free(sm_connection_t *sm_connection){
+    free(sm_connection);
+}
+#else
+#error "Neither HAVE_MALLOC nor MAX_NO_SM_CONNECTIONS for struct sm_connection is defined. Please, edit the config file."
+#endif
+#endif
+
 // init
 void btstack_memory_init(void){
 #if MAX_NO_HCI_CONNECTIONS > 0
-    memory_pool_create(&hci_connection_pool, hci_connection_storage, MAX_NO_HCI_CONNECTIONS, sizeof(hci_connection_t));
+    memory_pool_create(&hci_connection_pool, hci_connection_storage, MAX_NO_HCI_CONNECTIONS, BTSTACK_MEMORY_BLOCK_SIZE(hci_connection_t));
 #endif
 #if MAX_NO_L2CAP_SERVICES > 0
-    memory_pool_create(&l2cap_service_pool, l2cap_service_storage, MAX_NO_L2CAP_SERVICES, sizeof(l2cap_service_t));
+    memory_pool_create(&l2cap_service_pool, l2cap_service_storage, MAX_NO_L2CAP_SERVICES, BTSTACK_MEMORY_BLOCK_SIZE(l2cap_service_t));
 #endif
 #if MAX_NO_L2CAP_CHANNELS > 0
-    memory_pool_create(&l2cap_channel_pool, l2cap_channel_storage, MAX_NO_L2CAP_CHANNELS, sizeof(l2cap_channel_t));
+    memory_pool_create(&l2cap_channel_pool, l2cap_channel_storage, MAX_NO_L2CAP_CHANNELS, BTSTACK_MEMORY_BLOCK_SIZE(l2cap_channel_t));
 #endif
 #if MAX_NO_RFCOMM_MULTIPLEXERS > 0
-    memory_pool_create(&rfcomm_multiplexer_pool, rfcomm_multiplexer_storage, MAX_NO_RFCOMM_MULTIPLEXERS, sizeof(rfcomm_multiplexer_t));
+    memory_pool_create(&rfcomm_multiplexer_pool, rfcomm_multiplexer_storage, MAX_NO_RFCOMM_MULTIPLEXERS, BTSTACK_MEMORY_BLOCK_SIZE(rfcomm_multiplexer_t));
 #endif
 #if MAX_NO_RFCOMM_SERVICES > 0
-    memory_pool_create(&rfcomm_service_pool, rfcomm_service_storage, MAX_NO_RFCOMM_SERVICES, sizeof(rfcomm_service_t));
+    memory_pool_create(&rfcomm_service_pool, rfcomm_service_storage, MAX_NO_RFCOMM_SERVICES, BTSTACK_MEMORY_BLOCK_SIZE(rfcomm_service_t));
 #endif
 #if MAX_NO_RFCOMM_CHANNELS > 0
-    memory_pool_create(&rfcomm_channel_pool, rfcomm_channel_storage, MAX_NO_RFCOMM_CHANNELS, sizeof(rfcomm_channel_t));
+    memory_pool_create(&rfcomm_channel_pool, rfcomm_channel_storage, MAX_NO_RFCOMM_CHANNELS, BTSTACK_MEMORY_BLOCK_SIZE(rfcomm_channel_t));
 #endif
 #if MAX_NO_DB_MEM_DEVICE_NAMES > 0
-    memory_pool_create(&db_mem_device_name_pool, db_mem_device_name_storage, MAX_NO_DB_MEM_DEVICE_NAMES, sizeof(db_mem_device_name_t));
+    memory_pool_create(&db_mem_device_name_pool, db_mem_device_name_storage, MAX_NO_DB_MEM_DEVICE_NAMES, BTSTACK_MEMORY_BLOCK_SIZE(db_mem_device_name_t));
 #endif
 #if MAX_NO_DB_MEM_DEVICE_LINK_KEYS > 0
-    memory_pool_create(&db_mem_device_link_key_pool, db_mem_device_link_key_storage, MAX_NO_DB_MEM_DEVICE_LINK_KEYS, sizeof(db_mem_device_link_key_t));
+    memory_pool_create(&db_mem_device_link_key_pool, db_mem_device_link_key_storage, MAX_NO_DB_MEM_DEVICE_LINK_KEYS, BTSTACK_MEMORY_BLOCK_SIZE(db_mem_device_link_key_t));
 #endif
 #if MAX_NO_DB_MEM_SERVICES > 0
-    memory_pool_create(&db_mem_service_pool, db_mem_service_storage, MAX_NO_DB_MEM_SERVICES, sizeof(db_mem_service_t));
+    memory_pool_create(&db_mem_service_pool, db_mem_service_storage, MAX_NO_DB_MEM_SERVICES, BTSTACK_MEMORY_BLOCK_SIZE(db_mem_service_t));
+#endif
+#if MAX_NO_BNEP_SERVICES > 0
+    memory_pool_create(&bnep_service_pool, bnep_service_storage, MAX_NO_BNEP_SERVICES, BTSTACK_MEMORY_BLOCK_SIZE(bnep_service_t));
+#endif
+#if MAX_NO_BNEP_CHANNELS > 0
+    memory_pool_create(&bnep_channel_pool, bnep_channel_storage, MAX_NO_BNEP_CHANNELS, BTSTACK_MEMORY_BLOCK_SIZE(bnep_channel_t));
+#endif
+#if MAX_NO_SDP_SERVER_CONNECTIONS > 0
+    memory_pool_create(&sdp_server_connection_pool, sdp_server_connection_storage, MAX_NO_SDP_SERVER_CONNECTIONS, BTSTACK_MEMORY_BLOCK_SIZE(sdp_server_connection_t));
 #endif
 #ifdef HAVE_BLE
 #if MAX_NO_GATT_CLIENTS > 0
-    memory_pool_create(&gatt_client_pool, gatt_client_storage, MAX_NO_GATT_CLIENTS, sizeof(gatt_client_t));
+    memory_pool_create(&gatt_client_pool, gatt_client_storage, MAX_NO_GATT_CLIENTS, BTSTACK_MEMORY_BLOCK_SIZE(gatt_client_t));
+#endif
+#if MAX_NO_GATT_CLIENT_REQUESTS > 0
+    memory_pool_create(&gatt_client_request_pool, gatt_client_request_storage, MAX_NO_GATT_CLIENT_REQUESTS, BTSTACK_MEMORY_BLOCK_SIZE(gatt_client_request_t));
+#endif
+#if MAX_NO_SM_CONNECTIONS > 0
+    memory_pool_create(&sm_connection_pool, sm_connection_storage, MAX_NO_SM_CONNECTIONS, BTSTACK_MEMORY_BLOCK_SIZE(sm_connection_t));
 #endif
 #endif
 }
 
+#define BTSTACK_MEMORY_DUMP_POOL(name, count) \
+    log_info("%-24s in use %2u, max %2u of %2u, failed %u", #name, name##_pool.blocks_in_use, name##_pool.max_blocks_in_use, count, name##_pool.failed_allocations)
+
+// log usage of all memory pools, allocations with malloc are not tracked
+void btstack_memory_dump(void){
+#if MAX_NO_HCI_CONNECTIONS > 0
+    BTSTACK_MEMORY_DUMP_POOL(hci_connection, MAX_NO_HCI_CONNECTIONS);
+#endif
+#if MAX_NO_L2CAP_SERVICES > 0
+    BTSTACK_MEMORY_DUMP_POOL(l2cap_service, MAX_NO_L2CAP_SERVICES);
+#endif
+#if MAX_NO_L2CAP_CHANNELS > 0
+    BTSTACK_MEMORY_DUMP_POOL(l2cap_channel, MAX_NO_L2CAP_CHANNELS);
+#endif
+#if MAX_NO_RFCOMM_MULTIPLEXERS > 0
+    BTSTACK_MEMORY_DUMP_POOL(rfcomm_multiplexer, MAX_NO_RFCOMM_MULTIPLEXERS);
+#endif
+#if MAX_NO_RFCOMM_SERVICES > 0
+    BTSTACK_MEMORY_DUMP_POOL(rfcomm_service, MAX_NO_RFCOMM_SERVICES);
+#endif
+#if MAX_NO_RFCOMM_CHANNELS > 0
+    BTSTACK_MEMORY_DUMP_POOL(rfcomm_channel, MAX_NO_RFCOMM_CHANNELS);
+#endif
+#if MAX_NO_DB_MEM_DEVICE_NAMES > 0
+    BTSTACK_MEMORY_DUMP_POOL(db_mem_device_name, MAX_NO_DB_MEM_DEVICE_NAMES);
+#endif
+#if MAX_NO_DB_MEM_DEVICE_LINK_KEYS > 0
+    BTSTACK_MEMORY_DUMP_POOL(db_mem_device_link_key, MAX_NO_DB_MEM_DEVICE_LINK_KEYS);
+#endif
+#if MAX_NO_DB_MEM_SERVICES > 0
+    BTSTACK_MEMORY_DUMP_POOL(db_mem_service, MAX_NO_DB_MEM_SERVICES);
+#endif
+#if MAX_NO_BNEP_SERVICES > 0
+    BTSTACK_MEMORY_DUMP_POOL(bnep_service, MAX_NO_BNEP_SERVICES);
+#endif
+#if MAX_NO_BNEP_CHANNELS > 0
+    BTSTACK_MEMORY_DUMP_POOL(bnep_channel, MAX_NO_BNEP_CHANNELS);
+#endif
+#if MAX_NO_SDP_SERVER_CONNECTIONS > 0
+    BTSTACK_MEMORY_DUMP_POOL(sdp_server_connection, MAX_NO_SDP_SERVER_CONNECTIONS);
+#endif
+#ifdef HAVE_BLE
+#if MAX_NO_GATT_CLIENTS > 0
+    BTSTACK_MEMORY_DUMP_POOL(gatt_client, MAX_NO_GATT_CLIENTS);
+#endif
+#if MAX_NO_GATT_CLIENT_REQUESTS > 0
+    BTSTACK_MEMORY_DUMP_POOL(gatt_client_request, MAX_NO_GATT_CLIENT_REQUESTS);
+#endif
+#if MAX_NO_SM_CONNECTIONS > 0
+    BTSTACK_MEMORY_DUMP_POOL(sm_connection, MAX_NO_SM_CONNECTIONS);
+#endif
+#endif
+}
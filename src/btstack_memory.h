@@ -55,13 +55,19 @@ extern "C" {
 #include "rfcomm.h"
 #include "bnep.h"
 #include "remote_device_db.h"
+#include "sdp.h"
 
 #ifdef HAVE_BLE
 #include "gatt_client.h"
+#include "sm.h"
 #endif
 
 void btstack_memory_init(void);
 
+// log current use, high-water mark and failed allocations of all memory pools
+// types without MAX_NO_* are allocated with malloc if HAVE_MALLOC is set, their use is not tracked and not logged
+void btstack_memory_dump(void);
+
 hci_connection_t * btstack_memory_hci_connection_get(void);
 void   btstack_memory_hci_connection_free(hci_connection_t *hci_connection);
     
@@ -88,10 +94,17 @@ db_mem_device_link_key_t * btstack_memory_db_mem_device_link_key_get(void);
 void   btstack_memory_db_mem_device_link_key_free(db_mem_device_link_key_t *db_mem_device_link_key);
 db_mem_service_t * btstack_memory_db_mem_service_get(void);
 void   btstack_memory_db_mem_service_free(db_mem_service_t *db_mem_service);
+
+sdp_server_connection_t * btstack_memory_sdp_server_connection_get(void);
+void   btstack_memory_sdp_server_connection_free(sdp_server_connection_t *sdp_server_connection);
     
 #ifdef HAVE_BLE
 gatt_client_t * btstack_memory_gatt_client_get(void);
 void   btstack_memory_gatt_client_free(gatt_client_t *gatt_client);
+gatt_client_request_t * btstack_memory_gatt_client_request_get(void);
+void   btstack_memory_gatt_client_request_free(gatt_client_request_t *gatt_client_request);
+sm_connection_t * btstack_memory_sm_connection_get(void);
+void   btstack_memory_sm_connection_free(sm_connection_t *sm_connection);
 #endif
 
 #if defined __cplusplus
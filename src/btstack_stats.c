@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2009-2012 by Matthias Ringwald
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at btstack@ringwald.ch
+ *
+ */
+
+/*
+ *  btstack_stats.c
+ *
+ *  @brief Latency histograms and counters at the layer boundaries
+ */
+
+#include "btstack-config.h"
+
+#include <string.h>
+
+#include <btstack/utils.h>
+#include <btstack/hci_cmds.h>
+
+#include "btstack_stats.h"
+#include "debug.h"
+
+#ifdef HAVE_TIME
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+#ifdef HAVE_TICK
+#include <btstack/run_loop.h>
+#include <btstack/hal_tick.h>
+#endif
+
+typedef struct {
+    uint16_t opcode;    // 0 = unused
+    uint32_t sent_us;
+} btstack_stats_command_t;
+
+static const char * histogram_names[] = {
+    "hci command round trip",
+    "hci acl credit wait",
+    "hci transport send",
+    "l2cap rx",
+    "rfcomm rx",
+    "att rx",
+    "att response",
+};
+
+static const char * counter_names[] = {
+    "hci commands sent",
+    "hci events received",
+    "hci acl packets sent",
+    "hci acl packets received",
+    "hci reserve packet buffer failed",
+    "hci acl buffers full",
+};
+
+static btstack_stats_histogram_t histograms[BTSTACK_STATS_NUM_HISTOGRAMS];
+static uint32_t histogram_start_us[BTSTACK_STATS_NUM_HISTOGRAMS];
+static uint8_t  histogram_running[BTSTACK_STATS_NUM_HISTOGRAMS];
+static uint32_t counters[BTSTACK_STATS_NUM_COUNTERS];
+static btstack_stats_command_t pending_commands[BTSTACK_STATS_MAX_PENDING_COMMANDS];
+static uint32_t rx_us;
+
+void btstack_stats_reset(void){
+    memset(histograms, 0, sizeof(histograms));
+    memset(histogram_running, 0, sizeof(histogram_running));
+    memset(counters, 0, sizeof(counters));
+    memset(pending_commands, 0, sizeof(pending_commands));
+}
+
+uint32_t btstack_stats_time_us(void){
+#if defined(BTSTACK_STATS_TIME_US)
+    return BTSTACK_STATS_TIME_US();
+#elif defined(HAVE_TIME) && defined(CLOCK_MONOTONIC)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#elif defined(HAVE_TIME)
+    // not monotonic, but the only clock available
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (uint32_t) now.tv_sec * 1000000 + now.tv_usec;
+#elif defined(HAVE_TICK)
+    return embedded_get_ticks() * hal_tick_get_tick_period_in_ms() * 1000;
+#else
+    return 0;
+#endif
+}
+
+static int btstack_stats_bucket(uint32_t latency_us){
+    int bucket = 0;
+    while (latency_us > 1 && bucket < BTSTACK_STATS_NUM_BUCKETS - 1){
+        latency_us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void btstack_stats_count(btstack_stats_counter_id_t counter){
+    counters[counter]++;
+}
+
+void btstack_stats_add(btstack_stats_histogram_id_t histogram, uint32_t latency_us){
+    btstack_stats_histogram_t * h = &histograms[histogram];
+    h->count++;
+    h->sum_us += latency_us;
+    if (latency_us > h->max_us){
+        h->max_us = latency_us;
+    }
+    h->buckets[btstack_stats_bucket(latency_us)]++;
+}
+
+void btstack_stats_start(btstack_stats_histogram_id_t histogram){
+    if (histogram_running[histogram]) return;
+    histogram_running[histogram] = 1;
+    histogram_start_us[histogram] = btstack_stats_time_us();
+}
+
+void btstack_stats_stop(btstack_stats_histogram_id_t histogram){
+    if (!histogram_running[histogram]) return;
+    histogram_running[histogram] = 0;
+    btstack_stats_add(histogram, btstack_stats_time_us() - histogram_start_us[histogram]);
+}
+
+void btstack_stats_mark_rx(void){
+    rx_us = btstack_stats_time_us();
+}
+
+void btstack_stats_since_rx(btstack_stats_histogram_id_t histogram){
+    btstack_stats_add(histogram, btstack_stats_time_us() - rx_us);
+}
+
+void btstack_stats_command_sent(uint16_t opcode){
+    int i;
+    for (i = 0; i < BTSTACK_STATS_MAX_PENDING_COMMANDS; i++){
+        if (pending_commands[i].opcode) continue;
+        pending_commands[i].opcode  = opcode;
+        pending_commands[i].sent_us = btstack_stats_time_us();
+        return;
+    }
+    // more commands in flight than tracked, e.g. after a lost Command Complete: start over
+    memset(pending_commands, 0, sizeof(pending_commands));
+    pending_commands[0].opcode  = opcode;
+    pending_commands[0].sent_us = btstack_stats_time_us();
+}
+
+void btstack_stats_command_done(uint16_t opcode){
+    int i;
+    // opcode 0 is a NOP to signal free command slots
+    if (!opcode) return;
+    for (i = 0; i < BTSTACK_STATS_MAX_PENDING_COMMANDS; i++){
+        if (pending_commands[i].opcode != opcode) continue;
+        pending_commands[i].opcode = 0;
+        btstack_stats_add(BTSTACK_STATS_HCI_COMMAND_ROUND_TRIP, btstack_stats_time_us() - pending_commands[i].sent_us);
+        return;
+    }
+}
+
+const btstack_stats_histogram_t * btstack_stats_get_histogram(btstack_stats_histogram_id_t histogram){
+    return &histograms[histogram];
+}
+
+uint32_t btstack_stats_get_counter(btstack_stats_counter_id_t counter){
+    return counters[counter];
+}
+
+int btstack_stats_create_histogram_event(uint8_t * event, btstack_stats_histogram_id_t histogram){
+    btstack_stats_histogram_t * h = &histograms[histogram];
+    int pos = 0;
+    event[pos++] = BTSTACK_EVENT_STATS_HISTOGRAM;
+    event[pos++] = BTSTACK_STATS_HISTOGRAM_EVENT_SIZE - 2;
+    event[pos++] = histogram;
+    bt_store_32(event, pos, h->count);
+    pos += 4;
+    bt_store_32(event, pos, h->sum_us);
+    pos += 4;
+    bt_store_32(event, pos, h->max_us);
+    pos += 4;
+    int i;
+    for (i = 0; i < BTSTACK_STATS_NUM_BUCKETS; i++){
+        bt_store_32(event, pos, h->buckets[i]);
+        pos += 4;
+    }
+    return pos;
+}
+
+int btstack_stats_create_counters_event(uint8_t * event){
+    int pos = 0;
+    event[pos++] = BTSTACK_EVENT_STATS_COUNTERS;
+    event[pos++] = BTSTACK_STATS_COUNTERS_EVENT_SIZE - 2;
+    event[pos++] = BTSTACK_STATS_NUM_COUNTERS;
+    int i;
+    for (i = 0; i < BTSTACK_STATS_NUM_COUNTERS; i++){
+        bt_store_32(event, pos, counters[i]);
+        pos += 4;
+    }
+    return pos;
+}
+
+void btstack_stats_dump(void){
+    int i;
+    for (i = 0; i < BTSTACK_STATS_NUM_HISTOGRAMS; i++){
+        btstack_stats_histogram_t * h = &histograms[i];
+        if (!h->count) continue;
+        log_info("%-24s count %u, avg %u us, max %u us", histogram_names[i], h->count, h->sum_us / h->count, h->max_us);
+        int bucket;
+        for (bucket = 0; bucket < BTSTACK_STATS_NUM_BUCKETS; bucket++){
+            if (!h->buckets[bucket]) continue;
+            if (bucket == BTSTACK_STATS_NUM_BUCKETS - 1){
+                log_info("    >= %7u us: %u", 1 << bucket, h->buckets[bucket]);
+            } else {
+                log_info("    <  %7u us: %u", 2 << bucket, h->buckets[bucket]);
+            }
+        }
+    }
+    for (i = 0; i < BTSTACK_STATS_NUM_COUNTERS; i++){
+        log_info("%-32s %u", counter_names[i], counters[i]);
+    }
+}
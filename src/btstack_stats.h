@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2009-2012 by Matthias Ringwald
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at btstack@ringwald.ch
+ *
+ */
+
+/*
+ *  btstack_stats.h
+ *
+ *  @brief Latency histograms and counters at the layer boundaries
+ *
+ *  Hooks in HCI, L2CAP, RFCOMM, ATT Server and around the HCI transport are
+ *  only compiled with HAVE_STATS. Latencies are collected in microseconds
+ *  into fixed log2 buckets: bucket 0 counts 0-1 us, bucket i counts
+ *  [2^i, 2^(i+1)) us and the last bucket counts everything above.
+ */
+
+#ifndef __BTSTACK_STATS_H
+#define __BTSTACK_STATS_H
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+#define BTSTACK_STATS_NUM_BUCKETS 20
+
+// max number of HCI commands tracked for round trip time
+#ifndef BTSTACK_STATS_MAX_PENDING_COMMANDS
+#define BTSTACK_STATS_MAX_PENDING_COMMANDS 4
+#endif
+
+typedef enum {
+    BTSTACK_STATS_HCI_COMMAND_ROUND_TRIP,   // command sent until Command Complete/Status
+    BTSTACK_STATS_HCI_ACL_CREDIT_WAIT,      // no free controller ACL buffer until next Number Of Completed Packets
+    BTSTACK_STATS_HCI_TRANSPORT_SEND,       // packet passed to transport until transport is done with it
+    BTSTACK_STATS_L2CAP_RX,                 // acl_handler() until delivery to L2CAP channel
+    BTSTACK_STATS_RFCOMM_RX,                // acl_handler() until delivery to RFCOMM channel
+    BTSTACK_STATS_ATT_RX,                   // acl_handler() until ATT Server received request
+    BTSTACK_STATS_ATT_RESPONSE,             // ATT request received until response sent
+    BTSTACK_STATS_NUM_HISTOGRAMS
+} btstack_stats_histogram_id_t;
+
+typedef enum {
+    BTSTACK_STATS_HCI_COMMANDS_SENT,
+    BTSTACK_STATS_HCI_EVENTS_RECEIVED,
+    BTSTACK_STATS_HCI_ACL_PACKETS_SENT,
+    BTSTACK_STATS_HCI_ACL_PACKETS_RECEIVED,
+    BTSTACK_STATS_HCI_RESERVE_PACKET_BUFFER_FAILED,
+    BTSTACK_STATS_HCI_ACL_BUFFERS_FULL,
+    BTSTACK_STATS_NUM_COUNTERS
+} btstack_stats_counter_id_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t sum_us;    // wraps after ~71 minutes of total latency
+    uint32_t max_us;
+    uint32_t buckets[BTSTACK_STATS_NUM_BUCKETS];
+} btstack_stats_histogram_t;
+
+// BTSTACK_EVENT_STATS_HISTOGRAM: event(8), len(8), histogram id(8), count(32), sum_us(32), max_us(32), buckets(32 each)
+#define BTSTACK_STATS_HISTOGRAM_EVENT_SIZE (2 + 1 + 12 + 4 * BTSTACK_STATS_NUM_BUCKETS)
+
+// BTSTACK_EVENT_STATS_COUNTERS: event(8), len(8), num counters(8), counters(32 each)
+#define BTSTACK_STATS_COUNTERS_EVENT_SIZE  (2 + 1 + 4 * BTSTACK_STATS_NUM_COUNTERS)
+
+/**
+ * @brief clear all histograms and counters
+ */
+void btstack_stats_reset(void);
+
+/**
+ * @brief monotonic time in microseconds, wraps after ~71 minutes
+ * @note define BTSTACK_STATS_TIME_US() in btstack-config.h to use a platform timer
+ */
+uint32_t btstack_stats_time_us(void);
+
+void btstack_stats_count(btstack_stats_counter_id_t counter);
+void btstack_stats_add(btstack_stats_histogram_id_t histogram, uint32_t latency_us);
+
+/**
+ * @brief start measuring. Ignored if a measurement for this histogram is already running
+ */
+void btstack_stats_start(btstack_stats_histogram_id_t histogram);
+
+/**
+ * @brief stop measuring and add elapsed time. Ignored if no measurement is running
+ */
+void btstack_stats_stop(btstack_stats_histogram_id_t histogram);
+
+/**
+ * @brief remember arrival of an incoming packet for the rx histograms
+ */
+void btstack_stats_mark_rx(void);
+void btstack_stats_since_rx(btstack_stats_histogram_id_t histogram);
+
+/**
+ * @brief track HCI command round trip by opcode
+ */
+void btstack_stats_command_sent(uint16_t opcode);
+void btstack_stats_command_done(uint16_t opcode);
+
+const btstack_stats_histogram_t * btstack_stats_get_histogram(btstack_stats_histogram_id_t histogram);
+uint32_t btstack_stats_get_counter(btstack_stats_counter_id_t counter);
+
+/**
+ * @brief create BTSTACK_EVENT_STATS_HISTOGRAM / BTSTACK_EVENT_STATS_COUNTERS
+ * @param event buffer of BTSTACK_STATS_HISTOGRAM_EVENT_SIZE / BTSTACK_STATS_COUNTERS_EVENT_SIZE
+ * @returns event size
+ */
+int btstack_stats_create_histogram_event(uint8_t * event, btstack_stats_histogram_id_t histogram);
+int btstack_stats_create_counters_event(uint8_t * event);
+
+/**
+ * @brief log all non-empty histograms and all counters, e.g. from embedded builds
+ */
+void btstack_stats_dump(void);
+
+// hooks used by the stack
+#ifdef HAVE_STATS
+#define STATS_COUNT(counter)        btstack_stats_count(counter)
+#define STATS_START(histogram)      btstack_stats_start(histogram)
+#define STATS_STOP(histogram)       btstack_stats_stop(histogram)
+#define STATS_MARK_RX()             btstack_stats_mark_rx()
+#define STATS_SINCE_RX(histogram)   btstack_stats_since_rx(histogram)
+#define STATS_COMMAND_SENT(opcode)  btstack_stats_command_sent(opcode)
+#define STATS_COMMAND_DONE(opcode)  btstack_stats_command_done(opcode)
+#else
+#define STATS_COUNT(counter)
+#define STATS_START(histogram)
+#define STATS_STOP(histogram)
+#define STATS_MARK_RX()
+#define STATS_SINCE_RX(histogram)
+#define STATS_COMMAND_SENT(opcode)
+#define STATS_COMMAND_DONE(opcode)
+#endif
+
+#if defined __cplusplus
+}
+#endif
+
+#endif // __BTSTACK_STATS_H
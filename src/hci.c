@@ -58,6 +58,7 @@
 #include "btstack_memory.h"
 #include "debug.h"
 #include "hci_dump.h"
+#include "btstack_stats.h"
 
 #include <btstack/linked_list.h>
 #include <btstack/hci_cmds.h>
@@ -87,6 +88,24 @@ static hci_stack_t * hci_stack = NULL;
 // test helper
 static uint8_t disable_l2cap_timeouts = 0;
 
+static hci_acl_flow_t * hci_acl_flow_for_connection(hci_connection_t * connection){
+    if (hci_is_le_connection(connection)) return &hci_stack->acl_flow_le;
+    return &hci_stack->acl_flow_classic;
+}
+
+// update number of outgoing packets for connection and global counters
+static void hci_connection_set_num_acl_packets_sent(hci_connection_t * connection, uint8_t num_packets){
+    hci_acl_flow_t * flow = hci_acl_flow_for_connection(connection);
+    if (!connection->num_acl_packets_sent && num_packets){
+        flow->num_links_sending++;
+    }
+    if (connection->num_acl_packets_sent && !num_packets){
+        flow->num_links_sending--;
+    }
+    flow->num_packets_sent = flow->num_packets_sent - connection->num_acl_packets_sent + num_packets;
+    connection->num_acl_packets_sent = num_packets;
+}
+
 /**
  * create connection for given address
  *
@@ -111,9 +130,24 @@ static hci_connection_t * create_connection_for_bd_addr_and_type(bd_addr_t addr,
     conn->num_acl_packets_sent = 0;
     conn->le_con_parameter_update_state = CON_PARAMETER_UPDATE_NONE;
     linked_list_add(&hci_stack->connections, (linked_item_t *) conn);
+    hci_acl_flow_for_connection(conn)->num_links++;
     return conn;
 }
 
+// remove connection from list, packets in flight are flushed by the controller
+static void hci_connection_free(hci_connection_t * conn){
+    hci_connection_set_num_acl_packets_sent(conn, 0);
+    hci_acl_flow_for_connection(conn)->num_links--;
+    // connection might have been cached under its previous con_handle, too
+    int i;
+    for (i=0;i<HCI_CONNECTION_HANDLE_CACHE_SIZE;i++){
+        if (hci_stack->connection_for_handle_cache[i] != conn) continue;
+        hci_stack->connection_for_handle_cache[i] = NULL;
+    }
+    linked_list_remove(&hci_stack->connections, (linked_item_t *) conn);
+    btstack_memory_hci_connection_free( conn );
+}
+
 
 /**
  * get le connection parameter range
@@ -154,11 +188,16 @@ void hci_connections_get_iterator(linked_list_iterator_t *it){
  * @return connection OR NULL, if not found
  */
 hci_connection_t * hci_connection_for_handle(hci_con_handle_t con_handle){
+    // direct-mapped cache, entries are verified as con_handle is only assigned on connection complete
+    int slot = con_handle % HCI_CONNECTION_HANDLE_CACHE_SIZE;
+    hci_connection_t * cached = hci_stack->connection_for_handle_cache[slot];
+    if (cached && cached->con_handle == con_handle) return cached;
     linked_list_iterator_t it;
     linked_list_iterator_init(&it, &hci_stack->connections);
     while (linked_list_iterator_has_next(&it)){
         hci_connection_t * item = (hci_connection_t *) linked_list_iterator_next(&it);
         if ( item->con_handle == con_handle ) {
+            hci_stack->connection_for_handle_cache[slot] = item;
             return item;
         }
     } 
@@ -281,63 +320,48 @@ uint8_t hci_number_outgoing_packets(hci_con_handle_t handle){
 }
 
 uint8_t hci_number_free_acl_slots_for_handle(hci_con_handle_t con_handle){
-    
-    int num_packets_sent_classic = 0;
-    int num_packets_sent_le = 0;
-
-    bd_addr_type_t address_type = BD_ADDR_TYPE_UNKNOWN;
-
-    linked_item_t *it;
-    for (it = (linked_item_t *) hci_stack->connections; it ; it = it->next){
-        hci_connection_t * connection = (hci_connection_t *) it;
-        if (connection->address_type == BD_ADDR_TYPE_CLASSIC){
-            num_packets_sent_classic += connection->num_acl_packets_sent;
-        } else {
-            num_packets_sent_le += connection->num_acl_packets_sent;
-        }
-        if (connection->con_handle == con_handle){
-            address_type = connection->address_type;
-        }
-    }
-
-    int free_slots_classic = hci_stack->acl_packets_total_num - num_packets_sent_classic;
-    int free_slots_le = 0;
-
-    if (free_slots_classic < 0){
-        log_error("hci_number_free_acl_slots: outgoing classic packets (%u) > total classic packets (%u)", num_packets_sent_classic, hci_stack->acl_packets_total_num);
+    hci_connection_t * connection = hci_connection_for_handle(con_handle);
+    if (!connection){
+        log_error("hci_number_free_acl_slots: handle 0x%04x not in connection list", con_handle);
         return 0;
     }
+    return hci_number_free_acl_slots_for_connection(connection);
+}
 
-    if (hci_stack->le_acl_packets_total_num){
-        // if we have LE slots, they are used
-        free_slots_le = hci_stack->le_acl_packets_total_num - num_packets_sent_le;
-        if (free_slots_le < 0){
-            log_error("hci_number_free_acl_slots: outgoing le packets (%u) > total le packets (%u)", num_packets_sent_le, hci_stack->le_acl_packets_total_num);
-            return 0;
-        }
+uint8_t hci_number_free_acl_slots_for_connection(hci_connection_t * connection){
+    int total_packets;
+    int num_packets_sent;
+    int num_links_idle;
+    if (hci_stack->le_acl_packets_total_num == 0){
+        // no LE slots, classic slots are used for LE, too
+        total_packets    = hci_stack->acl_packets_total_num;
+        num_packets_sent = hci_stack->acl_flow_classic.num_packets_sent + hci_stack->acl_flow_le.num_packets_sent;
+        num_links_idle   = hci_stack->acl_flow_classic.num_links - hci_stack->acl_flow_classic.num_links_sending
+                         + hci_stack->acl_flow_le.num_links - hci_stack->acl_flow_le.num_links_sending;
     } else {
-        // otherwise, classic slots are used for LE, too
-        free_slots_classic -= num_packets_sent_le;
-        if (free_slots_classic < 0){
-            log_error("hci_number_free_acl_slots: outgoing classic + le packets (%u + %u) > total packets (%u)", num_packets_sent_classic, num_packets_sent_le, hci_stack->acl_packets_total_num);
-            return 0;
-        }
+        hci_acl_flow_t * flow = hci_acl_flow_for_connection(connection);
+        total_packets    = hci_is_le_connection(connection) ? hci_stack->le_acl_packets_total_num : hci_stack->acl_packets_total_num;
+        num_packets_sent = flow->num_packets_sent;
+        num_links_idle   = flow->num_links - flow->num_links_sending;
     }
 
-    switch (address_type){
-        case BD_ADDR_TYPE_UNKNOWN:
-            log_error("hci_number_free_acl_slots: handle 0x%04x not in connection list", con_handle);
-            return 0;
-
-        case BD_ADDR_TYPE_CLASSIC:
-            return free_slots_classic;
+    int free_slots = total_packets - num_packets_sent;
+    if (free_slots < 0){
+        log_error("hci_number_free_acl_slots: outgoing packets (%u) > total packets (%u)", num_packets_sent, total_packets);
+        return 0;
+    }
 
-        default:
-           if (hci_stack->le_acl_packets_total_num){
-               return free_slots_le;
-           }
-           return free_slots_classic; 
+#ifdef HAVE_ACL_FAIR_SHARE
+    // a link with packets in flight has to leave one slot for each idle link sharing the same buffers
+    if (connection->num_acl_packets_sent){
+        free_slots -= num_links_idle;
+        if (free_slots < 0) return 0;
     }
+#else
+    (void) num_links_idle;
+#endif
+
+    return free_slots;
 }
 
 
@@ -391,7 +415,10 @@ int hci_can_send_prepared_acl_packet_now(hci_con_handle_t con_handle) {
             return 0;
         }
     }
-    return hci_number_free_acl_slots_for_handle(con_handle) > 0;
+    if (hci_number_free_acl_slots_for_handle(con_handle) > 0) return 1;
+    // wait for Number Of Completed Packets
+    STATS_START(BTSTACK_STATS_HCI_ACL_CREDIT_WAIT);
+    return 0;
 }
 
 int hci_can_send_acl_packet_now(hci_con_handle_t con_handle){
@@ -408,6 +435,7 @@ int hci_is_packet_buffer_reserved(void){
 int hci_reserve_packet_buffer(void){
     if (hci_stack->hci_packet_buffer_reserved) {
         log_error("hci_reserve_packet_buffer called but buffer already reserved");
+        STATS_COUNT(BTSTACK_STATS_HCI_RESERVE_PACKET_BUFFER_FAILED);
         return 0;
     }
     hci_stack->hci_packet_buffer_reserved = 1;
@@ -466,13 +494,18 @@ static int hci_send_acl_packet_fragments(hci_connection_t *connection){
         bt_store_16(hci_stack->hci_packet_buffer, acl_header_pos + 2, current_acl_data_packet_length);
 
         // count packet
-        connection->num_acl_packets_sent++;
+        hci_connection_set_num_acl_packets_sent(connection, connection->num_acl_packets_sent + 1);
 
         // send packet
         uint8_t * packet = &hci_stack->hci_packet_buffer[acl_header_pos];
         const int size = current_acl_data_packet_length + 4;
         // hexdump(packet, size);
+        STATS_COUNT(BTSTACK_STATS_HCI_ACL_PACKETS_SENT);
+        STATS_START(BTSTACK_STATS_HCI_TRANSPORT_SEND);
         err = hci_stack->hci_transport->send_packet(HCI_ACL_DATA_PACKET, packet, size);
+        if (hci_transport_synchronous()){
+            STATS_STOP(BTSTACK_STATS_HCI_TRANSPORT_SEND);
+        }
 
         // done yet?
         if (!more_fragments) break;
@@ -512,6 +545,7 @@ int hci_send_acl_packet_buffer(int size){
     // check for free places on Bluetooth module
     if (!hci_can_send_prepared_acl_packet_now(con_handle)) {
         log_error("hci_send_acl_packet_buffer called but no free ACL buffers on controller");
+        STATS_COUNT(BTSTACK_STATS_HCI_ACL_BUFFERS_FULL);
         hci_release_packet_buffer();
         return BTSTACK_ACL_BUFFERS_FULL;
     }
@@ -537,6 +571,9 @@ static void acl_handler(uint8_t *packet, int size){
 
     // log_info("acl_handler: size %u", size);
 
+    STATS_MARK_RX();
+    STATS_COUNT(BTSTACK_STATS_HCI_ACL_PACKETS_RECEIVED);
+
     // get info
     hci_con_handle_t con_handle = READ_ACL_CONNECTION_HANDLE(packet);
     hci_connection_t *conn      = hci_connection_for_handle(con_handle);
@@ -568,6 +605,12 @@ static void acl_handler(uint8_t *packet, int size){
                 log_error( "ACL Cont Fragment but no first fragment for handle 0x%02x", con_handle);
                 return;
             }
+            if (conn->acl_recombination_pos + acl_length > sizeof(conn->acl_recombination_buffer)){
+                log_error( "ACL Cont Fragment exceeds recombination buffer for handle 0x%02x => dropping packet", con_handle);
+                conn->acl_recombination_length = 0;
+                conn->acl_recombination_pos = 0;
+                return;
+            }
             
             // append fragment payload (header already stored)
             memcpy(&conn->acl_recombination_buffer[conn->acl_recombination_pos], &packet[4], acl_length );
@@ -606,6 +649,13 @@ static void acl_handler(uint8_t *packet, int size){
                 hci_stack->packet_handler(HCI_ACL_DATA_PACKET, packet, acl_length + 4);
             
             } else {
+                if (l2cap_length + 4 + 4 > (int) sizeof(conn->acl_recombination_buffer)){
+                    log_error( "ACL First Fragment: L2CAP packet of size %u too large for handle 0x%02x => dropping packet", l2cap_length, con_handle);
+                    // continuation fragments of this packet are dropped, too
+                    conn->acl_recombination_length = 0;
+                    conn->acl_recombination_pos = 0;
+                    return;
+                }
                 // store first fragment and tweak acl length for complete package
                 memcpy(conn->acl_recombination_buffer, packet, acl_length + 4);
                 conn->acl_recombination_pos    = acl_length + 4;
@@ -629,8 +679,7 @@ static void hci_shutdown_connection(hci_connection_t *conn){
 
     run_loop_remove_timer(&conn->timeout);
     
-    linked_list_remove(&hci_stack->connections, (linked_item_t *) conn);
-    btstack_memory_hci_connection_free( conn );
+    hci_connection_free(conn);
     
     // now it's gone
     hci_emit_nr_connections_changed();
@@ -736,7 +785,6 @@ void le_handle_advertisement_report(uint8_t *packet, int size){
     offset += 1;
 
     int i;
-    log_info("HCI: handle adv report with num reports: %d", num_reports);
     for (i=0; i<num_reports;i++){
         uint8_t data_length = packet[offset + 8];
         uint8_t event_size = 10 + data_length;
@@ -752,14 +800,42 @@ void le_handle_advertisement_report(uint8_t *packet, int size){
         memcpy(&event[pos], &packet[offset], data_length);
         pos += data_length;
         offset += data_length + 1; // rssi
+        if (hci_stack->le_advertising_report_filter && !(*hci_stack->le_advertising_report_filter)(event, sizeof(event))) continue;
         hci_dump_packet( HCI_EVENT_PACKET, 0, event, sizeof(event));
         hci_stack->packet_handler(HCI_EVENT_PACKET, event, sizeof(event));
     }
 }
 #endif
 
+static void hci_init_script_cmd_completed(uint16_t opcode){
+    int i;
+    for (i = 0; i < hci_stack->init_script_cmds_in_flight; i++){
+        if (hci_stack->init_script_opcodes[i] != opcode) continue;
+        hci_stack->init_script_cmds_in_flight--;
+        hci_stack->init_script_opcodes[i] = hci_stack->init_script_opcodes[hci_stack->init_script_cmds_in_flight];
+        return;
+    }
+    log_info("Command complete for opcode %04x not sent by init script", opcode);
+}
+
 static void hci_initializing_event_handler(uint8_t * packet, uint16_t size){
     uint8_t command_completed = 0;
+
+    // init script commands are pipelined, retire them by opcode
+    if ((hci_stack->substate >> 1) == 3 && hci_stack->init_script_cmds_in_flight){
+        uint16_t opcode = 0;
+        if (packet[0] == HCI_EVENT_COMMAND_COMPLETE){
+            opcode = READ_BT_16(packet, 3);
+        }
+        if (packet[0] == HCI_EVENT_COMMAND_STATUS && packet[2]){
+            opcode = READ_BT_16(packet, 4);
+            log_error("Command status error 0x%02x for init script opcode %04x", packet[2], opcode);
+        }
+        // opcode 0x0000 only reports free command credits
+        if (opcode) hci_init_script_cmd_completed(opcode);
+        return;
+    }
+
     if ((hci_stack->substate % 2) == 0) return;
     // odd: waiting for event
     if (packet[0] == HCI_EVENT_COMMAND_COMPLETE){
@@ -805,8 +881,13 @@ static void hci_initializing_state_machine(){
         case 0: // RESET
             hci_state_reset();
         
+            hci_stack->init_script_cmds_in_flight = 0;
+            hci_stack->init_script_done = 0;
+
             hci_send_cmd(&hci_reset);
-            if (hci_stack->config == NULL || ((hci_uart_config_t *)hci_stack->config)->baudrate_main == 0){
+            // only UART transports with a chipset baudrate command provide a hci_uart_config_t
+            if (hci_stack->control == NULL || hci_stack->control->baudrate_cmd == NULL
+            ||  hci_stack->config == NULL || ((hci_uart_config_t *)hci_stack->config)->baudrate_main == 0){
                 // skip baud change
                 hci_stack->substate = 4; // >> 1 = 2
             }
@@ -823,20 +904,27 @@ static void hci_initializing_state_machine(){
             // break missing here for fall through
             
         case 3:
-            log_info("Custom init");
-            // Custom initialization
-            if (hci_stack->control && hci_stack->control->next_cmd){
-                int valid_cmd = (*hci_stack->control->next_cmd)(hci_stack->config, hci_stack->hci_packet_buffer);
-                if (valid_cmd){
+            // Custom initialization at main baud rate, send script commands as long as
+            // the controller grants command credits. substate stays even until script is done
+            if (hci_stack->control && hci_stack->control->next_cmd && !hci_stack->init_script_done){
+                while (hci_stack->init_script_cmds_in_flight < HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT && hci_can_send_command_packet_now()){
+                    int valid_cmd = (*hci_stack->control->next_cmd)(hci_stack->config, hci_stack->hci_packet_buffer);
+                    if (!valid_cmd){
+                        log_info("hci_run: init script done");
+                        hci_stack->init_script_done = 1;
+                        break;
+                    }
                     int size = 3 + hci_stack->hci_packet_buffer[2];
+                    hci_reserve_packet_buffer();
                     hci_stack->last_cmd_opcode = READ_BT_16(hci_stack->hci_packet_buffer, 0);
-                    hci_stack->hci_transport->send_packet(HCI_COMMAND_DATA_PACKET, hci_stack->hci_packet_buffer, size);
-                    hci_stack->substate = 4; // more init commands
-                    break;
+                    hci_stack->init_script_opcodes[hci_stack->init_script_cmds_in_flight++] = hci_stack->last_cmd_opcode;
+                    hci_send_cmd_packet(hci_stack->hci_packet_buffer, size);
                 }
-                log_info("hci_run: init script done");
+                if (!hci_stack->init_script_done) return;
             }
-            // otherwise continue
+            // wait for outstanding script commands
+            if (hci_stack->init_script_cmds_in_flight) return;
+            if (!hci_can_send_command_packet_now()) return;
             hci_send_cmd(&hci_read_bd_addr);
             break;
         case 4:
@@ -931,6 +1019,48 @@ static void hci_initializing_state_machine(){
     hci_stack->substate++;
 }
 
+// drop sent commands, owners are notified with NULL event. queued commands are sent when working again
+static void hci_cmd_requests_drop_sent(void){
+    while (hci_stack->cmd_requests_sent){
+        hci_cmd_request_t * request = (hci_cmd_request_t *) hci_stack->cmd_requests_sent;
+        linked_list_remove(&hci_stack->cmd_requests_sent, (linked_item_t *) request);
+        if (request->callback){
+            (*request->callback)(request, NULL, 0);
+        }
+    }
+}
+
+static void hci_cmd_request_complete(uint16_t opcode, uint8_t * packet, uint16_t size){
+    linked_item_t * it;
+    for (it = (linked_item_t *) hci_stack->cmd_requests_sent; it ; it = it->next){
+        hci_cmd_request_t * request = (hci_cmd_request_t *) it;
+        if (request->opcode != opcode) continue;
+        linked_list_remove(&hci_stack->cmd_requests_sent, it);
+        if (request->callback){
+            (*request->callback)(request, packet, size);
+        }
+        return;
+    }
+}
+
+static void hci_cmd_request_send_next(void){
+    hci_cmd_request_t * request = (hci_cmd_request_t *) hci_stack->cmd_requests;
+    linked_list_remove(&hci_stack->cmd_requests, (linked_item_t *) request);
+    // completions arrive in order, keep sent list in send order
+    linked_list_add_tail(&hci_stack->cmd_requests_sent, (linked_item_t *) request);
+    hci_reserve_packet_buffer();
+    memcpy(hci_stack->hci_packet_buffer, request->packet, request->size);
+    hci_stack->last_cmd_opcode = request->opcode;
+    int err = hci_send_cmd_packet(hci_stack->hci_packet_buffer, request->size);
+    if (!err) return;
+    // not sent, no Command Complete/Status will follow
+    log_info("hci_cmd_request_send_next: opcode %04x not sent, err %d", request->opcode, err);
+    linked_list_remove(&hci_stack->cmd_requests_sent, (linked_item_t *) request);
+    if (request->callback){
+        (*request->callback)(request, NULL, 0);
+    }
+}
+
 // avoid huge local variables
 #ifndef EMBEDDED
 static device_name_t device_name;
@@ -945,6 +1075,8 @@ static void event_handler(uint8_t *packet, int size){
         return;
     }
 
+    STATS_COUNT(BTSTACK_STATS_HCI_EVENTS_RECEIVED);
+
     bd_addr_t addr;
     bd_addr_type_t addr_type;
     uint8_t link_type;
@@ -960,6 +1092,7 @@ static void event_handler(uint8_t *packet, int size){
             // get num cmd packets
             // log_info("HCI_EVENT_COMMAND_COMPLETE cmds old %u - new %u", hci_stack->num_cmd_packets, packet[2]);
             hci_stack->num_cmd_packets = packet[2];
+            STATS_COMMAND_DONE(READ_BT_16(packet, 3));
 
             if (COMMAND_COMPLETE_EVENT(packet, hci_read_buffer_size)){
                 // from offset 5
@@ -1020,6 +1153,7 @@ static void event_handler(uint8_t *packet, int size){
             // get num cmd packets
             // log_info("HCI_EVENT_COMMAND_STATUS cmds - old %u - new %u", hci_stack->num_cmd_packets, packet[3]);
             hci_stack->num_cmd_packets = packet[3];
+            STATS_COMMAND_DONE(READ_BT_16(packet, 4));
             break;
             
         case HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS:{
@@ -1037,13 +1171,14 @@ static void event_handler(uint8_t *packet, int size){
                 }
                 
                 if (conn->num_acl_packets_sent >= num_packets){
-                    conn->num_acl_packets_sent -= num_packets;
+                    hci_connection_set_num_acl_packets_sent(conn, conn->num_acl_packets_sent - num_packets);
                 } else {
                     log_error("hci_number_completed_packets, more slots freed then sent.");
-                    conn->num_acl_packets_sent = 0;
+                    hci_connection_set_num_acl_packets_sent(conn, 0);
                 }
                 // log_info("hci_number_completed_packet %u processed for handle %u, outstanding %u", num_packets, handle, conn->num_acl_packets_sent);
             }
+            STATS_STOP(BTSTACK_STATS_HCI_ACL_CREDIT_WAIT);
             break;
         }
         case HCI_EVENT_CONNECTION_REQUEST:
@@ -1097,8 +1232,7 @@ static void event_handler(uint8_t *packet, int size){
                     memcpy(&bd_address, conn->address, 6);
 
                     // connection failed, remove entry
-                    linked_list_remove(&hci_stack->connections, (linked_item_t *) conn);
-                    btstack_memory_hci_connection_free( conn );
+                    hci_connection_free(conn);
                     
                     // notify client if dedicated bonding
                     if (notify_dedicated_bonding_failed){
@@ -1275,6 +1409,7 @@ static void event_handler(uint8_t *packet, int size){
         case DAEMON_EVENT_HCI_PACKET_SENT:
             // free packet buffer for asynchronous transport
             if (hci_transport_synchronous()) break;
+            STATS_STOP(BTSTACK_STATS_HCI_TRANSPORT_SEND);
             hci_stack->hci_packet_buffer_reserved = 0;
             break;
 
@@ -1296,8 +1431,7 @@ static void event_handler(uint8_t *packet, int size){
                     if (packet[3]){
                         if (conn){
                             // outgoing connection failed, remove entry
-                            linked_list_remove(&hci_stack->connections, (linked_item_t *) conn);
-                            btstack_memory_hci_connection_free( conn );
+                            hci_connection_free(conn);
                         }
                         // if authentication error, also delete link key
                         if (packet[3] == 0x05) {
@@ -1350,6 +1484,14 @@ static void event_handler(uint8_t *packet, int size){
         hci_stack->substate++;
     }
     
+    // complete queued command
+    if (packet[0] == HCI_EVENT_COMMAND_COMPLETE){
+        hci_cmd_request_complete(READ_BT_16(packet, 3), packet, size);
+    }
+    if (packet[0] == HCI_EVENT_COMMAND_STATUS){
+        hci_cmd_request_complete(READ_BT_16(packet, 4), packet, size);
+    }
+
     // notify upper stack
     hci_stack->packet_handler(HCI_EVENT_PACKET, packet, size);
 	
@@ -1375,6 +1517,9 @@ static void event_handler(uint8_t *packet, int size){
 }
 
 static void packet_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+    if (hci_stack->batch_active){
+        hci_stack->batch_packets++;
+    }
     switch (packet_type) {
         case HCI_EVENT_PACKET:
             event_handler(packet, size);
@@ -1387,6 +1532,29 @@ static void packet_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
     }
 }
 
+void hci_batch_begin(void){
+    hci_stack->batch_active = 1;
+}
+
+void hci_batch_end(void){
+    if (!hci_stack->batch_active) return;
+    hci_stack->batch_active = 0;
+    if (hci_stack->batch_run_pending){
+        hci_stack->batch_run_pending = 0;
+        hci_run();
+    }
+    if (!hci_stack->batch_packets) return;
+    hci_stack->batch_packets = 0;
+    // let upper layers run once
+    uint8_t event[] = { DAEMON_EVENT_HCI_BATCH_COMPLETE, 0};
+    hci_stack->packet_handler(HCI_EVENT_PACKET, event, sizeof(event));
+}
+
+int hci_batch_active(void){
+    if (!hci_stack) return 0;
+    return hci_stack->batch_active;
+}
+
 /** Register HCI packet handlers */
 void hci_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
     hci_stack->packet_handler = handler;
@@ -1395,6 +1563,12 @@ void hci_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *p
 static void hci_state_reset(){
     // no connections yet
     hci_stack->connections = NULL;
+    memset(hci_stack->connection_for_handle_cache, 0, sizeof(hci_stack->connection_for_handle_cache));
+
+    // commands sent before reset won't complete
+    hci_cmd_requests_drop_sent();
+    memset(&hci_stack->acl_flow_classic, 0, sizeof(hci_acl_flow_t));
+    memset(&hci_stack->acl_flow_le, 0, sizeof(hci_acl_flow_t));
 
     // keep discoverable/connectable as this has been requested by the client(s)
     // hci_stack->discoverable = 0;
@@ -1776,8 +1950,20 @@ void hci_run(){
     hci_connection_t * connection;
     linked_item_t * it;
     
+    // run once at the end of the batch
+    if (hci_stack->batch_active){
+        hci_stack->batch_run_pending = 1;
+        return;
+    }
+
     if (!hci_can_send_command_packet_now()) return;
 
+    // queued commands, send as many as the controller accepts
+    while (hci_stack->state == HCI_STATE_WORKING && hci_stack->cmd_requests){
+        hci_cmd_request_send_next();
+        if (!hci_can_send_command_packet_now()) return;
+    }
+
     // global/non-connection oriented commands
     
     // decline incoming connections
@@ -1990,6 +2176,10 @@ void hci_run(){
     switch (hci_stack->state){
         case HCI_STATE_INITIALIZING:
             hci_initializing_state_machine();
+            // send commands queued during initialization
+            if (hci_stack->state == HCI_STATE_WORKING && hci_stack->cmd_requests){
+                hci_run();
+            }
             break;
             
         case HCI_STATE_HALTING:
@@ -2084,6 +2274,14 @@ void hci_run(){
     }
 }
 
+// command handled without sending it to the controller
+static int hci_send_cmd_packet_skipped(uint8_t * packet, int err){
+    if (packet == hci_stack->hci_packet_buffer){
+        hci_stack->hci_packet_buffer_reserved = 0;
+    }
+    return err;
+}
+
 int hci_send_cmd_packet(uint8_t *packet, int size){
     bd_addr_t addr;
     hci_connection_t * conn;
@@ -2100,7 +2298,7 @@ int hci_send_cmd_packet(uint8_t *packet, int size){
             if (!conn){
                 // notify client that alloc failed
                 hci_emit_connection_complete(conn, BTSTACK_MEMORY_ALLOC_FAILED);
-                return 0; // don't sent packet to controller
+                return hci_send_cmd_packet_skipped(packet, BTSTACK_MEMORY_ALLOC_FAILED); // don't sent packet to controller
             }
             conn->state = SEND_CREATE_CONNECTION;
         }
@@ -2110,13 +2308,13 @@ int hci_send_cmd_packet(uint8_t *packet, int size){
             case OPEN:
                 // and OPEN, emit connection complete command, don't send to controller
                 hci_emit_connection_complete(conn, 0);
-                return 0;
+                return hci_send_cmd_packet_skipped(packet, BTSTACK_BUSY);
             case SEND_CREATE_CONNECTION:
                 // connection created by hci, e.g. dedicated bonding
                 break;
             default:
                 // otherwise, just ignore as it is already in the open process
-                return 0;
+                return hci_send_cmd_packet_skipped(packet, BTSTACK_BUSY);
         }
         conn->state = SENT_CREATE_CONNECTION;
     }
@@ -2165,7 +2363,13 @@ int hci_send_cmd_packet(uint8_t *packet, int size){
 #endif
 
     hci_stack->num_cmd_packets--;
+    STATS_COUNT(BTSTACK_STATS_HCI_COMMANDS_SENT);
+    STATS_COMMAND_SENT(READ_BT_16(packet, 0));
+    STATS_START(BTSTACK_STATS_HCI_TRANSPORT_SEND);
     int err = hci_stack->hci_transport->send_packet(HCI_COMMAND_DATA_PACKET, packet, size);
+    if (hci_transport_synchronous()){
+        STATS_STOP(BTSTACK_STATS_HCI_TRANSPORT_SEND);
+    }
 
     // free packet buffer for synchronous transport implementations    
     if (hci_transport_synchronous() && (packet == hci_stack->hci_packet_buffer)){
@@ -2232,6 +2436,47 @@ int hci_send_cmd(const hci_cmd_t *cmd, ...){
     return hci_send_cmd_packet(packet, size);
 }
 
+static int hci_cmd_request_active(hci_cmd_request_t * request){
+    linked_item_t * it;
+    for (it = (linked_item_t *) hci_stack->cmd_requests; it ; it = it->next){
+        if (it == (linked_item_t *) request) return 1;
+    }
+    for (it = (linked_item_t *) hci_stack->cmd_requests_sent; it ; it = it->next){
+        if (it == (linked_item_t *) request) return 1;
+    }
+    return 0;
+}
+
+static int hci_queue_request(hci_cmd_request_t * request, void (*callback)(hci_cmd_request_t * request, uint8_t * event, uint16_t size)){
+    request->callback = callback;
+    request->opcode = READ_BT_16(request->packet, 0);
+    linked_list_add_tail(&hci_stack->cmd_requests, (linked_item_t *) request);
+    hci_run();
+    return 0;
+}
+
+int hci_queue_cmd(hci_cmd_request_t * request, void (*callback)(hci_cmd_request_t * request, uint8_t * event, uint16_t size), const hci_cmd_t *cmd, ...){
+    if (hci_cmd_request_active(request)) return BTSTACK_BUSY;
+    va_list argptr;
+    va_start(argptr, cmd);
+    request->size = hci_create_cmd_internal(request->packet, cmd, argptr);
+    va_end(argptr);
+    return hci_queue_request(request, callback);
+}
+
+int hci_queue_cmd_packet(hci_cmd_request_t * request, void (*callback)(hci_cmd_request_t * request, uint8_t * event, uint16_t size), uint8_t *packet, uint16_t size){
+    if (size < HCI_CMD_HEADER_SIZE || size > HCI_CMD_BUFFER_SIZE) return BTSTACK_MEMORY_ALLOC_FAILED;
+    if (hci_cmd_request_active(request)) return BTSTACK_BUSY;
+    memcpy(request->packet, packet, size);
+    request->size = size;
+    return hci_queue_request(request, callback);
+}
+
+void hci_cancel_cmd(hci_cmd_request_t * request){
+    linked_list_remove(&hci_stack->cmd_requests, (linked_item_t *) request);
+    linked_list_remove(&hci_stack->cmd_requests_sent, (linked_item_t *) request);
+}
+
 // Create various non-HCI events. 
 // TODO: generalize, use table similar to hci_create_command
 
@@ -2544,6 +2789,10 @@ void le_central_set_scan_parameters(uint8_t scan_type, uint16_t scan_interval, u
     hci_run();
 }
 
+void le_central_set_advertising_report_filter(int (*filter)(uint8_t * event, uint16_t size)){
+    hci_stack->le_advertising_report_filter = filter;
+}
+
 le_command_status_t le_central_connect(bd_addr_t * addr, bd_addr_type_t addr_type){
     hci_connection_t * conn = hci_connection_for_bd_addr_and_type(addr, addr_type);
     if (!conn){
@@ -2598,8 +2847,7 @@ le_command_status_t le_central_connect_cancel(){
         case SEND_CREATE_CONNECTION:
             // skip sending create connection and emit event instead
             hci_emit_le_connection_complete(conn, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
-            linked_list_remove(&hci_stack->connections, (linked_item_t *) conn);
-            btstack_memory_hci_connection_free( conn );
+            hci_connection_free(conn);
             break;            
         case SENT_CREATE_CONNECTION:
             // request to send cancel connection
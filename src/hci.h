@@ -106,6 +106,16 @@ extern "C" {
         #define HCI_PACKET_BUFFER_SIZE HCI_CMD_BUFFER_SIZE
     #endif
 #endif
+
+// number of slots in the con_handle -> connection lookup cache
+#ifndef HCI_CONNECTION_HANDLE_CACHE_SIZE
+    #define HCI_CONNECTION_HANDLE_CACHE_SIZE 8
+#endif
+
+// max number of init script commands sent without Command Complete
+#ifndef HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT
+    #define HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT 4
+#endif
     
 // OGFs
 #define OGF_LINK_CONTROL          0x01
@@ -142,6 +152,9 @@ extern "C" {
 // set global Bluetooth state
 #define BTSTACK_SET_BLUETOOTH_ENABLED                      0x08
 
+// get latency histograms and counters: @param reset after read
+#define BTSTACK_GET_STATS                                  0x09
+
 // create l2cap channel: @param bd_addr(48), psm (16)
 #define L2CAP_CREATE_CHANNEL                               0x20
 
@@ -196,6 +209,9 @@ extern "C" {
 #define GAP_LE_CONNECT              0x62
 #define GAP_LE_CONNECT_CANCEL       0x63
 #define GAP_LE_SET_SCAN_PARAMETERS  0x64
+#define GAP_LE_SET_SCAN_FILTER      0x65
+#define GAP_LE_SCAN_FILTER_ADD_UUID16 0x66
+#define GAP_LE_SCAN_FILTER_CLEAR    0x67
 
 // GATT (Client) 0x70
 #define GATT_DISCOVER_ALL_PRIMARY_SERVICES                       0x70
@@ -235,6 +251,9 @@ extern "C" {
 // data: event(8)
 #define DAEMON_EVENT_HCI_PACKET_SENT                       0x54
 
+// data: event(8)
+#define DAEMON_EVENT_HCI_BATCH_COMPLETE                    0x55
+
 /**
  * LE connection parameter update state
  */ 
@@ -320,6 +339,20 @@ typedef enum {
     LE_STOP_SCAN,
 } le_scanning_state_t;
 
+// queued HCI command, owned by caller until callback was called
+typedef struct hci_cmd_request {
+    // linked list - assert: first field
+    linked_item_t item;
+
+    // called with Command Complete or Command Status event, event is NULL if the command
+    // could not be sent or HCI was reset meanwhile
+    void (*callback)(struct hci_cmd_request * request, uint8_t * event, uint16_t size);
+
+    uint16_t opcode;
+    uint16_t size;
+    uint8_t  packet[HCI_CMD_BUFFER_SIZE];
+} hci_cmd_request_t;
+
 
 typedef struct {
     // linked list - assert: first field
@@ -377,6 +410,15 @@ typedef struct {
 } hci_connection_t;
 
 
+/**
+ * ACL flow control bookkeeping for classic or LE connections
+ */
+typedef struct {
+    uint16_t num_packets_sent;  // ACL packets sent to controller, not completed yet
+    uint8_t  num_links;         // connections of this type
+    uint8_t  num_links_sending; // connections with ACL packets in flight
+} hci_acl_flow_t;
+
 /**
  * main data structure
  */
@@ -399,6 +441,7 @@ typedef struct {
     
     // list of existing baseband connections
     linked_list_t     connections;
+    hci_connection_t * connection_for_handle_cache[HCI_CONNECTION_HANDLE_CACHE_SIZE];
 
     // single buffer for HCI packet assembly
     uint8_t   hci_packet_buffer[HCI_PACKET_BUFFER_SIZE]; // opcode (16), len(8)
@@ -414,6 +457,10 @@ typedef struct {
     uint8_t  le_acl_packets_total_num;
     uint16_t le_data_packets_length;
 
+    // ACL packets in flight, updated on send and on Number Of Completed Packets
+    hci_acl_flow_t acl_flow_classic;
+    hci_acl_flow_t acl_flow_le;
+
     /* local supported features */
     uint8_t local_supported_features[8];
 
@@ -433,6 +480,15 @@ typedef struct {
     
     uint16_t  last_cmd_opcode;
 
+    // queued commands and commands waiting for Command Complete/Status
+    linked_list_t cmd_requests;
+    linked_list_t cmd_requests_sent;
+
+    // init script upload: opcodes sent but not completed, next_cmd returned 0
+    uint16_t  init_script_opcodes[HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT];
+    uint8_t   init_script_cmds_in_flight;
+    uint8_t   init_script_done;
+
     uint8_t   discoverable;
     uint8_t   connectable;
     uint8_t   bondable;
@@ -454,7 +510,15 @@ typedef struct {
     uint16_t le_scan_interval;  
     uint16_t le_scan_window;
 
+    // drops advertising reports before they are emitted, NULL to emit all
+    int (*le_advertising_report_filter)(uint8_t * event, uint16_t size);
+
     le_connection_parameter_range_t le_connection_parameter_range;
+
+    // packets received by transport in one wakeup, see hci_batch_begin
+    uint8_t   batch_active;
+    uint8_t   batch_run_pending;
+    uint16_t  batch_packets;
 } hci_stack_t;
 
 /**
@@ -473,6 +537,7 @@ le_command_status_t le_central_connect(bd_addr_t * addr, bd_addr_type_t addr_typ
 le_command_status_t le_central_connect_cancel(void);
 le_command_status_t gap_disconnect(hci_con_handle_t handle);
 void le_central_set_scan_parameters(uint8_t scan_type, uint16_t scan_interval, uint16_t scan_window);
+void le_central_set_advertising_report_filter(int (*filter)(uint8_t * event, uint16_t size));
 
 // *************** le client end
     
@@ -488,7 +553,15 @@ void hci_close(void);
  */
 void hci_run(void);
 
-// send complete CMD packet
+// Called by transports around delivery of all packets received in one wakeup. While a batch is active, the run
+// passes of HCI and the upper layers are skipped. hci_batch_end runs HCI once and emits DAEMON_EVENT_HCI_BATCH_COMPLETE
+// so that L2CAP and the protocols above run their state machines and hand out credits once per batch.
+// L2CAP passes the event once to its packet handler, ATT, SM and each distinct channel packet handler.
+void hci_batch_begin(void);
+void hci_batch_end(void);
+int  hci_batch_active(void);
+
+// send complete CMD packet. @returns 0 if passed to the transport, packet buffer is released if not
 int hci_send_cmd_packet(uint8_t *packet, int size);
 
 // send ACL packet prepared in hci packet buffer
@@ -523,6 +596,7 @@ hci_connection_t * hci_connection_for_bd_addr_and_type(bd_addr_t *addr, bd_addr_
 int hci_is_le_connection(hci_connection_t * connection);
 uint8_t  hci_number_outgoing_packets(hci_con_handle_t handle);
 uint8_t  hci_number_free_acl_slots_for_handle(hci_con_handle_t con_handle);
+uint8_t  hci_number_free_acl_slots_for_connection(hci_connection_t * connection);
 int      hci_authentication_active_for_handle(hci_con_handle_t handle);
 uint16_t hci_max_acl_data_packet_length(void);
 uint16_t hci_max_acl_le_data_packet_length(void);
@@ -582,6 +656,15 @@ void hci_discoverable_control(uint8_t enable);
 // is occupied. 
 int hci_send_cmd(const hci_cmd_t *cmd, ...);
 
+// Queue HCI command, it is sent as soon as the controller accepts commands.
+// The callback receives the matching Command Complete or Command Status event.
+// @returns 0 if ok
+int hci_queue_cmd(hci_cmd_request_t * request, void (*callback)(hci_cmd_request_t * request, uint8_t * event, uint16_t size), const hci_cmd_t *cmd, ...);
+int hci_queue_cmd_packet(hci_cmd_request_t * request, void (*callback)(hci_cmd_request_t * request, uint8_t * event, uint16_t size), uint8_t *packet, uint16_t size);
+
+// Removes queued or sent command without calling its callback
+void hci_cancel_cmd(hci_cmd_request_t * request);
+
 // Deletes link key for remote device with baseband address.
 void hci_drop_link_key_for_bd_addr(bd_addr_t *addr);
 
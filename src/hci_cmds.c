@@ -672,6 +672,14 @@ const hci_cmd_t btstack_set_bluetooth_enabled = {
 OPCODE(OGF_BTSTACK, BTSTACK_SET_BLUETOOTH_ENABLED), "1"
 };
 
+/**
+ * @param reset
+ */
+const hci_cmd_t btstack_get_stats = {
+OPCODE(OGF_BTSTACK, BTSTACK_GET_STATS), "1"
+// reset: 0 = keep, 1 = clear after read
+};
+
 const hci_cmd_t l2cap_create_channel = {
 OPCODE(OGF_BTSTACK, L2CAP_CREATE_CHANNEL), "B2"
 // @param bd_addr(48), psm (16)
@@ -807,6 +815,29 @@ const hci_cmd_t gap_le_connect_cancel_cmd = {
 OPCODE(OGF_BTSTACK, GAP_LE_CONNECT_CANCEL), ""
 };
 
+/**
+ * @note filters advertising reports sent to this client only. Dropped by
+ *       gap_le_scan_filter_clear and when the client disconnects
+ * @param min_report_interval_ms
+ * @param rssi_delta
+ */
+const hci_cmd_t gap_le_set_scan_filter = {
+OPCODE(OGF_BTSTACK, GAP_LE_SET_SCAN_FILTER), "21"
+};
+
+/**
+ * @param uuid16
+ */
+const hci_cmd_t gap_le_scan_filter_add_uuid16 = {
+OPCODE(OGF_BTSTACK, GAP_LE_SCAN_FILTER_ADD_UUID16), "2"
+};
+
+/**
+ */
+const hci_cmd_t gap_le_scan_filter_clear = {
+OPCODE(OGF_BTSTACK, GAP_LE_SCAN_FILTER_CLEAR), ""
+};
+
 /**
  * @param handle
  */
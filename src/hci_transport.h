@@ -47,6 +47,7 @@
 
 #include <stdint.h>
 #include <btstack/run_loop.h>
+#include <btstack/utils.h>
 
 #if defined __cplusplus
 extern "C" {
@@ -72,6 +73,11 @@ typedef struct {
     int   flowcontrol; // 
 } hci_uart_config_t;
 
+typedef struct {
+    int        peer_fd; // socket connected to peer virtual controller
+    bd_addr_t  bd_addr; // address reported by virtual controller
+} hci_virtual_config_t;
+
 
 // inline various hci_transport_X.h files
 extern hci_transport_t * hci_transport_h4_instance(void);
@@ -79,6 +85,7 @@ extern hci_transport_t * hci_transport_h4_dma_instance(void);
 extern hci_transport_t * hci_transport_h4_iphone_instance(void);
 extern hci_transport_t * hci_transport_h5_instance(void);
 extern hci_transport_t * hci_transport_usb_instance(void);
+extern hci_transport_t * hci_transport_virtual_instance(void);
 
 // support for "enforece wake device" in h4 - used by iOS power management
 extern void hci_transport_h4_iphone_set_enforce_wake_device(char *path);
@@ -47,6 +47,7 @@
 #include "hci_dump.h"
 #include "debug.h"
 #include "btstack_memory.h"
+#include "btstack_stats.h"
 
 #include <stdarg.h>
 #include <string.h>
@@ -59,6 +60,17 @@
 // used to cache l2cap rejects, echo, and informational requests
 #define NR_PENDING_SIGNALING_RESPONSES 3
 
+// size of local cid -> channel index, channels that don't fit are found by list scan
+#ifndef L2CAP_LOCAL_CID_TABLE_SIZE
+#if defined(MAX_NO_L2CAP_CHANNELS) && (MAX_NO_L2CAP_CHANNELS > 0)
+#define L2CAP_LOCAL_CID_TABLE_SIZE MAX_NO_L2CAP_CHANNELS
+#else
+#define L2CAP_LOCAL_CID_TABLE_SIZE 16
+#endif
+#endif
+
+#define L2CAP_LOCAL_CID_FIRST_DYNAMIC 0x40
+
 // offsets for L2CAP SIGNALING COMMANDS
 #define L2CAP_SIGNALING_COMMAND_CODE_OFFSET   0
 #define L2CAP_SIGNALING_COMMAND_SIGID_OFFSET  1
@@ -73,7 +85,13 @@ static l2cap_signaling_response_t signaling_responses[NR_PENDING_SIGNALING_RESPO
 static int signaling_responses_pending;
 
 static linked_list_t l2cap_channels;
+static linked_list_t l2cap_channels_pending;
+static l2cap_channel_t * l2cap_local_cid_table[L2CAP_LOCAL_CID_TABLE_SIZE];
+static int l2cap_channels_not_indexed;
 static linked_list_t l2cap_services;
+#ifdef HAVE_L2CAP_LE_COC
+static linked_list_t l2cap_le_services;
+#endif
 static void (*packet_handler) (void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size) = null_packet_handler;
 static int new_credits_blocked = 0;
 
@@ -88,6 +106,19 @@ static void l2cap_emit_channel_opened(l2cap_channel_t *channel, uint8_t status);
 static void l2cap_emit_channel_closed(l2cap_channel_t *channel);
 static void l2cap_emit_connection_request(l2cap_channel_t *channel);
 static int l2cap_channel_ready_for_open(l2cap_channel_t *channel);
+static void l2cap_handle_channel_open(l2cap_channel_t *channel);
+void l2cap_run(void);
+#ifdef HAVE_L2CAP_ERTM
+static int  l2cap_ertm_has_pending_work(l2cap_channel_t * channel);
+static int  l2cap_ertm_can_send_sdu(l2cap_channel_t * channel);
+static int  l2cap_ertm_send_sdu(l2cap_channel_t * channel, uint8_t * data, uint16_t len);
+#endif
+#ifdef HAVE_L2CAP_LE_COC
+static int  l2cap_le_has_pending_work(l2cap_channel_t * channel);
+static void l2cap_le_run_channel(l2cap_channel_t * channel);
+static void l2cap_le_signaling_handler(hci_con_handle_t handle, uint8_t * command);
+static void l2cap_le_handle_pdu(l2cap_channel_t * channel, uint8_t * pdu, uint16_t len);
+#endif
 
 
 void l2cap_init(){
@@ -95,7 +126,13 @@ void l2cap_init(){
     signaling_responses_pending = 0;
     
     l2cap_channels = NULL;
+    l2cap_channels_pending = NULL;
+    memset(l2cap_local_cid_table, 0, sizeof(l2cap_local_cid_table));
+    l2cap_channels_not_indexed = 0;
     l2cap_services = NULL;
+#ifdef HAVE_L2CAP_LE_COC
+    l2cap_le_services = NULL;
+#endif
 
     packet_handler = null_packet_handler;
     attribute_protocol_packet_handler = NULL;
@@ -120,6 +157,9 @@ void l2cap_register_packet_handler(void (*handler)(void * connection, uint8_t pa
 
 //  notify client/protocol handler
 void l2cap_dispatch(l2cap_channel_t *channel, uint8_t type, uint8_t * data, uint16_t size){
+    if (type == L2CAP_DATA_PACKET){
+        STATS_SINCE_RX(BTSTACK_STATS_L2CAP_RX);
+    }
     if (channel->packet_handler) {
         (* (channel->packet_handler))(type, channel->local_cid, data, size);
     } else {
@@ -215,20 +255,104 @@ void l2cap_block_new_credits(uint8_t blocked){
 void l2cap_hand_out_credits(void){
 
     if (new_credits_blocked) return;    // we're told not to. used by daemon
+    if (hci_batch_active()) return;     // hand out once at the end of the HCI batch
 
+    // only channels on the pending list can be waiting for credits
     linked_list_iterator_t it;    
-    linked_list_iterator_init(&it, &l2cap_channels);
+    linked_list_iterator_init(&it, &l2cap_channels_pending);
     while (linked_list_iterator_has_next(&it)){
-        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
-        if (!hci_number_free_acl_slots_for_handle(channel->handle)) return;
+        l2cap_channel_t * channel = (l2cap_channel_t *) linked_item_get_user(linked_list_iterator_next(&it));
         if (channel->state != L2CAP_STATE_OPEN) continue;
-        if (hci_number_outgoing_packets(channel->handle) < NR_BUFFERED_ACL_PACKETS && channel->packets_granted == 0) {
+        if (channel->packets_granted) continue;
+#ifdef HAVE_L2CAP_LE_COC
+        if (channel->le_coc && channel->send_sdu_buffer) continue;
+#endif
+        if (!hci_number_free_acl_slots_for_handle(channel->handle)) return;
+        if (hci_number_outgoing_packets(channel->handle) < NR_BUFFERED_ACL_PACKETS) {
             l2cap_emit_credits(channel, 1);
         }
     }
 }
 
+static int l2cap_local_cid_table_index(uint16_t local_cid){
+    return (local_cid - L2CAP_LOCAL_CID_FIRST_DYNAMIC) % L2CAP_LOCAL_CID_TABLE_SIZE;
+}
+
+// get next local cid whose table slot is free, so lookup is a single index operation
+static uint16_t l2cap_allocate_local_cid(l2cap_channel_t * channel){
+    int i;
+    for (i = 0; i < L2CAP_LOCAL_CID_TABLE_SIZE; i++){
+        uint16_t local_cid = l2cap_next_local_cid();
+        int index = l2cap_local_cid_table_index(local_cid);
+        if (l2cap_local_cid_table[index]) continue;
+        l2cap_local_cid_table[index] = channel;
+        return local_cid;
+    }
+    // table full
+    l2cap_channels_not_indexed++;
+    return l2cap_next_local_cid();
+}
+
+// mark channel for processing in l2cap_run and l2cap_hand_out_credits
+static void l2cap_channel_set_pending(l2cap_channel_t * channel){
+    linked_list_add_tail(&l2cap_channels_pending, &channel->pending_item);
+}
+
+// free channel, caller has to remove it from l2cap_channels
+static void l2cap_channel_free(l2cap_channel_t * channel){
+    linked_list_remove(&l2cap_channels_pending, &channel->pending_item);
+#ifdef HAVE_L2CAP_ERTM
+    run_loop_remove_timer(&channel->ertm.timer);
+    run_loop_remove_timer(&channel->ertm.ack_timer);
+#endif
+    if (channel->local_cid >= L2CAP_LOCAL_CID_FIRST_DYNAMIC){
+        int index = l2cap_local_cid_table_index(channel->local_cid);
+        if (l2cap_local_cid_table[index] == channel){
+            l2cap_local_cid_table[index] = NULL;
+        } else {
+            l2cap_channels_not_indexed--;
+        }
+    }
+    btstack_memory_l2cap_channel_free(channel);
+}
+
+static int l2cap_channel_has_pending_work(l2cap_channel_t * channel){
+    switch (channel->state){
+        case L2CAP_STATE_WAIT_INCOMING_SECURITY_LEVEL_UPDATE:
+        case L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT:
+            return (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONN_RESP_PEND) != 0;
+        case L2CAP_STATE_WILL_SEND_CREATE_CONNECTION:
+        case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_DECLINE:
+        case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT:
+        case L2CAP_STATE_WILL_SEND_CONNECTION_REQUEST:
+        case L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE:
+        case L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST:
+        case L2CAP_STATE_WILL_SEND_LE_CONNECTION_REQUEST:
+        case L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_ACCEPT:
+        case L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_DECLINE:
+            return 1;
+        case L2CAP_STATE_CONFIG:
+            if (channel->state_var & (L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP | L2CAP_CHANNEL_STATE_VAR_SEND_CONF_REQ)) return 1;
+            return l2cap_channel_ready_for_open(channel);
+        case L2CAP_STATE_OPEN:
+#ifdef HAVE_L2CAP_ERTM
+            if (l2cap_ertm_has_pending_work(channel)) return 1;
+#endif
+#ifdef HAVE_L2CAP_LE_COC
+            if (l2cap_le_has_pending_work(channel)) return 1;
+#endif
+            return channel->packets_granted == 0;
+        default:
+            return 0;
+    }
+}
+
 l2cap_channel_t * l2cap_get_channel_for_local_cid(uint16_t local_cid){
+    if (local_cid < L2CAP_LOCAL_CID_FIRST_DYNAMIC) return NULL;
+    l2cap_channel_t * channel = l2cap_local_cid_table[l2cap_local_cid_table_index(local_cid)];
+    if (channel && channel->local_cid == local_cid) return channel;
+    if (!l2cap_channels_not_indexed) return NULL;
+
     linked_list_iterator_t it;    
     linked_list_iterator_init(&it, &l2cap_channels);
     while (linked_list_iterator_has_next(&it)){
@@ -243,6 +367,16 @@ l2cap_channel_t * l2cap_get_channel_for_local_cid(uint16_t local_cid){
 int  l2cap_can_send_packet_now(uint16_t local_cid){
     l2cap_channel_t *channel = l2cap_get_channel_for_local_cid(local_cid);
     if (!channel) return 0;
+#ifdef HAVE_L2CAP_ERTM
+    if (channel->ertm.mode != L2CAP_CHANNEL_MODE_BASIC){
+        return l2cap_ertm_can_send_sdu(channel);
+    }
+#endif
+#ifdef HAVE_L2CAP_LE_COC
+    if (channel->le_coc){
+        return channel->packets_granted && !channel->send_sdu_buffer;
+    }
+#endif
     if (!channel->packets_granted) return 0;
     return hci_can_send_acl_packet_now(channel->handle);
 }
@@ -291,7 +425,7 @@ static void l2cap_rtx_timeout(timer_source_t * ts){
     // discard channel
     // no need to stop timer here, it is removed from list during timer callback
     linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
-    btstack_memory_l2cap_channel_free(channel);
+    l2cap_channel_free(channel);
 }
 
 static void l2cap_stop_rtx(l2cap_channel_t * channel){
@@ -361,6 +495,16 @@ int l2cap_send_le_signaling_packet(hci_con_handle_t handle, L2CAP_SIGNALING_COMM
 }
 #endif
 
+// disconnect request/response are sent on the signaling channel used to create the channel
+static int l2cap_send_disconnect_signaling_packet(l2cap_channel_t * channel, L2CAP_SIGNALING_COMMANDS cmd, uint8_t identifier, uint16_t dest_cid, uint16_t source_cid){
+#ifdef HAVE_L2CAP_LE_COC
+    if (channel->le_coc){
+        return l2cap_send_le_signaling_packet(channel->handle, cmd, identifier, dest_cid, source_cid);
+    }
+#endif
+    return l2cap_send_signaling_packet(channel->handle, cmd, identifier, dest_cid, source_cid);
+}
+
 uint8_t *l2cap_get_outgoing_buffer(void){
     return hci_get_outgoing_packet_buffer() + COMPLETE_L2CAP_HEADER; // 8 bytes
 }
@@ -387,6 +531,24 @@ int l2cap_send_prepared(uint16_t local_cid, uint16_t len){
         return -1;   // TODO: define error
     }
 
+#ifdef HAVE_L2CAP_ERTM
+    if (channel->ertm.mode != L2CAP_CHANNEL_MODE_BASIC){
+        // segment into stored I-frames
+        int err = l2cap_ertm_send_sdu(channel, &hci_get_outgoing_packet_buffer()[COMPLETE_L2CAP_HEADER], len);
+        hci_release_packet_buffer();
+        l2cap_run();
+        return err;
+    }
+#endif
+
+#ifdef HAVE_L2CAP_LE_COC
+    if (channel->le_coc){
+        log_error("l2cap_send_prepared cid 0x%02x is LE Credit-Based channel, use l2cap_le_send_data", local_cid);
+        hci_release_packet_buffer();
+        return -1;
+    }
+#endif
+
     if (channel->packets_granted == 0){
         log_error("l2cap_send_prepared cid 0x%02x, no credits!", local_cid);
         return -1;  // TODO: define error
@@ -398,6 +560,9 @@ int l2cap_send_prepared(uint16_t local_cid, uint16_t len){
     }
     
     --channel->packets_granted;
+    if (channel->packets_granted == 0){
+        l2cap_channel_set_pending(channel);
+    }
 
     log_debug("l2cap_send_prepared cid 0x%02x, handle %u, 1 credit used, credits left %u;",
                   local_cid, channel->handle, channel->packets_granted);
@@ -464,6 +629,21 @@ int l2cap_send_internal(uint16_t local_cid, uint8_t *data, uint16_t len){
         return -1;   // TODO: define error
     }
 
+#ifdef HAVE_L2CAP_ERTM
+    if (channel->ertm.mode != L2CAP_CHANNEL_MODE_BASIC){
+        int err = l2cap_ertm_send_sdu(channel, data, len);
+        l2cap_run();
+        return err;
+    }
+#endif
+
+#ifdef HAVE_L2CAP_LE_COC
+    if (channel->le_coc){
+        log_error("l2cap_send_internal cid 0x%02x is LE Credit-Based channel, use l2cap_le_send_data", local_cid);
+        return -1;
+    }
+#endif
+
     if (!hci_can_send_acl_packet_now(channel->handle)){
         log_info("l2cap_send_internal cid 0x%02x, cannot send", local_cid);
         return BTSTACK_ACL_BUFFERS_FULL;
@@ -498,6 +678,7 @@ int l2cap_send_echo_request(uint16_t handle, uint8_t *data, uint16_t len){
 
 static inline void channelStateVarSetFlag(l2cap_channel_t *channel, L2CAP_CHANNEL_STATE_VAR flag){
     channel->state_var = (L2CAP_CHANNEL_STATE_VAR) (channel->state_var | flag);
+    l2cap_channel_set_pending(channel);
 }
 
 static inline void channelStateVarClearFlag(l2cap_channel_t *channel, L2CAP_CHANNEL_STATE_VAR flag){
@@ -506,10 +687,611 @@ static inline void channelStateVarClearFlag(l2cap_channel_t *channel, L2CAP_CHAN
 
 
 
+#ifdef HAVE_L2CAP_ERTM
+
+// MARK: Enhanced Retransmission and Streaming Mode
+
+#define L2CAP_ERTM_SEQ_MASK 0x3f
+#define L2CAP_ERTM_MIN_MPS  16
+
+// enhanced control field: SAR values and supervisory functions
+#define L2CAP_SAR_UNSEGMENTED   0
+#define L2CAP_SAR_START         1
+#define L2CAP_SAR_END           2
+#define L2CAP_SAR_CONTINUATION  3
+
+#define L2CAP_SUPERVISORY_RR    0
+#define L2CAP_SUPERVISORY_REJ   1
+#define L2CAP_SUPERVISORY_RNR   2
+#define L2CAP_SUPERVISORY_SREJ  3
+
+// CRC-16 with polynomial x^16 + x^15 + x^2 + 1, bits processed LSB first
+static uint16_t l2cap_crc16(const uint8_t * data, uint16_t len){
+    uint16_t crc = 0;
+    while (len--){
+        crc ^= *data++;
+        int i;
+        for (i = 0; i < 8; i++){
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+static uint16_t l2cap_ertm_mps_for_buffer(l2cap_ertm_config_t * config, uint32_t size){
+    if (config->num_tx_buffers == 0 || config->num_tx_buffers > L2CAP_ERTM_MAX_TX_BUFFERS) return 0;
+    if (size <= config->local_mtu) return 0;
+    // I-frame payload incl. SDU length has to fit into one ACL packet together with control field and FCS
+    uint32_t mps = (size - config->local_mtu) / config->num_tx_buffers;
+    if (mps > l2cap_max_mtu() - 4){
+        mps = l2cap_max_mtu() - 4;
+    }
+    if (mps < L2CAP_ERTM_MIN_MPS) return 0;
+    return mps;
+}
+
+uint32_t l2cap_ertm_buffer_size(l2cap_ertm_config_t * config){
+    return config->num_tx_buffers * (l2cap_max_mtu() - 4) + config->local_mtu;
+}
+
+static void l2cap_ertm_timeout(timer_source_t * ts);
+static void l2cap_ertm_ack_timeout(timer_source_t * ts);
+
+static int l2cap_ertm_setup(l2cap_channel_t * channel, l2cap_ertm_config_t * config, uint8_t * buffer, uint32_t size){
+    uint16_t mps = l2cap_ertm_mps_for_buffer(config, size);
+    if (!mps) {
+        log_error("l2cap_ertm_setup: buffer of %u bytes too small", (int) size);
+        return 0;
+    }
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    memset(ertm, 0, sizeof(l2cap_ertm_state_t));
+    ertm->config = *config;
+    ertm->mode = config->mode;
+    ertm->remote_mode = L2CAP_CHANNEL_MODE_BASIC;
+    ertm->local_mps = mps;
+    ertm->remote_mps = mps;
+    ertm->tx_window = config->num_tx_buffers;
+    ertm->retransmission_timeout_ms = config->retransmission_timeout_ms;
+    ertm->monitor_timeout_ms = config->monitor_timeout_ms;
+    ertm->tx_buffer = buffer;
+    ertm->rx_buffer = buffer + config->num_tx_buffers * mps;
+    ertm->ack_window = L2CAP_ERTM_SEQ_MASK;
+    linked_item_set_user(&ertm->timer.item, channel);
+    run_loop_set_timer_handler(&ertm->timer, &l2cap_ertm_timeout);
+    linked_item_set_user(&ertm->ack_timer.item, channel);
+    run_loop_set_timer_handler(&ertm->ack_timer, &l2cap_ertm_ack_timeout);
+    channel->local_mtu = config->local_mtu;
+    return 1;
+}
+
+// Retransmission and Flow Control option { type(8): 4, len(8): 9, mode(8), tx window(8), max transmit(8), retransmission timeout(16), monitor timeout(16), mps(16) }
+// and FCS option { type(8): 5, len(8): 1, fcs type(8) }
+static uint16_t l2cap_ertm_store_config_options(l2cap_channel_t * channel, uint8_t * options, int response){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    uint16_t pos = 0;
+    options[pos++] = 4;
+    options[pos++] = 9;
+    options[pos++] = ertm->mode;
+    if (ertm->mode == L2CAP_CHANNEL_MODE_BASIC){
+        memset(&options[pos], 0, 8);
+        return pos + 8;
+    }
+    if (response){
+        // echo remote values, provide timeouts to be used by remote
+        options[pos++] = ertm->tx_window;
+        options[pos++] = ertm->max_transmit;
+        bt_store_16(options, pos, ertm->config.retransmission_timeout_ms);
+        bt_store_16(options, pos + 2, ertm->config.monitor_timeout_ms);
+        bt_store_16(options, pos + 4, ertm->remote_mps);
+        return pos + 6;
+    }
+    // incoming frames are delivered in order right away, so any window is fine
+    options[pos++] = ertm->mode == L2CAP_CHANNEL_MODE_STREAMING ? 0 : L2CAP_ERTM_SEQ_MASK;
+    options[pos++] = ertm->config.max_transmit;
+    bt_store_16(options, pos, 0);
+    bt_store_16(options, pos + 2, 0);
+    bt_store_16(options, pos + 4, ertm->local_mps);
+    pos += 6;
+    if (!ertm->config.use_fcs){
+        options[pos++] = 5;
+        options[pos++] = 1;
+        options[pos++] = 0;
+    }
+    return pos;
+}
+
+static uint8_t * l2cap_find_config_option(uint8_t * command, uint16_t pos, uint8_t option_type, uint8_t option_len){
+    uint16_t end_pos = L2CAP_SIGNALING_COMMAND_DATA_OFFSET + READ_BT_16(command, L2CAP_SIGNALING_COMMAND_LENGTH_OFFSET);
+    while (pos + 2 <= end_pos){
+        uint8_t type = command[pos] & 0x7f;
+        uint8_t len  = command[pos+1];
+        if (type == option_type && len == option_len && pos + 2 + len <= end_pos) return &command[pos+2];
+        pos += 2 + len;
+    }
+    return NULL;
+}
+
+// remote configuration request options
+static void l2cap_ertm_handle_rfc_option(l2cap_channel_t * channel, uint8_t * option){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    ertm->remote_mode = (l2cap_channel_mode_t) option[0];
+    if (ertm->remote_mode != ertm->mode) return;
+    if (ertm->mode == L2CAP_CHANNEL_MODE_BASIC) return;
+    uint8_t tx_window = option[1];
+    ertm->tx_window = tx_window < ertm->config.num_tx_buffers ? tx_window : ertm->config.num_tx_buffers;
+    if (ertm->tx_window == 0){
+        ertm->tx_window = 1;
+    }
+    ertm->max_transmit = option[2];
+    uint16_t mps = READ_BT_16(option, 7);
+    ertm->remote_mps = mps < ertm->local_mps ? mps : ertm->local_mps;
+}
+
+static void l2cap_ertm_handle_fcs_option(l2cap_channel_t * channel, uint8_t * option){
+    channel->ertm.remote_fcs_none = option[0] == 0;
+}
+
+// after complete configuration request has been received
+static void l2cap_ertm_check_remote_mode(l2cap_channel_t * channel){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    if (ertm->remote_mode == ertm->mode){
+        if (ertm->mode != L2CAP_CHANNEL_MODE_BASIC){
+            channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_ERTM);
+        }
+        return;
+    }
+    if (ertm->remote_mode == L2CAP_CHANNEL_MODE_BASIC && !ertm->config.mode_mandatory){
+        log_info("l2cap cid 0x%02x, remote requests basic mode, falling back", channel->local_cid);
+        ertm->mode = L2CAP_CHANNEL_MODE_BASIC;
+        return;
+    }
+    // suggest our mode
+    channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE);
+}
+
+// configuration response to our request, returns 0 if channel has to be disconnected
+static int l2cap_ertm_handle_configure_response(l2cap_channel_t * channel, uint16_t result, uint8_t * command){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    uint8_t * option = l2cap_find_config_option(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 6, 4, 9);
+    if (result == 0){
+        if (!option || ertm->mode == L2CAP_CHANNEL_MODE_BASIC) return 1;
+        // use timeouts and mps provided by remote
+        uint16_t retransmission_timeout_ms = READ_BT_16(option, 3);
+        uint16_t monitor_timeout_ms = READ_BT_16(option, 5);
+        uint16_t mps = READ_BT_16(option, 7);
+        // remote might use a smaller tx window than we offered
+        if (option[1] && option[1] < ertm->ack_window) ertm->ack_window = option[1];
+        if (retransmission_timeout_ms) ertm->retransmission_timeout_ms = retransmission_timeout_ms;
+        if (monitor_timeout_ms) ertm->monitor_timeout_ms = monitor_timeout_ms;
+        if (mps && mps < ertm->remote_mps) ertm->remote_mps = mps;
+        return 1;
+    }
+    if (result != L2CAP_CONF_RESULT_UNACCEPTABLE_PARAMETERS || !option) return 1;
+    if (option[0] == ertm->mode) return 1;
+    if (option[0] == L2CAP_CHANNEL_MODE_BASIC && !ertm->config.mode_mandatory){
+        log_info("l2cap cid 0x%02x, remote rejected mode %u, falling back to basic mode", channel->local_cid, ertm->mode);
+        ertm->mode = L2CAP_CHANNEL_MODE_BASIC;
+        return 1;
+    }
+    log_info("l2cap cid 0x%02x, remote rejected mode %u", channel->local_cid, ertm->mode);
+    return 0;
+}
+
+static void l2cap_ertm_channel_opened(l2cap_channel_t * channel){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    if (ertm->mode == L2CAP_CHANNEL_MODE_BASIC) return;
+    // FCS is only omitted if both sides ask for it
+    ertm->fcs = ertm->config.use_fcs || !ertm->remote_fcs_none;
+    log_info("l2cap cid 0x%02x, mode %u, tx window %u, remote mps %u, fcs %u", channel->local_cid, ertm->mode,
+        ertm->tx_window, ertm->remote_mps, ertm->fcs);
+}
+
+static int l2cap_ertm_num_stored_frames(l2cap_ertm_state_t * ertm){
+    return (ertm->next_tx_seq - ertm->expected_ack_seq) & L2CAP_ERTM_SEQ_MASK;
+}
+
+static int l2cap_ertm_num_free_frames(l2cap_ertm_state_t * ertm){
+    return ertm->config.num_tx_buffers - l2cap_ertm_num_stored_frames(ertm);
+}
+
+static int l2cap_ertm_tx_frame_index(l2cap_ertm_state_t * ertm, uint8_t tx_seq){
+    return (ertm->tx_frame_head + ((tx_seq - ertm->expected_ack_seq) & L2CAP_ERTM_SEQ_MASK)) % ertm->config.num_tx_buffers;
+}
+
+// start frame carries 2 bytes SDU length
+static int l2cap_ertm_num_segments(l2cap_ertm_state_t * ertm, uint16_t len){
+    if (len <= ertm->remote_mps) return 1;
+    uint16_t first = ertm->remote_mps - 2;
+    return 1 + (len - first + ertm->remote_mps - 1) / ertm->remote_mps;
+}
+
+static int l2cap_ertm_can_send_sdu(l2cap_channel_t * channel){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    int segments = l2cap_ertm_num_segments(ertm, channel->remote_mtu);
+    if (segments > ertm->config.num_tx_buffers){
+        segments = ertm->config.num_tx_buffers;
+    }
+    return l2cap_ertm_num_free_frames(ertm) >= segments;
+}
+
+// segment SDU into stored I-frames, sent by l2cap_run
+static int l2cap_ertm_send_sdu(l2cap_channel_t * channel, uint8_t * data, uint16_t len){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    if (len > channel->remote_mtu) {
+        log_error("l2cap_ertm_send_sdu cid 0x%02x, sdu len %u > remote mtu %u", channel->local_cid, len, channel->remote_mtu);
+        return L2CAP_DATA_LEN_EXCEEDS_REMOTE_MTU;
+    }
+    int segments = l2cap_ertm_num_segments(ertm, len);
+    if (segments > ertm->config.num_tx_buffers) return BTSTACK_MEMORY_ALLOC_FAILED;
+    if (segments > l2cap_ertm_num_free_frames(ertm)) return BTSTACK_ACL_BUFFERS_FULL;
+
+    uint16_t pos = 0;
+    int i;
+    for (i = 0; i < segments; i++){
+        int index = l2cap_ertm_tx_frame_index(ertm, ertm->next_tx_seq);
+        l2cap_ertm_tx_frame_t * frame = &ertm->tx_frames[index];
+        uint16_t payload = ertm->remote_mps;
+        if (segments == 1){
+            frame->sar = L2CAP_SAR_UNSEGMENTED;
+        } else if (i == 0){
+            frame->sar = L2CAP_SAR_START;
+            frame->sdu_length = len;
+            payload -= 2;
+        } else if (i == segments - 1){
+            frame->sar = L2CAP_SAR_END;
+        } else {
+            frame->sar = L2CAP_SAR_CONTINUATION;
+        }
+        if (payload > len - pos){
+            payload = len - pos;
+        }
+        frame->len = payload;
+        memcpy(&ertm->tx_buffer[index * ertm->local_mps], &data[pos], payload);
+        pos += payload;
+        ertm->next_tx_seq = (ertm->next_tx_seq + 1) & L2CAP_ERTM_SEQ_MASK;
+    }
+    l2cap_channel_set_pending(channel);
+    return 0;
+}
+
+static void l2cap_ertm_start_timer(l2cap_channel_t * channel, l2cap_ertm_timer_state_t timer_state){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    uint16_t timeout_ms = timer_state == L2CAP_ERTM_TIMER_MONITOR ? ertm->monitor_timeout_ms : ertm->retransmission_timeout_ms;
+    run_loop_remove_timer(&ertm->timer);
+    run_loop_set_timer(&ertm->timer, timeout_ms);
+    run_loop_add_timer(&ertm->timer);
+    ertm->timer_state = timer_state;
+}
+
+static void l2cap_ertm_stop_timer(l2cap_channel_t * channel){
+    run_loop_remove_timer(&channel->ertm.timer);
+    channel->ertm.timer_state = L2CAP_ERTM_TIMER_NONE;
+}
+
+// acknowledge once 3/4 of the remote tx window has been received, so remote can keep sending
+static int l2cap_ertm_ack_threshold(l2cap_ertm_state_t * ertm){
+    int threshold = (ertm->ack_window * 3) / 4;
+    return threshold ? threshold : 1;
+}
+
+static void l2cap_ertm_ack_timeout(timer_source_t * ts){
+    l2cap_channel_t * channel = (l2cap_channel_t *) linked_item_get_user(&ts->item);
+    if (!channel->ertm.rx_unacked) return;
+    channel->ertm.send_ack = 1;
+    l2cap_channel_set_pending(channel);
+    l2cap_run();
+}
+
+// received I-frame in sequence
+static void l2cap_ertm_received_i_frame(l2cap_channel_t * channel){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    ertm->rx_unacked++;
+    if (ertm->rx_unacked >= l2cap_ertm_ack_threshold(ertm)){
+        ertm->send_ack = 1;
+        return;
+    }
+    if (ertm->rx_unacked > 1) return;
+    run_loop_set_timer(&ertm->ack_timer, L2CAP_ERTM_ACK_TIMEOUT_MS);
+    run_loop_add_timer(&ertm->ack_timer);
+}
+
+// frame with current req seq has been sent
+static void l2cap_ertm_acknowledged(l2cap_channel_t * channel){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    ertm->send_ack = 0;
+    if (!ertm->rx_unacked) return;
+    ertm->rx_unacked = 0;
+    run_loop_remove_timer(&ertm->ack_timer);
+}
+
+static void l2cap_ertm_timeout(timer_source_t * ts){
+    l2cap_channel_t * channel = (l2cap_channel_t *) linked_item_get_user(&ts->item);
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    if (ertm->timer_state == L2CAP_ERTM_TIMER_MONITOR && ertm->max_transmit && ertm->retry_count >= ertm->max_transmit){
+        log_info("l2cap cid 0x%02x, no response after %u polls, disconnect", channel->local_cid, ertm->retry_count);
+        ertm->timer_state = L2CAP_ERTM_TIMER_NONE;
+        channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+    } else {
+        // poll remote for its receive state
+        ertm->retry_count++;
+        ertm->send_poll = 1;
+        l2cap_ertm_start_timer(channel, L2CAP_ERTM_TIMER_MONITOR);
+    }
+    l2cap_channel_set_pending(channel);
+    l2cap_run();
+}
+
+static void l2cap_ertm_send_frame(l2cap_channel_t * channel, uint16_t control, l2cap_ertm_tx_frame_t * frame, uint8_t * payload){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+
+    hci_reserve_packet_buffer();
+    uint8_t *acl_buffer = hci_get_outgoing_packet_buffer();
+
+    uint16_t pos = COMPLETE_L2CAP_HEADER;
+    bt_store_16(acl_buffer, pos, control);
+    pos += 2;
+    if (frame){
+        if (frame->sar == L2CAP_SAR_START){
+            bt_store_16(acl_buffer, pos, frame->sdu_length);
+            pos += 2;
+        }
+        memcpy(&acl_buffer[pos], payload, frame->len);
+        pos += frame->len;
+    }
+    uint16_t len = pos - COMPLETE_L2CAP_HEADER + (ertm->fcs ? 2 : 0);
+
+    int pb = hci_non_flushable_packet_boundary_flag_supported() ? 0x00 : 0x02;
+
+    // 0 - Connection handle : PB=pb : BC=00 
+    bt_store_16(acl_buffer, 0, channel->handle | (pb << 12) | (0 << 14));
+    // 2 - ACL length
+    bt_store_16(acl_buffer, 2,  len + 4);
+    // 4 - L2CAP packet length
+    bt_store_16(acl_buffer, 4,  len);
+    // 6 - L2CAP channel DEST
+    bt_store_16(acl_buffer, 6, channel->remote_cid);
+    // FCS over L2CAP header, control and payload
+    if (ertm->fcs){
+        bt_store_16(acl_buffer, pos, l2cap_crc16(&acl_buffer[HCI_ACL_HEADER_SIZE], pos - HCI_ACL_HEADER_SIZE));
+        pos += 2;
+    }
+    hci_send_acl_packet_buffer(pos);
+}
+
+static void l2cap_ertm_send_supervisory_frame(l2cap_channel_t * channel, uint8_t function, int poll, int final){
+    uint16_t control = 1 | (function << 2) | (poll << 4) | (final << 7) | (channel->ertm.expected_tx_seq << 8);
+    l2cap_ertm_send_frame(channel, control, NULL, NULL);
+    l2cap_ertm_acknowledged(channel);
+}
+
+static int l2cap_ertm_can_send_i_frame(l2cap_ertm_state_t * ertm){
+    if (ertm->tx_send_seq == ertm->next_tx_seq) return 0;
+    if (ertm->mode == L2CAP_CHANNEL_MODE_STREAMING) return 1;
+    if (ertm->remote_busy) return 0;
+    if (ertm->timer_state == L2CAP_ERTM_TIMER_MONITOR) return 0;
+    return ((ertm->tx_send_seq - ertm->expected_ack_seq) & L2CAP_ERTM_SEQ_MASK) < ertm->tx_window;
+}
+
+static int l2cap_ertm_has_pending_work(l2cap_channel_t * channel){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    if (ertm->mode == L2CAP_CHANNEL_MODE_BASIC) return 0;
+    if (ertm->send_ack || ertm->send_rej || ertm->send_poll || ertm->send_final) return 1;
+    return l2cap_ertm_can_send_i_frame(ertm);
+}
+
+static void l2cap_ertm_run(l2cap_channel_t * channel){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    while (l2cap_ertm_has_pending_work(channel)){
+        if (!hci_can_send_acl_packet_now(channel->handle)) return;
+
+        if (ertm->send_poll){
+            ertm->send_poll = 0;
+            l2cap_ertm_send_supervisory_frame(channel, L2CAP_SUPERVISORY_RR, 1, 0);
+            continue;
+        }
+        if (ertm->send_rej){
+            ertm->send_rej = 0;
+            l2cap_ertm_send_supervisory_frame(channel, L2CAP_SUPERVISORY_REJ, 0, ertm->send_final);
+            ertm->send_final = 0;
+            continue;
+        }
+        if (ertm->send_final || !l2cap_ertm_can_send_i_frame(ertm)){
+            l2cap_ertm_send_supervisory_frame(channel, L2CAP_SUPERVISORY_RR, 0, ertm->send_final);
+            ertm->send_final = 0;
+            continue;
+        }
+
+        // send next I-frame, acknowledges received frames, too
+        uint8_t tx_seq = ertm->tx_send_seq;
+        int index = l2cap_ertm_tx_frame_index(ertm, tx_seq);
+        l2cap_ertm_tx_frame_t * frame = &ertm->tx_frames[index];
+        uint16_t control = (tx_seq << 1) | (frame->sar << 14);
+        if (ertm->mode == L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION){
+            control |= ertm->expected_tx_seq << 8;
+        }
+        l2cap_ertm_send_frame(channel, control, frame, &ertm->tx_buffer[index * ertm->local_mps]);
+        if (ertm->mode == L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION){
+            l2cap_ertm_acknowledged(channel);
+        }
+        ertm->tx_send_seq = (tx_seq + 1) & L2CAP_ERTM_SEQ_MASK;
+
+        if (ertm->mode == L2CAP_CHANNEL_MODE_STREAMING){
+            // no acknowledgements, drop frame
+            ertm->expected_ack_seq = ertm->tx_send_seq;
+            ertm->tx_frame_head = (ertm->tx_frame_head + 1) % ertm->config.num_tx_buffers;
+        } else if (ertm->timer_state == L2CAP_ERTM_TIMER_NONE){
+            l2cap_ertm_start_timer(channel, L2CAP_ERTM_TIMER_RETRANSMISSION);
+        }
+    }
+}
+
+// process acknowledgement in received frame
+static void l2cap_ertm_handle_req_seq(l2cap_channel_t * channel, uint8_t req_seq){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    int num_acked = (req_seq - ertm->expected_ack_seq) & L2CAP_ERTM_SEQ_MASK;
+    int num_stored = l2cap_ertm_num_stored_frames(ertm);
+    if (num_acked > num_stored){
+        log_error("l2cap cid 0x%02x, invalid req seq %u", channel->local_cid, req_seq);
+        return;
+    }
+    if (!num_acked) return;
+    ertm->expected_ack_seq = req_seq;
+    ertm->tx_frame_head = (ertm->tx_frame_head + num_acked) % ertm->config.num_tx_buffers;
+    // retransmission might have been started before
+    if (((ertm->tx_send_seq - ertm->expected_ack_seq) & L2CAP_ERTM_SEQ_MASK) > num_stored - num_acked){
+        ertm->tx_send_seq = ertm->expected_ack_seq;
+    }
+    if (ertm->timer_state == L2CAP_ERTM_TIMER_RETRANSMISSION){
+        if (ertm->tx_send_seq == ertm->expected_ack_seq){
+            l2cap_ertm_stop_timer(channel);
+        } else {
+            l2cap_ertm_start_timer(channel, L2CAP_ERTM_TIMER_RETRANSMISSION);
+        }
+    }
+}
+
+// remote answered our poll, retransmit all unacknowledged frames
+static void l2cap_ertm_handle_final(l2cap_channel_t * channel){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    if (ertm->timer_state != L2CAP_ERTM_TIMER_MONITOR) return;
+    l2cap_ertm_stop_timer(channel);
+    ertm->retry_count = 0;
+    ertm->tx_send_seq = ertm->expected_ack_seq;
+}
+
+static void l2cap_ertm_handle_sdu_segment(l2cap_channel_t * channel, uint8_t sar, uint8_t * payload, uint16_t len){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    switch (sar){
+        case L2CAP_SAR_UNSEGMENTED:
+            ertm->rx_sdu_active = 0;
+            l2cap_dispatch(channel, L2CAP_DATA_PACKET, payload, len);
+            return;
+        case L2CAP_SAR_START:
+            if (len < 2) return;
+            ertm->rx_sdu_length = READ_BT_16(payload, 0);
+            ertm->rx_sdu_pos = 0;
+            ertm->rx_sdu_active = 1;
+            payload += 2;
+            len -= 2;
+            break;
+        default:
+            if (!ertm->rx_sdu_active) return;
+            break;
+    }
+    if (ertm->rx_sdu_length > channel->local_mtu || ertm->rx_sdu_pos + len > ertm->rx_sdu_length){
+        log_error("l2cap cid 0x%02x, sdu exceeds mtu or announced length", channel->local_cid);
+        ertm->rx_sdu_active = 0;
+        return;
+    }
+    memcpy(&ertm->rx_buffer[ertm->rx_sdu_pos], payload, len);
+    ertm->rx_sdu_pos += len;
+    if (sar != L2CAP_SAR_END) return;
+    ertm->rx_sdu_active = 0;
+    if (ertm->rx_sdu_pos != ertm->rx_sdu_length) return;
+    l2cap_dispatch(channel, L2CAP_DATA_PACKET, ertm->rx_buffer, ertm->rx_sdu_length);
+}
+
+static void l2cap_ertm_handle_pdu(l2cap_channel_t * channel, uint8_t * packet, uint16_t size){
+    l2cap_ertm_state_t * ertm = &channel->ertm;
+    uint8_t * pdu = &packet[COMPLETE_L2CAP_HEADER];
+    uint16_t len  = size - COMPLETE_L2CAP_HEADER;
+
+    if (ertm->fcs){
+        if (len < 4) return;
+        len -= 2;
+        uint16_t fcs = READ_BT_16(pdu, len);
+        if (l2cap_crc16(&packet[HCI_ACL_HEADER_SIZE], L2CAP_HEADER_SIZE + len) != fcs){
+            log_info("l2cap cid 0x%02x, fcs error", channel->local_cid);
+            return;
+        }
+    } else if (len < 2) return;
+
+    uint16_t control = READ_BT_16(pdu, 0);
+    uint8_t  req_seq = (control >> 8) & L2CAP_ERTM_SEQ_MASK;
+    int      final   = (control >> 7) & 1;
+
+    // S-frame
+    if (control & 1){
+        if (ertm->mode == L2CAP_CHANNEL_MODE_STREAMING) return;
+        uint8_t function = (control >> 2) & 3;
+        int     poll     = (control >> 4) & 1;
+        if (function != L2CAP_SUPERVISORY_SREJ){
+            l2cap_ertm_handle_req_seq(channel, req_seq);
+        }
+        if (final){
+            l2cap_ertm_handle_final(channel);
+        }
+        switch (function){
+            case L2CAP_SUPERVISORY_RR:
+                ertm->remote_busy = 0;
+                break;
+            case L2CAP_SUPERVISORY_RNR:
+                ertm->remote_busy = 1;
+                break;
+            case L2CAP_SUPERVISORY_REJ:
+                ertm->remote_busy = 0;
+                ertm->tx_send_seq = ertm->expected_ack_seq;
+                break;
+            case L2CAP_SUPERVISORY_SREJ:
+                // selective reject not supported, go back to requested frame
+                if (((req_seq - ertm->expected_ack_seq) & L2CAP_ERTM_SEQ_MASK) < l2cap_ertm_num_stored_frames(ertm)){
+                    ertm->tx_send_seq = req_seq;
+                }
+                break;
+            default:
+                break;
+        }
+        if (poll){
+            ertm->send_final = 1;
+        }
+        l2cap_channel_set_pending(channel);
+        return;
+    }
+
+    // I-frame
+    uint8_t tx_seq = (control >> 1) & L2CAP_ERTM_SEQ_MASK;
+    uint8_t sar    = control >> 14;
+
+    if (ertm->mode == L2CAP_CHANNEL_MODE_STREAMING){
+        if (tx_seq != ertm->expected_tx_seq){
+            // frames lost, drop partial SDU
+            ertm->rx_sdu_active = 0;
+        }
+        ertm->expected_tx_seq = (tx_seq + 1) & L2CAP_ERTM_SEQ_MASK;
+        l2cap_ertm_handle_sdu_segment(channel, sar, &pdu[2], len - 2);
+        return;
+    }
+
+    l2cap_ertm_handle_req_seq(channel, req_seq);
+    if (final){
+        l2cap_ertm_handle_final(channel);
+    }
+    l2cap_channel_set_pending(channel);
+
+    if (tx_seq != ertm->expected_tx_seq){
+        // duplicates are dropped, frames after a gap trigger a reject once
+        if (((tx_seq - ertm->expected_tx_seq) & L2CAP_ERTM_SEQ_MASK) < 32 && !ertm->rej_sent){
+            ertm->rej_sent = 1;
+            ertm->send_rej = 1;
+        }
+        return;
+    }
+    ertm->expected_tx_seq = (tx_seq + 1) & L2CAP_ERTM_SEQ_MASK;
+    ertm->rej_sent = 0;
+    // acknowledged by next outgoing I-frame, on threshold or after ack timeout
+    l2cap_ertm_received_i_frame(channel);
+    l2cap_ertm_handle_sdu_segment(channel, sar, &pdu[2], len - 2);
+}
+
+#endif
+
 // MARK: L2CAP_RUN
 // process outstanding signaling tasks
 void l2cap_run(void){
     
+    // run once at the end of the HCI batch
+    if (hci_batch_active()) return;
+
     // check pending signaling responses
     while (signaling_responses_pending){
         
@@ -540,6 +1322,10 @@ void l2cap_run(void){
                     case 2: { // Extended Features Supported
                         // extended features request supported, only supporing fixed channel map
                         uint32_t features = 0x80;
+#ifdef HAVE_L2CAP_ERTM
+                        // Enhanced Retransmission Mode, Streaming Mode, FCS Option
+                        features |= 0x08 | 0x10 | 0x20;
+#endif
                         l2cap_send_signaling_packet(handle, INFORMATION_RESPONSE, sig_id, infoType, 0, sizeof(features), &features);
                         break;
                     }
@@ -558,10 +1344,16 @@ void l2cap_run(void){
                 break;
             case COMMAND_REJECT:
                 l2cap_send_signaling_packet(handle, COMMAND_REJECT, sig_id, result, 0, NULL);
+                break;
 #ifdef HAVE_BLE
             case COMMAND_REJECT_LE:
                 l2cap_send_le_signaling_packet(handle, COMMAND_REJECT, sig_id, result, 0, NULL);
                 break;
+#endif
+#ifdef HAVE_L2CAP_LE_COC
+            case LE_CREDIT_BASED_CONNECTION_REQUEST:
+                l2cap_send_le_signaling_packet(handle, LE_CREDIT_BASED_CONNECTION_RESPONSE, sig_id, 0, 0, 0, 0, result);
+                break;
 #endif
             default:
                 // should not happen
@@ -576,13 +1368,21 @@ void l2cap_run(void){
         }
     }
     
-    uint8_t  config_options[4];
+    uint8_t  config_options[20];
+    uint16_t config_options_len;
     linked_list_iterator_t it;    
-    linked_list_iterator_init(&it, &l2cap_channels);
+    linked_list_iterator_init(&it, &l2cap_channels_pending);
     while (linked_list_iterator_has_next(&it)){
 
-        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
+        l2cap_channel_t * channel = (l2cap_channel_t *) linked_item_get_user(linked_list_iterator_next(&it));
         // log_info("l2cap_run: state %u, var 0x%02x", channel->state, channel->state_var);
+
+        // drop channels without work, channels handled below are checked again on next run
+        if (!l2cap_channel_has_pending_work(channel)){
+            linked_list_iterator_remove(&it);
+            continue;
+        }
+
         switch (channel->state){
 
             case L2CAP_STATE_WAIT_INCOMING_SECURITY_LEVEL_UPDATE:
@@ -607,9 +1407,9 @@ void l2cap_run(void){
                 l2cap_send_signaling_packet(channel->handle, CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid, channel->reason, 0);
                 // discard channel - l2cap_finialize_channel_close without sending l2cap close event
                 l2cap_stop_rtx(channel);
-                linked_list_iterator_remove(&it);
-                btstack_memory_l2cap_channel_free(channel); 
-                break;
+                linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
+                l2cap_channel_free(channel);
+                continue;
                 
             case L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT:
                 if (!hci_can_send_acl_packet_now(channel->handle)) break;
@@ -639,14 +1439,30 @@ void l2cap_run(void){
                     }
                     if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_INVALID){
                         l2cap_send_signaling_packet(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, L2CAP_CONF_RESULT_UNKNOWN_OPTIONS, 0, NULL);
-                    } else if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU){
-                        config_options[0] = 1; // MTU
-                        config_options[1] = 2; // len param
-                        bt_store_16( (uint8_t*)&config_options, 2, channel->remote_mtu);
-                        l2cap_send_signaling_packet(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, 0, 4, &config_options);
-                        channelStateVarClearFlag(channel,L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU);
+#ifdef HAVE_L2CAP_ERTM
+                    } else if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE){
+                        // suggest our mode, remote has to send new request
+                        config_options_len = l2cap_ertm_store_config_options(channel, config_options, 1);
+                        l2cap_send_signaling_packet(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, L2CAP_CONF_RESULT_UNACCEPTABLE_PARAMETERS, config_options_len, &config_options);
+                        channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE);
+                        channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SENT_CONF_RSP);
+#endif
                     } else {
-                        l2cap_send_signaling_packet(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, 0, 0, NULL);
+                        config_options_len = 0;
+                        if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU){
+                            config_options[0] = 1; // MTU
+                            config_options[1] = 2; // len param
+                            bt_store_16( (uint8_t*)&config_options, 2, channel->remote_mtu);
+                            config_options_len = 4;
+                            channelStateVarClearFlag(channel,L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_MTU);
+                        }
+#ifdef HAVE_L2CAP_ERTM
+                        if (channel->state_var & L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_ERTM){
+                            config_options_len += l2cap_ertm_store_config_options(channel, &config_options[config_options_len], 1);
+                            channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_ERTM);
+                        }
+#endif
+                        l2cap_send_signaling_packet(channel->handle, CONFIGURE_RESPONSE, channel->remote_sig_id, channel->remote_cid, flags, 0, config_options_len, &config_options);
                     }
                     channelStateVarClearFlag(channel, L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_CONT);
                 }
@@ -657,28 +1473,69 @@ void l2cap_run(void){
                     config_options[0] = 1; // MTU
                     config_options[1] = 2; // len param
                     bt_store_16( (uint8_t*)&config_options, 2, channel->local_mtu);
-                    l2cap_send_signaling_packet(channel->handle, CONFIGURE_REQUEST, channel->local_sig_id, channel->remote_cid, 0, 4, &config_options);
+                    config_options_len = 4;
+#ifdef HAVE_L2CAP_ERTM
+                    if (channel->ertm.mode != L2CAP_CHANNEL_MODE_BASIC){
+                        config_options_len += l2cap_ertm_store_config_options(channel, &config_options[config_options_len], 0);
+                    }
+#endif
+                    l2cap_send_signaling_packet(channel->handle, CONFIGURE_REQUEST, channel->local_sig_id, channel->remote_cid, 0, config_options_len, &config_options);
                     l2cap_start_rtx(channel);
                 }
                 if (l2cap_channel_ready_for_open(channel)){
-                    channel->state = L2CAP_STATE_OPEN;
-                    l2cap_emit_channel_opened(channel, 0);  // success
-                    l2cap_emit_credits(channel, 1);
+                    l2cap_handle_channel_open(channel);
                 }
                 break;
 
+#if defined(HAVE_L2CAP_ERTM) || defined(HAVE_L2CAP_LE_COC)
+            case L2CAP_STATE_OPEN:
+#ifdef HAVE_L2CAP_ERTM
+                l2cap_ertm_run(channel);
+#endif
+#ifdef HAVE_L2CAP_LE_COC
+                l2cap_le_run_channel(channel);
+#endif
+                break;
+#endif
+
+#ifdef HAVE_L2CAP_LE_COC
+            case L2CAP_STATE_WILL_SEND_LE_CONNECTION_REQUEST:
+                if (!hci_can_send_acl_packet_now(channel->handle)) break;
+                channel->local_sig_id = l2cap_next_sig_id();
+                channel->state = L2CAP_STATE_WAIT_LE_CONNECTION_RESPONSE;
+                l2cap_send_le_signaling_packet(channel->handle, LE_CREDIT_BASED_CONNECTION_REQUEST, channel->local_sig_id, channel->psm,
+                    channel->local_cid, channel->local_mtu, channel->local_mps, channel->credits_incoming);
+                l2cap_start_rtx(channel);
+                break;
+
+            case L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_ACCEPT:
+                if (!hci_can_send_acl_packet_now(channel->handle)) break;
+                l2cap_send_le_signaling_packet(channel->handle, LE_CREDIT_BASED_CONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid,
+                    channel->local_mtu, channel->local_mps, channel->credits_incoming, L2CAP_LE_RESULT_SUCCESS);
+                l2cap_handle_channel_open(channel);
+                break;
+
+            case L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_DECLINE:
+                if (!hci_can_send_acl_packet_now(channel->handle)) break;
+                l2cap_send_le_signaling_packet(channel->handle, LE_CREDIT_BASED_CONNECTION_RESPONSE, channel->remote_sig_id, 0, 0, 0, 0, channel->reason);
+                // discard channel without sending l2cap close event
+                linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
+                l2cap_channel_free(channel);
+                continue;
+#endif
+
             case L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE:
                 if (!hci_can_send_acl_packet_now(channel->handle)) break;
-                l2cap_send_signaling_packet( channel->handle, DISCONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid);   
+                l2cap_send_disconnect_signaling_packet(channel, DISCONNECTION_RESPONSE, channel->remote_sig_id, channel->local_cid, channel->remote_cid);
                 // we don't start an RTX timer for a disconnect - there's no point in closing the channel if the other side doesn't respond :)
                 l2cap_finialize_channel_close(channel);  // -- remove from list
-                break;
+                continue;
                 
             case L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST:
                 if (!hci_can_send_acl_packet_now(channel->handle)) break;
                 channel->local_sig_id = l2cap_next_sig_id();
                 channel->state = L2CAP_STATE_WAIT_DISCONNECT;
-                l2cap_send_signaling_packet( channel->handle, DISCONNECTION_REQUEST, channel->local_sig_id, channel->remote_cid, channel->local_cid);   
+                l2cap_send_disconnect_signaling_packet(channel, DISCONNECTION_REQUEST, channel->local_sig_id, channel->remote_cid, channel->local_cid);
                 break;
             default:
                 break;
@@ -729,7 +1586,7 @@ static void l2cap_handle_connection_complete(uint16_t handle, l2cap_channel_t *
         log_info("l2cap_handle_connection_complete expected state");
         // success, start l2cap handshake
         channel->handle = handle;
-        channel->local_cid = l2cap_next_local_cid();
+        channel->local_cid = l2cap_allocate_local_cid(channel);
         // check remote SSP feature first
         channel->state = L2CAP_STATE_WAIT_REMOTE_SUPPORTED_FEATURES;
     }
@@ -748,24 +1605,22 @@ static void l2cap_handle_remote_supported_features_received(l2cap_channel_t * ch
     }
     // fine, go ahead
     channel->state = L2CAP_STATE_WILL_SEND_CONNECTION_REQUEST;
+    l2cap_channel_set_pending(channel);
 }
 
-// open outgoing L2CAP channel
-void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler,
-                                   bd_addr_t address, uint16_t psm, uint16_t mtu){
-    
-    log_info("L2CAP_CREATE_CHANNEL_MTU addr %s psm 0x%x mtu %u", bd_addr_to_str(address), psm, mtu);
-    
+static void l2cap_emit_channel_opened_failed(bd_addr_t address, uint16_t psm, uint8_t status){
+    l2cap_channel_t dummy_channel;
+    BD_ADDR_COPY(dummy_channel.address, address);
+    dummy_channel.psm = psm;
+    l2cap_emit_channel_opened(&dummy_channel, status);
+}
+
+static l2cap_channel_t * l2cap_create_channel_entry(void * connection, btstack_packet_handler_t packet_handler,
+                                   bd_addr_t address, uint16_t psm, uint16_t mtu){
     // alloc structure
     l2cap_channel_t * chan = btstack_memory_l2cap_channel_get();
-    if (!chan) {
-        // emit error event
-        l2cap_channel_t dummy_channel;
-        BD_ADDR_COPY(dummy_channel.address, address);
-        dummy_channel.psm = psm;
-        l2cap_emit_channel_opened(&dummy_channel, BTSTACK_MEMORY_ALLOC_FAILED);
-        return;
-    }
+    if (!chan) return NULL;
+
     // limit local mtu to max acl packet length
     if (mtu > l2cap_max_mtu()) {
         mtu = l2cap_max_mtu();
@@ -787,12 +1642,25 @@ void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t p
     chan->remote_sig_id = L2CAP_SIG_ID_INVALID;
     chan->local_sig_id = L2CAP_SIG_ID_INVALID;
     chan->required_security_level = LEVEL_0;
+    chan->local_cid = 0;
+#ifdef HAVE_L2CAP_ERTM
+    memset(&chan->ertm, 0, sizeof(l2cap_ertm_state_t));
+#endif
+#ifdef HAVE_L2CAP_LE_COC
+    chan->le_coc = 0;
+#endif
+    return chan;
+}
+
+static void l2cap_start_channel(l2cap_channel_t * chan){
 
     // add to connections list
     linked_list_add(&l2cap_channels, (linked_item_t *) chan);
+    linked_item_set_user(&chan->pending_item, chan);
+    l2cap_channel_set_pending(chan);
     
     // check if hci connection is already usable
-    hci_connection_t * conn = hci_connection_for_bd_addr_and_type((bd_addr_t*)address, BD_ADDR_TYPE_CLASSIC);
+    hci_connection_t * conn = hci_connection_for_bd_addr_and_type(&chan->address, BD_ADDR_TYPE_CLASSIC);
     if (conn){
         log_info("l2cap_create_channel_internal, hci connection already exists");
         l2cap_handle_connection_complete(conn->con_handle, chan);
@@ -805,12 +1673,49 @@ void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t p
     l2cap_run();
 }
 
+// open outgoing L2CAP channel
+void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler,
+                                   bd_addr_t address, uint16_t psm, uint16_t mtu){
+    
+    log_info("L2CAP_CREATE_CHANNEL_MTU addr %s psm 0x%x mtu %u", bd_addr_to_str(address), psm, mtu);
+    
+    l2cap_channel_t * chan = l2cap_create_channel_entry(connection, packet_handler, address, psm, mtu);
+    if (!chan) {
+        // emit error event
+        l2cap_emit_channel_opened_failed(address, psm, BTSTACK_MEMORY_ALLOC_FAILED);
+        return;
+    }
+    l2cap_start_channel(chan);
+}
+
+#ifdef HAVE_L2CAP_ERTM
+// open outgoing L2CAP channel in Enhanced Retransmission or Streaming Mode
+void l2cap_create_ertm_channel_internal(void * connection, btstack_packet_handler_t packet_handler, bd_addr_t address, uint16_t psm,
+    l2cap_ertm_config_t * config, uint8_t * buffer, uint32_t size){
+
+    log_info("L2CAP_CREATE_ERTM_CHANNEL addr %s psm 0x%x mode %u", bd_addr_to_str(address), psm, config->mode);
+
+    l2cap_channel_t * chan = l2cap_create_channel_entry(connection, packet_handler, address, psm, config->local_mtu);
+    if (!chan) {
+        l2cap_emit_channel_opened_failed(address, psm, BTSTACK_MEMORY_ALLOC_FAILED);
+        return;
+    }
+    if (!l2cap_ertm_setup(chan, config, buffer, size)){
+        btstack_memory_l2cap_channel_free(chan);
+        l2cap_emit_channel_opened_failed(address, psm, BTSTACK_MEMORY_ALLOC_FAILED);
+        return;
+    }
+    l2cap_start_channel(chan);
+}
+#endif
+
 void l2cap_disconnect_internal(uint16_t local_cid, uint8_t reason){
     log_info("L2CAP_DISCONNECT local_cid 0x%x reason 0x%x", local_cid, reason);
     // find channel for local_cid
     l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
     if (channel) {
         channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+        l2cap_channel_set_pending(channel);
     }
     // process
     l2cap_run();
@@ -831,7 +1736,7 @@ static void l2cap_handle_connection_failed_for_addr(bd_addr_t address, uint8_t s
                 // discard channel
                 l2cap_stop_rtx(channel);
                 linked_list_iterator_remove(&it);
-                btstack_memory_l2cap_channel_free(channel);
+                l2cap_channel_free(channel);
                 break;
             default:
                 break;               
@@ -852,6 +1757,39 @@ static void l2cap_handle_connection_success_for_addr(bd_addr_t address, hci_con_
     l2cap_run();
 }
 
+// @returns 1 if a channel before this one in l2cap_channels has the same packet handler
+static int l2cap_channel_packet_handler_used_before(l2cap_channel_t * channel){
+    linked_item_t * it;
+    for (it = (linked_item_t *) l2cap_channels; it && it != (linked_item_t *) channel; it = it->next){
+        if (((l2cap_channel_t *) it)->packet_handler == channel->packet_handler) return 1;
+    }
+    return 0;
+}
+
+// notify each channel packet handler once, e.g. RFCOMM uses the same handler for all multiplexers
+static void l2cap_emit_batch_complete(uint8_t *packet, uint16_t size){
+    btstack_packet_handler_t notified[L2CAP_BATCH_COMPLETE_MAX_HANDLERS];
+    int num_notified = 0;
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &l2cap_channels);
+    while (linked_list_iterator_has_next(&it)){
+        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
+        int i;
+        if (!channel->packet_handler) continue;
+        for (i = 0; i < num_notified; i++){
+            if (notified[i] == channel->packet_handler) break;
+        }
+        if (i < num_notified) continue;
+        if (num_notified < L2CAP_BATCH_COMPLETE_MAX_HANDLERS){
+            notified[num_notified++] = channel->packet_handler;
+        } else if (l2cap_channel_packet_handler_used_before(channel)){
+            // more handlers than tracked, scan channels before this one
+            continue;
+        }
+        (* (channel->packet_handler))(HCI_EVENT_PACKET, channel->local_cid, packet, size);
+    }
+}
+
 void l2cap_event_handler(uint8_t *packet, uint16_t size){
     
     bd_addr_t address;
@@ -899,7 +1837,7 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
                 l2cap_emit_channel_closed(channel);
                 l2cap_stop_rtx(channel);
                 linked_list_iterator_remove(&it);
-                btstack_memory_l2cap_channel_free(channel);
+                l2cap_channel_free(channel);
             }
             break;
             
@@ -907,6 +1845,12 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
             l2cap_run();    // try sending signaling packets first
             l2cap_hand_out_credits();
             break;
+
+        case DAEMON_EVENT_HCI_BATCH_COMPLETE:
+            l2cap_run();    // try sending signaling packets first
+            l2cap_hand_out_credits();
+            l2cap_emit_batch_complete(packet, size);
+            break;
             
         // HCI Connection Timeouts
         case L2CAP_EVENT_TIMEOUT_CHECK:
@@ -961,7 +1905,7 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
 
                 log_info("l2cap - state %u", channel->state);
 
-                gap_security_level_t actual_level = packet[4];
+                gap_security_level_t actual_level = (gap_security_level_t) packet[4];
                 gap_security_level_t required_level = channel->required_security_level;
 
                 switch (channel->state){
@@ -972,12 +1916,14 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
                         } else {
                             channel->reason = 0x03; // security block
                             channel->state = L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_DECLINE;
+                            l2cap_channel_set_pending(channel);
                         }
                         break;
 
                     case L2CAP_STATE_WAIT_OUTGOING_SECURITY_LEVEL_UPDATE:
                         if (actual_level >= required_level){
                             channel->state = L2CAP_STATE_WILL_SEND_CONNECTION_REQUEST;
+                            l2cap_channel_set_pending(channel);
                         } else {
                             // disconnnect, authentication not good enough
                             hci_disconnect_security_block(handle);
@@ -1009,6 +1955,7 @@ void l2cap_event_handler(uint8_t *packet, uint16_t size){
 static void l2cap_handle_disconnect_request(l2cap_channel_t *channel, uint16_t identifier){
     channel->remote_sig_id = identifier;
     channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE;
+    l2cap_channel_set_pending(channel);
     l2cap_run();
 }
 
@@ -1067,13 +2014,19 @@ static void l2cap_handle_connection_request(hci_con_handle_t handle, uint8_t sig
     channel->handle = handle;
     channel->connection = service->connection;
     channel->packet_handler = service->packet_handler;
-    channel->local_cid  = l2cap_next_local_cid();
+    channel->local_cid  = l2cap_allocate_local_cid(channel);
     channel->remote_cid = source_cid;
     channel->local_mtu  = service->mtu;
     channel->remote_mtu = L2CAP_DEFAULT_MTU;
     channel->packets_granted = 0;
     channel->remote_sig_id = sig_id; 
     channel->required_security_level = service->required_security_level;
+#ifdef HAVE_L2CAP_ERTM
+    memset(&channel->ertm, 0, sizeof(l2cap_ertm_state_t));
+#endif
+#ifdef HAVE_L2CAP_LE_COC
+    channel->le_coc = 0;
+#endif
 
     // limit local mtu to max acl packet length
     if (channel->local_mtu > l2cap_max_mtu()) {
@@ -1086,6 +2039,8 @@ static void l2cap_handle_connection_request(hci_con_handle_t handle, uint8_t sig
     
     // add to connections list
     linked_list_add(&l2cap_channels, (linked_item_t *) channel);
+    linked_item_set_user(&channel->pending_item, channel);
+    l2cap_channel_set_pending(channel);
 
     // assert security requirements
     gap_request_security_level(handle, channel->required_security_level);
@@ -1100,11 +2055,28 @@ void l2cap_accept_connection_internal(uint16_t local_cid){
     }
 
     channel->state = L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT;
+    l2cap_channel_set_pending(channel);
 
     // process
     l2cap_run();
 }
 
+#ifdef HAVE_L2CAP_ERTM
+void l2cap_accept_ertm_connection_internal(uint16_t local_cid, l2cap_ertm_config_t * config, uint8_t * buffer, uint32_t size){
+    log_info("L2CAP_ACCEPT_ERTM_CONNECTION local_cid 0x%x mode %u", local_cid, config->mode);
+    l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
+    if (!channel) {
+        log_error("l2cap_accept_ertm_connection_internal called but local_cid 0x%x not found", local_cid);
+        return;
+    }
+    if (!l2cap_ertm_setup(channel, config, buffer, size)){
+        l2cap_decline_connection_internal(local_cid, 0x04);    // refused - no resources available
+        return;
+    }
+    l2cap_accept_connection_internal(local_cid);
+}
+#endif
+
 void l2cap_decline_connection_internal(uint16_t local_cid, uint8_t reason){
     log_info("L2CAP_DECLINE_CONNECTION local_cid 0x%x, reason %x", local_cid, reason);
     l2cap_channel_t * channel = l2cap_get_channel_for_local_cid( local_cid);
@@ -1114,6 +2086,7 @@ void l2cap_decline_connection_internal(uint16_t local_cid, uint8_t reason){
     }
     channel->state  = L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_DECLINE;
     channel->reason = reason;
+    l2cap_channel_set_pending(channel);
     l2cap_run();
 }
 
@@ -1145,6 +2118,16 @@ void l2cap_signaling_handle_configure_request(l2cap_channel_t *channel, uint8_t
         if (option_type == 2 && length == 2){
             channel->flush_timeout = READ_BT_16(command, pos);
         }
+#ifdef HAVE_L2CAP_ERTM
+        // Retransmission and Flow Control { type(8): 4, len(8): 9, ... }
+        if (option_type == 4 && length == 9){
+            l2cap_ertm_handle_rfc_option(channel, &command[pos]);
+        }
+        // FCS { type(8): 5, len(8): 1, FCS type(8) }
+        if (option_type == 5 && length == 1){
+            l2cap_ertm_handle_fcs_option(channel, &command[pos]);
+        }
+#endif
         // check for unknown options
         if (option_hint == 0 && (option_type == 0 || option_type >= 0x07)){
             log_info("l2cap cid %u, unknown options", channel->local_cid);
@@ -1152,6 +2135,20 @@ void l2cap_signaling_handle_configure_request(l2cap_channel_t *channel, uint8_t
         }
         pos += length;
     }
+#ifdef HAVE_L2CAP_ERTM
+    if ((flags & 1) == 0){
+        l2cap_ertm_check_remote_mode(channel);
+    }
+#endif
+}
+
+static void l2cap_handle_channel_open(l2cap_channel_t *channel){
+    channel->state = L2CAP_STATE_OPEN;
+#ifdef HAVE_L2CAP_ERTM
+    l2cap_ertm_channel_opened(channel);
+#endif
+    l2cap_emit_channel_opened(channel, 0);  // success
+    l2cap_emit_credits(channel, 1);
 }
 
 static int l2cap_channel_ready_for_open(l2cap_channel_t *channel){
@@ -1219,7 +2216,7 @@ void l2cap_signaling_handler_channel(l2cap_channel_t *channel, uint8_t *command)
                             
                             // discard channel
                             linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
-                            btstack_memory_l2cap_channel_free(channel);
+                            l2cap_channel_free(channel);
                             break;
                     }
                     break;
@@ -1243,6 +2240,13 @@ void l2cap_signaling_handler_channel(l2cap_channel_t *channel, uint8_t *command)
                     break;
                 case CONFIGURE_RESPONSE:
                     l2cap_stop_rtx(channel);
+#ifdef HAVE_L2CAP_ERTM
+                    if (!l2cap_ertm_handle_configure_response(channel, result, command)){
+                        channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+                        l2cap_channel_set_pending(channel);
+                        break;
+                    }
+#endif
                     switch (result){
                         case 0: // success
                             channelStateVarSetFlag(channel, L2CAP_CHANNEL_STATE_VAR_RCVD_CONF_RSP);
@@ -1260,10 +2264,7 @@ void l2cap_signaling_handler_channel(l2cap_channel_t *channel, uint8_t *command)
                     break;
             }
             if (l2cap_channel_ready_for_open(channel)){
-                // for open:
-                channel->state = L2CAP_STATE_OPEN;
-                l2cap_emit_channel_opened(channel, 0);
-                l2cap_emit_credits(channel, 1);
+                l2cap_handle_channel_open(channel);
             }
             break;
             
@@ -1435,6 +2436,15 @@ void l2cap_acl_handler( uint8_t *packet, uint16_t size ){
 
                     break;
                 }
+#ifdef HAVE_L2CAP_LE_COC
+                case LE_CREDIT_BASED_CONNECTION_REQUEST:
+                case LE_CREDIT_BASED_CONNECTION_RESPONSE:
+                case LE_FLOW_CONTROL_CREDIT:
+                case DISCONNECTION_REQUEST:
+                case DISCONNECTION_RESPONSE:
+                    l2cap_le_signaling_handler(handle, &packet[COMPLETE_L2CAP_HEADER]);
+                    break;
+#endif
                 default: {
                     uint8_t sig_id = packet[COMPLETE_L2CAP_HEADER + 1]; 
                     l2cap_register_signaling_response(handle, COMMAND_REJECT_LE, sig_id, L2CAP_REJ_CMD_UNKNOWN);
@@ -1447,6 +2457,22 @@ void l2cap_acl_handler( uint8_t *packet, uint16_t size ){
         default: {
             // Find channel for this channel_id and connection handle
             l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(channel_id);
+#ifdef HAVE_L2CAP_ERTM
+            if (channel && channel->ertm.mode != L2CAP_CHANNEL_MODE_BASIC) {
+                if (channel->state == L2CAP_STATE_OPEN){
+                    l2cap_ertm_handle_pdu(channel, packet, size);
+                    l2cap_run();
+                }
+                break;
+            }
+#endif
+#ifdef HAVE_L2CAP_LE_COC
+            if (channel && channel->le_coc){
+                l2cap_le_handle_pdu(channel, &packet[COMPLETE_L2CAP_HEADER], size-COMPLETE_L2CAP_HEADER);
+                l2cap_run();
+                break;
+            }
+#endif
             if (channel) {
                 l2cap_dispatch(channel, L2CAP_DATA_PACKET, &packet[COMPLETE_L2CAP_HEADER], size-COMPLETE_L2CAP_HEADER);
             }
@@ -1476,12 +2502,12 @@ void l2cap_finialize_channel_close(l2cap_channel_t *channel){
     // discard channel
     l2cap_stop_rtx(channel);
     linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
-    btstack_memory_l2cap_channel_free(channel);
+    l2cap_channel_free(channel);
 }
 
-l2cap_service_t * l2cap_get_service(uint16_t psm){
+static l2cap_service_t * l2cap_get_service_internal(linked_list_t * services, uint16_t psm){
     linked_list_iterator_t it;
-    linked_list_iterator_init(&it, &l2cap_services);
+    linked_list_iterator_init(&it, services);
     while (linked_list_iterator_has_next(&it)){
         l2cap_service_t * service = (l2cap_service_t *) linked_list_iterator_next(&it);
         if ( service->psm == psm){
@@ -1491,6 +2517,10 @@ l2cap_service_t * l2cap_get_service(uint16_t psm){
     return NULL;
 }
 
+l2cap_service_t * l2cap_get_service(uint16_t psm){
+    return l2cap_get_service_internal(&l2cap_services, psm);
+}
+
 void l2cap_register_service_internal(void *connection, btstack_packet_handler_t packet_handler, uint16_t psm, uint16_t mtu, gap_security_level_t security_level){
     
     log_info("L2CAP_REGISTER_SERVICE psm 0x%x mtu %u connection %p", psm, mtu, connection);
@@ -1573,3 +2603,404 @@ int l2cap_le_request_connection_parameter_update(uint16_t handle, uint16_t inter
 }
 #endif
 
+
+#ifdef HAVE_L2CAP_LE_COC
+
+// MARK: LE Credit-Based Connection-Oriented Channels
+
+// first K-frame of an SDU starts with SDU length
+#define L2CAP_LE_SDU_LENGTH_SIZE 2
+
+static void l2cap_le_setup_receive_buffer(l2cap_channel_t * channel, uint8_t * receive_sdu_buffer, uint16_t receive_buffer_size){
+    // K-frame has to fit into a single ACL packet, no need to be larger than a single SDU
+    uint32_t mps = receive_buffer_size + L2CAP_LE_SDU_LENGTH_SIZE;
+    if (mps > l2cap_max_le_mtu()){
+        mps = l2cap_max_le_mtu();
+    }
+    channel->le_coc = 1;
+    channel->local_mtu = receive_buffer_size;
+    channel->local_mps = mps;
+    // remote can send one complete SDU before it has to wait for new credits, even with minimal K-frames
+    channel->initial_credits = (receive_buffer_size + L2CAP_LE_SDU_LENGTH_SIZE + L2CAP_LE_DEFAULT_MTU - 1) / L2CAP_LE_DEFAULT_MTU;
+    channel->credits_incoming = channel->initial_credits;
+    channel->receive_sdu_buffer = receive_sdu_buffer;
+    channel->receive_sdu_len = 0;
+    channel->receive_sdu_pos = 0;
+    channel->send_sdu_buffer = NULL;
+}
+
+static l2cap_channel_t * l2cap_le_create_channel_entry(void * connection, btstack_packet_handler_t packet_handler, hci_connection_t * hci_connection, uint16_t psm){
+    l2cap_channel_t * channel = btstack_memory_l2cap_channel_get();
+    if (!channel) return NULL;
+    memset(channel, 0, sizeof(l2cap_channel_t));
+    BD_ADDR_COPY(channel->address, hci_connection->address);
+    channel->handle = hci_connection->con_handle;
+    channel->psm = psm;
+    channel->connection = connection;
+    channel->packet_handler = packet_handler;
+    channel->local_cid = l2cap_allocate_local_cid(channel);
+    channel->remote_sig_id = L2CAP_SIG_ID_INVALID;
+    channel->local_sig_id = L2CAP_SIG_ID_INVALID;
+    channel->state_var = L2CAP_CHANNEL_STATE_VAR_NONE;
+    channel->le_coc = 1;
+    return channel;
+}
+
+static void l2cap_le_add_channel(l2cap_channel_t * channel){
+    linked_list_add(&l2cap_channels, (linked_item_t *) channel);
+    linked_item_set_user(&channel->pending_item, channel);
+    l2cap_channel_set_pending(channel);
+}
+
+static uint8_t l2cap_le_status_for_result(uint16_t result){
+    switch (result){
+        case L2CAP_LE_RESULT_LE_PSM_NOT_SUPPORTED:
+            return L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_PSM;
+        case L2CAP_LE_RESULT_NO_RESOURCES_AVAILABLE:
+            return L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_RESOURCES;
+        default:
+            // insufficient authentication, authorization, encryption key size, encryption
+            return L2CAP_CONNECTION_RESPONSE_RESULT_REFUSED_SECURITY;
+    }
+}
+
+// protocol violation, e.g. K-frame without credits
+static void l2cap_le_disconnect_on_error(l2cap_channel_t * channel){
+    channel->state = L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST;
+    l2cap_channel_set_pending(channel);
+}
+
+static int l2cap_le_has_pending_work(l2cap_channel_t * channel){
+    if (!channel->le_coc) return 0;
+    if (channel->credits_incoming <= channel->initial_credits / 2) return 1;
+    return channel->send_sdu_buffer && channel->credits_outgoing;
+}
+
+static void l2cap_le_send_k_frame(l2cap_channel_t * channel){
+    hci_reserve_packet_buffer();
+    uint8_t * acl_buffer = hci_get_outgoing_packet_buffer();
+    uint16_t pos = COMPLETE_L2CAP_HEADER;
+    uint16_t max_payload = channel->remote_mps;
+    if (max_payload > l2cap_max_le_mtu()){
+        max_payload = l2cap_max_le_mtu();
+    }
+    if (channel->send_sdu_pos == 0){
+        bt_store_16(acl_buffer, pos, channel->send_sdu_len);
+        pos += L2CAP_LE_SDU_LENGTH_SIZE;
+        max_payload -= L2CAP_LE_SDU_LENGTH_SIZE;
+    }
+    uint16_t payload_len = channel->send_sdu_len - channel->send_sdu_pos;
+    if (payload_len > max_payload){
+        payload_len = max_payload;
+    }
+    memcpy(&acl_buffer[pos], &channel->send_sdu_buffer[channel->send_sdu_pos], payload_len);
+    pos += payload_len;
+    channel->send_sdu_pos += payload_len;
+    channel->credits_outgoing--;
+    if (channel->send_sdu_pos == channel->send_sdu_len){
+        // SDU complete, application can send next one after next credits event
+        channel->send_sdu_buffer = NULL;
+    }
+
+    int pb = hci_non_flushable_packet_boundary_flag_supported() ? 0x00 : 0x02;
+    // 0 - Connection handle : PB=pb : BC=00 
+    bt_store_16(acl_buffer, 0, channel->handle | (pb << 12) | (0 << 14));
+    // 2 - ACL length
+    bt_store_16(acl_buffer, 2, pos - 4);
+    // 4 - L2CAP packet length
+    bt_store_16(acl_buffer, 4, pos - 8);
+    // 6 - L2CAP channel DEST
+    bt_store_16(acl_buffer, 6, channel->remote_cid);
+    hci_send_acl_packet_buffer(pos);
+}
+
+static void l2cap_le_run_channel(l2cap_channel_t * channel){
+    if (!channel->le_coc) return;
+
+    // return credits when half of them are used up
+    if (channel->credits_incoming <= channel->initial_credits / 2){
+        if (!hci_can_send_acl_packet_now(channel->handle)) return;
+        uint16_t credits = channel->initial_credits - channel->credits_incoming;
+        channel->credits_incoming = channel->initial_credits;
+        l2cap_send_le_signaling_packet(channel->handle, LE_FLOW_CONTROL_CREDIT, l2cap_next_sig_id(), channel->local_cid, credits);
+    }
+
+    // fill all available ACL buffers
+    while (channel->send_sdu_buffer && channel->credits_outgoing && hci_can_send_acl_packet_now(channel->handle)){
+        l2cap_le_send_k_frame(channel);
+    }
+}
+
+static void l2cap_le_handle_pdu(l2cap_channel_t * channel, uint8_t * pdu, uint16_t len){
+    if (channel->state != L2CAP_STATE_OPEN) return;
+
+    if (channel->credits_incoming == 0 || len > channel->local_mps){
+        log_error("l2cap_le_handle_pdu cid 0x%02x, K-frame of %u bytes without credits or larger than MPS", channel->local_cid, len);
+        l2cap_le_disconnect_on_error(channel);
+        return;
+    }
+    channel->credits_incoming--;
+    if (channel->credits_incoming <= channel->initial_credits / 2){
+        l2cap_channel_set_pending(channel);
+    }
+
+    if (channel->receive_sdu_len == 0){
+        // first K-frame of SDU
+        if (len < L2CAP_LE_SDU_LENGTH_SIZE || READ_BT_16(pdu, 0) > channel->local_mtu){
+            log_error("l2cap_le_handle_pdu cid 0x%02x, invalid SDU start", channel->local_cid);
+            l2cap_le_disconnect_on_error(channel);
+            return;
+        }
+        channel->receive_sdu_len = READ_BT_16(pdu, 0);
+        channel->receive_sdu_pos = 0;
+        pdu += L2CAP_LE_SDU_LENGTH_SIZE;
+        len -= L2CAP_LE_SDU_LENGTH_SIZE;
+    }
+    if (channel->receive_sdu_pos + len > channel->receive_sdu_len){
+        log_error("l2cap_le_handle_pdu cid 0x%02x, SDU longer than announced", channel->local_cid);
+        l2cap_le_disconnect_on_error(channel);
+        return;
+    }
+    memcpy(&channel->receive_sdu_buffer[channel->receive_sdu_pos], pdu, len);
+    channel->receive_sdu_pos += len;
+    if (channel->receive_sdu_pos < channel->receive_sdu_len) return;
+
+    uint16_t sdu_len = channel->receive_sdu_len;
+    channel->receive_sdu_len = 0;
+    l2cap_dispatch(channel, L2CAP_DATA_PACKET, channel->receive_sdu_buffer, sdu_len);
+}
+
+static void l2cap_le_handle_connection_request(hci_con_handle_t handle, uint8_t sig_id, uint8_t * command){
+    uint16_t psm        = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET);
+    uint16_t source_cid = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 2);
+    uint16_t mtu        = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 4);
+    uint16_t mps        = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 6);
+    uint16_t credits    = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 8);
+
+    l2cap_service_t * service = l2cap_get_service_internal(&l2cap_le_services, psm);
+    if (!service){
+        l2cap_register_signaling_response(handle, LE_CREDIT_BASED_CONNECTION_REQUEST, sig_id, L2CAP_LE_RESULT_LE_PSM_NOT_SUPPORTED);
+        return;
+    }
+
+    hci_connection_t * hci_connection = hci_connection_for_handle(handle);
+    if (!hci_connection) {
+        log_error("no hci_connection for handle %u", handle);
+        return;
+    }
+
+    if (gap_security_level(handle) < service->required_security_level){
+        l2cap_register_signaling_response(handle, LE_CREDIT_BASED_CONNECTION_REQUEST, sig_id, L2CAP_LE_RESULT_INSUFFICIENT_AUTHENTICATION);
+        return;
+    }
+
+    l2cap_channel_t * channel = NULL;
+    if (mtu >= L2CAP_LE_DEFAULT_MTU && mps >= L2CAP_LE_DEFAULT_MTU){
+        channel = l2cap_le_create_channel_entry(service->connection, service->packet_handler, hci_connection, psm);
+    }
+    if (!channel){
+        l2cap_register_signaling_response(handle, LE_CREDIT_BASED_CONNECTION_REQUEST, sig_id, L2CAP_LE_RESULT_NO_RESOURCES_AVAILABLE);
+        return;
+    }
+    channel->remote_cid = source_cid;
+    channel->remote_mtu = mtu;
+    channel->remote_mps = mps;
+    channel->credits_outgoing = credits;
+    channel->remote_sig_id = sig_id;
+    channel->required_security_level = service->required_security_level;
+    channel->state = L2CAP_STATE_WAIT_CLIENT_ACCEPT_OR_REJECT;
+    l2cap_le_add_channel(channel);
+
+    l2cap_emit_connection_request(channel);
+}
+
+static void l2cap_le_handle_connection_response(l2cap_channel_t * channel, uint8_t * command){
+    l2cap_stop_rtx(channel);
+    uint16_t result = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 8);
+    uint16_t mps    = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 4);
+    if (result != L2CAP_LE_RESULT_SUCCESS || mps < L2CAP_LE_DEFAULT_MTU){
+        l2cap_emit_channel_opened(channel, l2cap_le_status_for_result(result));
+        linked_list_remove(&l2cap_channels, (linked_item_t *) channel);
+        l2cap_channel_free(channel);
+        return;
+    }
+    channel->remote_cid       = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET);
+    channel->remote_mtu       = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 2);
+    channel->remote_mps       = mps;
+    channel->credits_outgoing = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 6);
+    l2cap_handle_channel_open(channel);
+}
+
+static void l2cap_le_handle_flow_control_credit(l2cap_channel_t * channel, uint16_t credits){
+    if (channel->state != L2CAP_STATE_OPEN) return;
+    if ((uint32_t) channel->credits_outgoing + credits > L2CAP_LE_MAX_CREDITS){
+        log_error("l2cap_le_handle_flow_control_credit cid 0x%02x, credit overflow", channel->local_cid);
+        l2cap_le_disconnect_on_error(channel);
+        return;
+    }
+    channel->credits_outgoing += credits;
+    l2cap_channel_set_pending(channel);
+}
+
+static void l2cap_le_signaling_handler(hci_con_handle_t handle, uint8_t * command){
+    uint8_t code   = command[L2CAP_SIGNALING_COMMAND_CODE_OFFSET];
+    uint8_t sig_id = command[L2CAP_SIGNALING_COMMAND_SIGID_OFFSET];
+
+    if (code == LE_CREDIT_BASED_CONNECTION_REQUEST){
+        l2cap_le_handle_connection_request(handle, sig_id, command);
+        l2cap_run();
+        return;
+    }
+
+    // responses are matched by signaling identifier, requests and credits by channel id
+    uint16_t cid = READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET);
+    linked_list_iterator_t it;
+    linked_list_iterator_init(&it, &l2cap_channels);
+    while (linked_list_iterator_has_next(&it)){
+        l2cap_channel_t * channel = (l2cap_channel_t *) linked_list_iterator_next(&it);
+        if (channel->handle != handle || !channel->le_coc) continue;
+        switch (code){
+            case LE_CREDIT_BASED_CONNECTION_RESPONSE:
+                if (channel->state != L2CAP_STATE_WAIT_LE_CONNECTION_RESPONSE || channel->local_sig_id != sig_id) continue;
+                l2cap_le_handle_connection_response(channel, command);
+                break;
+            case LE_FLOW_CONTROL_CREDIT:
+                if (channel->remote_cid != cid) continue;
+                l2cap_le_handle_flow_control_credit(channel, READ_BT_16(command, L2CAP_SIGNALING_COMMAND_DATA_OFFSET + 2));
+                break;
+            case DISCONNECTION_REQUEST:
+                if (channel->local_cid != cid) continue;
+                if (channel->state != L2CAP_STATE_OPEN && channel->state != L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST
+                &&  channel->state != L2CAP_STATE_WAIT_DISCONNECT) break;
+                l2cap_handle_disconnect_request(channel, sig_id);
+                break;
+            case DISCONNECTION_RESPONSE:
+                if (channel->state != L2CAP_STATE_WAIT_DISCONNECT || channel->local_sig_id != sig_id) continue;
+                l2cap_finialize_channel_close(channel);
+                break;
+            default:
+                break;
+        }
+        break;
+    }
+    l2cap_run();
+}
+
+void l2cap_le_register_service_internal(void * connection, btstack_packet_handler_t packet_handler, uint16_t psm, gap_security_level_t security_level){
+    
+    log_info("L2CAP_LE_REGISTER_SERVICE psm 0x%x connection %p", psm, connection);
+
+    l2cap_service_t * service = l2cap_get_service_internal(&l2cap_le_services, psm);
+    if (service) {
+        log_error("l2cap_le_register_service_internal: LE PSM %u already registered", psm);
+        l2cap_emit_service_registered(connection, L2CAP_SERVICE_ALREADY_REGISTERED, psm);
+        return;
+    }
+
+    service = btstack_memory_l2cap_service_get();
+    if (!service) {
+        log_error("l2cap_le_register_service_internal: no memory for l2cap_service_t");
+        l2cap_emit_service_registered(connection, BTSTACK_MEMORY_ALLOC_FAILED, psm);
+        return;
+    }
+
+    // MTU is set when connection is accepted
+    service->psm = psm;
+    service->mtu = 0;
+    service->connection = connection;
+    service->packet_handler = packet_handler;
+    service->required_security_level = security_level;
+    linked_list_add(&l2cap_le_services, (linked_item_t *) service);
+
+    l2cap_emit_service_registered(connection, 0, psm);
+}
+
+void l2cap_le_unregister_service_internal(void * connection, uint16_t psm){
+    log_info("L2CAP_LE_UNREGISTER_SERVICE psm 0x%x", psm);
+    l2cap_service_t * service = l2cap_get_service_internal(&l2cap_le_services, psm);
+    if (!service) return;
+    linked_list_remove(&l2cap_le_services, (linked_item_t *) service);
+    btstack_memory_l2cap_service_free(service);
+}
+
+void l2cap_le_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler, hci_con_handle_t handle, uint16_t psm,
+    uint8_t * receive_sdu_buffer, uint16_t receive_buffer_size){
+
+    log_info("L2CAP_LE_CREATE_CHANNEL handle 0x%x psm 0x%x mtu %u", handle, psm, receive_buffer_size);
+
+    hci_connection_t * hci_connection = hci_connection_for_handle(handle);
+    if (!hci_connection){
+        bd_addr_t address;
+        memset(address, 0, sizeof(bd_addr_t));
+        l2cap_emit_channel_opened_failed(address, psm, 0x02);   // unknown connection identifier
+        return;
+    }
+    l2cap_channel_t * channel = NULL;
+    if (receive_buffer_size >= L2CAP_LE_DEFAULT_MTU){
+        channel = l2cap_le_create_channel_entry(connection, packet_handler, hci_connection, psm);
+    }
+    if (!channel){
+        l2cap_emit_channel_opened_failed(hci_connection->address, psm, BTSTACK_MEMORY_ALLOC_FAILED);
+        return;
+    }
+    l2cap_le_setup_receive_buffer(channel, receive_sdu_buffer, receive_buffer_size);
+    channel->state = L2CAP_STATE_WILL_SEND_LE_CONNECTION_REQUEST;
+    l2cap_le_add_channel(channel);
+    l2cap_run();
+}
+
+void l2cap_le_accept_connection_internal(uint16_t local_cid, uint8_t * receive_sdu_buffer, uint16_t receive_buffer_size){
+    log_info("L2CAP_LE_ACCEPT_CONNECTION local_cid 0x%x mtu %u", local_cid, receive_buffer_size);
+    l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
+    if (!channel || !channel->le_coc) {
+        log_error("l2cap_le_accept_connection_internal called but local_cid 0x%x not found", local_cid);
+        return;
+    }
+    if (receive_buffer_size < L2CAP_LE_DEFAULT_MTU){
+        log_error("l2cap_le_accept_connection_internal: receive buffer of %u bytes too small", receive_buffer_size);
+        l2cap_le_decline_connection_internal(local_cid);
+        return;
+    }
+    l2cap_le_setup_receive_buffer(channel, receive_sdu_buffer, receive_buffer_size);
+    channel->state = L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_ACCEPT;
+    l2cap_channel_set_pending(channel);
+    l2cap_run();
+}
+
+void l2cap_le_decline_connection_internal(uint16_t local_cid){
+    log_info("L2CAP_LE_DECLINE_CONNECTION local_cid 0x%x", local_cid);
+    l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
+    if (!channel || !channel->le_coc) {
+        log_error("l2cap_le_decline_connection_internal called but local_cid 0x%x not found", local_cid);
+        return;
+    }
+    channel->state  = L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_DECLINE;
+    channel->reason = L2CAP_LE_RESULT_NO_RESOURCES_AVAILABLE;
+    l2cap_channel_set_pending(channel);
+    l2cap_run();
+}
+
+int l2cap_le_send_data(uint16_t local_cid, uint8_t * data, uint16_t len){
+    l2cap_channel_t * channel = l2cap_get_channel_for_local_cid(local_cid);
+    if (!channel || !channel->le_coc) {
+        log_error("l2cap_le_send_data no LE channel for cid 0x%02x", local_cid);
+        return -1;   // TODO: define error
+    }
+    if (len > channel->remote_mtu){
+        log_error("l2cap_le_send_data cid 0x%02x, SDU of %u bytes exceeds remote MTU %u", local_cid, len, channel->remote_mtu);
+        return L2CAP_DATA_LEN_EXCEEDS_REMOTE_MTU;
+    }
+    if (channel->state != L2CAP_STATE_OPEN || !channel->packets_granted || channel->send_sdu_buffer){
+        log_info("l2cap_le_send_data cid 0x%02x, cannot send", local_cid);
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+    channel->packets_granted--;
+    channel->send_sdu_buffer = data;
+    channel->send_sdu_len = len;
+    channel->send_sdu_pos = 0;
+    l2cap_channel_set_pending(channel);
+    l2cap_run();
+    return 0;
+}
+
+#endif
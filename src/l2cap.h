@@ -81,10 +81,25 @@ extern "C" {
 #define L2CAP_CID_SECURITY_MANAGER_PROTOCOL 0x0006
 
 // L2CAP Configuration Result Codes
+#define L2CAP_CONF_RESULT_UNACCEPTABLE_PARAMETERS 0x0001
 #define L2CAP_CONF_RESULT_UNKNOWN_OPTIONS   0x0003
 
 // L2CAP Reject Result Codes
 #define L2CAP_REJ_CMD_UNKNOWN               0x0000
+
+// L2CAP LE Credit Based Connection Result Codes
+#define L2CAP_LE_RESULT_SUCCESS                     0x0000
+#define L2CAP_LE_RESULT_LE_PSM_NOT_SUPPORTED        0x0002
+#define L2CAP_LE_RESULT_NO_RESOURCES_AVAILABLE      0x0004
+#define L2CAP_LE_RESULT_INSUFFICIENT_AUTHENTICATION 0x0005
+#define L2CAP_LE_RESULT_INSUFFICIENT_ENCRYPTION     0x0008
+
+// LE Credit Based Flow Control: max number of credits
+#define L2CAP_LE_MAX_CREDITS 0xffff
+
+#if defined(HAVE_L2CAP_LE_COC) && !defined(HAVE_BLE)
+#error "HAVE_L2CAP_LE_COC requires HAVE_BLE"
+#endif
     
 // Response Timeout eXpired
 #define L2CAP_RTX_TIMEOUT_MS 2000
@@ -92,6 +107,11 @@ extern "C" {
 // Extended Response Timeout eXpired
 #define L2CAP_ERTX_TIMEOUT_MS 120000
 
+// number of distinct channel packet handlers tracked while notifying DAEMON_EVENT_HCI_BATCH_COMPLETE
+#ifndef L2CAP_BATCH_COMPLETE_MAX_HANDLERS
+#define L2CAP_BATCH_COMPLETE_MAX_HANDLERS 4
+#endif
+
 // private structs
 typedef enum {
     L2CAP_STATE_CLOSED = 1,           // no baseband
@@ -111,6 +131,10 @@ typedef enum {
     L2CAP_STATE_WILL_SEND_CONNECTION_RESPONSE_ACCEPT,   
     L2CAP_STATE_WILL_SEND_DISCONNECT_REQUEST,
     L2CAP_STATE_WILL_SEND_DISCONNECT_RESPONSE,
+    L2CAP_STATE_WILL_SEND_LE_CONNECTION_REQUEST,
+    L2CAP_STATE_WAIT_LE_CONNECTION_RESPONSE,
+    L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_ACCEPT,
+    L2CAP_STATE_WILL_SEND_LE_CONNECTION_RESPONSE_DECLINE,
 } L2CAP_STATE;
 
 typedef enum {
@@ -126,13 +150,108 @@ typedef enum {
     L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_INVALID = 1 << 8,   // in CONF RSP, send UNKNOWN OPTIONS
     L2CAP_CHANNEL_STATE_VAR_SEND_CMD_REJ_UNKNOWN  = 1 << 9,   // send CMD_REJ with reason unknown
     L2CAP_CHANNEL_STATE_VAR_SEND_CONN_RESP_PEND   = 1 << 10,  // send Connection Respond with pending
+    L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_ERTM    = 1 << 11,  // in CONF RSP, add Retransmission and Flow Control option
+    L2CAP_CHANNEL_STATE_VAR_SEND_CONF_RSP_UNACCEPTABLE = 1 << 12, // send CONF RSP with unacceptable parameters, e.g. mode
 } L2CAP_CHANNEL_STATE_VAR;
 
+#ifdef HAVE_L2CAP_ERTM
+
+// max number of outgoing I-frames stored per channel
+#ifndef L2CAP_ERTM_MAX_TX_BUFFERS
+#define L2CAP_ERTM_MAX_TX_BUFFERS 8
+#endif
+
+// max delay for acknowledging received I-frames if no I-frame can carry the acknowledgement
+#ifndef L2CAP_ERTM_ACK_TIMEOUT_MS
+#define L2CAP_ERTM_ACK_TIMEOUT_MS 200
+#endif
+
+typedef enum {
+    L2CAP_CHANNEL_MODE_BASIC                   = 0,
+    L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION = 3,
+    L2CAP_CHANNEL_MODE_STREAMING               = 4,
+} l2cap_channel_mode_t;
+
+// configuration for Enhanced Retransmission and Streaming Mode channels
+typedef struct {
+    l2cap_channel_mode_t mode;
+    uint8_t  mode_mandatory;            // if not set, fall back to Basic mode if remote doesn't support mode
+    uint8_t  max_transmit;              // max transmissions of a single I-frame by remote, 0 = infinite
+    uint16_t retransmission_timeout_ms;
+    uint16_t monitor_timeout_ms;
+    uint16_t local_mtu;                 // max incoming SDU size
+    uint8_t  num_tx_buffers;            // outgoing I-frames stored for retransmission, limits tx window
+    uint8_t  use_fcs;
+} l2cap_ertm_config_t;
+
+typedef enum {
+    L2CAP_ERTM_TIMER_NONE,
+    L2CAP_ERTM_TIMER_RETRANSMISSION,
+    L2CAP_ERTM_TIMER_MONITOR,
+} l2cap_ertm_timer_state_t;
+
+typedef struct {
+    uint8_t  sar;
+    uint16_t sdu_length;                // only for start of SDU
+    uint16_t len;
+} l2cap_ertm_tx_frame_t;
+
+typedef struct {
+    l2cap_ertm_config_t config;
+
+    // negotiated mode, might fall back to basic
+    l2cap_channel_mode_t mode;
+    l2cap_channel_mode_t remote_mode;
+    uint8_t  remote_fcs_none;
+    uint8_t  fcs;
+
+    // outgoing
+    uint16_t local_mps;                 // size of tx slot and max incoming payload
+    uint16_t remote_mps;
+    uint8_t  tx_window;
+    uint8_t  max_transmit;
+    uint16_t retransmission_timeout_ms;
+    uint16_t monitor_timeout_ms;
+    uint8_t  expected_ack_seq;          // oldest unacknowledged I-frame
+    uint8_t  tx_send_seq;               // next I-frame to (re-)transmit
+    uint8_t  next_tx_seq;               // sequence number for next stored I-frame
+    uint8_t  tx_frame_head;             // index of expected_ack_seq in tx_frames
+    uint8_t  remote_busy;
+    uint8_t  retry_count;
+    l2cap_ertm_tx_frame_t tx_frames[L2CAP_ERTM_MAX_TX_BUFFERS];
+    uint8_t * tx_buffer;
+
+    // incoming
+    uint8_t  expected_tx_seq;
+    uint8_t  ack_window;                // max I-frames remote sends without acknowledgement
+    uint8_t  rx_unacked;                // received I-frames not acknowledged yet
+    uint8_t  rej_sent;
+    uint8_t  rx_sdu_active;
+    uint16_t rx_sdu_length;
+    uint16_t rx_sdu_pos;
+    uint8_t * rx_buffer;
+
+    // pending S-frames
+    uint8_t  send_ack;
+    uint8_t  send_rej;
+    uint8_t  send_poll;
+    uint8_t  send_final;
+
+    l2cap_ertm_timer_state_t timer_state;
+    timer_source_t timer;               // retransmission or monitor timer
+    timer_source_t ack_timer;
+} l2cap_ertm_state_t;
+
+#endif
+
 // info regarding an actual coneection
 typedef struct {
     // linked list - assert: first field
     linked_item_t    item;
     
+    // list of channels with pending signaling or waiting for credits
+    linked_item_t    pending_item;
+
     L2CAP_STATE state;
     L2CAP_CHANNEL_STATE_VAR state_var;
     
@@ -166,6 +285,31 @@ typedef struct {
     // internal connection
     btstack_packet_handler_t packet_handler;
     
+#ifdef HAVE_L2CAP_ERTM
+    // Enhanced Retransmission and Streaming Mode
+    l2cap_ertm_state_t ertm;
+#endif
+
+#ifdef HAVE_L2CAP_LE_COC
+    // LE Credit-Based Connection-Oriented Channel
+    uint8_t   le_coc;
+    uint16_t  local_mps;
+    uint16_t  remote_mps;
+    uint16_t  credits_outgoing;     // K-frames we can send
+    uint16_t  credits_incoming;     // K-frames remote can send
+    uint16_t  initial_credits;      // K-frames needed for one SDU of local MTU
+
+    // incoming SDU, receive buffer of local MTU provided by application
+    uint8_t * receive_sdu_buffer;
+    uint16_t  receive_sdu_len;      // 0 if no SDU started
+    uint16_t  receive_sdu_pos;
+
+    // outgoing SDU, data provided by application
+    uint8_t * send_sdu_buffer;      // NULL if no SDU active
+    uint16_t  send_sdu_len;
+    uint16_t  send_sdu_pos;
+#endif
+
 } l2cap_channel_t;
 
 // info regarding potential connections
@@ -259,6 +403,39 @@ void l2cap_unregister_service_internal(void *connection, uint16_t psm);
 void l2cap_accept_connection_internal(uint16_t local_cid);
 void l2cap_decline_connection_internal(uint16_t local_cid, uint8_t reason);
 
+#ifdef HAVE_L2CAP_ERTM
+// Size of buffer needed for Enhanced Retransmission or Streaming Mode channel with given configuration.
+uint32_t l2cap_ertm_buffer_size(l2cap_ertm_config_t * config);
+
+// Creates L2CAP channel in Enhanced Retransmission or Streaming Mode. The buffer stores outgoing I-frames and
+// incoming SDUs and must stay valid until the channel is closed.
+void l2cap_create_ertm_channel_internal(void * connection, btstack_packet_handler_t packet_handler, bd_addr_t address, uint16_t psm,
+    l2cap_ertm_config_t * config, uint8_t * buffer, uint32_t size);
+
+// Accepts incoming L2CAP connection and requests Enhanced Retransmission or Streaming Mode, see l2cap_create_ertm_channel_internal.
+void l2cap_accept_ertm_connection_internal(uint16_t local_cid, l2cap_ertm_config_t * config, uint8_t * buffer, uint32_t size);
+#endif
+
+#ifdef HAVE_L2CAP_LE_COC
+// Registers LE Credit-Based Connection-Oriented Channel service with given LE PSM. On embedded systems, use NULL for connection parameter.
+// Connection requests on a link below the required security level are rejected with insufficient authentication.
+// Pairing is not triggered, the link has to be paired/encrypted before the remote connects (or retries).
+void l2cap_le_register_service_internal(void * connection, btstack_packet_handler_t packet_handler, uint16_t psm, gap_security_level_t security_level);
+void l2cap_le_unregister_service_internal(void * connection, uint16_t psm);
+
+// Creates LE Credit-Based Connection-Oriented Channel to LE PSM over existing LE connection. Incoming SDUs
+// are reassembled in the receive buffer, its size is used as local MTU. Credits are sized to the receive buffer.
+void l2cap_le_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler, hci_con_handle_t handle, uint16_t psm,
+    uint8_t * receive_sdu_buffer, uint16_t receive_buffer_size);
+
+// Accepts/Deny incoming LE Credit-Based connection, see l2cap_le_create_channel_internal for receive buffer.
+void l2cap_le_accept_connection_internal(uint16_t local_cid, uint8_t * receive_sdu_buffer, uint16_t receive_buffer_size);
+void l2cap_le_decline_connection_internal(uint16_t local_cid);
+
+// Sends SDU on LE Credit-Based channel. The SDU is not buffered by L2CAP, each K-frame is copied from data into the
+// HCI packet buffer when it is sent. data has to stay valid until L2CAP_EVENT_CREDITS is emitted for this channel.
+int l2cap_le_send_data(uint16_t local_cid, uint8_t * data, uint16_t len);
+#endif
 
 // Request LE connection parameter update
 int l2cap_le_request_connection_parameter_update(uint16_t handle, uint16_t interval_min, uint16_t interval_max, uint16_t slave_latency, uint16_t timeout_multiplier);
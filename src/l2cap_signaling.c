@@ -62,6 +62,9 @@ static const char *l2cap_signaling_commands_format[] = {
 // skip 6 not supported signaling pdus, see below
 "2222", // 0x12 connection parameter update request: interval min, interval max, slave latency, timeout multipler
 "2",    // 0x13 connection parameter update response: result
+"22222",// 0x14 le credit based connection request: le psm, source cid, mtu, mps, initial credits
+"22222",// 0x15 le credit based connection response: dest cid, mtu, mps, initial credits, result
+"22",   // 0x16 le flow control credit: cid, credits
 #endif
 };
 
@@ -78,6 +81,10 @@ uint8_t l2cap_next_sig_id(void){
 }
 
 uint16_t l2cap_next_local_cid(void){
+    // dynamically allocated CIDs start at 0x0040
+    if (source_cid < 0x40){
+        source_cid = 0x40;
+    }
     return source_cid++;
 }
 
@@ -97,10 +104,11 @@ uint16_t l2cap_create_signaling_internal(uint8_t * acl_buffer, hci_con_handle_t
     // 12 - L2CAP signaling parameters
     uint16_t pos = 12;
     // skip AMP commands
+    int index = cmd;
     if (cmd >= CONNECTION_PARAMETER_UPDATE_REQUEST){
-        cmd -= 6;
+        index -= 6;
     }
-    const char *format = l2cap_signaling_commands_format[cmd-1];
+    const char *format = l2cap_signaling_commands_format[index-1];
     uint16_t word;
     uint8_t * ptr;
     while (*format) {
@@ -61,17 +61,27 @@ void memory_pool_create(memory_pool_t *pool, void * storage, int count, int bloc
         memory_pool_free(pool, mem_ptr);
         mem_ptr += block_size;
     }
+    pool->blocks_in_use = 0;
+    pool->max_blocks_in_use = 0;
+    pool->failed_allocations = 0;
 }
 
 void * memory_pool_get(memory_pool_t *pool){
     node_t *free_blocks = (node_t*) pool;
     
-    if (!free_blocks->next) return NULL;
+    if (!free_blocks->next) {
+        pool->failed_allocations++;
+        return NULL;
+    }
     
     // remove first
     node_t *node      = free_blocks->next;
     free_blocks->next = node->next;
     
+    pool->blocks_in_use++;
+    if (pool->blocks_in_use > pool->max_blocks_in_use){
+        pool->max_blocks_in_use = pool->blocks_in_use;
+    }
     return (void*) node;
 }
 
@@ -81,4 +91,5 @@ void memory_pool_free(memory_pool_t *pool, void * block){
     // add block as node to list
     node->next          = free_blocks->next;
     free_blocks->next   = node;
+    pool->blocks_in_use--;
 }
@@ -52,6 +52,7 @@
 #include "hci.h"
 #include "hci_dump.h"
 #include "debug.h"
+#include "btstack_stats.h"
 #include "rfcomm.h"
 
 // workaround for missing PRIxPTR on mspgcc (16/20-bit MCU)
@@ -976,6 +977,10 @@ static int rfcomm_multiplexer_hci_event_handler(uint8_t *packet, uint16_t size){
             // testing DMA done code
             rfcomm_run();
             break;
+
+        case DAEMON_EVENT_HCI_BATCH_COMPLETE:
+            // handled: run RFCOMM, don't forward, application gets it from L2CAP once
+            return 1;
             
         case L2CAP_EVENT_CHANNEL_CLOSED:
             // data: event (8), len(8), channel (16)
@@ -1279,6 +1284,7 @@ static void rfcomm_channel_packet_handler_uih(rfcomm_multiplexer_t *multiplexer,
         }
         
         // deliver payload
+        STATS_SINCE_RX(BTSTACK_STATS_RFCOMM_RX);
         (*app_packet_handler)(channel->connection, RFCOMM_DATA_PACKET, channel->rfcomm_cid,
                               &packet[payload_offset], size-payload_offset-1);
     }
@@ -1932,6 +1938,9 @@ static void rfcomm_channel_state_machine(rfcomm_channel_t *channel, rfcomm_chann
 // process outstanding signaling tasks
 static void rfcomm_run(void){
     
+    // run once at the end of the HCI batch
+    if (hci_batch_active()) return;
+
     linked_item_t *it;
     linked_item_t *next;
     
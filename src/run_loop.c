@@ -62,6 +62,10 @@ extern run_loop_t run_loop_posix;
 extern run_loop_t run_loop_cocoa;
 #endif
 
+#ifdef USE_DISPATCH_RUN_LOOP
+extern run_loop_t run_loop_dispatch;
+#endif
+
 // assert run loop initialized
 static void run_loop_assert(void){
 #ifndef EMBEDDED
@@ -98,6 +102,30 @@ int run_loop_remove_data_source(data_source_t *ds){
     return the_run_loop->remove_data_source(ds);
 }
 
+/**
+ * Suspend data_source, e.g. while its connection is parked
+ */
+void run_loop_suspend_data_source(data_source_t *ds){
+    run_loop_assert();
+    if (!the_run_loop->suspend_data_source){
+        the_run_loop->remove_data_source(ds);
+        return;
+    }
+    the_run_loop->suspend_data_source(ds);
+}
+
+/**
+ * Resume suspended data_source
+ */
+void run_loop_resume_data_source(data_source_t *ds){
+    run_loop_assert();
+    if (!the_run_loop->resume_data_source){
+        the_run_loop->add_data_source(ds);
+        return;
+    }
+    the_run_loop->resume_data_source(ds);
+}
+
 void run_loop_set_timer(timer_source_t *a, uint32_t timeout_in_ms){
     run_loop_assert();
     the_run_loop->set_timer(a, timeout_in_ms);
@@ -155,6 +183,11 @@ void run_loop_init(RUN_LOOP_TYPE type){
         case RUN_LOOP_COCOA:
             the_run_loop = &run_loop_cocoa;
             break;
+#endif
+#ifdef USE_DISPATCH_RUN_LOOP
+        case RUN_LOOP_DISPATCH:
+            the_run_loop = &run_loop_dispatch;
+            break;
 #endif
         default:
 #ifndef EMBEDDED
@@ -66,6 +66,9 @@ typedef struct {
 	int  (*remove_timer)(timer_source_t *timer); 
 	void (*execute)(void);
 	void (*dump_timer)(void);
+	// optional, remove/add data source is used if not provided
+	void (*suspend_data_source)(data_source_t *dataSource);
+	void (*resume_data_source)(data_source_t *dataSource);
 } run_loop_t;
 
 #if defined __cplusplus
@@ -41,6 +41,7 @@
 #include "sdp.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <btstack/sdp_util.h>
@@ -49,13 +50,11 @@
 #include "l2cap.h"
 
 #include "debug.h"
+#include "btstack_memory.h"
 
 // max reserved ServiceRecordHandle
 #define maxReservedServiceRecordHandle 0xffff
 
-// max SDP response
-#define SDP_RESPONSE_BUFFER_SIZE (HCI_ACL_BUFFER_SIZE-HCI_ACL_HEADER_SIZE)
-
 static void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
 
 // registered service records
@@ -64,13 +63,15 @@ static linked_list_t sdp_service_records = NULL;
 // our handles start after the reserved range
 static uint32_t sdp_next_service_record_handle = ((uint32_t) maxReservedServiceRecordHandle) + 2;
 
-static uint8_t sdp_response_buffer[SDP_RESPONSE_BUFFER_SIZE];
-
 static void (*app_packet_handler)(void * connection, uint8_t packet_type,
                                   uint16_t channel, uint8_t *packet, uint16_t size) = NULL;
 
-static uint16_t l2cap_cid = 0;
-static uint16_t sdp_response_size = 0;
+// open SDP server connections, each with its own response buffer
+static linked_list_t sdp_server_connections = NULL;
+
+// connection of request currently being handled
+static sdp_server_connection_t * sdp_server_connection = NULL;
+static uint8_t * sdp_response_buffer = NULL;
 
 void sdp_init(){
     // register with l2cap psm sevices - max MTU
@@ -81,7 +82,6 @@ void sdp_init(){
 void sdp_register_packet_handler(void (*handler)(void * connection, uint8_t packet_type,
                                                  uint16_t channel, uint8_t *packet, uint16_t size)){
 	app_packet_handler = handler;
-    l2cap_cid = 0;
 }
 
 uint32_t sdp_get_service_record_handle(uint8_t * record){
@@ -125,6 +125,180 @@ uint32_t sdp_create_service_record_handle(void){
     return handle;
 }
 
+static sdp_server_connection_t * sdp_server_connection_for_l2cap_cid(uint16_t l2cap_cid){
+    linked_item_t *it;
+    for (it = (linked_item_t *) sdp_server_connections; it ; it = it->next){
+        sdp_server_connection_t * connection = (sdp_server_connection_t *) it;
+        if (connection->l2cap_cid == l2cap_cid) return connection;
+    }
+    return NULL;
+}
+
+// stored continuation records become invalid when the record list changes
+static void sdp_server_connections_reset_continuation(void){
+    linked_item_t *it;
+    for (it = (linked_item_t *) sdp_server_connections; it ; it = it->next){
+        ((sdp_server_connection_t *) it)->continuation_record = NULL;
+    }
+}
+
+// MARK: Service record index
+
+// build UUID bitmap and attribute offset table once, so requests don't need to parse the whole record
+static void sdp_record_item_create_index(service_record_item_t * item){
+    uint8_t * record = item->service_record;
+    sdp_create_uuid_bitmap(record, item->uuid_bitmap);
+    item->num_attributes = 0;
+    item->attribute_offsets = NULL;
+#if !defined(EMBEDDED) || defined(HAVE_MALLOC)
+    // record is a DES of { attribute ID (UINT16), attribute value } pairs in ascending order
+    int end_pos = de_get_len(record);
+    int pos;
+    uint16_t num_attributes = 0;
+    for (pos = de_get_header_size(record); pos + 3 < end_pos; pos += 3 + de_get_len(&record[pos+3])){
+        num_attributes++;
+    }
+    uint16_t * offsets = (uint16_t *) malloc((num_attributes + 1) * sizeof(uint16_t));
+    if (!offsets) return;
+    uint16_t i = 0;
+    uint32_t last_id = 0;
+    for (pos = de_get_header_size(record); pos + 3 < end_pos; pos += 3 + de_get_len(&record[pos+3])){
+        uint32_t attribute_id = READ_NET_16(record, pos + 1);
+        if (de_get_element_type(&record[pos]) != DE_UINT || de_get_size_type(&record[pos]) != DE_SIZE_16
+        ||  (i && attribute_id <= last_id)){
+            // unexpected layout, use record traversal
+            free(offsets);
+            return;
+        }
+        last_id = attribute_id;
+        offsets[i++] = pos;
+    }
+    offsets[i] = pos;
+    item->num_attributes = num_attributes;
+    item->attribute_offsets = offsets;
+#endif
+}
+
+static void sdp_record_item_free_index(service_record_item_t * item){
+#if !defined(EMBEDDED) || defined(HAVE_MALLOC)
+    if (item->attribute_offsets){
+        free(item->attribute_offsets);
+    }
+#endif
+    item->attribute_offsets = NULL;
+}
+
+// index of first attribute with ID >= attribute_id
+static uint16_t sdp_record_item_lower_bound(service_record_item_t * item, uint32_t attribute_id){
+    uint16_t lo = 0;
+    uint16_t hi = item->num_attributes;
+    while (lo < hi){
+        uint16_t mid = (lo + hi) / 2;
+        if ((uint32_t) READ_NET_16(item->service_record, item->attribute_offsets[mid] + 1) < attribute_id){
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// get ID range of AttributeIDList element, @returns 0 if element is not an attribute ID or range
+static int sdp_attribute_list_element_range(uint8_t * element, uint32_t * first_id, uint32_t * last_id){
+    if (de_get_element_type(element) != DE_UINT) return 0;
+    switch (de_get_size_type(element)){
+        case DE_SIZE_16:
+            *first_id = READ_NET_16(element, 1);
+            *last_id  = *first_id;
+            return 1;
+        case DE_SIZE_32:
+            *first_id = READ_NET_16(element, 1);
+            *last_id  = READ_NET_16(element, 3);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// index can be used if attributes selected by the AttributeIDList elements are in record order and don't overlap,
+// checked for the whole list before copying, as a response may end before an unsorted element is reached
+static int sdp_record_item_index_usable(service_record_item_t * item, uint8_t * attributeIDList){
+    if (!item->attribute_offsets) return 0;
+    if (de_get_element_type(attributeIDList) != DE_DES) return 0;
+    int pos = de_get_header_size(attributeIDList);
+    int end_pos = de_get_len(attributeIDList);
+    uint16_t next_index = 0;
+    for ( ; pos < end_pos; pos += de_get_len(&attributeIDList[pos])){
+        uint32_t first_id, last_id;
+        if (!sdp_attribute_list_element_range(&attributeIDList[pos], &first_id, &last_id)) return 0;
+        uint16_t first = sdp_record_item_lower_bound(item, first_id);
+        uint16_t last  = sdp_record_item_lower_bound(item, last_id + 1);
+        if (first >= last) continue;
+        if (first < next_index) return 0;
+        next_index = last;
+    }
+    return 1;
+}
+
+// copy attributes selected by attributeIDList starting at startOffset, only count them if buffer is NULL
+// @returns 1 if complete, 0 if maxBytes reached, -1 if index or attributeIDList cannot be used
+static int sdp_record_item_filter_with_index(service_record_item_t * item, uint8_t * attributeIDList, uint16_t startOffset, uint16_t maxBytes, uint16_t * usedBytes, uint8_t * buffer){
+    *usedBytes = 0;
+    if (!sdp_record_item_index_usable(item, attributeIDList)) return -1;
+    int pos = de_get_header_size(attributeIDList);
+    int end_pos = de_get_len(attributeIDList);
+    for ( ; pos < end_pos; pos += de_get_len(&attributeIDList[pos])){
+        uint32_t first_id, last_id;
+        sdp_attribute_list_element_range(&attributeIDList[pos], &first_id, &last_id);
+        uint16_t first = sdp_record_item_lower_bound(item, first_id);
+        uint16_t last  = sdp_record_item_lower_bound(item, last_id + 1);
+        if (first >= last) continue;
+        // selected attributes are stored back to back in the record
+        uint16_t block_start = item->attribute_offsets[first];
+        uint16_t block_len   = item->attribute_offsets[last] - block_start;
+        if (startOffset >= block_len){
+            startOffset -= block_len;
+            continue;
+        }
+        block_start += startOffset;
+        block_len   -= startOffset;
+        startOffset  = 0;
+        int complete = 1;
+        if (block_len > maxBytes){
+            block_len = maxBytes;
+            complete = 0;
+        }
+        if (buffer){
+            memcpy(&buffer[*usedBytes], &item->service_record[block_start], block_len);
+        }
+        *usedBytes += block_len;
+        maxBytes   -= block_len;
+        if (!complete) return 0;
+    }
+    return 1;
+}
+
+static uint16_t sdp_record_item_get_filtered_size(service_record_item_t * item, uint8_t * attributeIDList){
+    uint16_t size;
+    if (sdp_record_item_filter_with_index(item, attributeIDList, 0, 0xffff, &size, NULL) < 0){
+        return spd_get_filtered_size(item->service_record, attributeIDList);
+    }
+    return size;
+}
+
+static int sdp_record_item_filter_attributes(service_record_item_t * item, uint8_t * attributeIDList, uint16_t startOffset, uint16_t maxBytes, uint16_t * usedBytes, uint8_t * buffer){
+    int complete = sdp_record_item_filter_with_index(item, attributeIDList, startOffset, maxBytes, usedBytes, buffer);
+    if (complete >= 0) return complete;
+    return sdp_filter_attributes_in_attributeIDList(item->service_record, attributeIDList, startOffset, maxBytes, usedBytes, buffer);
+}
+
+// only records containing all bits of the pattern bitmap need to be checked
+static int sdp_record_item_matches_pattern(service_record_item_t * item, uint8_t * serviceSearchPattern, uint32_t * pattern_bitmap){
+    if ((item->uuid_bitmap[0] & pattern_bitmap[0]) != pattern_bitmap[0]) return 0;
+    if ((item->uuid_bitmap[1] & pattern_bitmap[1]) != pattern_bitmap[1]) return 0;
+    return sdp_record_matches_service_search_pattern(item->service_record, serviceSearchPattern);
+}
+
 #ifdef EMBEDDED
 
 // register service record internally - this special version doesn't copy the record, it should not be freeed
@@ -163,8 +337,10 @@ uint32_t sdp_register_service_internal(void *connection, service_record_item_t *
         sdp_set_attribute_value_for_attribute_id(record, SDP_ServiceRecordHandle, record_handle);
     }
     
-    // add to linked list
+    // index and add to linked list
+    sdp_record_item_create_index(record_item);
     linked_list_add(&sdp_service_records, (linked_item_t *) record_item);
+    sdp_server_connections_reset_continuation();
     
     sdp_emit_service_registered(connection, 0, record_item->service_record_handle);
     
@@ -236,8 +412,10 @@ uint32_t sdp_register_service_internal(void *connection, uint8_t * record){
     // de_dump_data_element(newRecord);
     // log_info("reserved size %u, actual size %u", recordSize, de_get_len(newRecord));
     
-    // add to linked list
+    // index and add to linked list
+    sdp_record_item_create_index(newRecordItem);
     linked_list_add(&sdp_service_records, (linked_item_t *) newRecordItem);
+    sdp_server_connections_reset_continuation();
     
     sdp_emit_service_registered(connection, 0, newRecordItem->service_record_handle);
 
@@ -254,6 +432,8 @@ void sdp_unregister_service_internal(void *connection, uint32_t service_record_h
     service_record_item_t * record_item = sdp_get_record_for_handle(service_record_handle);
     if (record_item && record_item->connection == connection) {
         linked_list_remove(&sdp_service_records, (linked_item_t *) record_item);
+        sdp_record_item_free_index(record_item);
+        sdp_server_connections_reset_continuation();
 #ifndef EMBEDDED
         free(record_item);
 #endif        
@@ -291,12 +471,15 @@ int sdp_handle_service_search_request(uint8_t * packet, uint16_t remote_mtu){
         continuation_index = READ_NET_16(continuationState, 1);
     }
     
+    uint32_t pattern_bitmap[2];
+    sdp_create_uuid_bitmap(serviceSearchPattern, pattern_bitmap);
+
     // get and limit total count
     linked_item_t *it;
     uint16_t total_service_count   = 0;
     for (it = (linked_item_t *) sdp_service_records; it ; it = it->next){
         service_record_item_t * item = (service_record_item_t *) it;
-        if (!sdp_record_matches_service_search_pattern(item->service_record, serviceSearchPattern)) continue;
+        if (!sdp_record_item_matches_pattern(item, serviceSearchPattern, pattern_bitmap)) continue;
         total_service_count++;
     }
     if (total_service_count > maximumServiceRecordCount){
@@ -311,7 +494,7 @@ int sdp_handle_service_search_request(uint8_t * packet, uint16_t remote_mtu){
     for (it = (linked_item_t *) sdp_service_records; it ; it = it->next, ++current_service_index){
         service_record_item_t * item = (service_record_item_t *) it;
 
-        if (!sdp_record_matches_service_search_pattern(item->service_record, serviceSearchPattern)) continue;
+        if (!sdp_record_item_matches_pattern(item, serviceSearchPattern, pattern_bitmap)) continue;
         matching_service_count++;
         
         if (current_service_index < continuation_index) continue;
@@ -385,7 +568,7 @@ int sdp_handle_service_attribute_request(uint8_t * packet, uint16_t remote_mtu){
     if (continuation_offset == 0){
         
         // get size of this record
-        uint16_t filtered_attributes_size = spd_get_filtered_size(item->service_record, attributeIDList);
+        uint16_t filtered_attributes_size = sdp_record_item_get_filtered_size(item, attributeIDList);
         
         // store DES
         de_store_descriptor_with_len(&sdp_response_buffer[pos], DE_DES, DE_SIZE_VAR_16, filtered_attributes_size);
@@ -395,7 +578,7 @@ int sdp_handle_service_attribute_request(uint8_t * packet, uint16_t remote_mtu){
 
     // copy maximumAttributeByteCount from record
     uint16_t bytes_used;
-    int complete = sdp_filter_attributes_in_attributeIDList(item->service_record, attributeIDList, continuation_offset, maximumAttributeByteCount, &bytes_used, &sdp_response_buffer[pos]);
+    int complete = sdp_record_item_filter_attributes(item, attributeIDList, continuation_offset, maximumAttributeByteCount, &bytes_used, &sdp_response_buffer[pos]);
     pos += bytes_used;
     
     uint16_t attributeListByteCount = pos - 7;
@@ -418,16 +601,16 @@ int sdp_handle_service_attribute_request(uint8_t * packet, uint16_t remote_mtu){
     return pos;
 }
 
-static uint16_t sdp_get_size_for_service_search_attribute_response(uint8_t * serviceSearchPattern, uint8_t * attributeIDList){
+static uint16_t sdp_get_size_for_service_search_attribute_response(uint8_t * serviceSearchPattern, uint32_t * pattern_bitmap, uint8_t * attributeIDList){
     uint16_t total_response_size = 0;
     linked_item_t *it;
     for (it = (linked_item_t *) sdp_service_records; it ; it = it->next){
         service_record_item_t * item = (service_record_item_t *) it;
         
-        if (!sdp_record_matches_service_search_pattern(item->service_record, serviceSearchPattern)) continue;
+        if (!sdp_record_item_matches_pattern(item, serviceSearchPattern, pattern_bitmap)) continue;
         
         // for all service records that match
-        total_response_size += 3 + spd_get_filtered_size(item->service_record, attributeIDList);
+        total_response_size += 3 + sdp_record_item_get_filtered_size(item, attributeIDList);
     }
     return total_response_size;
 }
@@ -464,12 +647,15 @@ int sdp_handle_service_search_attribute_request(uint8_t * packet, uint16_t remot
 
     // log_info("--> sdp_handle_service_search_attribute_request, cont %u/%u, max %u", continuation_service_index, continuation_offset, maximumAttributeByteCount);
     
+    uint32_t pattern_bitmap[2];
+    sdp_create_uuid_bitmap(serviceSearchPattern, pattern_bitmap);
+
     // AttributeLists - starts at offset 7
     uint16_t pos = 7;
     
     // add DES with total size for first request
     if (continuation_service_index == 0 && continuation_offset == 0){
-        uint16_t total_response_size = sdp_get_size_for_service_search_attribute_response(serviceSearchPattern, attributeIDList);
+        uint16_t total_response_size = sdp_get_size_for_service_search_attribute_response(serviceSearchPattern, pattern_bitmap, attributeIDList);
         de_store_descriptor_with_len(&sdp_response_buffer[pos], DE_DES, DE_SIZE_VAR_16, total_response_size);
         // log_info("total response size %u", total_response_size);
         pos += 3;
@@ -481,16 +667,22 @@ int sdp_handle_service_search_attribute_request(uint8_t * packet, uint16_t remot
     int      continuation = 0;
     uint16_t current_service_index = 0;
     linked_item_t *it = (linked_item_t *) sdp_service_records;
+    if (continuation_service_index && sdp_server_connection->continuation_record
+    &&  sdp_server_connection->continuation_index == continuation_service_index){
+        it = (linked_item_t *) sdp_server_connection->continuation_record;
+        current_service_index = continuation_service_index;
+    }
+    sdp_server_connection->continuation_record = NULL;
     for ( ; it ; it = it->next, ++current_service_index){
         service_record_item_t * item = (service_record_item_t *) it;
         
         if (current_service_index < continuation_service_index ) continue;
-        if (!sdp_record_matches_service_search_pattern(item->service_record, serviceSearchPattern)) continue;
+        if (!sdp_record_item_matches_pattern(item, serviceSearchPattern, pattern_bitmap)) continue;
 
         if (continuation_offset == 0){
             
             // get size of this record
-            uint16_t filtered_attributes_size = spd_get_filtered_size(item->service_record, attributeIDList);
+            uint16_t filtered_attributes_size = sdp_record_item_get_filtered_size(item, attributeIDList);
             
             // stop if complete record doesn't fits into response but we already have a partial response
             if ((filtered_attributes_size + 3 > maximumAttributeByteCount) && !first_answer) {
@@ -508,7 +700,7 @@ int sdp_handle_service_search_attribute_request(uint8_t * packet, uint16_t remot
     
         // copy maximumAttributeByteCount from record
         uint16_t bytes_used;
-        int complete = sdp_filter_attributes_in_attributeIDList(item->service_record, attributeIDList, continuation_offset, maximumAttributeByteCount, &bytes_used, &sdp_response_buffer[pos]);
+        int complete = sdp_record_item_filter_attributes(item, attributeIDList, continuation_offset, maximumAttributeByteCount, &bytes_used, &sdp_response_buffer[pos]);
         pos += bytes_used;
         maximumAttributeByteCount -= bytes_used;
         
@@ -526,6 +718,8 @@ int sdp_handle_service_search_attribute_request(uint8_t * packet, uint16_t remot
     
     // Continuation State
     if (continuation){
+        sdp_server_connection->continuation_record = (service_record_item_t *) it;
+        sdp_server_connection->continuation_index  = current_service_index;
         sdp_response_buffer[pos++] = 4;
         net_store_16(sdp_response_buffer, pos, (uint16_t) current_service_index);
         pos += 2;
@@ -545,27 +739,51 @@ int sdp_handle_service_search_attribute_request(uint8_t * packet, uint16_t remot
     return pos;
 }
 
-static void sdp_try_respond(void){
-    if (!sdp_response_size ) return;
-    if (!l2cap_cid) return;
-    if (!l2cap_can_send_packet_now(l2cap_cid)) return;
+static int sdp_try_respond(sdp_server_connection_t * connection){
+    if (!connection->response_size) return 0;
+    if (!l2cap_can_send_packet_now(connection->l2cap_cid)) return 0;
     
     // update state before sending packet (avoid getting called when new l2cap credit gets emitted)
-    uint16_t size = sdp_response_size;
-    sdp_response_size = 0;
-    l2cap_send_internal(l2cap_cid, sdp_response_buffer, size);
+    uint16_t size = connection->response_size;
+    connection->response_size = 0;
+    l2cap_send_internal(connection->l2cap_cid, connection->response_buffer, size);
+    return 1;
 }
 
-// we assume that we don't get two requests in a row
+// send pending responses, connection that just sent is moved to the end for fairness
+static void sdp_server_connections_try_respond(void){
+    linked_item_t *it;
+    for (it = (linked_item_t *) sdp_server_connections; it ; it = it->next){
+        sdp_server_connection_t * connection = (sdp_server_connection_t *) it;
+        if (!sdp_try_respond(connection)) continue;
+        linked_list_remove(&sdp_server_connections, it);
+        linked_list_add_tail(&sdp_server_connections, it);
+        break;
+    }
+}
+
+static void sdp_server_connection_free(uint16_t l2cap_cid){
+    sdp_server_connection_t * connection = sdp_server_connection_for_l2cap_cid(l2cap_cid);
+    if (!connection) return;
+    linked_list_remove(&sdp_server_connections, (linked_item_t *) connection);
+    btstack_memory_sdp_server_connection_free(connection);
+}
+
+// we assume that we don't get two requests in a row on the same channel
 static void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
 	uint16_t transaction_id;
     SDP_PDU_ID_t pdu_id;
     uint16_t remote_mtu;
+    uint16_t response_size;
+    sdp_server_connection_t * connection;
     // uint16_t param_len;
     
 	switch (packet_type) {
 			
 		case L2CAP_DATA_PACKET:
+            connection = sdp_server_connection_for_l2cap_cid(channel);
+            if (!connection) break;
+            
             pdu_id = (SDP_PDU_ID_t) packet[0];
             transaction_id = READ_NET_16(packet, 1);
             // param_len = READ_NET_16(packet, 3);
@@ -575,27 +793,35 @@ static void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
                 remote_mtu = SDP_RESPONSE_BUFFER_SIZE;
             }
             
+            // responses are created in the connection's buffer
+            sdp_server_connection = connection;
+            sdp_response_buffer   = connection->response_buffer;
+            
             // log_info("SDP Request: type %u, transaction id %u, len %u, mtu %u", pdu_id, transaction_id, param_len, remote_mtu);
             switch (pdu_id){
                     
                 case SDP_ServiceSearchRequest:
-                    sdp_response_size = sdp_handle_service_search_request(packet, remote_mtu);
+                    response_size = sdp_handle_service_search_request(packet, remote_mtu);
                     break;
                                         
                 case SDP_ServiceAttributeRequest:
-                    sdp_response_size = sdp_handle_service_attribute_request(packet, remote_mtu);
+                    response_size = sdp_handle_service_attribute_request(packet, remote_mtu);
                     break;
                     
                 case SDP_ServiceSearchAttributeRequest:
-                    sdp_response_size = sdp_handle_service_search_attribute_request(packet, remote_mtu);
+                    response_size = sdp_handle_service_search_attribute_request(packet, remote_mtu);
                     break;
                     
                 default:
-                    sdp_response_size = sdp_create_error_response(transaction_id, 0x0003); // invalid syntax
+                    response_size = sdp_create_error_response(transaction_id, 0x0003); // invalid syntax
                     break;
             }
             
-            sdp_try_respond();
+            sdp_server_connection = NULL;
+            sdp_response_buffer   = NULL;
+            
+            connection->response_size = response_size;
+            sdp_try_respond(connection);
             
 			break;
 			
@@ -604,34 +830,33 @@ static void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
 			switch (packet[0]) {
 
 				case L2CAP_EVENT_INCOMING_CONNECTION:
-                    if (l2cap_cid) {
+                    connection = btstack_memory_sdp_server_connection_get();
+                    if (!connection) {
                         // CONNECTION REJECTED DUE TO LIMITED RESOURCES 
                         l2cap_decline_connection_internal(channel, 0x04);
                         break;
                     }
                     // accept
-                    l2cap_cid = channel;
-                    sdp_response_size = 0;
+                    memset(connection, 0, sizeof(sdp_server_connection_t));
+                    connection->l2cap_cid = channel;
+                    linked_list_add(&sdp_server_connections, (linked_item_t *) connection);
                     l2cap_accept_connection_internal(channel);
 					break;
                     
                 case L2CAP_EVENT_CHANNEL_OPENED:
                     if (packet[2]) {
                         // open failed -> reset
-                        l2cap_cid = 0;
+                        sdp_server_connection_free(channel);
                     }
                     break;
 
                 case L2CAP_EVENT_CREDITS:
                 case DAEMON_EVENT_HCI_PACKET_SENT:
-                    sdp_try_respond();
+                    sdp_server_connections_try_respond();
                     break;
                 
                 case L2CAP_EVENT_CHANNEL_CLOSED:
-                    if (channel == l2cap_cid){
-                        // reset
-                        l2cap_cid = 0;
-                    }
+                    sdp_server_connection_free(channel);
                     break;
 					                    
 				default:
@@ -40,6 +40,7 @@
 #include <btstack/linked_list.h>
 
 #include "btstack-config.h"
+#include "hci.h"
 
 #if defined __cplusplus
 extern "C" {
@@ -65,11 +66,36 @@ typedef struct {
     // client connection
     void *  connection;
     
+    // index built on registration: bloom filter of contained UUIDs and offset of each attribute
+    uint32_t        uuid_bitmap[2];
+    uint16_t        num_attributes;
+    uint16_t *      attribute_offsets;  // num_attributes + 1 entries, NULL if not available
+    
     // data is contained in same memory
     uint32_t        service_record_handle;
     uint8_t         service_record[1];  // waste 1 byte to allow compilation with older compilers
 } service_record_item_t;
 
+// max SDP response
+#define SDP_RESPONSE_BUFFER_SIZE (HCI_ACL_BUFFER_SIZE-HCI_ACL_HEADER_SIZE)
+
+// SDP server connection, one per L2CAP channel
+typedef struct {
+    // linked list - assert: first field
+    linked_item_t   item;
+    
+    uint16_t        l2cap_cid;
+    
+    // pending response, 0 if none
+    uint16_t        response_size;
+    
+    // ServiceSearchAttribute continuation resumes at this record instead of walking the record list
+    service_record_item_t * continuation_record;
+    uint16_t        continuation_index;
+    
+    uint8_t         response_buffer[SDP_RESPONSE_BUFFER_SIZE];
+} sdp_server_connection_t;
+
 
 void sdp_register_packet_handler(void (*handler)(void * connection, uint8_t packet_type,
                                                  uint16_t channel, uint8_t *packet, uint16_t size));
@@ -49,101 +49,185 @@
 #include "debug.h"
 
 typedef enum {
-    INIT, W4_CONNECT, W2_SEND, W4_RESPONSE, QUERY_COMPLETE
+    INIT, W4_CONNECT, W2_SEND, W4_RESPONSE, IDLE, W4_DISCONNECT
 } sdp_client_state_t;
 
 
 void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
 
-static uint16_t setup_service_search_attribute_request(uint8_t * data);
+static uint16_t setup_service_search_attribute_request(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * data);
 
 #ifdef HAVE_SDP_EXTRA_QUERIES
-static uint16_t setup_service_search_request(uint8_t * data);
-static uint16_t setup_service_attribute_request(uint8_t * data);
-static void     parse_service_search_response(uint8_t* packet);
-static void     parse_service_attribute_response(uint8_t* packet);
-static uint32_t serviceRecordHandle;
+static uint16_t setup_service_search_request(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * data);
+static uint16_t setup_service_attribute_request(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * data);
+static void     parse_service_search_response(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t* packet);
+static void     parse_service_attribute_response(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t* packet);
 #endif
 
-// SDP Client Query
-static uint16_t  mtu;
-static uint16_t  sdp_cid = 0x40;
-static uint8_t * serviceSearchPattern;
-static uint8_t * attributeIDList;
-static uint16_t  transactionID = 0;
-static uint8_t   continuationState[16];
-static uint8_t   continuationStateLen;
-static sdp_client_state_t sdp_client_state = INIT;
-static SDP_PDU_ID_t PDU_ID = SDP_Invalid;
+static void sdp_client_session_run(sdp_client_session_t * session);
+
+// active sessions
+static linked_list_t sdp_client_sessions = NULL;
+
+// used by sdp_client_query & co, results are delivered via the default parser
+static sdp_client_session_t sdp_client_default_session;
+static sdp_client_query_t   sdp_client_default_query;
 
 // TODO: inline if not needed (des(des))
 void parse_attribute_lists(uint8_t* packet, uint16_t length){
     sdp_parser_handle_chunk(packet, length);
 }
 
-/* Queries the SDP service of the remote device given a service search pattern 
-and a list of attribute IDs. The remote data is handled by the SDP parser. The 
-SDP parser delivers attribute values and done event via a registered callback. */
+static sdp_client_query_t * sdp_client_active_query(sdp_client_session_t * session){
+    return (sdp_client_query_t *) session->queries;
+}
+
+static void sdp_client_select_parser(sdp_client_query_t * query){
+    if (query == &sdp_client_default_query){
+        sdp_parser_select(NULL);
+        return;
+    }
+    sdp_parser_select(&query->parser);
+}
 
-void sdp_client_query(bd_addr_t remote, uint8_t * des_serviceSearchPattern, uint8_t * des_attributeIDList){
-    serviceSearchPattern = des_serviceSearchPattern;
-    attributeIDList = des_attributeIDList;
-    continuationStateLen = 0;
-    PDU_ID = SDP_ServiceSearchAttributeResponse;
+static void sdp_client_query_done(sdp_client_query_t * query, uint8_t status){
+    sdp_client_select_parser(query);
+    sdp_parser_handle_done(status);
+    sdp_parser_select(NULL);
+}
 
-    sdp_client_state = W4_CONNECT;
-    l2cap_create_channel_internal(NULL, sdp_packet_handler, remote, PSM_SDP, l2cap_max_mtu());
+// complete all queued queries with given status
+static void sdp_client_session_flush(sdp_client_session_t * session, uint8_t status){
+    while (session->queries){
+        sdp_client_query_t * query = sdp_client_active_query(session);
+        linked_list_remove(&session->queries, (linked_item_t *) query);
+        sdp_client_query_done(query, status);
+    }
 }
 
+static sdp_client_session_t * sdp_client_session_for_cid(uint16_t cid){
+    linked_item_t *it;
+    for (it = (linked_item_t *) sdp_client_sessions; it ; it = it->next){
+        sdp_client_session_t * session = (sdp_client_session_t *) it;
+        if (session->state == INIT || session->state == W4_CONNECT) continue;
+        if (session->cid == cid) return session;
+    }
+    return NULL;
+}
 
-static void try_to_send(uint16_t channel){
-    if (sdp_client_state != W2_SEND) return;
+static sdp_client_session_t * sdp_client_session_for_timer(timer_source_t * ts){
+    linked_item_t *it;
+    for (it = (linked_item_t *) sdp_client_sessions; it ; it = it->next){
+        sdp_client_session_t * session = (sdp_client_session_t *) it;
+        if (&session->idle_timer == ts) return session;
+    }
+    return NULL;
+}
 
+static void sdp_client_idle_timeout(timer_source_t * ts){
+    sdp_client_session_t * session = sdp_client_session_for_timer(ts);
+    if (!session) return;
+    if (session->state != IDLE) return;
+    log_info("SDP Client idle, disconnect cid %x", session->cid);
+    session->state = W4_DISCONNECT;
+    l2cap_disconnect_internal(session->cid, 0);
+}
+
+static void sdp_client_session_start_idle_timer(sdp_client_session_t * session){
+    run_loop_remove_timer(&session->idle_timer);
+    run_loop_set_timer_handler(&session->idle_timer, sdp_client_idle_timeout);
+    run_loop_set_timer(&session->idle_timer, SDP_CLIENT_IDLE_TIMEOUT_MS);
+    run_loop_add_timer(&session->idle_timer);
+}
+
+static void sdp_client_session_enqueue(sdp_client_session_t * session, sdp_client_query_t * query){
+    query->continuationStateLen = 0;
+    linked_list_add_tail(&session->queries, (linked_item_t *) query);
+    linked_list_add(&sdp_client_sessions, (linked_item_t *) session);
+    sdp_client_session_run(session);
+}
+
+static void try_to_send(sdp_client_session_t * session){
+    if (session->state != W2_SEND) return;
+
+    sdp_client_query_t * query = sdp_client_active_query(session);
+    if (!query) return;
+    
+    uint16_t channel = session->cid;
     if (!l2cap_can_send_packet_now(channel)) return;
 
     l2cap_reserve_packet_buffer();
     uint8_t * data = l2cap_get_outgoing_buffer();
     uint16_t request_len = 0;
 
-    switch (PDU_ID){
+    switch (query->pdu_id){
 #ifdef HAVE_SDP_EXTRA_QUERIES
         case SDP_ServiceSearchResponse:
-            request_len = setup_service_search_request(data);
+            request_len = setup_service_search_request(session, query, data);
             break;
         case SDP_ServiceAttributeResponse:
-            request_len = setup_service_attribute_request(data);
+            request_len = setup_service_attribute_request(session, query, data);
             break;
 #endif
         case SDP_ServiceSearchAttributeResponse:
-            request_len = setup_service_search_attribute_request(data);
+            request_len = setup_service_search_attribute_request(session, query, data);
             break;
         default:
-            log_error("SDP Client try_to_send :: PDU ID invalid. %u", PDU_ID);
+            log_error("SDP Client try_to_send :: PDU ID invalid. %u", query->pdu_id);
+            l2cap_release_packet_buffer();
             return;
     }
 
     // prevent re-entrance
-    sdp_client_state = W4_RESPONSE;
+    session->state = W4_RESPONSE;
     int err = l2cap_send_prepared(channel, request_len);
     // l2cap_send_prepared shouldn't have failed as l2ap_can_send_packet_now() was true
     switch (err){
         case 0:
             log_debug("l2cap_send_internal() -> OK");
-            PDU_ID = SDP_Invalid;
             break;
         case BTSTACK_ACL_BUFFERS_FULL:
-            sdp_client_state = W2_SEND;
+            session->state = W2_SEND;
             log_info("l2cap_send_internal() ->BTSTACK_ACL_BUFFERS_FULL");
             break;
         default:
-            sdp_client_state = W2_SEND;
+            session->state = W2_SEND;
             log_error("l2cap_send_internal() -> err %d", err);
             break;
     }
 }
 
+static void sdp_client_session_run(sdp_client_session_t * session){
+    switch (session->state){
+        case INIT:
+            if (!session->queries) {
+                linked_list_remove(&sdp_client_sessions, (linked_item_t *) session);
+                break;
+            }
+            session->state = W4_CONNECT;
+            l2cap_create_channel_internal(NULL, sdp_packet_handler, session->remote, PSM_SDP, l2cap_max_mtu());
+            break;
+        case W2_SEND:
+            if (!session->queries){
+                // keep channel open for next query
+                session->state = IDLE;
+                sdp_client_session_start_idle_timer(session);
+                break;
+            }
+            try_to_send(session);
+            break;
+        case IDLE:
+            if (!session->queries) break;
+            run_loop_remove_timer(&session->idle_timer);
+            session->state = W2_SEND;
+            try_to_send(session);
+            break;
+        default:
+            break;
+    }
+}
 
-static void parse_service_search_attribute_response(uint8_t* packet){
+static void parse_service_search_attribute_response(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t* packet){
     uint16_t offset = 3;
     uint16_t parameterLength = READ_NET_16(packet,offset);
     offset+=2;
@@ -151,7 +235,7 @@ static void parse_service_search_attribute_response(uint8_t* packet){
     uint16_t attributeListByteCount = READ_NET_16(packet,offset);
     offset+=2;
 
-    if (attributeListByteCount > mtu){
+    if (attributeListByteCount > session->mtu){
         log_error("Error parsing ServiceSearchAttributeResponse: Number of bytes in found attribute list is larger then the MaximumAttributeByteCount.");
         return;
     }
@@ -160,68 +244,79 @@ static void parse_service_search_attribute_response(uint8_t* packet){
     parse_attribute_lists(packet+offset, attributeListByteCount);
     offset+=attributeListByteCount;
 
-    continuationStateLen = packet[offset];
+    query->continuationStateLen = packet[offset];
     offset++;
 
-    if (continuationStateLen > 16){
+    if (query->continuationStateLen > 16){
         log_error("Error parsing ServiceSearchAttributeResponse: Number of bytes in continuation state exceedes 16.");
         return;
     }
-    memcpy(continuationState, packet+offset, continuationStateLen);
-    offset+=continuationStateLen;
+    memcpy(query->continuationState, packet+offset, query->continuationStateLen);
+    offset+=query->continuationStateLen;
 
     if (parameterLength != offset - 5){
         log_error("Error parsing ServiceSearchAttributeResponse: wrong size of parameters, number of expected bytes%u, actual number %u.", parameterLength, offset);
     }
 }
 
-void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
-    // uint16_t handle;
-    if (packet_type == L2CAP_DATA_PACKET){
-        uint16_t responseTransactionID = READ_NET_16(packet,1);
-        if ( responseTransactionID != transactionID){
-            log_error("Missmatching transaction ID, expected %u, found %u.", transactionID, responseTransactionID);
-            return;
-        } 
-        
-        if (packet[0] != SDP_ServiceSearchAttributeResponse 
-            && packet[0] != SDP_ServiceSearchResponse
-            && packet[0] != SDP_ServiceAttributeResponse){
-            log_error("Not a valid PDU ID, expected %u, %u or %u, found %u.", SDP_ServiceSearchResponse, 
-                                    SDP_ServiceAttributeResponse, SDP_ServiceSearchAttributeResponse, packet[0]);
-            return;
-        }
+static void sdp_client_handle_response(sdp_client_session_t * session, uint8_t *packet){
+    if (session->state != W4_RESPONSE) return;
+    
+    uint16_t responseTransactionID = READ_NET_16(packet,1);
+    if ( responseTransactionID != session->transactionID){
+        log_error("Missmatching transaction ID, expected %u, found %u.", session->transactionID, responseTransactionID);
+        return;
+    } 
+    
+    sdp_client_query_t * query = sdp_client_active_query(session);
+    if (!query) return;
+    
+    if (packet[0] != query->pdu_id){
+        log_error("Not a valid PDU ID, expected %u, found %u.", query->pdu_id, packet[0]);
+        return;
+    }
 
-        PDU_ID = packet[0];
-        log_info("SDP Client :: PDU ID. %u ,%u", PDU_ID, packet[0]);
-        switch (PDU_ID){
+    log_info("SDP Client :: PDU ID. %u", packet[0]);
+    sdp_client_select_parser(query);
+    switch (packet[0]){
 #ifdef HAVE_SDP_EXTRA_QUERIES
-            case SDP_ServiceSearchResponse:
-                parse_service_search_response(packet);
-                break;
-            case SDP_ServiceAttributeResponse:
-                parse_service_attribute_response(packet);
-                break;
+        case SDP_ServiceSearchResponse:
+            parse_service_search_response(session, query, packet);
+            break;
+        case SDP_ServiceAttributeResponse:
+            parse_service_attribute_response(session, query, packet);
+            break;
 #endif
-            case SDP_ServiceSearchAttributeResponse:
-                parse_service_search_attribute_response(packet);
-                break;
-            default:
-                log_error("SDP Client :: PDU ID invalid. %u ,%u", PDU_ID, packet[0]);
-                return;
-        }
+        case SDP_ServiceSearchAttributeResponse:
+            parse_service_search_attribute_response(session, query, packet);
+            break;
+        default:
+            break;
+    }
+    sdp_parser_select(NULL);
+    
+    session->state = W2_SEND;
+
+    // continuation set or DONE?
+    if (query->continuationStateLen == 0){
+        log_info("SDP Client Query DONE! ");
+        // remove before notifying as the callback might queue the next query
+        linked_list_remove(&session->queries, (linked_item_t *) query);
+        sdp_client_query_done(query, 0);
+    }
+    
+    // prepare next request and send
+    sdp_client_session_run(session);
+}
 
-        // continuation set or DONE?
-        if (continuationStateLen == 0){
-            log_info("SDP Client Query DONE! ");
-            sdp_client_state = QUERY_COMPLETE;
-            l2cap_disconnect_internal(sdp_cid, 0);
-            // sdp_parser_handle_done(0);
-            return;
-        }
-        // prepare next request and send
-        sdp_client_state = W2_SEND;
-        try_to_send(sdp_cid);
+void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    sdp_client_session_t * session;
+    linked_item_t *it;
+    
+    if (packet_type == L2CAP_DATA_PACKET){
+        session = sdp_client_session_for_cid(channel);
+        if (!session) return;
+        sdp_client_handle_response(session, packet);
         return;
     }
     
@@ -231,35 +326,61 @@ void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet,
         case L2CAP_EVENT_TIMEOUT_CHECK:
             log_info("sdp client: L2CAP_EVENT_TIMEOUT_CHECK");
             break;
-        case L2CAP_EVENT_CHANNEL_OPENED:
-            if (sdp_client_state != W4_CONNECT) break;
+        case L2CAP_EVENT_CHANNEL_OPENED: {
             // data: event (8), len(8), status (8), address(48), handle (16), psm (16), local_cid(16), remote_cid (16), local_mtu(16), remote_mtu(16) 
+            if (READ_BT_16(packet, 11) != PSM_SDP) break;
+            bd_addr_t event_addr;
+            bt_flip_addr(event_addr, &packet[3]);
+            session = NULL;
+            for (it = (linked_item_t *) sdp_client_sessions; it ; it = it->next){
+                sdp_client_session_t * candidate = (sdp_client_session_t *) it;
+                if (candidate->state != W4_CONNECT) continue;
+                if (BD_ADDR_CMP(candidate->remote, event_addr)) continue;
+                session = candidate;
+                break;
+            }
+            if (!session) {
+                // session closed while connecting
+                if (packet[2] == 0){
+                    l2cap_disconnect_internal(channel, 0);
+                }
+                break;
+            }
             if (packet[2]) {
                 log_error("SDP Client Connection failed.");
-                sdp_parser_handle_done(packet[2]);
+                session->state = INIT;
+                linked_list_remove(&sdp_client_sessions, (linked_item_t *) session);
+                sdp_client_session_flush(session, packet[2]);
                 break;
             }
-            sdp_cid = channel;
-            mtu = READ_BT_16(packet, 17);
+            session->cid = channel;
+            session->mtu = READ_BT_16(packet, 17);
             // handle = READ_BT_16(packet, 9);
-            log_info("SDP Client Connected, cid %x, mtu %u.", sdp_cid, mtu);
+            log_info("SDP Client Connected, cid %x, mtu %u.", session->cid, session->mtu);
 
-            sdp_client_state = W2_SEND;
-            try_to_send(sdp_cid);
+            session->state = W2_SEND;
+            sdp_client_session_run(session);
             break;
+        }
         case L2CAP_EVENT_CREDITS:
         case DAEMON_EVENT_HCI_PACKET_SENT:
-            try_to_send(sdp_cid);
+            for (it = (linked_item_t *) sdp_client_sessions; it ; it = it->next){
+                try_to_send((sdp_client_session_t *) it);
+            }
             break;
         case L2CAP_EVENT_CHANNEL_CLOSED: {
-            if (sdp_cid != READ_BT_16(packet, 2)) {
-                // log_info("Received L2CAP_EVENT_CHANNEL_CLOSED for cid %x, current cid %x\n",  READ_BT_16(packet, 2),sdp_cid);
-                break;
-            }
+            session = sdp_client_session_for_cid(READ_BT_16(packet, 2));
+            if (!session) break;
             log_info("SDP Client disconnected.");
-            uint8_t status = sdp_client_state == QUERY_COMPLETE ? 0 : SDP_QUERY_INCOMPLETE;
-            sdp_client_state = INIT;
-            sdp_parser_handle_done(status);
+            run_loop_remove_timer(&session->idle_timer);
+            uint8_t reconnect = session->state == W4_DISCONNECT;
+            session->state = INIT;
+            if (!reconnect){
+                // closed by remote or link loss
+                sdp_client_session_flush(session, SDP_QUERY_INCOMPLETE);
+            }
+            // queries queued meanwhile need a new channel
+            sdp_client_session_run(session);
             break;
         }
         default:
@@ -268,14 +389,14 @@ void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet,
 }
 
 
-static uint16_t setup_service_search_attribute_request(uint8_t * data){
+static uint16_t setup_service_search_attribute_request(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * data){
 
     uint16_t offset = 0;
-    transactionID++;
+    session->transactionID++;
     // uint8_t SDP_PDU_ID_t.SDP_ServiceSearchRequest;
     data[offset++] = SDP_ServiceSearchAttributeRequest;
     // uint16_t transactionID
-    net_store_16(data, offset, transactionID);
+    net_store_16(data, offset, session->transactionID);
     offset += 2;
 
     // param legnth
@@ -283,24 +404,24 @@ static uint16_t setup_service_search_attribute_request(uint8_t * data){
 
     // parameters: 
     //     ServiceSearchPattern - DES (min 1 UUID, max 12)
-    uint16_t serviceSearchPatternLen = de_get_len(serviceSearchPattern);
-    memcpy(data + offset, serviceSearchPattern, serviceSearchPatternLen);
+    uint16_t serviceSearchPatternLen = de_get_len(query->serviceSearchPattern);
+    memcpy(data + offset, query->serviceSearchPattern, serviceSearchPatternLen);
     offset += serviceSearchPatternLen;
 
     //     MaximumAttributeByteCount - uint16_t  0x0007 - 0xffff -> mtu
-    net_store_16(data, offset, mtu);
+    net_store_16(data, offset, session->mtu);
     offset += 2;
 
     //     AttibuteIDList  
-    uint16_t attributeIDListLen = de_get_len(attributeIDList);
-    memcpy(data + offset, attributeIDList, attributeIDListLen);
+    uint16_t attributeIDListLen = de_get_len(query->attributeIDList);
+    memcpy(data + offset, query->attributeIDList, attributeIDListLen);
     offset += attributeIDListLen;
 
     //     ContinuationState - uint8_t number of cont. bytes N<=16 
-    data[offset++] = continuationStateLen;
+    data[offset++] = query->continuationStateLen;
     //                       - N-bytes previous response from server
-    memcpy(data + offset, continuationState, continuationStateLen);
-    offset += continuationStateLen;
+    memcpy(data + offset, query->continuationState, query->continuationStateLen);
+    offset += query->continuationStateLen;
 
     // uint16_t paramLength 
     net_store_16(data, 3, offset - 5);
@@ -313,13 +434,13 @@ void parse_service_record_handle_list(uint8_t* packet, uint16_t total_count, uin
     sdp_parser_handle_service_search(packet, total_count, current_count);
 }
 
-static uint16_t setup_service_search_request(uint8_t * data){
+static uint16_t setup_service_search_request(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * data){
     uint16_t offset = 0;
-    transactionID++;
+    session->transactionID++;
     // uint8_t SDP_PDU_ID_t.SDP_ServiceSearchRequest;
     data[offset++] = SDP_ServiceSearchRequest;
     // uint16_t transactionID
-    net_store_16(data, offset, transactionID);
+    net_store_16(data, offset, session->transactionID);
     offset += 2;
 
     // param legnth
@@ -327,19 +448,19 @@ static uint16_t setup_service_search_request(uint8_t * data){
 
     // parameters: 
     //     ServiceSearchPattern - DES (min 1 UUID, max 12)
-    uint16_t serviceSearchPatternLen = de_get_len(serviceSearchPattern);
-    memcpy(data + offset, serviceSearchPattern, serviceSearchPatternLen);
+    uint16_t serviceSearchPatternLen = de_get_len(query->serviceSearchPattern);
+    memcpy(data + offset, query->serviceSearchPattern, serviceSearchPatternLen);
     offset += serviceSearchPatternLen;
 
     //     MaximumAttributeByteCount - uint16_t  0x0007 - 0xffff -> mtu
-    net_store_16(data, offset, mtu);
+    net_store_16(data, offset, session->mtu);
     offset += 2;
 
     //     ContinuationState - uint8_t number of cont. bytes N<=16 
-    data[offset++] = continuationStateLen;
+    data[offset++] = query->continuationStateLen;
     //                       - N-bytes previous response from server
-    memcpy(data + offset, continuationState, continuationStateLen);
-    offset += continuationStateLen;
+    memcpy(data + offset, query->continuationState, query->continuationStateLen);
+    offset += query->continuationStateLen;
 
     // uint16_t paramLength 
     net_store_16(data, 3, offset - 5);
@@ -348,14 +469,14 @@ static uint16_t setup_service_search_request(uint8_t * data){
 }
 
 
-static uint16_t setup_service_attribute_request(uint8_t * data){
+static uint16_t setup_service_attribute_request(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * data){
 
     uint16_t offset = 0;
-    transactionID++;
+    session->transactionID++;
     // uint8_t SDP_PDU_ID_t.SDP_ServiceSearchRequest;
     data[offset++] = SDP_ServiceAttributeRequest;
     // uint16_t transactionID
-    net_store_16(data, offset, transactionID);
+    net_store_16(data, offset, session->transactionID);
     offset += 2;
 
     // param legnth
@@ -363,23 +484,23 @@ static uint16_t setup_service_attribute_request(uint8_t * data){
 
     // parameters: 
     //     ServiceRecordHandle
-    net_store_32(data, offset, serviceRecordHandle);
+    net_store_32(data, offset, query->serviceRecordHandle);
     offset += 4;
 
     //     MaximumAttributeByteCount - uint16_t  0x0007 - 0xffff -> mtu
-    net_store_16(data, offset, mtu);
+    net_store_16(data, offset, session->mtu);
     offset += 2;
 
     //     AttibuteIDList  
-    uint16_t attributeIDListLen = de_get_len(attributeIDList);
-    memcpy(data + offset, attributeIDList, attributeIDListLen);
+    uint16_t attributeIDListLen = de_get_len(query->attributeIDList);
+    memcpy(data + offset, query->attributeIDList, attributeIDListLen);
     offset += attributeIDListLen;
 
     //     ContinuationState - uint8_t number of cont. bytes N<=16 
-    data[offset++] = continuationStateLen;
+    data[offset++] = query->continuationStateLen;
     //                       - N-bytes previous response from server
-    memcpy(data + offset, continuationState, continuationStateLen);
-    offset += continuationStateLen;
+    memcpy(data + offset, query->continuationState, query->continuationStateLen);
+    offset += query->continuationStateLen;
 
     // uint16_t paramLength 
     net_store_16(data, 3, offset - 5);
@@ -387,7 +508,7 @@ static uint16_t setup_service_attribute_request(uint8_t * data){
     return offset;
 }
 
-static void parse_service_search_response(uint8_t* packet){
+static void parse_service_search_response(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t* packet){
     uint16_t offset = 3;
     uint16_t parameterLength = READ_NET_16(packet,offset);
     offset+=2;
@@ -405,21 +526,21 @@ static void parse_service_search_response(uint8_t* packet){
     parse_service_record_handle_list(packet+offset, totalServiceRecordCount, currentServiceRecordCount);
     offset+=(currentServiceRecordCount * 4);
 
-    continuationStateLen = packet[offset];
+    query->continuationStateLen = packet[offset];
     offset++;
-    if (continuationStateLen > 16){
+    if (query->continuationStateLen > 16){
         log_error("Error parsing ServiceSearchResponse: Number of bytes in continuation state exceedes 16.");
         return;
     }
-    memcpy(continuationState, packet+offset, continuationStateLen);
-    offset+=continuationStateLen;
+    memcpy(query->continuationState, packet+offset, query->continuationStateLen);
+    offset+=query->continuationStateLen;
 
     if (parameterLength != offset - 5){
         log_error("Error parsing ServiceSearchResponse: wrong size of parameters, number of expected bytes%u, actual number %u.", parameterLength, offset);
     }
 }
 
-static void parse_service_attribute_response(uint8_t* packet){
+static void parse_service_attribute_response(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t* packet){
     uint16_t offset = 3;
     uint16_t parameterLength = READ_NET_16(packet,offset);
     offset+=2;
@@ -428,7 +549,7 @@ static void parse_service_attribute_response(uint8_t* packet){
     uint16_t attributeListByteCount = READ_NET_16(packet,offset);
     offset+=2;
 
-    if (attributeListByteCount > mtu){
+    if (attributeListByteCount > session->mtu){
         log_error("Error parsing ServiceSearchAttributeResponse: Number of bytes in found attribute list is larger then the MaximumAttributeByteCount.");
         return;
     }
@@ -437,38 +558,147 @@ static void parse_service_attribute_response(uint8_t* packet){
     parse_attribute_lists(packet+offset, attributeListByteCount);
     offset+=attributeListByteCount;
 
-    continuationStateLen = packet[offset];
+    query->continuationStateLen = packet[offset];
     offset++;
 
-    if (continuationStateLen > 16){
+    if (query->continuationStateLen > 16){
         log_error("Error parsing ServiceAttributeResponse: Number of bytes in continuation state exceedes 16.");
         return;
     }
-    memcpy(continuationState, packet+offset, continuationStateLen);
-    offset+=continuationStateLen;
+    memcpy(query->continuationState, packet+offset, query->continuationStateLen);
+    offset+=query->continuationStateLen;
 
     if (parameterLength != offset - 5){
         log_error("Error parsing ServiceAttributeResponse: wrong size of parameters, number of expected bytes%u, actual number %u.", parameterLength, offset);
     }
 }
+#endif
+
+// MARK: Sessions
 
-void sdp_client_service_attribute_search(bd_addr_t remote, uint32_t search_serviceRecordHandle, uint8_t * des_attributeIDList){
-    serviceRecordHandle = search_serviceRecordHandle;
-    attributeIDList = des_attributeIDList;
-    continuationStateLen = 0;
-    PDU_ID = SDP_ServiceAttributeResponse;
+void sdp_client_session_init(sdp_client_session_t * session, bd_addr_t remote){
+    memset(session, 0, sizeof(sdp_client_session_t));
+    BD_ADDR_COPY(session->remote, remote);
+    session->state = INIT;
+}
 
-    sdp_client_state = W4_CONNECT;
-    l2cap_create_channel_internal(NULL, sdp_packet_handler, remote, PSM_SDP, l2cap_max_mtu());
+void sdp_client_session_query(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * des_serviceSearchPattern,
+                              uint8_t * des_attributeIDList, void (*callback)(sdp_query_event_t * event)){
+    query->pdu_id = SDP_ServiceSearchAttributeResponse;
+    query->serviceSearchPattern = des_serviceSearchPattern;
+    query->attributeIDList = des_attributeIDList;
+    sdp_parser_select(&query->parser);
+    sdp_parser_init();
+    sdp_parser_register_callback(callback);
+    sdp_parser_select(NULL);
+    sdp_client_session_enqueue(session, query);
 }
 
-void sdp_client_service_search(bd_addr_t remote, uint8_t * des_serviceSearchPattern){
-    serviceSearchPattern = des_serviceSearchPattern;
-    continuationStateLen = 0;
-    PDU_ID = SDP_ServiceSearchResponse;
+#ifdef HAVE_SDP_EXTRA_QUERIES
+void sdp_client_session_service_attribute_search(sdp_client_session_t * session, sdp_client_query_t * query, uint32_t search_serviceRecordHandle,
+                                                 uint8_t * des_attributeIDList, void (*callback)(sdp_query_event_t * event)){
+    query->pdu_id = SDP_ServiceAttributeResponse;
+    query->serviceRecordHandle = search_serviceRecordHandle;
+    query->attributeIDList = des_attributeIDList;
+    sdp_parser_select(&query->parser);
+    sdp_parser_init_service_attribute_search();
+    sdp_parser_register_callback(callback);
+    sdp_parser_select(NULL);
+    sdp_client_session_enqueue(session, query);
+}
 
-    sdp_client_state = W4_CONNECT;
-    l2cap_create_channel_internal(NULL, sdp_packet_handler, remote, PSM_SDP, l2cap_max_mtu());
+void sdp_client_session_service_search(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * des_serviceSearchPattern,
+                                       void (*callback)(sdp_query_event_t * event)){
+    query->pdu_id = SDP_ServiceSearchResponse;
+    query->serviceSearchPattern = des_serviceSearchPattern;
+    sdp_parser_select(&query->parser);
+    sdp_parser_init();
+    sdp_parser_init_service_search();
+    sdp_parser_register_callback(callback);
+    sdp_parser_select(NULL);
+    sdp_client_session_enqueue(session, query);
 }
 #endif
 
+void sdp_client_session_close(sdp_client_session_t * session){
+    run_loop_remove_timer(&session->idle_timer);
+    switch (session->state){
+        case W2_SEND:
+        case W4_RESPONSE:
+        case IDLE:
+            l2cap_disconnect_internal(session->cid, 0);
+            break;
+        default:
+            // channel still being opened is closed in L2CAP_EVENT_CHANNEL_OPENED
+            break;
+    }
+    // unlink now, L2CAP events for the old channel don't refer to the session anymore
+    session->state = INIT;
+    linked_list_remove(&sdp_client_sessions, (linked_item_t *) session);
+    sdp_client_session_flush(session, SDP_QUERY_INCOMPLETE);
+}
+
+// MARK: Single query API using the default parser
+
+int sdp_client_ready(void){
+    return sdp_client_default_session.queries == NULL;
+}
+
+static void sdp_client_default_query_enqueue(bd_addr_t remote){
+    sdp_client_session_t * session = &sdp_client_default_session;
+    if (BD_ADDR_CMP(session->remote, remote) == 0){
+        sdp_client_session_enqueue(session, &sdp_client_default_query);
+        return;
+    }
+    // switch to other device, new channel is opened after the current one is closed
+    switch (session->state){
+        case W2_SEND:
+        case W4_RESPONSE:
+        case IDLE:
+            run_loop_remove_timer(&session->idle_timer);
+            session->state = W4_DISCONNECT;
+            l2cap_disconnect_internal(session->cid, 0);
+            break;
+        default:
+            break;
+    }
+    BD_ADDR_COPY(session->remote, remote);
+    sdp_client_session_enqueue(session, &sdp_client_default_query);
+}
+
+int sdp_client_query(bd_addr_t remote, uint8_t * des_serviceSearchPattern, uint8_t * des_attributeIDList){
+    if (!sdp_client_ready()) {
+        log_error("SDP Client busy, query refused");
+        return BTSTACK_BUSY;
+    }
+    sdp_client_default_query.pdu_id = SDP_ServiceSearchAttributeResponse;
+    sdp_client_default_query.serviceSearchPattern = des_serviceSearchPattern;
+    sdp_client_default_query.attributeIDList = des_attributeIDList;
+    sdp_client_default_query_enqueue(remote);
+    return 0;
+}
+
+#ifdef HAVE_SDP_EXTRA_QUERIES
+int sdp_client_service_attribute_search(bd_addr_t remote, uint32_t search_serviceRecordHandle, uint8_t * des_attributeIDList){
+    if (!sdp_client_ready()) {
+        log_error("SDP Client busy, query refused");
+        return BTSTACK_BUSY;
+    }
+    sdp_client_default_query.pdu_id = SDP_ServiceAttributeResponse;
+    sdp_client_default_query.serviceRecordHandle = search_serviceRecordHandle;
+    sdp_client_default_query.attributeIDList = des_attributeIDList;
+    sdp_client_default_query_enqueue(remote);
+    return 0;
+}
+
+int sdp_client_service_search(bd_addr_t remote, uint8_t * des_serviceSearchPattern){
+    if (!sdp_client_ready()) {
+        log_error("SDP Client busy, query refused");
+        return BTSTACK_BUSY;
+    }
+    sdp_client_default_query.pdu_id = SDP_ServiceSearchResponse;
+    sdp_client_default_query.serviceSearchPattern = des_serviceSearchPattern;
+    sdp_client_default_query_enqueue(remote);
+    return 0;
+}
+#endif
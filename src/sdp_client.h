@@ -43,25 +43,95 @@
 
 #include "btstack-config.h"
 
+#include <btstack/linked_list.h>
+#include <btstack/run_loop.h>
 #include <btstack/utils.h>
 
+#include "sdp_parser.h"
+
 #if defined __cplusplus
 extern "C" {
 #endif
 
+// L2CAP channel is closed if no new query is queued within this time
+#ifndef SDP_CLIENT_IDLE_TIMEOUT_MS
+#define SDP_CLIENT_IDLE_TIMEOUT_MS 2000
+#endif
+
+// SDP query, provided by the application and queued in a session until complete
+typedef struct sdp_client_query {
+    // linked list - assert: first field
+    linked_item_t item;
+    
+    uint8_t   pdu_id;               // expected response
+    uint8_t * serviceSearchPattern;
+    uint8_t * attributeIDList;
+    uint32_t  serviceRecordHandle;
+    uint8_t   continuationState[16];
+    uint8_t   continuationStateLen;
+    
+    // each query has its own parser and callback
+    sdp_parser_t parser;
+} sdp_client_query_t;
+
+// SDP client session: one L2CAP channel to a remote device, shared by all queued queries
+typedef struct sdp_client_session {
+    // linked list - assert: first field
+    linked_item_t item;
+    
+    bd_addr_t remote;
+    uint8_t   state;
+    uint16_t  cid;
+    uint16_t  mtu;
+    uint16_t  transactionID;
+    
+    // queued queries, first one is active
+    linked_list_t queries;
+    
+    timer_source_t idle_timer;
+} sdp_client_session_t;
+
 /* SDP Client */
  
 /* Queries the SDP service of the remote device given a service search pattern 
 and a list of attribute IDs. The remote data is handled by the SDP parser. The 
-SDP parser delivers attribute values and done event via a registered callback. */
+SDP parser delivers attribute values and done event via a registered callback.
+Only one query can be active, further queries are refused with BTSTACK_BUSY
+until SDP_QUERY_COMPLETE was delivered. Check sdp_client_ready() before
+setting up the SDP parser for a new query, the active query still uses it. */
+
+int sdp_client_ready(void);
+
+int sdp_client_query(bd_addr_t remote, uint8_t * des_serviceSearchPattern, uint8_t * des_attributeIDList);
 
-void sdp_client_query(bd_addr_t remote, uint8_t * des_serviceSearchPattern, uint8_t * des_attributeIDList);
+#ifdef HAVE_SDP_EXTRA_QUERIES
+int sdp_client_service_attribute_search(bd_addr_t remote, uint32_t search_serviceRecordHandle, uint8_t * des_attributeIDList);
+int sdp_client_service_search(bd_addr_t remote, uint8_t * des_serviceSearchPattern);
+#endif
+
+/* SDP Client Sessions */
+
+/* Sessions keep the L2CAP channel open while queries are queued and close it
+after SDP_CLIENT_IDLE_TIMEOUT_MS. Sessions to different devices run in parallel.
+Query results are delivered to the callback given for each query, the query
+must not be modified until its SDP_QUERY_COMPLETE event was received. */
+
+void sdp_client_session_init(sdp_client_session_t * session, bd_addr_t remote);
+
+void sdp_client_session_query(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * des_serviceSearchPattern,
+                              uint8_t * des_attributeIDList, void (*callback)(sdp_query_event_t * event));
 
 #ifdef HAVE_SDP_EXTRA_QUERIES
-void sdp_client_service_attribute_search(bd_addr_t remote, uint32_t search_serviceRecordHandle, uint8_t * des_attributeIDList);
-void sdp_client_service_search(bd_addr_t remote, uint8_t * des_serviceSearchPattern);
+void sdp_client_session_service_attribute_search(sdp_client_session_t * session, sdp_client_query_t * query, uint32_t search_serviceRecordHandle,
+                                                 uint8_t * des_attributeIDList, void (*callback)(sdp_query_event_t * event));
+void sdp_client_session_service_search(sdp_client_session_t * session, sdp_client_query_t * query, uint8_t * des_serviceSearchPattern,
+                                       void (*callback)(sdp_query_event_t * event));
 #endif
 
+// Closes the L2CAP channel. The session is unlinked before returning and can be re-initialized or freed right
+// away, queued queries complete with SDP_QUERY_INCOMPLETE from within this call.
+void sdp_client_session_close(sdp_client_session_t * session);
+
 #if defined __cplusplus
 }
 #endif
@@ -50,25 +50,12 @@ typedef enum {
     GET_ATTRIBUTE_VALUE
 } state_t;
 
-static state_t state = GET_LIST_LENGTH;
-static uint16_t attribute_id = 0;
-static uint16_t attribute_bytes_received = 0;
-static uint16_t attribute_bytes_delivered = 0;
-static uint16_t list_offset = 0;
-static uint16_t list_size;
-static uint16_t record_offset = 0;
-static uint16_t record_size;
-static uint16_t attribute_value_size;
-static int record_counter = 0;
+void dummy_notify(sdp_query_event_t* event);
 
-#ifdef HAVE_SDP_EXTRA_QUERIES
-static uint32_t record_handle;
-#endif
-
-static void (*sdp_query_callback)(sdp_query_event_t * event);
+static sdp_parser_t sdp_parser_default = { GET_LIST_LENGTH, 0, 0, 0, 0, 0, 0, 0, 0, 0, { 1, 0, 0, 0 }, dummy_notify };
 
-// Low level parser
-static de_state_t de_header_state;
+// parser used by sdp_parser_* calls
+static sdp_parser_t * sdp_parser = &sdp_parser_default;
 
 
 void de_state_init(de_state_t * state){
@@ -108,115 +95,119 @@ int de_state_size(uint8_t eventByte, de_state_t *de_state){
 
 void dummy_notify(sdp_query_event_t* event){}
 
+void sdp_parser_select(sdp_parser_t * parser){
+    sdp_parser = parser ? parser : &sdp_parser_default;
+}
+
 void sdp_parser_register_callback(void (*sdp_callback)(sdp_query_event_t* event)){
-    sdp_query_callback = dummy_notify;
+    sdp_parser->callback = dummy_notify;
     if (sdp_callback != NULL){
-        sdp_query_callback = sdp_callback;
+        sdp_parser->callback = sdp_callback;
     } 
 }
 
 void parse(uint8_t eventByte){
     // count all bytes
-    list_offset++;
-    record_offset++;
+    sdp_parser->list_offset++;
+    sdp_parser->record_offset++;
 
     // log_info(" parse BYTE_RECEIVED %02x", eventByte);
-    switch(state){
+    switch(sdp_parser->state){
         case GET_LIST_LENGTH:
-            if (!de_state_size(eventByte, &de_header_state)) break;
-            list_offset = de_header_state.de_offset;
-            list_size = de_header_state.de_size;
-            // log_info("parser: List offset %u, list size %u", list_offset, list_size);
+            if (!de_state_size(eventByte, &sdp_parser->de_header_state)) break;
+            sdp_parser->list_offset = sdp_parser->de_header_state.de_offset;
+            sdp_parser->list_size = sdp_parser->de_header_state.de_size;
+            // log_info("parser: List offset %u, list size %u", sdp_parser->list_offset, sdp_parser->list_size);
             
-            record_counter = 0;
-            state = GET_RECORD_LENGTH;
+            sdp_parser->record_counter = 0;
+            sdp_parser->state = GET_RECORD_LENGTH;
             break;
 
         case GET_RECORD_LENGTH:
             // check size
-            if (!de_state_size(eventByte, &de_header_state)) break;
-            // log_info("parser: Record payload is %d bytes.", de_header_state.de_size);
-            record_offset = de_header_state.de_offset;
-            record_size = de_header_state.de_size;
-            state = GET_ATTRIBUTE_ID_HEADER_LENGTH;
+            if (!de_state_size(eventByte, &sdp_parser->de_header_state)) break;
+            // log_info("parser: Record payload is %d bytes.", sdp_parser->de_header_state.de_size);
+            sdp_parser->record_offset = sdp_parser->de_header_state.de_offset;
+            sdp_parser->record_size = sdp_parser->de_header_state.de_size;
+            sdp_parser->state = GET_ATTRIBUTE_ID_HEADER_LENGTH;
             break;
 
         case GET_ATTRIBUTE_ID_HEADER_LENGTH:
-            if (!de_state_size(eventByte, &de_header_state)) break;
-            attribute_id = 0;
-            // log_info("ID data is stored in %d bytes.", de_header_state.de_size);
-            state = GET_ATTRIBUTE_ID;
+            if (!de_state_size(eventByte, &sdp_parser->de_header_state)) break;
+            sdp_parser->attribute_id = 0;
+            // log_info("ID data is stored in %d bytes.", sdp_parser->de_header_state.de_size);
+            sdp_parser->state = GET_ATTRIBUTE_ID;
             break;
         
         case GET_ATTRIBUTE_ID:
-            attribute_id = (attribute_id << 8) | eventByte;
-            de_header_state.de_size--;
-            if (de_header_state.de_size > 0) break;
-            // log_info("parser: Attribute ID: %04x.", attribute_id);
+            sdp_parser->attribute_id = (sdp_parser->attribute_id << 8) | eventByte;
+            sdp_parser->de_header_state.de_size--;
+            if (sdp_parser->de_header_state.de_size > 0) break;
+            // log_info("parser: Attribute ID: %04x.", sdp_parser->attribute_id);
 
-            state = GET_ATTRIBUTE_VALUE_LENGTH;
-            attribute_bytes_received  = 0;
-            attribute_bytes_delivered = 0;
-            attribute_value_size      = 0;
-            de_state_init(&de_header_state);
+            sdp_parser->state = GET_ATTRIBUTE_VALUE_LENGTH;
+            sdp_parser->attribute_bytes_received  = 0;
+            sdp_parser->attribute_bytes_delivered = 0;
+            sdp_parser->attribute_value_size      = 0;
+            de_state_init(&sdp_parser->de_header_state);
             break;
         
         case GET_ATTRIBUTE_VALUE_LENGTH:
-            attribute_bytes_received++;
+            sdp_parser->attribute_bytes_received++;
             {
             sdp_query_attribute_value_event_t attribute_value_event = {
                 SDP_QUERY_ATTRIBUTE_VALUE, 
-                record_counter, 
-                attribute_id, 
-                attribute_value_size,
-                attribute_bytes_delivered++,
+                sdp_parser->record_counter, 
+                sdp_parser->attribute_id, 
+                sdp_parser->attribute_value_size,
+                sdp_parser->attribute_bytes_delivered++,
                 eventByte
             };
-            (*sdp_query_callback)((sdp_query_event_t*)&attribute_value_event);
+            (*sdp_parser->callback)((sdp_query_event_t*)&attribute_value_event);
             }
-           if (!de_state_size(eventByte, &de_header_state)) break;
+           if (!de_state_size(eventByte, &sdp_parser->de_header_state)) break;
 
-            attribute_value_size = de_header_state.de_size + attribute_bytes_received;
+            sdp_parser->attribute_value_size = sdp_parser->de_header_state.de_size + sdp_parser->attribute_bytes_received;
 
-            state = GET_ATTRIBUTE_VALUE;
+            sdp_parser->state = GET_ATTRIBUTE_VALUE;
             break;
         
         case GET_ATTRIBUTE_VALUE: 
-            attribute_bytes_received++;
+            sdp_parser->attribute_bytes_received++;
             {
             sdp_query_attribute_value_event_t attribute_value_event = {
                 SDP_QUERY_ATTRIBUTE_VALUE, 
-                record_counter, 
-                attribute_id, 
-                attribute_value_size,
-                attribute_bytes_delivered++,
+                sdp_parser->record_counter, 
+                sdp_parser->attribute_id, 
+                sdp_parser->attribute_value_size,
+                sdp_parser->attribute_bytes_delivered++,
                 eventByte
             };
 
-            (*sdp_query_callback)((sdp_query_event_t*)&attribute_value_event);
+            (*sdp_parser->callback)((sdp_query_event_t*)&attribute_value_event);
             }
-            // log_info("paser: attribute_bytes_received %u, attribute_value_size %u", attribute_bytes_received, attribute_value_size);
+            // log_info("paser: attribute_bytes_received %u, attribute_value_size %u", sdp_parser->attribute_bytes_received, sdp_parser->attribute_value_size);
 
-            if (attribute_bytes_received < attribute_value_size) break;
-            // log_info("parser: Record offset %u, record size %u", record_offset, record_size);
-            if (record_offset != record_size){
-                state = GET_ATTRIBUTE_ID_HEADER_LENGTH;
+            if (sdp_parser->attribute_bytes_received < sdp_parser->attribute_value_size) break;
+            // log_info("parser: Record offset %u, record size %u", sdp_parser->record_offset, sdp_parser->record_size);
+            if (sdp_parser->record_offset != sdp_parser->record_size){
+                sdp_parser->state = GET_ATTRIBUTE_ID_HEADER_LENGTH;
                 // log_info("Get next attribute");
                 break;
             } 
-            record_offset = 0;
-            // log_info("parser: List offset %u, list size %u", list_offset, list_size);
+            sdp_parser->record_offset = 0;
+            // log_info("parser: List offset %u, list size %u", sdp_parser->list_offset, sdp_parser->list_size);
             
-            if (list_size > 0 && list_offset != list_size){
-                record_counter++;
-                state = GET_RECORD_LENGTH;
+            if (sdp_parser->list_size > 0 && sdp_parser->list_offset != sdp_parser->list_size){
+                sdp_parser->record_counter++;
+                sdp_parser->state = GET_RECORD_LENGTH;
                 // log_info("parser: END_OF_RECORD");
                 break;
             }
-            list_offset = 0;
-            de_state_init(&de_header_state);
-            state = GET_LIST_LENGTH;
-            record_counter = 0;
+            sdp_parser->list_offset = 0;
+            de_state_init(&sdp_parser->de_header_state);
+            sdp_parser->state = GET_LIST_LENGTH;
+            sdp_parser->record_counter = 0;
             // log_info("parser: END_OF_RECORD & DONE");
             break;
         default:
@@ -226,11 +217,11 @@ void parse(uint8_t eventByte){
 
 void sdp_parser_init(void){
     // init
-    de_state_init(&de_header_state);
-    state = GET_LIST_LENGTH;
-    list_offset = 0;
-    record_offset = 0;
-    record_counter = 0;
+    de_state_init(&sdp_parser->de_header_state);
+    sdp_parser->state = GET_LIST_LENGTH;
+    sdp_parser->list_offset = 0;
+    sdp_parser->record_offset = 0;
+    sdp_parser->record_counter = 0;
 }
 
 void sdp_parser_handle_chunk(uint8_t * data, uint16_t size){
@@ -243,29 +234,29 @@ void sdp_parser_handle_chunk(uint8_t * data, uint16_t size){
 #ifdef HAVE_SDP_EXTRA_QUERIES
 void sdp_parser_init_service_attribute_search(void){
     // init
-    de_state_init(&de_header_state);
-    state = GET_RECORD_LENGTH;
-    list_offset = 0;
-    record_offset = 0;
-    record_counter = 0;
+    de_state_init(&sdp_parser->de_header_state);
+    sdp_parser->state = GET_RECORD_LENGTH;
+    sdp_parser->list_offset = 0;
+    sdp_parser->record_offset = 0;
+    sdp_parser->record_counter = 0;
 }
 
 void sdp_parser_init_service_search(void){
-    record_offset = 0;
+    sdp_parser->record_offset = 0;
 }
 
 void sdp_parser_handle_service_search(uint8_t * data, uint16_t total_count, uint16_t record_handle_count){
     int i;
     for (i=0;i<record_handle_count;i++){
-        record_handle = READ_NET_32(data, i*4);
-        record_counter++;
+        uint32_t record_handle = READ_NET_32(data, i*4);
+        sdp_parser->record_counter++;
         sdp_query_service_record_handle_event_t service_record_handle_event = {
             SDP_QUERY_SERVICE_RECORD_HANDLE, 
             total_count, 
-            record_counter, 
+            sdp_parser->record_counter, 
             record_handle
         };
-        (*sdp_query_callback)((sdp_query_event_t*)&service_record_handle_event);       
+        (*sdp_parser->callback)((sdp_query_event_t*)&service_record_handle_event);       
     }        
 }
 #endif
@@ -275,5 +266,5 @@ void sdp_parser_handle_done(uint8_t status){
         SDP_QUERY_COMPLETE, 
         status
     };
-    (*sdp_query_callback)((sdp_query_event_t*)&complete_event);
+    (*sdp_parser->callback)((sdp_query_event_t*)&complete_event);
 }
@@ -99,6 +99,25 @@ typedef struct sdp_query_service_record_handle_event {
 } sdp_query_service_record_handle_event_t;
 #endif
 
+// SDP parser state, allows to parse several SDP responses in parallel
+typedef struct sdp_parser {
+    uint8_t  state;
+    uint16_t attribute_id;
+    uint16_t attribute_bytes_received;
+    uint16_t attribute_bytes_delivered;
+    uint16_t list_offset;
+    uint16_t list_size;
+    uint16_t record_offset;
+    uint16_t record_size;
+    uint16_t attribute_value_size;
+    int      record_counter;
+    de_state_t de_header_state;
+    void (*callback)(sdp_query_event_t * event);
+} sdp_parser_t;
+
+// Selects parser used by the following calls, NULL selects the default parser.
+void sdp_parser_select(sdp_parser_t * parser);
+
 void sdp_parser_init(void);
 void sdp_parser_handle_chunk(uint8_t * data, uint16_t size);
 
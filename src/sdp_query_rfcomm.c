@@ -281,15 +281,18 @@ void sdp_query_rfcomm_init(){
 }
 
 
-void sdp_query_rfcomm_channel_and_name_for_search_pattern(bd_addr_t remote, uint8_t * serviceSearchPattern){
+int sdp_query_rfcomm_channel_and_name_for_search_pattern(bd_addr_t remote, uint8_t * serviceSearchPattern){
+    // parser and pattern are still used by the active query
+    if (!sdp_client_ready()) return BTSTACK_BUSY;
     sdp_parser_init();
     sdp_query_rfcomm_init();
-    sdp_client_query(remote, serviceSearchPattern, (uint8_t*)&des_attributeIDList[0]);
+    return sdp_client_query(remote, serviceSearchPattern, (uint8_t*)&des_attributeIDList[0]);
 }
 
-void sdp_query_rfcomm_channel_and_name_for_uuid(bd_addr_t remote, uint16_t uuid){
+int sdp_query_rfcomm_channel_and_name_for_uuid(bd_addr_t remote, uint16_t uuid){
+    if (!sdp_client_ready()) return BTSTACK_BUSY;
     net_store_16(des_serviceSearchPattern, 3, uuid);
-    sdp_query_rfcomm_channel_and_name_for_search_pattern(remote, (uint8_t*)des_serviceSearchPattern);
+    return sdp_query_rfcomm_channel_and_name_for_search_pattern(remote, (uint8_t*)des_serviceSearchPattern);
 }
 
 void sdp_query_rfcomm_deregister_callback(){
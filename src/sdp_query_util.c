@@ -37,6 +37,8 @@
 /*
  *  sdp_query_util.c
  */
+#include <btstack/hci_cmds.h>
+
 #include "sdp_parser.h"
 #include "sdp_client.h"
 
@@ -48,10 +50,11 @@ uint8_t* create_service_search_pattern_for_uuid(uint16_t uuid){
 	return (uint8_t*)des_serviceSearchPattern;
 }
 
-void sdp_general_query_for_uuid(bd_addr_t remote, uint16_t uuid){
+int sdp_general_query_for_uuid(bd_addr_t remote, uint16_t uuid){
+    if (!sdp_client_ready()) return BTSTACK_BUSY;
     create_service_search_pattern_for_uuid(uuid);
     sdp_parser_init();
-    sdp_client_query(remote, (uint8_t*)&des_serviceSearchPattern[0], (uint8_t*)&des_attributeIDList[0]);
+    return sdp_client_query(remote, (uint8_t*)&des_serviceSearchPattern[0], (uint8_t*)&des_attributeIDList[0]);
 }
 
 
@@ -51,8 +51,8 @@ extern "C" {
 uint8_t* create_service_search_pattern_for_uuid(uint16_t uuid);
 
 // Searches SDP records on a remote device for all services with
-// a given UUID.
-void sdp_general_query_for_uuid(bd_addr_t remote, uint16_t uuid);
+// a given UUID. Returns BTSTACK_BUSY if another SDP query is active.
+int sdp_general_query_for_uuid(bd_addr_t remote, uint16_t uuid);
 
 #if defined __cplusplus
 }
@@ -566,6 +566,32 @@ int sdp_record_matches_service_search_pattern(uint8_t *record, uint8_t *serviceS
     return context.result;
 }
 
+// MARK: UUID bitmap
+// bloom filter over all UUIDs contained in a data element: a record can only match a
+// ServiceSearchPattern if all bits of the pattern bitmap are set in the record bitmap
+static int sdp_traversal_uuid_bitmap(uint8_t * element, de_type_t type, de_size_t size, void *my_context){
+    uint32_t * bitmap = (uint32_t *) my_context;
+    uint8_t normalizedUUID[16];
+    if (type == DE_UUID && de_get_normalized_uuid(normalizedUUID, element)){
+        int i;
+        uint8_t hash = 0;
+        for (i = 0; i < 16; i++){
+            hash = hash * 31 + normalizedUUID[i];
+        }
+        hash &= 0x3f;
+        bitmap[hash >> 5] |= 1UL << (hash & 0x1f);
+    }
+    if (type == DE_DES){
+        de_traverse_sequence(element, sdp_traversal_uuid_bitmap, my_context);
+    }
+    return 0;
+}
+void sdp_create_uuid_bitmap(uint8_t * element, uint32_t * bitmap){
+    bitmap[0] = 0;
+    bitmap[1] = 0;
+    de_traverse_sequence(element, sdp_traversal_uuid_bitmap, bitmap);
+}
+
 // MARK: Dump DataElement
 // context { indent }
 #ifdef SDP_DES_DUMP
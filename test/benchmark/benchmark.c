@@ -0,0 +1,435 @@
+/*
+ * Copyright (C) 2009-2012 by Matthias Ringwald
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at btstack@ringwald.ch
+ *
+ */
+
+/*
+ *  benchmark.c
+ *
+ *  Throughput benchmarks for L2CAP, RFCOMM and ATT
+ *
+ *  Each benchmark forks two BTstack processes that are connected back-to-back
+ *  via the virtual HCI transport. The client sends a fixed number of packets,
+ *  the server counts them and reports the elapsed time. CPU time is taken
+ *  from both processes.
+ */
+
+#include "btstack-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+
+#include "hci.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "btstack_memory.h"
+#include "remote_device_db.h"
+#include "hci_transport.h"
+#include "att.h"
+#include "att_server.h"
+#include "gatt_client.h"
+#include "sm.h"
+
+#include "profile.h"
+
+#define BENCHMARK_PSM               0x1001
+#define BENCHMARK_RFCOMM_CHANNEL    1
+#define BENCHMARK_VALUE_HANDLE      ATT_CHARACTERISTIC_0000FF11_0000_1000_8000_00805F9B34FB_01_VALUE_HANDLE
+#define BENCHMARK_TIMEOUT_S         60
+
+typedef enum {
+    BENCHMARK_L2CAP,
+    BENCHMARK_RFCOMM,
+    BENCHMARK_ATT,
+    BENCHMARK_COUNT
+} benchmark_t;
+
+static const char * benchmark_names[BENCHMARK_COUNT] = { "l2cap", "rfcomm", "att" };
+
+typedef struct {
+    uint32_t packets;
+    uint32_t bytes;
+    uint32_t usec;
+} benchmark_result_t;
+
+static bd_addr_t server_addr = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x01 };
+static bd_addr_t client_addr = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x02 };
+
+// configuration
+static benchmark_t benchmark;
+static uint32_t    num_packets = 10000;
+static uint16_t    payload_size = 1000;
+static int         result_fd;
+
+// client state
+static uint8_t   * test_data;
+static uint32_t    packets_to_send;
+static uint16_t    local_cid;
+static uint16_t    send_size;
+
+// server state
+static uint32_t    bytes_expected;
+static benchmark_result_t result;
+static struct timeval start_time;
+
+// server
+
+static void server_start(void){
+    gettimeofday(&start_time, NULL);
+}
+
+static void server_received(uint16_t size){
+    result.packets++;
+    result.bytes += size;
+    if (result.bytes < bytes_expected) return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    result.usec = (now.tv_sec - start_time.tv_sec) * 1000000 + (now.tv_usec - start_time.tv_usec);
+    write(result_fd, &result, sizeof(result));
+    // client sees disconnect when virtual link goes down
+    exit(0);
+}
+
+static int server_att_write_callback(uint16_t con_handle, uint16_t attribute_handle, uint16_t transaction_mode, uint16_t offset, uint8_t *buffer, uint16_t buffer_size){
+    if (attribute_handle != BENCHMARK_VALUE_HANDLE) return 0;
+    server_received(buffer_size);
+    return 0;
+}
+
+static void server_packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    switch (packet_type){
+        case L2CAP_DATA_PACKET:
+        case RFCOMM_DATA_PACKET:
+            server_received(size);
+            return;
+        case HCI_EVENT_PACKET:
+            break;
+        default:
+            return;
+    }
+    switch (packet[0]){
+        case L2CAP_EVENT_INCOMING_CONNECTION:
+            l2cap_accept_connection_internal(READ_BT_16(packet, 12));
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]) break;
+            server_start();
+            break;
+        case RFCOMM_EVENT_INCOMING_CONNECTION:
+            rfcomm_accept_connection_internal(READ_BT_16(packet, 9));
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) break;
+            server_start();
+            break;
+        case HCI_EVENT_LE_META:
+            if (packet[2] != HCI_SUBEVENT_LE_CONNECTION_COMPLETE) break;
+            server_start();
+            break;
+        default:
+            break;
+    }
+}
+
+static void server_l2cap_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    server_packet_handler(NULL, packet_type, channel, packet, size);
+}
+
+static void server_sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    server_packet_handler(NULL, packet_type, channel, packet, size);
+}
+
+// client
+
+static void client_try_send(void){
+    if (!local_cid) return;
+    while (packets_to_send){
+        int err;
+        if (benchmark == BENCHMARK_L2CAP){
+            if (!l2cap_can_send_packet_now(local_cid)) return;
+            err = l2cap_send_internal(local_cid, test_data, send_size);
+        } else {
+            err = rfcomm_send_internal(local_cid, test_data, send_size);
+        }
+        if (err) return;
+        packets_to_send--;
+    }
+}
+
+static void client_gatt_event_handler(le_event_t * event){
+    if (event->type != GATT_QUERY_COMPLETE) return;
+    if (((gatt_complete_event_t *) event)->status){
+        fprintf(stderr, "att: write stream failed, status %u\n", ((gatt_complete_event_t *) event)->status);
+        exit(1);
+    }
+}
+
+static void client_packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            if (packet[2] != HCI_STATE_WORKING) break;
+            switch (benchmark){
+                case BENCHMARK_L2CAP:
+                    l2cap_create_channel_internal(NULL, NULL, server_addr, BENCHMARK_PSM, payload_size);
+                    break;
+                case BENCHMARK_RFCOMM:
+                    rfcomm_create_channel_internal(NULL, &server_addr, BENCHMARK_RFCOMM_CHANNEL);
+                    break;
+                case BENCHMARK_ATT:
+                    le_central_connect(&server_addr, BD_ADDR_TYPE_LE_PUBLIC);
+                    break;
+                default:
+                    break;
+            }
+            break;
+        case L2CAP_EVENT_CHANNEL_OPENED:
+            if (packet[2]) {
+                fprintf(stderr, "l2cap: channel open failed, status %u\n", packet[2]);
+                exit(1);
+            }
+            local_cid = READ_BT_16(packet, 13);
+            send_size = READ_BT_16(packet, 19);
+            if (send_size > payload_size) send_size = payload_size;
+            client_try_send();
+            break;
+        case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+            if (packet[2]) {
+                fprintf(stderr, "rfcomm: channel open failed, status %u\n", packet[2]);
+                exit(1);
+            }
+            local_cid = READ_BT_16(packet, 12);
+            send_size = READ_BT_16(packet, 14);
+            if (send_size > payload_size) send_size = payload_size;
+            client_try_send();
+            break;
+        case L2CAP_EVENT_CREDITS:
+        case RFCOMM_EVENT_CREDITS:
+        case DAEMON_EVENT_HCI_PACKET_SENT:
+            client_try_send();
+            break;
+        case HCI_EVENT_LE_META:
+            if (packet[2] != HCI_SUBEVENT_LE_CONNECTION_COMPLETE) break;
+            if (packet[3]) {
+                fprintf(stderr, "att: connection failed, status %u\n", packet[3]);
+                exit(1);
+            }
+            gatt_client_write_value_of_characteristic_without_response_stream(READ_BT_16(packet, 4),
+                BENCHMARK_VALUE_HANDLE, bytes_expected, test_data);
+            break;
+        case HCI_EVENT_DISCONNECTION_COMPLETE:
+            // server has seen all data
+            exit(0);
+            break;
+        default:
+            break;
+    }
+}
+
+static void client_sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    client_packet_handler(NULL, packet_type, channel, packet, size);
+}
+
+// stack setup, runs in child process
+static void benchmark_run_stack(int server, int peer_fd){
+    static hci_virtual_config_t config;
+    config.peer_fd = peer_fd;
+    BD_ADDR_COPY(config.bd_addr, server ? server_addr : client_addr);
+
+    alarm(BENCHMARK_TIMEOUT_S);
+
+    btstack_memory_init();
+    run_loop_init(RUN_LOOP_POSIX);
+    hci_init(hci_transport_virtual_instance(), &config, NULL, (remote_device_db_t *) &remote_device_db_memory);
+    l2cap_init();
+
+    switch (benchmark){
+        case BENCHMARK_L2CAP:
+            if (server){
+                l2cap_register_packet_handler(server_packet_handler);
+                l2cap_register_service_internal(NULL, server_l2cap_packet_handler, BENCHMARK_PSM, payload_size, LEVEL_0);
+            } else {
+                l2cap_register_packet_handler(client_packet_handler);
+            }
+            break;
+        case BENCHMARK_RFCOMM:
+            rfcomm_init();
+            if (server){
+                l2cap_register_packet_handler(server_packet_handler);
+                rfcomm_register_packet_handler(server_packet_handler);
+                rfcomm_register_service_internal(NULL, BENCHMARK_RFCOMM_CHANNEL, payload_size);
+            } else {
+                l2cap_register_packet_handler(client_packet_handler);
+                rfcomm_register_packet_handler(client_packet_handler);
+            }
+            break;
+        case BENCHMARK_ATT:
+            sm_init();
+            if (server){
+                att_server_init(profile_data, NULL, server_att_write_callback);
+                att_server_register_packet_handler(server_sm_packet_handler);
+            } else {
+                gatt_client_init();
+                gatt_client_register_packet_handler(client_gatt_event_handler);
+                sm_register_packet_handler(client_sm_packet_handler);
+            }
+            break;
+        default:
+            break;
+    }
+
+    hci_power_control(HCI_POWER_ON);
+    run_loop_execute();
+    exit(0);
+}
+
+static double benchmark_cpu_usec(void){
+    struct rusage usage;
+    getrusage(RUSAGE_CHILDREN, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000.0
+         +  usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static int benchmark_run(benchmark_t which){
+    int peer_fds[2];
+    int result_fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, peer_fds)) return -1;
+    if (pipe(result_fds)) return -1;
+
+    benchmark = which;
+    memset(&result, 0, sizeof(result));
+    bytes_expected = payload_size * num_packets;
+    packets_to_send = num_packets;
+    fflush(stdout);
+
+    double cpu_start = benchmark_cpu_usec();
+
+    pid_t server_pid = fork();
+    if (server_pid == 0){
+        close(peer_fds[1]);
+        close(result_fds[0]);
+        result_fd = result_fds[1];
+        benchmark_run_stack(1, peer_fds[0]);
+    }
+    pid_t client_pid = fork();
+    if (client_pid == 0){
+        close(peer_fds[0]);
+        close(result_fds[0]);
+        close(result_fds[1]);
+        benchmark_run_stack(0, peer_fds[1]);
+    }
+    close(peer_fds[0]);
+    close(peer_fds[1]);
+    close(result_fds[1]);
+
+    benchmark_result_t benchmark_result;
+    int have_result = read(result_fds[0], &benchmark_result, sizeof(benchmark_result)) == sizeof(benchmark_result);
+    close(result_fds[0]);
+
+    int status;
+    int failed = 0;
+    waitpid(server_pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+    waitpid(client_pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) failed = 1;
+
+    double cpu_usec = benchmark_cpu_usec() - cpu_start;
+
+    if (!have_result || failed || benchmark_result.packets == 0){
+        printf("%-8s failed\n", benchmark_names[which]);
+        return -1;
+    }
+
+    double seconds = benchmark_result.usec / 1000000.0;
+    printf("%-8s %8u packets %10u bytes in %7.3f s: %9.0f packets/s %8.0f kB/s %7.2f us CPU/packet\n",
+           benchmark_names[which], benchmark_result.packets, benchmark_result.bytes, seconds,
+           benchmark_result.packets / seconds, benchmark_result.bytes / seconds / 1000.0,
+           cpu_usec / benchmark_result.packets);
+    return 0;
+}
+
+static void usage(const char * name){
+    fprintf(stderr, "Usage: %s [-n packets] [-s payload size] [l2cap] [rfcomm] [att]\n", name);
+    exit(1);
+}
+
+int main(int argc, char ** argv){
+    int selected[BENCHMARK_COUNT];
+    int any_selected = 0;
+    int i, j;
+
+    memset(selected, 0, sizeof(selected));
+    for (i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc){
+            num_packets = atoi(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc){
+            payload_size = atoi(argv[++i]);
+            continue;
+        }
+        for (j = 0; j < BENCHMARK_COUNT; j++){
+            if (strcmp(argv[i], benchmark_names[j]) == 0) break;
+        }
+        if (j == BENCHMARK_COUNT) usage(argv[0]);
+        selected[j] = 1;
+        any_selected = 1;
+    }
+    if (num_packets == 0 || payload_size == 0) usage(argv[0]);
+
+    // att client streams all data from one buffer, write size is given by the negotiated MTU
+    uint32_t test_data_len = payload_size * num_packets;
+    test_data = malloc(test_data_len);
+    if (!test_data) return 1;
+    for (i = 0; i < (int) test_data_len; i++){
+        test_data[i] = i;
+    }
+
+    int err = 0;
+    for (i = 0; i < BENCHMARK_COUNT; i++){
+        if (any_selected && !selected[i]) continue;
+        if (benchmark_run((benchmark_t) i)) err = 1;
+    }
+    return err;
+}
@@ -0,0 +1,15 @@
+// config.h created by hand for the BTstack benchmarks
+
+#ifndef __BTSTACK_CONFIG
+#define __BTSTACK_CONFIG
+
+#define HAVE_BLE
+#define USE_POSIX_RUN_LOOP
+#define HAVE_RFCOMM
+#define HAVE_TIME
+#define HAVE_MALLOC
+#define HAVE_BZERO
+#define ENABLE_LOG_ERROR
+#define HCI_ACL_PAYLOAD_SIZE 1021
+
+#endif
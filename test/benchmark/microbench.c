@@ -0,0 +1,893 @@
+/*
+ * Copyright (C) 2009-2012 by Matthias Ringwald
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor the names of
+ *    contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 4. Any redistribution, use, or modification is done solely for
+ *    personal benefit and not for any commercial purpose or for
+ *    monetary gain.
+ *
+ * THIS SOFTWARE IS PROVIDED BY MATTHIAS RINGWALD AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL MATTHIAS
+ * RINGWALD OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Please inquire about commercial licensing options at btstack@ringwald.ch
+ *
+ */
+
+/*
+ *  microbench.c
+ *
+ *  Microbenchmarks for protocol hot paths
+ *
+ *  The stack runs in-process against an emulated controller. A scripted peer
+ *  connects and opens L2CAP, RFCOMM and SDP channels, then each benchmark runs
+ *  a tight loop over one hot path and reports ns/op and heap allocations/op.
+ *  Packets the stack sends in response are processed by the controller and the
+ *  peer as part of the operation, like a real controller would complete them.
+ */
+
+#include "btstack-config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include <btstack/sdp_util.h>
+#include <btstack/utils.h>
+
+#include "hci.h"
+#include "l2cap.h"
+#include "rfcomm.h"
+#include "sdp.h"
+#include "btstack_memory.h"
+#include "remote_device_db.h"
+#include "hci_transport.h"
+#include "att.h"
+
+#define MICROBENCH_HANDLE               0x0001
+#define MICROBENCH_PSM                  0x1001
+#define MICROBENCH_RFCOMM_CHANNEL       1
+#define MICROBENCH_RFCOMM_DLCI          (MICROBENCH_RFCOMM_CHANNEL << 1)
+#define MICROBENCH_L2CAP_PAYLOAD        1000
+#define MICROBENCH_ACL_FRAGMENT         339     // DH5 payload
+#define MICROBENCH_RFCOMM_PAYLOAD       127
+#define MICROBENCH_SDP_RECORDS          100
+#define MICROBENCH_GATT_SERVICES        100
+#define MICROBENCH_GATT_CHARACTERISTICS 10
+
+// peer side CIDs
+#define PEER_CID_L2CAP   0x0041
+#define PEER_CID_RFCOMM  0x0042
+#define PEER_CID_SDP     0x0043
+
+// RFCOMM frame types and multiplexer commands, see rfcomm.c
+#define BT_RFCOMM_SABM      0x3F
+#define BT_RFCOMM_UIH       0xEF
+#define BT_RFCOMM_MSC_CMD   0xE3
+#define BT_RFCOMM_MSC_RSP   0xE1
+#define BT_RFCOMM_PN_CMD    0x83
+
+#define QUEUE_SIZE 64
+
+typedef struct {
+    int      to_peer;
+    uint8_t  type;
+    uint16_t size;
+    uint8_t  data[HCI_ACL_BUFFER_SIZE];
+} queued_packet_t;
+
+typedef struct {
+    uint16_t psm;
+    uint16_t peer_cid;
+    uint16_t stack_cid;
+    int      config_done;   // bit 0: peer config accepted, bit 1: stack config accepted
+    uint16_t rx_len;
+    uint8_t  rx[HCI_ACL_BUFFER_SIZE];
+} peer_channel_t;
+
+typedef struct {
+    const char * name;
+    void      (*op)(void);
+    uint32_t     iterations;
+} microbench_t;
+
+typedef struct {
+    double ns_per_op;
+    double allocs_per_op;
+} microbench_result_t;
+
+static bd_addr_t peer_addr  = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x02 };
+static bd_addr_t local_addr = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x01 };
+
+static void (*host_packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size);
+static hci_transport_t controller_transport;
+
+static queued_packet_t queue[QUEUE_SIZE];
+static int queue_read_pos;
+static int queue_write_pos;
+
+static peer_channel_t peer_channels[] = {
+    { MICROBENCH_PSM, PEER_CID_L2CAP,  0, 0, 0 },
+    { PSM_RFCOMM,     PEER_CID_RFCOMM, 0, 0, 0 },
+    { PSM_SDP,        PEER_CID_SDP,    0, 0, 0 },
+};
+static uint8_t peer_sig_id;
+
+static int      stack_working;
+static uint16_t l2cap_local_cid;
+static uint32_t l2cap_bytes_received;
+static uint16_t rfcomm_cid;
+static uint32_t rfcomm_bytes_received;
+
+// inputs
+static uint8_t  acl_fragments[3][HCI_ACL_HEADER_SIZE + MICROBENCH_ACL_FRAGMENT];
+static uint16_t acl_fragment_sizes[3];
+static uint8_t  rfcomm_uih_packet[HCI_ACL_HEADER_SIZE + 4 + 4 + MICROBENCH_RFCOMM_PAYLOAD];
+static uint16_t rfcomm_uih_packet_size;
+static uint8_t  rfcomm_msc_packet[HCI_ACL_HEADER_SIZE + 4 + 4 + 4];
+static uint16_t rfcomm_msc_packet_size;
+static uint8_t  spp_record[200];
+static uint8_t  spp_search_pattern[20];
+static uint8_t  rfcomm_header[3];
+static uint8_t * gatt_db;
+static uint16_t gatt_last_handle;
+static att_connection_t att_connection;
+static uint8_t  att_response[ATT_DEFAULT_MTU];
+static volatile uint32_t sink;
+
+// heap allocations, counted if malloc is wrapped by the linker
+static uint32_t allocations;
+#ifdef MICROBENCH_WRAP_MALLOC
+void * __real_malloc(size_t size);
+void * __wrap_malloc(size_t size){
+    allocations++;
+    return __real_malloc(size);
+}
+#endif
+
+// queue shared by controller and peer, processed in order by controller_run()
+
+static void queue_packet(int to_peer, uint8_t type, const uint8_t * data, uint16_t size){
+    int next = (queue_write_pos + 1) % QUEUE_SIZE;
+    if (next == queue_read_pos || size > HCI_ACL_BUFFER_SIZE){
+        fprintf(stderr, "microbench: queue overflow\n");
+        exit(1);
+    }
+    queued_packet_t * packet = &queue[queue_write_pos];
+    packet->to_peer = to_peer;
+    packet->type    = type;
+    packet->size    = size;
+    memcpy(packet->data, data, size);
+    queue_write_pos = next;
+}
+
+// emulated controller
+
+static void controller_emit_event(uint8_t * event, uint16_t size){
+    queue_packet(0, HCI_EVENT_PACKET, event, size);
+}
+
+static void controller_emit_command_complete(uint16_t opcode, uint8_t * params, int params_len){
+    uint8_t event[2 + 3 + 16];
+    event[0] = HCI_EVENT_COMMAND_COMPLETE;
+    event[1] = 3 + params_len;
+    event[2] = 1;
+    bt_store_16(event, 3, opcode);
+    memcpy(&event[5], params, params_len);
+    controller_emit_event(event, 5 + params_len);
+}
+
+static void controller_emit_command_status(uint16_t opcode){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_COMMAND_STATUS;
+    event[1] = 4;
+    event[2] = 0;
+    event[3] = 1;
+    bt_store_16(event, 4, opcode);
+    controller_emit_event(event, sizeof(event));
+}
+
+static void controller_handle_command(uint8_t * packet){
+    uint16_t opcode = READ_BT_16(packet, 0);
+    uint8_t params[16];
+    uint8_t event[16];
+    memset(params, 0, sizeof(params));
+
+    if (IS_COMMAND(packet, hci_read_bd_addr)){
+        bt_flip_addr(&params[1], local_addr);
+        controller_emit_command_complete(opcode, params, 7);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_buffer_size)){
+        bt_store_16(params, 1, HCI_ACL_PAYLOAD_SIZE);
+        bt_store_16(params, 4, 8);
+        controller_emit_command_complete(opcode, params, 8);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_local_supported_features)){
+        // no SSP, no LE
+        controller_emit_command_complete(opcode, params, 9);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_accept_connection_request)){
+        controller_emit_command_status(opcode);
+        event[0] = HCI_EVENT_CONNECTION_COMPLETE;
+        event[1] = 11;
+        event[2] = 0;
+        bt_store_16(event, 3, MICROBENCH_HANDLE);
+        bt_flip_addr(&event[5], peer_addr);
+        event[11] = 1;  // ACL
+        event[12] = 0;  // no encryption
+        controller_emit_event(event, 13);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_remote_supported_features_command)){
+        controller_emit_command_status(opcode);
+        memset(event, 0, sizeof(event));
+        event[0] = HCI_EVENT_READ_REMOTE_SUPPORTED_FEATURES_COMPLETE;
+        event[1] = 11;
+        bt_store_16(event, 3, MICROBENCH_HANDLE);
+        controller_emit_event(event, 13);
+        return;
+    }
+    controller_emit_command_complete(opcode, params, 1);
+}
+
+static int controller_send_packet(uint8_t packet_type, uint8_t * packet, int size){
+    uint8_t event[7];
+    event[0] = DAEMON_EVENT_HCI_PACKET_SENT;
+    event[1] = 0;
+    controller_emit_event(event, 2);
+    switch (packet_type){
+        case HCI_COMMAND_DATA_PACKET:
+            controller_handle_command(packet);
+            break;
+        case HCI_ACL_DATA_PACKET:
+            queue_packet(1, packet_type, packet, size);
+            event[0] = HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS;
+            event[1] = 5;
+            event[2] = 1;
+            bt_store_16(event, 3, READ_ACL_CONNECTION_HANDLE(packet));
+            bt_store_16(event, 5, 1);
+            controller_emit_event(event, 7);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static int controller_can_send_packet_now(uint8_t packet_type){
+    return 1;
+}
+
+static int controller_open(void * config){
+    return 0;
+}
+
+static int controller_close(void * config){
+    return 0;
+}
+
+static void controller_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    host_packet_handler = handler;
+}
+
+static const char * controller_get_transport_name(void){
+    return "microbench";
+}
+
+// scripted peer
+
+static peer_channel_t * peer_channel_for_cid(uint16_t peer_cid){
+    int i;
+    for (i = 0; i < sizeof(peer_channels) / sizeof(peer_channel_t); i++){
+        if (peer_channels[i].peer_cid == peer_cid) return &peer_channels[i];
+    }
+    return NULL;
+}
+
+static uint16_t peer_create_acl(uint8_t * packet, uint16_t cid, const uint8_t * data, uint16_t len){
+    bt_store_16(packet, 0, MICROBENCH_HANDLE | (0x02 << 12));
+    bt_store_16(packet, 2, len + 4);
+    bt_store_16(packet, 4, len);
+    bt_store_16(packet, 6, cid);
+    memcpy(&packet[8], data, len);
+    return len + 8;
+}
+
+static void peer_send_acl(uint16_t cid, const uint8_t * data, uint16_t len){
+    uint8_t packet[HCI_ACL_BUFFER_SIZE];
+    uint16_t size = peer_create_acl(packet, cid, data, len);
+    queue_packet(0, HCI_ACL_DATA_PACKET, packet, size);
+}
+
+static void peer_send_signaling(uint8_t code, uint8_t identifier, uint8_t * params, uint16_t len){
+    uint8_t command[4 + 16];
+    command[0] = code;
+    command[1] = identifier;
+    bt_store_16(command, 2, len);
+    memcpy(&command[4], params, len);
+    peer_send_acl(L2CAP_CID_SIGNALING, command, 4 + len);
+}
+
+static void peer_send_config_request(peer_channel_t * channel){
+    uint8_t params[4];
+    bt_store_16(params, 0, channel->stack_cid);
+    bt_store_16(params, 2, 0);
+    peer_send_signaling(CONFIGURE_REQUEST, ++peer_sig_id, params, sizeof(params));
+}
+
+static void peer_handle_signaling(uint8_t * command){
+    uint8_t params[8];
+    peer_channel_t * channel;
+    switch (command[0]){
+        case CONNECTION_RESPONSE:
+            channel = peer_channel_for_cid(READ_BT_16(command, 6));
+            if (!channel || READ_BT_16(command, 8) != 0) break;
+            channel->stack_cid = READ_BT_16(command, 4);
+            peer_send_config_request(channel);
+            break;
+        case CONFIGURE_REQUEST:
+            channel = peer_channel_for_cid(READ_BT_16(command, 4));
+            if (!channel) break;
+            bt_store_16(params, 0, channel->stack_cid);
+            bt_store_16(params, 2, 0);
+            bt_store_16(params, 4, 0);
+            peer_send_signaling(CONFIGURE_RESPONSE, command[1], params, 6);
+            channel->config_done |= 2;
+            break;
+        case CONFIGURE_RESPONSE:
+            channel = peer_channel_for_cid(READ_BT_16(command, 4));
+            if (!channel) break;
+            channel->config_done |= 1;
+            break;
+        case INFORMATION_REQUEST:
+            bt_store_16(params, 0, READ_BT_16(command, 4));
+            bt_store_16(params, 2, 1);  // not supported
+            peer_send_signaling(INFORMATION_RESPONSE, command[1], params, 4);
+            break;
+        default:
+            break;
+    }
+}
+
+static void peer_handle_acl(uint8_t * packet, uint16_t size){
+    uint16_t cid = READ_L2CAP_CHANNEL_ID(packet);
+    uint16_t len = READ_L2CAP_LENGTH(packet);
+    if (cid == L2CAP_CID_SIGNALING){
+        uint16_t pos = 8;
+        while (pos < 8 + len){
+            peer_handle_signaling(&packet[pos]);
+            pos += 4 + READ_BT_16(packet, pos + 2);
+        }
+        return;
+    }
+    peer_channel_t * channel = peer_channel_for_cid(cid);
+    if (!channel) return;
+    channel->rx_len = len;
+    memcpy(channel->rx, &packet[8], len);
+}
+
+static void controller_run(void){
+    while (queue_read_pos != queue_write_pos){
+        queued_packet_t * packet = &queue[queue_read_pos];
+        queue_read_pos = (queue_read_pos + 1) % QUEUE_SIZE;
+        if (packet->to_peer){
+            peer_handle_acl(packet->data, packet->size);
+        } else {
+            (*host_packet_handler)(packet->type, packet->data, packet->size);
+        }
+    }
+}
+
+static peer_channel_t * peer_open_channel(uint16_t psm){
+    peer_channel_t * channel = NULL;
+    int i;
+    for (i = 0; i < sizeof(peer_channels) / sizeof(peer_channel_t); i++){
+        if (peer_channels[i].psm == psm) channel = &peer_channels[i];
+    }
+    uint8_t params[4];
+    bt_store_16(params, 0, psm);
+    bt_store_16(params, 2, channel->peer_cid);
+    peer_send_signaling(CONNECTION_REQUEST, ++peer_sig_id, params, sizeof(params));
+    controller_run();
+    if (channel->config_done != 3){
+        fprintf(stderr, "microbench: failed to open L2CAP channel for PSM 0x%04x\n", psm);
+        exit(1);
+    }
+    return channel;
+}
+
+static uint16_t peer_create_rfcomm(uint8_t * frame, uint8_t dlci, uint8_t control, const uint8_t * data, uint8_t len){
+    frame[0] = 0x03 | (dlci << 2);  // EA, C/R: peer is initiator
+    frame[1] = control;
+    frame[2] = (len << 1) | 1;
+    memcpy(&frame[3], data, len);
+    // FCS over address and control for UIH, including length otherwise
+    frame[3 + len] = crc8_calc(frame, (control & 0xef) == 0xef ? 2 : 3);
+    return 4 + len;
+}
+
+static void peer_send_rfcomm(uint8_t dlci, uint8_t control, const uint8_t * data, uint8_t len){
+    uint8_t frame[4 + MICROBENCH_RFCOMM_PAYLOAD];
+    uint16_t size = peer_create_rfcomm(frame, dlci, control, data, len);
+    peer_send_acl(peer_channel_for_cid(PEER_CID_RFCOMM)->stack_cid, frame, size);
+    controller_run();
+}
+
+// stack side
+
+static void packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    switch (packet_type){
+        case L2CAP_DATA_PACKET:
+            l2cap_bytes_received += size;
+            break;
+        case RFCOMM_DATA_PACKET:
+            rfcomm_bytes_received += size;
+            break;
+        case HCI_EVENT_PACKET:
+            switch (packet[0]){
+                case BTSTACK_EVENT_STATE:
+                    stack_working = packet[2] == HCI_STATE_WORKING;
+                    break;
+                case RFCOMM_EVENT_INCOMING_CONNECTION:
+                    rfcomm_accept_connection_internal(READ_BT_16(packet, 9));
+                    break;
+                case RFCOMM_EVENT_OPEN_CHANNEL_COMPLETE:
+                    if (packet[2] == 0){
+                        rfcomm_cid = READ_BT_16(packet, 12);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void l2cap_service_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    switch (packet_type){
+        case L2CAP_DATA_PACKET:
+            l2cap_bytes_received += size;
+            break;
+        case HCI_EVENT_PACKET:
+            switch (packet[0]){
+                case L2CAP_EVENT_INCOMING_CONNECTION:
+                    l2cap_accept_connection_internal(READ_BT_16(packet, 12));
+                    break;
+                case L2CAP_EVENT_CHANNEL_OPENED:
+                    if (packet[2] == 0){
+                        l2cap_local_cid = READ_BT_16(packet, 13);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void stack_setup(void){
+    controller_transport.open                    = controller_open;
+    controller_transport.close                   = controller_close;
+    controller_transport.send_packet             = controller_send_packet;
+    controller_transport.register_packet_handler = controller_register_packet_handler;
+    controller_transport.get_transport_name      = controller_get_transport_name;
+    controller_transport.set_baudrate            = NULL;
+    controller_transport.can_send_packet_now     = controller_can_send_packet_now;
+
+    run_loop_init(RUN_LOOP_POSIX);
+    btstack_memory_init();
+    hci_init(&controller_transport, NULL, NULL, &remote_device_db_memory);
+    l2cap_init();
+    l2cap_register_packet_handler(packet_handler);
+    l2cap_register_service_internal(NULL, l2cap_service_packet_handler, MICROBENCH_PSM, MICROBENCH_L2CAP_PAYLOAD + 100, LEVEL_0);
+    rfcomm_init();
+    rfcomm_set_required_security_level(LEVEL_0);
+    rfcomm_register_packet_handler(packet_handler);
+    rfcomm_register_service_internal(NULL, MICROBENCH_RFCOMM_CHANNEL, MICROBENCH_RFCOMM_PAYLOAD);
+    sdp_init();
+
+    int i;
+    for (i = 0; i < MICROBENCH_SDP_RECORDS; i++){
+        char name[20];
+        sprintf(name, "Serial Port %u", i);
+        sdp_create_spp_service(spp_record, MICROBENCH_RFCOMM_CHANNEL, name);
+        sdp_register_service_internal(NULL, spp_record);
+    }
+
+    hci_power_control(HCI_POWER_ON);
+    controller_run();
+    if (!stack_working){
+        fprintf(stderr, "microbench: HCI init failed\n");
+        exit(1);
+    }
+
+    // incoming ACL connection
+    uint8_t event[12];
+    event[0] = HCI_EVENT_CONNECTION_REQUEST;
+    event[1] = 10;
+    bt_flip_addr(&event[2], peer_addr);
+    memset(&event[8], 0, 3);
+    event[11] = 1;
+    queue_packet(0, HCI_EVENT_PACKET, event, sizeof(event));
+    controller_run();
+
+    // L2CAP channel for reassembly
+    peer_open_channel(MICROBENCH_PSM);
+    if (!l2cap_local_cid){
+        fprintf(stderr, "microbench: L2CAP channel not opened\n");
+        exit(1);
+    }
+
+    // RFCOMM multiplexer and channel
+    peer_open_channel(PSM_RFCOMM);
+    uint8_t payload[10];
+    peer_send_rfcomm(0, BT_RFCOMM_SABM, NULL, 0);
+    payload[0] = BT_RFCOMM_PN_CMD;
+    payload[1] = (8 << 1) | 1;
+    payload[2] = MICROBENCH_RFCOMM_DLCI;
+    payload[3] = 0xf0;  // credit based flow control
+    payload[4] = 0;
+    payload[5] = 0;
+    bt_store_16(payload, 6, MICROBENCH_RFCOMM_PAYLOAD);
+    payload[8] = 0;
+    payload[9] = 7;     // initial credits
+    peer_send_rfcomm(0, BT_RFCOMM_UIH, payload, 10);
+    peer_send_rfcomm(MICROBENCH_RFCOMM_DLCI, BT_RFCOMM_SABM, NULL, 0);
+    payload[0] = BT_RFCOMM_MSC_CMD;
+    payload[1] = (2 << 1) | 1;
+    payload[2] = 0x03 | (MICROBENCH_RFCOMM_DLCI << 2);
+    payload[3] = 0x8d;
+    peer_send_rfcomm(0, BT_RFCOMM_UIH, payload, 4);
+    payload[0] = BT_RFCOMM_MSC_RSP;
+    peer_send_rfcomm(0, BT_RFCOMM_UIH, payload, 4);
+    if (!rfcomm_cid){
+        fprintf(stderr, "microbench: RFCOMM channel not opened\n");
+        exit(1);
+    }
+
+    // SDP
+    peer_open_channel(PSM_SDP);
+}
+
+static void inputs_setup(void){
+    int i;
+
+    // L2CAP packet on dynamic channel, split into DH5 sized ACL fragments
+    uint8_t l2cap_packet[4 + MICROBENCH_L2CAP_PAYLOAD];
+    bt_store_16(l2cap_packet, 0, MICROBENCH_L2CAP_PAYLOAD);
+    bt_store_16(l2cap_packet, 2, l2cap_local_cid);
+    for (i = 0; i < MICROBENCH_L2CAP_PAYLOAD; i++){
+        l2cap_packet[4 + i] = i;
+    }
+    uint16_t pos = 0;
+    for (i = 0; i < 3; i++){
+        uint16_t len = sizeof(l2cap_packet) - pos;
+        if (len > MICROBENCH_ACL_FRAGMENT) len = MICROBENCH_ACL_FRAGMENT;
+        bt_store_16(acl_fragments[i], 0, MICROBENCH_HANDLE | ((i ? 0x01 : 0x02) << 12));
+        bt_store_16(acl_fragments[i], 2, len);
+        memcpy(&acl_fragments[i][4], &l2cap_packet[pos], len);
+        acl_fragment_sizes[i] = 4 + len;
+        pos += len;
+    }
+
+    // RFCOMM data and modem status command
+    uint8_t frame[4 + MICROBENCH_RFCOMM_PAYLOAD];
+    uint8_t payload[MICROBENCH_RFCOMM_PAYLOAD];
+    memset(payload, 0x55, sizeof(payload));
+    uint16_t size = peer_create_rfcomm(frame, MICROBENCH_RFCOMM_DLCI, BT_RFCOMM_UIH, payload, MICROBENCH_RFCOMM_PAYLOAD);
+    rfcomm_uih_packet_size = peer_create_acl(rfcomm_uih_packet, peer_channel_for_cid(PEER_CID_RFCOMM)->stack_cid, frame, size);
+    memcpy(rfcomm_header, frame, 3);
+    payload[0] = BT_RFCOMM_MSC_CMD;
+    payload[1] = (2 << 1) | 1;
+    payload[2] = 0x03 | (MICROBENCH_RFCOMM_DLCI << 2);
+    payload[3] = 0x8d;
+    size = peer_create_rfcomm(frame, 0, BT_RFCOMM_UIH, payload, 4);
+    rfcomm_msc_packet_size = peer_create_acl(rfcomm_msc_packet, peer_channel_for_cid(PEER_CID_RFCOMM)->stack_cid, frame, size);
+
+    // SDP record and search pattern for L2CAP, RFCOMM and SPP
+    sdp_create_spp_service(spp_record, MICROBENCH_RFCOMM_CHANNEL, "Serial Port");
+    de_create_sequence(spp_search_pattern);
+    de_add_number(spp_search_pattern, DE_UUID, DE_SIZE_16, 0x0100);
+    de_add_number(spp_search_pattern, DE_UUID, DE_SIZE_16, 0x0003);
+    de_add_number(spp_search_pattern, DE_UUID, DE_SIZE_16, 0x1101);
+
+    // GATT DB: services with characteristic declaration and value each
+    int num_handles = MICROBENCH_GATT_SERVICES * (1 + 2 * MICROBENCH_GATT_CHARACTERISTICS);
+    gatt_db = malloc(num_handles * 16 + 2);
+    uint8_t * entry = gatt_db;
+    uint16_t handle = 1;
+    int service, characteristic;
+    for (service = 0; service < MICROBENCH_GATT_SERVICES; service++){
+        bt_store_16(entry, 0, 10);
+        bt_store_16(entry, 2, ATT_PROPERTY_READ);
+        bt_store_16(entry, 4, handle++);
+        bt_store_16(entry, 6, GATT_PRIMARY_SERVICE_UUID);
+        bt_store_16(entry, 8, 0xa000 + service);
+        entry += 10;
+        for (characteristic = 0; characteristic < MICROBENCH_GATT_CHARACTERISTICS; characteristic++){
+            bt_store_16(entry, 0, 13);
+            bt_store_16(entry, 2, ATT_PROPERTY_READ);
+            bt_store_16(entry, 4, handle++);
+            bt_store_16(entry, 6, GATT_CHARACTERISTICS_UUID);
+            entry[8] = ATT_PROPERTY_READ | ATT_PROPERTY_WRITE;
+            bt_store_16(entry, 9, handle);
+            bt_store_16(entry, 11, 0xb000 + characteristic);
+            entry += 13;
+            bt_store_16(entry, 0, 16);
+            bt_store_16(entry, 2, ATT_PROPERTY_READ | ATT_PROPERTY_WRITE);
+            bt_store_16(entry, 4, handle++);
+            bt_store_16(entry, 6, 0xb000 + characteristic);
+            memset(&entry[8], characteristic, 8);
+            entry += 16;
+        }
+    }
+    bt_store_16(entry, 0, 0);
+    gatt_last_handle = handle - 1;
+    att_set_db(gatt_db);
+    att_connection.con_handle = MICROBENCH_HANDLE;
+    att_connection.mtu = ATT_DEFAULT_MTU;
+}
+
+// benchmarks
+
+static void bench_att_read_last_handle(void){
+    uint8_t request[3];
+    request[0] = ATT_READ_REQUEST;
+    bt_store_16(request, 1, gatt_last_handle);
+    sink += att_handle_request(&att_connection, request, sizeof(request), att_response);
+}
+
+static void bench_att_read_by_type(void){
+    uint8_t request[7];
+    request[0] = ATT_READ_BY_TYPE_REQUEST;
+    bt_store_16(request, 1, 0x0001);
+    bt_store_16(request, 3, 0xffff);
+    bt_store_16(request, 5, GATT_CHARACTERISTICS_UUID);
+    sink += att_handle_request(&att_connection, request, sizeof(request), att_response);
+}
+
+static void bench_att_read_by_group_type(void){
+    uint8_t request[7];
+    request[0] = ATT_READ_BY_GROUP_TYPE_REQUEST;
+    bt_store_16(request, 1, 0x0001);
+    bt_store_16(request, 3, 0xffff);
+    bt_store_16(request, 5, GATT_PRIMARY_SERVICE_UUID);
+    sink += att_handle_request(&att_connection, request, sizeof(request), att_response);
+}
+
+// ServiceSearchAttributeRequest for SPP with all attributes, including continuations
+static void bench_sdp_service_search_attribute(void){
+    peer_channel_t * channel = peer_channel_for_cid(PEER_CID_SDP);
+    uint8_t request[32];
+    uint8_t continuation[17];
+    continuation[0] = 0;
+    uint16_t transaction_id = 0;
+    while (1){
+        uint16_t pos = 5;
+        request[0] = SDP_ServiceSearchAttributeRequest;
+        net_store_16(request, 1, ++transaction_id);
+        de_create_sequence(&request[pos]);
+        de_add_number(&request[pos], DE_UUID, DE_SIZE_16, 0x1101);
+        pos += de_get_len(&request[pos]);
+        net_store_16(request, pos, 0xffff);
+        pos += 2;
+        de_create_sequence(&request[pos]);
+        de_add_number(&request[pos], DE_UINT, DE_SIZE_32, 0x0000ffff);
+        pos += de_get_len(&request[pos]);
+        memcpy(&request[pos], continuation, 1 + continuation[0]);
+        pos += 1 + continuation[0];
+        net_store_16(request, 3, pos - 5);
+
+        channel->rx_len = 0;
+        peer_send_acl(channel->stack_cid, request, pos);
+        controller_run();
+        if (channel->rx_len < 7 || channel->rx[0] != SDP_ServiceSearchAttributeResponse){
+            fprintf(stderr, "microbench: invalid SDP response\n");
+            exit(1);
+        }
+        uint16_t continuation_pos = 7 + READ_NET_16(channel->rx, 5);
+        memcpy(continuation, &channel->rx[continuation_pos], 1 + channel->rx[continuation_pos]);
+        if (!continuation[0]) break;
+    }
+}
+
+static void bench_rfcomm_uih(void){
+    (*host_packet_handler)(HCI_ACL_DATA_PACKET, rfcomm_uih_packet, rfcomm_uih_packet_size);
+    controller_run();
+}
+
+static void bench_rfcomm_msc(void){
+    (*host_packet_handler)(HCI_ACL_DATA_PACKET, rfcomm_msc_packet, rfcomm_msc_packet_size);
+    controller_run();
+}
+
+static void bench_acl_reassembly(void){
+    int i;
+    for (i = 0; i < 3; i++){
+        (*host_packet_handler)(HCI_ACL_DATA_PACKET, acl_fragments[i], acl_fragment_sizes[i]);
+    }
+}
+
+static void bench_hci_create_cmd(void){
+    uint8_t packet[HCI_CMD_BUFFER_SIZE];
+    sink += hci_create_cmd(packet, (hci_cmd_t *) &hci_create_connection, peer_addr, hci_usable_acl_packet_types(), 0, 0, 0, 1);
+}
+
+static void bench_crc8_calc(void){
+    sink += crc8_calc(rfcomm_header, 3);
+}
+
+static void bench_de_traverse_sequence(void){
+    sink += sdp_record_matches_service_search_pattern(spp_record, spp_search_pattern);
+}
+
+static const microbench_t microbenchmarks[] = {
+    { "att_handle_request_read_last_handle",    bench_att_read_last_handle,         20000 },
+    { "att_handle_request_read_by_type",        bench_att_read_by_type,           1000000 },
+    { "att_handle_request_read_by_group_type",  bench_att_read_by_group_type,      200000 },
+    { "sdp_service_search_attribute_request",   bench_sdp_service_search_attribute,  5000 },
+    { "rfcomm_uih_data",                        bench_rfcomm_uih,                 1000000 },
+    { "rfcomm_channel_packet_handler_msc",      bench_rfcomm_msc,                  200000 },
+    { "acl_handler_reassembly",                 bench_acl_reassembly,             1000000 },
+    { "hci_create_cmd_internal",                bench_hci_create_cmd,            10000000 },
+    { "crc8_calc",                              bench_crc8_calc,                 10000000 },
+    { "de_traverse_sequence",                   bench_de_traverse_sequence,       1000000 },
+};
+
+#define NUM_MICROBENCHMARKS (sizeof(microbenchmarks) / sizeof(microbench_t))
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static microbench_result_t microbench_run(const microbench_t * bench, double scale){
+    uint32_t iterations = bench->iterations * scale;
+    uint32_t i;
+    microbench_result_t result;
+    if (iterations == 0) iterations = 1;
+
+    // warm up caches and lazily created state
+    for (i = 0; i < iterations / 10 + 1; i++){
+        (*bench->op)();
+    }
+
+    allocations = 0;
+    double start = now_ns();
+    for (i = 0; i < iterations; i++){
+        (*bench->op)();
+    }
+    result.ns_per_op     = (now_ns() - start) / iterations;
+    result.allocs_per_op = (double) allocations / iterations;
+    return result;
+}
+
+// baseline file: one line per benchmark with name, ns/op and allocs/op, '#' starts a comment
+static int baseline_lookup(const char * path, const char * name, microbench_result_t * result){
+    FILE * file = fopen(path, "r");
+    if (!file) return 0;
+    char line[200];
+    char line_name[100];
+    int found = 0;
+    while (fgets(line, sizeof(line), file)){
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%99s %lf %lf", line_name, &result->ns_per_op, &result->allocs_per_op) != 3) continue;
+        if (strcmp(line_name, name) != 0) continue;
+        found = 1;
+        break;
+    }
+    fclose(file);
+    return found;
+}
+
+static void usage(const char * name){
+    fprintf(stderr, "Usage: %s [-s scale] [-b baseline] [-w baseline] [benchmark...]\n", name);
+    exit(1);
+}
+
+int main(int argc, char ** argv){
+    const char * baseline_path = NULL;
+    const char * write_path = NULL;
+    double scale = 1.0;
+    int selected[NUM_MICROBENCHMARKS];
+    int any_selected = 0;
+    int i, j;
+
+    memset(selected, 0, sizeof(selected));
+    for (i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc){
+            scale = atof(argv[++i]);
+            continue;
+        }
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc){
+            baseline_path = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "-w") == 0 && i + 1 < argc){
+            write_path = argv[++i];
+            continue;
+        }
+        for (j = 0; j < NUM_MICROBENCHMARKS; j++){
+            if (strcmp(argv[i], microbenchmarks[j].name) == 0) break;
+        }
+        if (j == NUM_MICROBENCHMARKS) usage(argv[0]);
+        selected[j] = 1;
+        any_selected = 1;
+    }
+    if (scale <= 0) usage(argv[0]);
+
+    stack_setup();
+    inputs_setup();
+
+    FILE * write_file = NULL;
+    if (write_path){
+        write_file = fopen(write_path, "w");
+        if (!write_file){
+            perror(write_path);
+            return 1;
+        }
+        fprintf(write_file, "# microbench baseline: name ns/op allocs/op\n");
+    }
+
+    printf("%-40s %12s %10s", "benchmark", "ns/op", "allocs/op");
+    if (baseline_path){
+        printf(" %12s %8s", "baseline", "delta");
+    }
+    printf("\n");
+
+    for (i = 0; i < NUM_MICROBENCHMARKS; i++){
+        if (any_selected && !selected[i]) continue;
+        const microbench_t * bench = &microbenchmarks[i];
+        microbench_result_t result = microbench_run(bench, scale);
+        printf("%-40s %12.1f", bench->name, result.ns_per_op);
+#ifdef MICROBENCH_WRAP_MALLOC
+        printf(" %10.2f", result.allocs_per_op);
+#else
+        printf(" %10s", "-");
+#endif
+        microbench_result_t baseline;
+        if (baseline_path && baseline_lookup(baseline_path, bench->name, &baseline)){
+            printf(" %12.1f %+7.1f%%", baseline.ns_per_op, (result.ns_per_op / baseline.ns_per_op - 1.0) * 100.0);
+        }
+        printf("\n");
+        if (write_file){
+            fprintf(write_file, "%s %.1f %.2f\n", bench->name, result.ns_per_op, result.allocs_per_op);
+        }
+    }
+
+    if (write_file){
+        fclose(write_file);
+    }
+    return 0;
+}
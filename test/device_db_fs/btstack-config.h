@@ -0,0 +1,14 @@
+// config.h created by hand for the BTstack file-backed remote and central device DB tests
+
+#ifndef __BTSTACK_CONFIG
+#define __BTSTACK_CONFIG
+
+#define HAVE_BZERO
+#define HAVE_TIME
+#define REMOTE_DEVICE_DB_FS_DIR "remote_device_db_fs_test.dir"
+#define REMOTE_DEVICE_DB_FS_MAX_LINK_KEYS 4
+#define REMOTE_DEVICE_DB_FS_MAX_NAMES 4
+#define CENTRAL_DEVICE_DB_FS_DIR "central_device_db_fs_test.dir"
+#define CENTRAL_DEVICE_DB_FS_MAX_DEVICES 4
+
+#endif
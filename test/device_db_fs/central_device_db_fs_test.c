@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include "central_device_db.h"
+
+#include "btstack-config.h"
+
+// CENTRAL_DEVICE_DB_FS_DIR and CENTRAL_DEVICE_DB_FS_MAX_DEVICES (4) set in btstack-config.h
+#define DB_PATH CENTRAL_DEVICE_DB_FS_DIR "/btstack_central_device_db.bin"
+
+// mirrors file layout in central_device_db_fs.c
+typedef struct {
+    uint32_t  signing_counter;
+    uint8_t   addr_type;
+    bd_addr_t addr;
+    sm_key_t  csrk;
+} test_device_t;
+
+typedef struct {
+    uint32_t      magic;
+    uint32_t      version;
+    uint32_t      capacity;
+    uint32_t      count;
+    sm_key_t      irk[CENTRAL_DEVICE_DB_FS_MAX_DEVICES];
+    test_device_t devices[CENTRAL_DEVICE_DB_FS_MAX_DEVICES];
+} test_file_t;
+
+static void addr_for_index(bd_addr_t addr, int index){
+    bd_addr_t base = {0x00, 0x01, 0x02, 0x03, 0x04, 0x00 };
+    BD_ADDR_COPY(addr, base);
+    addr[5] = index;
+}
+
+// irk and csrk derived from index
+static int add_device(int index){
+    bd_addr_t addr;
+    sm_key_t irk;
+    sm_key_t csrk;
+    addr_for_index(addr, index);
+    memset(irk,  0x10 + index, 16);
+    memset(csrk, 0x20 + index, 16);
+    return central_device_db_add(0, addr, irk, csrk);
+}
+
+static int lookup_device(int index){
+    bd_addr_t addr;
+    addr_for_index(addr, index);
+    return central_device_db_lookup(0, addr);
+}
+
+// @returns device index stored at db index, checks keys
+static int device_at(int db_index){
+    int addr_type;
+    bd_addr_t addr;
+    sm_key_t irk;
+    sm_key_t csrk;
+    central_device_db_info(db_index, &addr_type, addr, irk);
+    central_device_db_csrk(db_index, csrk);
+    int index = addr[5];
+    CHECK_EQUAL(0, addr_type);
+    CHECK_EQUAL(0x10 + index, irk[15]);
+    CHECK_EQUAL(0x20 + index, csrk[15]);
+    CHECK_EQUAL(0x10 + index, central_device_db_irk_table()[db_index][0]);
+    return index;
+}
+
+static void read_file(test_file_t * file){
+    int fd = open(DB_PATH, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK_EQUAL((int) sizeof(test_file_t), (int) read(fd, file, sizeof(test_file_t)));
+    close(fd);
+}
+
+static void write_file(test_file_t * file){
+    int fd = open(DB_PATH, O_WRONLY);
+    CHECK(fd >= 0);
+    CHECK_EQUAL((int) sizeof(test_file_t), (int) write(fd, file, sizeof(test_file_t)));
+    close(fd);
+}
+
+TEST_GROUP(CentralDeviceDBFs){
+    void setup(){
+        unlink(DB_PATH);
+        rmdir(CENTRAL_DEVICE_DB_FS_DIR);
+        central_device_db_init();
+    }
+};
+
+TEST(CentralDeviceDBFs, AddLookupRemove){
+    CHECK_EQUAL(0, central_device_db_count());
+    CHECK_EQUAL(0, add_device(1));
+    CHECK_EQUAL(1, add_device(2));
+    CHECK_EQUAL(2, add_device(3));
+    CHECK_EQUAL(3, central_device_db_count());
+    CHECK_EQUAL(1, lookup_device(2));
+    CHECK_EQUAL(-1, lookup_device(4));
+    CHECK_EQUAL(2, device_at(1));
+
+    // last device takes index of removed one
+    central_device_db_remove(0);
+    CHECK_EQUAL(2, central_device_db_count());
+    CHECK_EQUAL(-1, lookup_device(1));
+    CHECK_EQUAL(0, lookup_device(3));
+    CHECK_EQUAL(1, lookup_device(2));
+    CHECK_EQUAL(3, device_at(0));
+}
+
+TEST(CentralDeviceDBFs, AddExistingKeepsIndex){
+    CHECK_EQUAL(0, add_device(1));
+    CHECK_EQUAL(1, add_device(2));
+    central_device_db_counter_set(0, 5);
+    CHECK_EQUAL(0, add_device(1));
+    CHECK_EQUAL(2, central_device_db_count());
+    CHECK_EQUAL(0, central_device_db_counter_get(0));
+}
+
+TEST(CentralDeviceDBFs, Full){
+    int i;
+    for (i = 0; i < CENTRAL_DEVICE_DB_FS_MAX_DEVICES; i++){
+        CHECK_EQUAL(i, add_device(i));
+    }
+    CHECK_EQUAL(-1, add_device(CENTRAL_DEVICE_DB_FS_MAX_DEVICES));
+    CHECK_EQUAL(CENTRAL_DEVICE_DB_FS_MAX_DEVICES, central_device_db_count());
+}
+
+TEST(CentralDeviceDBFs, PersistAcrossInit){
+    add_device(1);
+    add_device(2);
+    add_device(3);
+    central_device_db_remove(1);
+    central_device_db_counter_set(0, 0x12345678);
+    central_device_db_counter_set(1, 7);
+
+    central_device_db_init();
+    CHECK_EQUAL(2, central_device_db_count());
+    CHECK_EQUAL(0, lookup_device(1));
+    CHECK_EQUAL(1, lookup_device(3));
+    CHECK_EQUAL(-1, lookup_device(2));
+    CHECK_EQUAL(1, device_at(0));
+    CHECK_EQUAL(3, device_at(1));
+    CHECK_EQUAL(0x12345678, central_device_db_counter_get(0));
+    CHECK_EQUAL(7, central_device_db_counter_get(1));
+}
+
+TEST(CentralDeviceDBFs, DuplicateFromInterruptedRemove){
+    add_device(1);
+    add_device(2);
+    add_device(3);
+    central_device_db_counter_set(2, 9);
+
+    // remove(0) stopped after copying last device, count not lowered yet
+    test_file_t file;
+    read_file(&file);
+    CHECK_EQUAL(3, file.count);
+    memcpy(file.irk[0], file.irk[2], 16);
+    file.devices[0] = file.devices[2];
+    write_file(&file);
+
+    central_device_db_init();
+    CHECK_EQUAL(2, central_device_db_count());
+    CHECK_EQUAL(-1, lookup_device(1));
+    CHECK_EQUAL(0, lookup_device(3));
+    CHECK_EQUAL(1, lookup_device(2));
+    CHECK_EQUAL(3, device_at(0));
+    CHECK_EQUAL(9, central_device_db_counter_get(0));
+
+    // recovery persisted
+    read_file(&file);
+    CHECK_EQUAL(2, file.count);
+}
+
+TEST(CentralDeviceDBFs, InvalidFileFormatted){
+    add_device(1);
+    test_file_t file;
+    read_file(&file);
+    file.capacity = CENTRAL_DEVICE_DB_FS_MAX_DEVICES + 1;
+    write_file(&file);
+
+    central_device_db_init();
+    CHECK_EQUAL(0, central_device_db_count());
+    CHECK_EQUAL(-1, lookup_device(1));
+}
+
+int main (int argc, const char * argv[]){
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include "remote_device_db.h"
+
+#include "btstack-config.h"
+
+// REMOTE_DEVICE_DB_FS_DIR, REMOTE_DEVICE_DB_FS_MAX_LINK_KEYS (4) and REMOTE_DEVICE_DB_FS_MAX_NAMES (4) set in btstack-config.h
+#define LOG_PATH    REMOTE_DEVICE_DB_FS_DIR "/btstack_remote_device_db.log"
+#define TARGET_PATH "remote_device_db_fs_test.target"
+
+static const remote_device_db_t * db = &remote_device_db_fs;
+
+static void addr_for_index(bd_addr_t addr, int index){
+    bd_addr_t base = {0x00, 0x01, 0x02, 0x03, 0x04, 0x00 };
+    BD_ADDR_COPY(addr, base);
+    addr[5] = index;
+}
+
+static void put_link_key(int index, int value){
+    bd_addr_t addr;
+    link_key_t link_key;
+    addr_for_index(addr, index);
+    memset(link_key, value, sizeof(link_key));
+    db->put_link_key(&addr, &link_key, COMBINATION_KEY);
+}
+
+// @returns value of stored link key or -1
+static int get_link_key(int index){
+    bd_addr_t addr;
+    link_key_t link_key;
+    link_key_type_t link_key_type;
+    addr_for_index(addr, index);
+    if (!db->get_link_key(&addr, &link_key, &link_key_type)) return -1;
+    CHECK_EQUAL(COMBINATION_KEY, link_key_type);
+    return link_key[0];
+}
+
+static void put_name(int index, const char * name){
+    bd_addr_t addr;
+    device_name_t device_name;
+    addr_for_index(addr, index);
+    memset(device_name, 0, sizeof(device_name));
+    strcpy((char *) device_name, name);
+    db->put_name(&addr, &device_name);
+}
+
+static int has_name(int index){
+    bd_addr_t addr;
+    device_name_t device_name;
+    addr_for_index(addr, index);
+    return db->get_name(&addr, &device_name);
+}
+
+static long file_size(const char * path){
+    struct stat st;
+    if (lstat(path, &st) != 0) return -1;
+    return st.st_size;
+}
+
+TEST_GROUP(RemoteDeviceDBFs){
+    void setup(){
+        unlink(LOG_PATH);
+        unlink(LOG_PATH ".tmp");
+        unlink(TARGET_PATH);
+        rmdir(REMOTE_DEVICE_DB_FS_DIR);
+        db->open();
+    }
+    void teardown(){
+        db->close();
+    }
+};
+
+TEST(RemoteDeviceDBFs, PutGetDelete){
+    bd_addr_t addr;
+    device_name_t name;
+    addr_for_index(addr, 1);
+    put_link_key(1, 0x11);
+    CHECK_EQUAL(0x11, get_link_key(1));
+    CHECK_EQUAL(-1, get_link_key(2));
+
+    strcpy((char *) name, "a name that is longer than MAX_NAME_LEN bytes");
+    db->put_name(&addr, &name);
+    memset(name, 0xff, sizeof(name));
+    CHECK(db->get_name(&addr, &name));
+    CHECK_EQUAL(MAX_NAME_LEN, strlen((char *) name));
+    CHECK_EQUAL(0, strncmp((char *) name, "a name that is longer than MAX_NAME_LEN bytes", MAX_NAME_LEN));
+
+    db->delete_link_key(&addr);
+    CHECK_EQUAL(-1, get_link_key(1));
+    CHECK(db->get_name(&addr, &name));
+    db->delete_name(&addr);
+    CHECK(!db->get_name(&addr, &name));
+}
+
+TEST(RemoteDeviceDBFs, LogCreatedOwnerOnly){
+    struct stat st;
+    CHECK_EQUAL(0, stat(LOG_PATH, &st));
+    CHECK_EQUAL(0600, st.st_mode & 0777);
+    CHECK_EQUAL(0, stat(REMOTE_DEVICE_DB_FS_DIR, &st));
+    CHECK_EQUAL(0700, st.st_mode & 0777);
+}
+
+TEST(RemoteDeviceDBFs, LeastRecentlyUsedIsEvicted){
+    int i;
+    for (i = 1; i <= 4; i++){
+        put_link_key(i, i);
+    }
+    // device 1 used recently, device 2 is the oldest now
+    CHECK_EQUAL(1, get_link_key(1));
+    put_link_key(5, 5);
+    CHECK_EQUAL(-1, get_link_key(2));
+    CHECK_EQUAL(1, get_link_key(1));
+    CHECK_EQUAL(3, get_link_key(3));
+    CHECK_EQUAL(4, get_link_key(4));
+    CHECK_EQUAL(5, get_link_key(5));
+}
+
+TEST(RemoteDeviceDBFs, NamesDoNotEvictLinkKeys){
+    int i;
+    for (i = 1; i <= 4; i++){
+        put_link_key(i, i);
+    }
+    // names of many discovered devices
+    for (i = 10; i < 20; i++){
+        put_name(i, "discovered");
+    }
+    for (i = 1; i <= 4; i++){
+        CHECK_EQUAL(i, get_link_key(i));
+    }
+    CHECK(!has_name(15));
+    for (i = 16; i < 20; i++){
+        CHECK(has_name(i));
+    }
+    db->close();
+    db->open();
+    for (i = 1; i <= 4; i++){
+        CHECK_EQUAL(i, get_link_key(i));
+    }
+    CHECK(has_name(19));
+}
+
+TEST(RemoteDeviceDBFs, EvictedLinkKeyKeepsName){
+    put_link_key(1, 1);
+    put_name(1, "bonded");
+    int i;
+    for (i = 2; i <= 5; i++){
+        put_link_key(i, i);
+    }
+    CHECK_EQUAL(-1, get_link_key(1));
+    CHECK(has_name(1));
+    // deleted link key keeps name, too
+    bd_addr_t addr;
+    addr_for_index(addr, 2);
+    put_name(2, "bonded");
+    db->delete_link_key(&addr);
+    CHECK_EQUAL(-1, get_link_key(2));
+    CHECK(has_name(2));
+    CHECK_EQUAL(5, get_link_key(5));
+}
+
+TEST(RemoteDeviceDBFs, ReloadAfterCompaction){
+    // enough updates to compact the log several times
+    int i;
+    for (i = 0; i < 200; i++){
+        put_link_key(1 + (i % 3), i);
+    }
+    CHECK(file_size(LOG_PATH) < 100 * 24);
+    CHECK_EQUAL(-1, file_size(LOG_PATH ".tmp"));
+    db->close();
+    db->open();
+
+    // LRU order survives reload: device 3 was written first
+    put_link_key(4, 4);
+    put_link_key(5, 5);
+    CHECK_EQUAL(-1, get_link_key(3));
+    CHECK_EQUAL(198, get_link_key(1));
+    CHECK_EQUAL(199, get_link_key(2));
+}
+
+TEST(RemoteDeviceDBFs, TruncatedRecordIsDropped){
+    put_link_key(1, 0x11);
+    put_link_key(2, 0x22);
+    db->close();
+    CHECK_EQUAL(0, truncate(LOG_PATH, file_size(LOG_PATH) - 1));
+    db->open();
+    CHECK_EQUAL(0x11, get_link_key(1));
+    CHECK_EQUAL(-1, get_link_key(2));
+    put_link_key(3, 0x33);
+    db->close();
+    db->open();
+    CHECK_EQUAL(0x11, get_link_key(1));
+    CHECK_EQUAL(0x33, get_link_key(3));
+}
+
+TEST(RemoteDeviceDBFs, SymlinkIsNotFollowed){
+    db->close();
+    FILE * target = fopen(TARGET_PATH, "w");
+    fclose(target);
+    unlink(LOG_PATH);
+    CHECK_EQUAL(0, symlink("../" TARGET_PATH, LOG_PATH));
+    db->open();
+    put_link_key(1, 0x11);
+    CHECK_EQUAL(0, file_size(TARGET_PATH));
+    struct stat st;
+    CHECK_EQUAL(0, lstat(LOG_PATH, &st));
+    CHECK(S_ISREG(st.st_mode));
+}
+
+int main (int argc, const char * argv[]){
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -53,7 +53,9 @@ typedef enum {
     READ_LONG_CHARACTERISTIC_DESCRIPTOR,
     WRITE_LONG_CHARACTERISTIC_DESCRIPTOR,
     WRITE_RELIABLE_LONG_CHARACTERISTIC_VALUE,
-    WRITE_CHARACTERISTIC_VALUE_WITHOUT_RESPONSE
+    WRITE_CHARACTERISTIC_VALUE_WITHOUT_RESPONSE,
+    DISCOVER_PRIMARY_SERVICES_WITH_QUEUED_QUERY,
+    WRITE_CHARACTERISTIC_VALUE_WITHOUT_RESPONSE_STREAM
 } current_test_t;
 
 current_test_t test = IDLE;
@@ -63,6 +65,10 @@ uint16_t characteristic_uuid16 = 0xF000;
 
 static int result_index;
 static uint8_t result_counter;
+static int complete_counter;
+static le_command_status_t queued_query_status;
+static int stream_offset;
+static uint32_t stream_bytes_reported;
 
 static le_service_t services[50];
 static le_service_t included_services[50];
@@ -152,6 +158,19 @@ static void handle_ble_client_event(le_event_t * event){
 		case GATT_SERVICE_QUERY_RESULT:
 			services[result_index++] = ((le_service_event_t *) event)->service;
 			result_counter++;
+			// issue second query while the first one is still active
+			if (test == DISCOVER_PRIMARY_SERVICES_WITH_QUEUED_QUERY && result_counter == 1){
+				queued_query_status = gatt_client_discover_primary_services_by_uuid16(gatt_client_handle, service_uuid16);
+			}
+            break;
+
+        case GATT_QUERY_COMPLETE:
+            complete_counter++;
+            break;
+
+        case GATT_WRITE_WITHOUT_RESPONSE_STREAM_PROGRESS:
+            stream_bytes_reported = ((gatt_stream_progress_event_t *) event)->bytes_sent;
+            CHECK_EQUAL(long_value_length, ((gatt_stream_progress_event_t *) event)->total_length);
             break;
 
         case GATT_INCLUDED_SERVICE_QUERY_RESULT:
@@ -228,6 +247,13 @@ extern "C" int att_write_callback(uint16_t con_handle, uint16_t attribute_handle
 			if (offset + buffer_size != sizeof(long_value)) break;
 			result_counter++;
 			break;
+		case WRITE_CHARACTERISTIC_VALUE_WITHOUT_RESPONSE_STREAM:
+			CHECK_EQUAL(ATT_TRANSACTION_MODE_NONE, transaction_mode);
+			CHECK(buffer_size <= 20);
+			CHECK_EQUAL_ARRAY((uint8_t *)&long_value[stream_offset], buffer, buffer_size);
+			stream_offset += buffer_size;
+			result_counter++;
+			break;
 		default:
 			break;
 	}
@@ -273,6 +299,9 @@ TEST_GROUP(GATTClient){
 	void setup(){
 		result_counter = 0;
 		result_index = 0;
+		complete_counter = 0;
+		stream_offset = 0;
+		stream_bytes_reported = 0;
 		test = IDLE;
 	}
 
@@ -306,6 +335,18 @@ TEST(GATTClient, TestDiscoverPrimaryServicesByUUID128){
 	verify_primary_services_with_uuid128();
 }
 
+TEST(GATTClient, TestDiscoverPrimaryServicesWithQueuedQuery){
+	test = DISCOVER_PRIMARY_SERVICES_WITH_QUEUED_QUERY;
+	reset_query_state();
+	queued_query_status = BLE_PERIPHERAL_IN_WRONG_STATE;
+	gatt_client_discover_primary_services(gatt_client_handle);
+	CHECK_EQUAL(BLE_PERIPHERAL_OK, queued_query_status);
+	CHECK_EQUAL(2, complete_counter);
+	// all primary services followed by the result of the queued query
+	CHECK_EQUAL(7, result_index);
+	CHECK_EQUAL_GATT_ATTRIBUTE(primary_service_uuid16, primary_service_uuid16_handles, services[6].uuid128, services[6].start_group_handle, services[6].end_group_handle);
+	CHECK_EQUAL(1, gatt_client_is_ready(gatt_client_handle));
+}
 
 TEST(GATTClient, TestFindIncludedServicesForServiceWithUUID16){
 	test = DISCOVER_INCLUDED_SERVICE_FOR_SERVICE_WITH_UUID16;
@@ -557,6 +598,28 @@ TEST(GATTClient, TestWriteCharacteristicValue){
 
 
 
+TEST(GATTClient, TestWriteCharacteristicValueWithoutResponseStream){
+	test = WRITE_CHARACTERISTIC_VALUE_WITHOUT_RESPONSE_STREAM;
+	reset_query_state();
+	gatt_client_discover_primary_services_by_uuid16(gatt_client_handle, service_uuid16);
+	CHECK_EQUAL(result_counter, 1);
+
+	reset_query_state();
+	gatt_client_discover_characteristics_for_service_by_uuid16(gatt_client_handle, &services[0], 0xF10D);
+	CHECK_EQUAL(result_counter, 1);
+
+	reset_query_state();
+	complete_counter = 0;
+	le_command_status_t status = gatt_client_write_value_of_characteristic_without_response_stream(gatt_client_handle, characteristics[0].value_handle, long_value_length, (uint8_t*)long_value);
+	CHECK_EQUAL(BLE_PERIPHERAL_OK, status);
+	// 27 bytes with MTU 23 -> 20 + 7
+	CHECK_EQUAL(2, result_counter);
+	CHECK_EQUAL(long_value_length, stream_offset);
+	CHECK_EQUAL(long_value_length, stream_bytes_reported);
+	CHECK_EQUAL(1, complete_counter);
+	CHECK_EQUAL(1, gatt_client_is_ready(gatt_client_handle));
+}
+
 TEST(GATTClient, TestWriteLongCharacteristicValue){
 	test = WRITE_LONG_CHARACTERISTIC_VALUE;
 	reset_query_state();
@@ -589,6 +652,182 @@ TEST(GATTClient, TestWriteReliableLongCharacteristicValue){
 }
 
 
+#ifdef HAVE_GATT_CLIENT_CACHE
+
+extern int mock_att_requests_sent;
+void mock_simulate_disconnect(void);
+void mock_simulate_indication(uint16_t value_handle);
+
+static bd_addr_t cache_peer_addr = {0x00, 0x1b, 0xdc, 0x07, 0x32, 0xef};
+static uint8_t cache_entry[512];
+static int cache_entry_size;
+static int cache_gets;
+static int cache_puts;
+static int cache_removes;
+
+static int test_cache_get(uint8_t addr_type, bd_addr_t addr, uint8_t * buffer, uint16_t buffer_size){
+	cache_gets++;
+	if (cache_entry_size > buffer_size) return 0;
+	memcpy(buffer, cache_entry, cache_entry_size);
+	return cache_entry_size;
+}
+
+static void test_cache_put(uint8_t addr_type, bd_addr_t addr, uint8_t * buffer, uint16_t size){
+	cache_puts++;
+	CHECK(size <= sizeof(cache_entry));
+	memcpy(cache_entry, buffer, size);
+	cache_entry_size = size;
+}
+
+static void test_cache_remove(uint8_t addr_type, bd_addr_t addr){
+	cache_removes++;
+	cache_entry_size = 0;
+}
+
+static const gatt_client_cache_t test_cache = {
+	test_cache_get,
+	test_cache_put,
+	test_cache_remove,
+};
+
+static int service_index_for_uuid16(uint16_t uuid16){
+	for (int i=0; i<result_index; i++){
+		if (services[i].uuid16 == uuid16) return i;
+	}
+	return -1;
+}
+
+TEST_GROUP(GATTClientCache){
+	void setup(){
+		// start with a fresh connection context
+		mock_simulate_disconnect();
+		result_counter = 0;
+		result_index = 0;
+		complete_counter = 0;
+		test = IDLE;
+		cache_entry_size = 0;
+		cache_gets = 0;
+		cache_puts = 0;
+		cache_removes = 0;
+		gatt_client_set_cache(&test_cache);
+	}
+
+	void teardown(){
+		gatt_client_set_cache(NULL);
+		mock_simulate_disconnect();
+	}
+
+	void reset_query_state(){
+		result_counter = 0;
+		result_index = 0;
+	}
+};
+
+TEST(GATTClientCache, ReplayWithoutATTRequests){
+	gatt_client_set_peer_identity(gatt_client_handle, 0, cache_peer_addr);
+
+	test = DISCOVER_PRIMARY_SERVICES;
+	reset_query_state();
+	int sent = mock_att_requests_sent;
+	gatt_client_discover_primary_services(gatt_client_handle);
+	verify_primary_services();
+	CHECK(mock_att_requests_sent > sent);
+	// stored once when the query completes
+	CHECK_EQUAL(1, cache_puts);
+
+	reset_query_state();
+	sent = mock_att_requests_sent;
+	gatt_client_discover_primary_services(gatt_client_handle);
+	verify_primary_services();
+	CHECK_EQUAL(sent, mock_att_requests_sent);
+	CHECK_EQUAL(2, complete_counter);
+
+	int index = service_index_for_uuid16(service_uuid16);
+	CHECK(index >= 0);
+	le_service_t service = services[index];
+
+	test = DISCOVER_CHARACTERISTICS_FOR_SERVICE_WITH_UUID16;
+	reset_query_state();
+	gatt_client_discover_characteristics_for_service(gatt_client_handle, &service);
+	verify_charasteristics();
+	CHECK_EQUAL(2, cache_puts);
+
+	reset_query_state();
+	sent = mock_att_requests_sent;
+	gatt_client_discover_characteristics_for_service(gatt_client_handle, &service);
+	verify_charasteristics();
+	CHECK_EQUAL(sent, mock_att_requests_sent);
+
+	// storage is read once per connection
+	CHECK_EQUAL(1, cache_gets);
+	CHECK_EQUAL(2, cache_puts);
+}
+
+TEST(GATTClientCache, NotUsedWithoutPeerIdentity){
+	test = DISCOVER_PRIMARY_SERVICES;
+	reset_query_state();
+	gatt_client_discover_primary_services(gatt_client_handle);
+	verify_primary_services();
+
+	reset_query_state();
+	int sent = mock_att_requests_sent;
+	gatt_client_discover_primary_services(gatt_client_handle);
+	verify_primary_services();
+	CHECK(mock_att_requests_sent > sent);
+	CHECK_EQUAL(0, cache_gets);
+	CHECK_EQUAL(0, cache_puts);
+}
+
+TEST(GATTClientCache, ServiceChangedInvalidates){
+	// stored entry: all services complete, GATT Service 0x0c-0x0f with Service Changed characteristic
+	uint8_t entry[] = {
+		1, 0x01,
+		0x01 | 0x40, 0x0c, 0x00, 0x0f, 0x00, 0x01, 0x18,
+		0x02, 0x0d, 0x00, 0x0e, 0x00, 0x0f, 0x00, 0x22, 0x05, 0x2a,
+	};
+	memcpy(cache_entry, entry, sizeof(entry));
+	cache_entry_size = sizeof(entry);
+	gatt_client_set_peer_identity(gatt_client_handle, 0, cache_peer_addr);
+
+	// replayed from storage, only the MTU exchange of the new connection goes over the air
+	test = DISCOVER_PRIMARY_SERVICES;
+	reset_query_state();
+	int sent = mock_att_requests_sent;
+	gatt_client_discover_primary_services(gatt_client_handle);
+	CHECK_EQUAL(sent + 1, mock_att_requests_sent);
+	sent = mock_att_requests_sent;
+	CHECK_EQUAL(1, result_index);
+	CHECK_EQUAL(0x1801, services[0].uuid16);
+	le_service_t gatt_service = services[0];
+
+	reset_query_state();
+	gatt_client_discover_characteristics_for_service(gatt_client_handle, &gatt_service);
+	CHECK_EQUAL(sent, mock_att_requests_sent);
+	CHECK_EQUAL(1, result_index);
+	CHECK_EQUAL(0x2a05, characteristics[0].uuid16);
+	CHECK_EQUAL(0x0e, characteristics[0].value_handle);
+	CHECK_EQUAL(0, cache_puts);
+
+	// other indications keep the entry
+	mock_simulate_indication(0x0030);
+	CHECK_EQUAL(0, cache_removes);
+
+	mock_simulate_indication(characteristics[0].value_handle);
+	CHECK_EQUAL(1, cache_removes);
+	CHECK_EQUAL(0, cache_entry_size);
+
+	// discovery goes over the air again and is stored again
+	reset_query_state();
+	sent = mock_att_requests_sent;
+	gatt_client_discover_primary_services(gatt_client_handle);
+	verify_primary_services();
+	CHECK(mock_att_requests_sent > sent);
+	CHECK_EQUAL(1, cache_puts);
+}
+
+#endif
+
+
 int main (int argc, const char * argv[]){
 
 	run_loop_init(RUN_LOOP_POSIX);
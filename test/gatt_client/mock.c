@@ -18,6 +18,7 @@ static void (*gatt_central_packet_handler) (void * connection, uint8_t packet_ty
 static const uint16_t max_mtu = 23;
 static uint8_t  l2cap_stack_buffer[max_mtu];
 uint16_t gatt_client_handle = 0x40;
+int mock_att_requests_sent = 0;
 
 uint16_t get_gatt_client_handle(){
 	return gatt_client_handle;
@@ -39,6 +40,16 @@ void mock_simulate_connected(){
 }
 
 
+void mock_simulate_disconnect(){
+	uint8_t packet[] = {HCI_EVENT_DISCONNECTION_COMPLETE, 4, 0, gatt_client_handle & 0xff, gatt_client_handle >> 8, 0x13};
+	att_packet_handler(HCI_EVENT_PACKET, 0, (uint8_t *)&packet, sizeof(packet));
+}
+
+void mock_simulate_indication(uint16_t value_handle){
+	uint8_t packet[] = {ATT_HANDLE_VALUE_INDICATION, value_handle & 0xff, value_handle >> 8, 0x01, 0x00, 0xff, 0xff};
+	att_packet_handler(ATT_DATA_PACKET, gatt_client_handle, (uint8_t *)&packet, sizeof(packet));
+}
+
 void mock_simulate_scan_response(){
 	uint8_t packet[] = {0x3E, 0x0F, 0x02, 0x01, 0x00, 0x00, 0x9B, 0x77, 0xD1, 0xF7, 0xB1, 0x34, 0x03, 0x02, 0x01, 0x05, 0xBC};
 	gatt_central_packet_handler(NULL, HCI_EVENT_PACKET, NULL, (uint8_t *)&packet, sizeof(packet));
@@ -90,6 +101,7 @@ int l2cap_can_send_fixed_channel_packet_now(uint16_t handle){
 int l2cap_send_prepared_connectionless(uint16_t handle, uint16_t cid, uint16_t len){
 	att_connection_t att_connection;
 	att_init_connection(&att_connection);
+	mock_att_requests_sent++;
 	uint8_t response[max_mtu];
 	uint16_t response_len = att_handle_request(&att_connection, l2cap_get_outgoing_buffer(), len, &response[0]);
 	if (response_len){
@@ -98,10 +110,10 @@ int l2cap_send_prepared_connectionless(uint16_t handle, uint16_t cid, uint16_t l
 	return 0;
 }
 
-int  sm_cmac_ready(){
+int  sm_cmac_ready(uint16_t con_handle){
 	return 1;
 }
-void sm_cmac_start(sm_key_t k, uint16_t message_len, uint8_t * message, void (*done_handler)(uint8_t hash[8])){
+void sm_cmac_start(uint16_t con_handle, sm_key_t k, uint16_t message_len, uint8_t * message, void (*done_handler)(uint16_t con_handle, uint8_t hash[8])){
 	//sm_notify_client(SM_IDENTITY_RESOLVING_SUCCEEDED, sm_central_device_addr_type, sm_central_device_address, 0, sm_central_device_matched);
                 
 }
@@ -0,0 +1,13 @@
+// config.h created by hand for the BTstack HCI tests
+
+#ifndef __BTSTACK_CONFIG
+#define __BTSTACK_CONFIG
+
+#define USE_POSIX_RUN_LOOP
+#define HAVE_TIME
+#define HAVE_MALLOC
+#define HAVE_BZERO
+#define HAVE_ACL_FAIR_SHARE
+#define HCI_ACL_PAYLOAD_SIZE 1021
+
+#endif
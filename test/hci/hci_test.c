@@ -0,0 +1,560 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include <btstack/btstack.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include "btstack_memory.h"
+#include "hci.h"
+#include "hci_transport.h"
+#include "remote_device_db.h"
+
+// emulated controller with ACL_BUFFERS controller buffers, events are queued and delivered by controller_run()
+
+#define ACL_BUFFERS 4
+#define QUEUE_SIZE  32
+
+typedef struct {
+    uint8_t  type;
+    uint16_t size;
+    uint8_t  data[HCI_EVENT_BUFFER_SIZE];
+} queued_event_t;
+
+static queued_event_t queue[QUEUE_SIZE];
+static int queue_read_pos;
+static int queue_write_pos;
+
+static hci_transport_t controller_transport;
+static void (*host_packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size);
+static int acl_packets_received;
+static int hci_state;
+static int batch_complete_events;
+
+// if set, Command Complete events are held back until controller_complete_held_commands()
+static int      controller_hold_commands;
+static int      controller_hold_vendor_commands;
+static int      controller_command_credits;
+static uint16_t held_opcodes[QUEUE_SIZE];
+static int      num_held_opcodes;
+static uint16_t commands_received[QUEUE_SIZE];
+static int      num_commands_received;
+
+static const hci_con_handle_t handle_a = 0x0001;
+static const hci_con_handle_t handle_b = 0x0009;   // same slot as handle_a in the con_handle cache
+static bd_addr_t addr_a = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x0a };
+static bd_addr_t addr_b = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x0b };
+
+static void controller_emit_event(uint8_t * event, uint16_t size){
+    queued_event_t * entry = &queue[queue_write_pos];
+    queue_write_pos = (queue_write_pos + 1) % QUEUE_SIZE;
+    entry->type = HCI_EVENT_PACKET;
+    entry->size = size;
+    memcpy(entry->data, event, size);
+}
+
+static void controller_emit_command_complete(uint16_t opcode, uint8_t * params, int params_len){
+    uint8_t event[5 + 16];
+    event[0] = HCI_EVENT_COMMAND_COMPLETE;
+    event[1] = 3 + params_len;
+    event[2] = controller_command_credits;
+    bt_store_16(event, 3, opcode);
+    memcpy(&event[5], params, params_len);
+    controller_emit_event(event, 5 + params_len);
+}
+
+static void controller_emit_command_status(uint16_t opcode){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_COMMAND_STATUS;
+    event[1] = 4;
+    event[2] = 0;
+    event[3] = 1;
+    bt_store_16(event, 4, opcode);
+    controller_emit_event(event, sizeof(event));
+}
+
+static void controller_handle_command(uint8_t * packet){
+    uint16_t opcode = READ_BT_16(packet, 0);
+    uint8_t params[16];
+    memset(params, 0, sizeof(params));
+
+    if (num_commands_received < QUEUE_SIZE){
+        commands_received[num_commands_received++] = opcode;
+    }
+    if (controller_hold_commands || (controller_hold_vendor_commands && (opcode >> 10) == OGF_VENDOR)){
+        held_opcodes[num_held_opcodes++] = opcode;
+        return;
+    }
+
+    if (IS_COMMAND(packet, hci_read_buffer_size)){
+        bt_store_16(params, 1, HCI_ACL_PAYLOAD_SIZE);
+        bt_store_16(params, 4, ACL_BUFFERS);
+        controller_emit_command_complete(opcode, params, 8);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_local_supported_features)){
+        controller_emit_command_complete(opcode, params, 9);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_accept_connection_request)){
+        controller_emit_command_status(opcode);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_remote_supported_features_command)){
+        controller_emit_command_status(opcode);
+        return;
+    }
+    controller_emit_command_complete(opcode, params, 1);
+}
+
+static int controller_send_packet(uint8_t packet_type, uint8_t * packet, int size){
+    // packet buffer is free again once the transport reports the packet as sent
+    uint8_t event[2];
+    event[0] = DAEMON_EVENT_HCI_PACKET_SENT;
+    event[1] = 0;
+    controller_emit_event(event, sizeof(event));
+    switch (packet_type){
+        case HCI_COMMAND_DATA_PACKET:
+            controller_handle_command(packet);
+            break;
+        case HCI_ACL_DATA_PACKET:
+            acl_packets_received++;
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static int controller_can_send_packet_now(uint8_t packet_type){
+    return 1;
+}
+
+static int controller_open(void * config){
+    return 0;
+}
+
+static int controller_close(void * config){
+    return 0;
+}
+
+static void controller_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    host_packet_handler = handler;
+}
+
+static const char * controller_get_transport_name(void){
+    return "test";
+}
+
+static void controller_run(void){
+    while (queue_read_pos != queue_write_pos){
+        queued_event_t * entry = &queue[queue_read_pos];
+        queue_read_pos = (queue_read_pos + 1) % QUEUE_SIZE;
+        host_packet_handler(entry->type, entry->data, entry->size);
+    }
+}
+
+static void controller_complete_held_commands(int num_commands){
+    int i;
+    for (i = 0; i < num_commands && num_held_opcodes; i++){
+        uint8_t status = 0;
+        controller_emit_command_complete(held_opcodes[0], &status, 1);
+        num_held_opcodes--;
+        memmove(&held_opcodes[0], &held_opcodes[1], num_held_opcodes * sizeof(uint16_t));
+    }
+    controller_run();
+}
+
+static void controller_complete_held_command(int index){
+    uint8_t status = 0;
+    controller_emit_command_complete(held_opcodes[index], &status, 1);
+    num_held_opcodes--;
+    memmove(&held_opcodes[index], &held_opcodes[index+1], (num_held_opcodes - index) * sizeof(uint16_t));
+    controller_run();
+}
+
+static void controller_connect(bd_addr_t addr, hci_con_handle_t con_handle){
+    uint8_t event[13];
+    event[0] = HCI_EVENT_CONNECTION_REQUEST;
+    event[1] = 10;
+    bt_flip_addr(&event[2], addr);
+    memset(&event[8], 0, 3);
+    event[11] = 1;
+    controller_emit_event(event, 12);
+    controller_run();
+
+    event[0] = HCI_EVENT_CONNECTION_COMPLETE;
+    event[1] = 11;
+    event[2] = 0;
+    bt_store_16(event, 3, con_handle);
+    bt_flip_addr(&event[5], addr);
+    event[11] = 1;  // ACL
+    event[12] = 0;  // no encryption
+    controller_emit_event(event, 13);
+    controller_run();
+}
+
+static void controller_disconnect(hci_con_handle_t con_handle){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_DISCONNECTION_COMPLETE;
+    event[1] = 4;
+    event[2] = 0;
+    bt_store_16(event, 3, con_handle);
+    event[5] = 0x13;
+    controller_emit_event(event, sizeof(event));
+    controller_run();
+}
+
+static void controller_complete_packets(hci_con_handle_t con_handle, uint16_t num_packets){
+    uint8_t event[7];
+    event[0] = HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS;
+    event[1] = 5;
+    event[2] = 1;
+    bt_store_16(event, 3, con_handle);
+    bt_store_16(event, 5, num_packets);
+    controller_emit_event(event, sizeof(event));
+    controller_run();
+}
+
+static void host_packet_handler_test(uint8_t packet_type, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    switch (packet[0]){
+        case BTSTACK_EVENT_STATE:
+            hci_state = packet[2];
+            break;
+        case DAEMON_EVENT_HCI_BATCH_COMPLETE:
+            batch_complete_events++;
+            break;
+        default:
+            break;
+    }
+}
+
+static int host_send_acl(hci_con_handle_t con_handle){
+    if (!hci_can_send_acl_packet_now(con_handle)) return 0;
+    hci_reserve_packet_buffer();
+    uint8_t * packet = hci_get_outgoing_packet_buffer();
+    bt_store_16(packet, 0, con_handle | (2 << 12));
+    bt_store_16(packet, 2, 4);
+    bt_store_16(packet, 4, 0);
+    bt_store_16(packet, 6, 0x0040);
+    hci_send_acl_packet_buffer(8);
+    controller_run();
+    return 1;
+}
+
+// completed command requests
+static hci_cmd_request_t * requests_done[QUEUE_SIZE];
+static int                 requests_done_with_event[QUEUE_SIZE];
+static int                 num_requests_done;
+
+static void request_done(hci_cmd_request_t * request, uint8_t * event, uint16_t size){
+    requests_done[num_requests_done] = request;
+    requests_done_with_event[num_requests_done] = event != NULL;
+    num_requests_done++;
+}
+
+TEST_GROUP(HCI){
+    void setup(){
+        queue_read_pos = 0;
+        queue_write_pos = 0;
+        acl_packets_received = 0;
+        controller_hold_commands = 0;
+        controller_hold_vendor_commands = 0;
+        controller_command_credits = 1;
+        num_held_opcodes = 0;
+        num_requests_done = 0;
+        controller_transport.open                    = controller_open;
+        controller_transport.close                   = controller_close;
+        controller_transport.send_packet             = controller_send_packet;
+        controller_transport.register_packet_handler = controller_register_packet_handler;
+        controller_transport.get_transport_name      = controller_get_transport_name;
+        controller_transport.set_baudrate            = NULL;
+        controller_transport.can_send_packet_now     = controller_can_send_packet_now;
+
+        btstack_memory_init();
+        hci_init(&controller_transport, NULL, NULL, &remote_device_db_memory);
+        hci_register_packet_handler(host_packet_handler_test);
+        hci_power_control(HCI_POWER_ON);
+        controller_run();
+        CHECK_EQUAL(HCI_STATE_WORKING, hci_state);
+        num_commands_received = 0;
+        batch_complete_events = 0;
+    }
+    void teardown(){
+        hci_close();
+        queue_read_pos = queue_write_pos;
+    }
+};
+
+TEST(HCI, ConnectionForHandle){
+    controller_connect(addr_a, handle_a);
+    controller_connect(addr_b, handle_b);
+    hci_connection_t * conn_a = hci_connection_for_handle(handle_a);
+    hci_connection_t * conn_b = hci_connection_for_handle(handle_b);
+    CHECK(conn_a != NULL);
+    CHECK(conn_b != NULL);
+    CHECK(conn_a != conn_b);
+    CHECK(conn_a == hci_connection_for_handle(handle_a));
+    CHECK(conn_b == hci_connection_for_handle(handle_b));
+    controller_disconnect(handle_a);
+    CHECK(hci_connection_for_handle(handle_a) == NULL);
+    CHECK(conn_b == hci_connection_for_handle(handle_b));
+}
+
+TEST(HCI, SingleLinkUsesAllBuffers){
+    controller_connect(addr_a, handle_a);
+    int sent = 0;
+    while (host_send_acl(handle_a)) sent++;
+    CHECK_EQUAL(ACL_BUFFERS, sent);
+    CHECK_EQUAL(ACL_BUFFERS, acl_packets_received);
+    controller_complete_packets(handle_a, 1);
+    CHECK_EQUAL(1, hci_number_free_acl_slots_for_handle(handle_a));
+}
+
+TEST(HCI, FairShareKeepsBufferForIdleLink){
+    controller_connect(addr_a, handle_a);
+    controller_connect(addr_b, handle_b);
+    CHECK_EQUAL(ACL_BUFFERS, hci_number_free_acl_slots_for_handle(handle_a));
+
+    // busy link leaves one buffer for the idle one
+    int sent = 0;
+    while (host_send_acl(handle_a)) sent++;
+    CHECK_EQUAL(ACL_BUFFERS - 1, sent);
+    CHECK_EQUAL(0, hci_number_free_acl_slots_for_handle(handle_a));
+    CHECK_EQUAL(1, hci_number_free_acl_slots_for_handle(handle_b));
+    CHECK(host_send_acl(handle_b));
+    CHECK_EQUAL(0, hci_number_free_acl_slots_for_handle(handle_b));
+
+    // completed packets are returned to the link that sent them
+    controller_complete_packets(handle_a, 1);
+    CHECK_EQUAL(1, hci_number_free_acl_slots_for_handle(handle_a));
+    CHECK_EQUAL(1, hci_number_free_acl_slots_for_handle(handle_b));
+
+    // packets in flight are dropped with the connection
+    controller_disconnect(handle_a);
+    CHECK_EQUAL(ACL_BUFFERS - 1, hci_number_free_acl_slots_for_handle(handle_b));
+}
+
+TEST(HCI, QueuedCommandsCompleteInOrder){
+    hci_cmd_request_t requests[3];
+    hci_queue_cmd(&requests[0], &request_done, &hci_read_bd_addr);
+    hci_queue_cmd(&requests[1], &request_done, &hci_write_scan_enable, 2);
+    hci_queue_cmd(&requests[2], &request_done, &hci_read_bd_addr);
+    controller_run();
+    CHECK_EQUAL(3, num_commands_received);
+    CHECK_EQUAL(hci_read_bd_addr.opcode,     commands_received[0]);
+    CHECK_EQUAL(hci_write_scan_enable.opcode, commands_received[1]);
+    CHECK_EQUAL(3, num_requests_done);
+    CHECK(requests_done[0] == &requests[0]);
+    CHECK(requests_done[1] == &requests[1]);
+    CHECK(requests_done[2] == &requests[2]);
+    CHECK(requests_done_with_event[2]);
+}
+
+TEST(HCI, QueuedCommandsWaitForCredits){
+    hci_cmd_request_t requests[3];
+    controller_hold_commands = 1;
+    hci_queue_cmd(&requests[0], &request_done, &hci_read_bd_addr);
+    hci_queue_cmd(&requests[1], &request_done, &hci_read_bd_addr);
+    hci_queue_cmd(&requests[2], &request_done, &hci_write_scan_enable, 2);
+    controller_run();
+    CHECK_EQUAL(1, num_commands_received);
+    CHECK_EQUAL(BTSTACK_BUSY, hci_queue_cmd(&requests[1], &request_done, &hci_read_bd_addr));
+
+    // each Command Complete grants one credit
+    controller_complete_held_commands(1);
+    CHECK_EQUAL(1, num_requests_done);
+    CHECK(requests_done[0] == &requests[0]);
+    CHECK_EQUAL(2, num_commands_received);
+    controller_complete_held_commands(1);
+    controller_complete_held_commands(1);
+    CHECK_EQUAL(3, num_requests_done);
+    CHECK(requests_done[1] == &requests[1]);
+    CHECK(requests_done[2] == &requests[2]);
+}
+
+TEST(HCI, CancelledCommandIsNotSent){
+    hci_cmd_request_t requests[2];
+    controller_hold_commands = 1;
+    hci_queue_cmd(&requests[0], &request_done, &hci_read_bd_addr);
+    hci_queue_cmd(&requests[1], &request_done, &hci_write_scan_enable, 2);
+    controller_run();
+    hci_cancel_cmd(&requests[1]);
+    controller_complete_held_commands(1);
+    CHECK_EQUAL(1, num_commands_received);
+    CHECK_EQUAL(1, num_requests_done);
+    CHECK(requests_done[0] == &requests[0]);
+}
+
+TEST(HCI, ResetDropsSentCommands){
+    hci_cmd_request_t requests[2];
+    controller_hold_commands = 1;
+    hci_queue_cmd(&requests[0], &request_done, &hci_read_bd_addr);
+    hci_queue_cmd(&requests[1], &request_done, &hci_write_scan_enable, 2);
+    controller_run();
+    CHECK_EQUAL(1, num_commands_received);
+
+    // controller is reset, held Command Complete is lost
+    controller_hold_commands = 0;
+    num_held_opcodes = 0;
+    hci_power_control(HCI_POWER_OFF);
+    controller_run();
+    hci_power_control(HCI_POWER_ON);
+    controller_run();
+    CHECK_EQUAL(HCI_STATE_WORKING, hci_state);
+
+    // sent command is reported without event, queued command is sent after init
+    CHECK_EQUAL(2, num_requests_done);
+    CHECK(requests_done[0] == &requests[0]);
+    CHECK(!requests_done_with_event[0]);
+    CHECK(requests_done[1] == &requests[1]);
+    CHECK(requests_done_with_event[1]);
+}
+
+TEST(HCI, CommandNotSentIsDropped){
+    controller_connect(addr_a, handle_a);
+    num_commands_received = 0;
+    // connection is already open, command is answered by HCI
+    hci_cmd_request_t request;
+    CHECK_EQUAL(0, hci_queue_cmd(&request, &request_done, &hci_create_connection, addr_a, 0x18, 0, 0, 0, 1));
+    CHECK_EQUAL(0, num_commands_received);
+    CHECK_EQUAL(1, num_requests_done);
+    CHECK(!requests_done_with_event[0]);
+    CHECK(hci_can_send_command_packet_now());
+}
+
+TEST(HCI, BatchDefersRunToEnd){
+    hci_cmd_request_t requests[2];
+    controller_hold_commands = 1;
+    hci_queue_cmd(&requests[0], &request_done, &hci_read_bd_addr);
+    hci_queue_cmd(&requests[1], &request_done, &hci_write_scan_enable, 2);
+    controller_run();
+    CHECK_EQUAL(1, num_commands_received);
+
+    // Command Complete is handled right away, next command is sent when the batch ends
+    hci_batch_begin();
+    CHECK(hci_batch_active());
+    controller_complete_held_commands(1);
+    CHECK_EQUAL(1, num_requests_done);
+    CHECK_EQUAL(1, num_commands_received);
+    CHECK_EQUAL(0, batch_complete_events);
+    hci_batch_end();
+    CHECK(!hci_batch_active());
+    CHECK_EQUAL(2, num_commands_received);
+    CHECK_EQUAL(1, batch_complete_events);
+}
+
+TEST(HCI, BatchCompleteOncePerBatch){
+    controller_connect(addr_a, handle_a);
+    CHECK_EQUAL(0, batch_complete_events);
+    host_send_acl(handle_a);
+    host_send_acl(handle_a);
+    hci_batch_begin();
+    controller_complete_packets(handle_a, 1);
+    controller_complete_packets(handle_a, 1);
+    hci_batch_end();
+    CHECK_EQUAL(1, batch_complete_events);
+    CHECK_EQUAL(ACL_BUFFERS, hci_number_free_acl_slots_for_handle(handle_a));
+}
+
+TEST(HCI, EmptyBatchEmitsNoEvent){
+    hci_batch_end();
+    hci_batch_begin();
+    hci_batch_end();
+    CHECK_EQUAL(0, batch_complete_events);
+
+    // run requested during an empty batch still happens at its end
+    hci_cmd_request_t request;
+    hci_batch_begin();
+    hci_queue_cmd(&request, &request_done, &hci_read_bd_addr);
+    CHECK_EQUAL(0, num_commands_received);
+    hci_batch_end();
+    CHECK_EQUAL(1, num_commands_received);
+    CHECK_EQUAL(0, batch_complete_events);
+}
+
+// init script of SCRIPT_CMDS vendor commands with opcodes SCRIPT_OPCODE(0)..
+#define SCRIPT_CMDS 6
+#define SCRIPT_OPCODE(i) ((OGF_VENDOR << 10) | (0x10 + (i)))
+
+static int script_pos;
+
+static int script_next_cmd(void * config, uint8_t * hci_cmd_buffer){
+    if (script_pos == SCRIPT_CMDS) return 0;
+    bt_store_16(hci_cmd_buffer, 0, SCRIPT_OPCODE(script_pos));
+    hci_cmd_buffer[2] = 1;
+    hci_cmd_buffer[3] = script_pos;
+    script_pos++;
+    return 1;
+}
+
+static int commands_received_with_opcode(uint16_t opcode){
+    int i;
+    int count = 0;
+    for (i = 0; i < num_commands_received; i++){
+        if (commands_received[i] == opcode) count++;
+    }
+    return count;
+}
+
+TEST(HCI, InitScriptCommandsInFlight){
+    bt_control_t control;
+    memset(&control, 0, sizeof(control));
+    control.next_cmd = script_next_cmd;
+    script_pos = 0;
+    hci_close();
+    hci_init(&controller_transport, NULL, &control, &remote_device_db_memory);
+    hci_register_packet_handler(host_packet_handler_test);
+
+    // controller grants more credits than script commands may be in flight
+    controller_command_credits = HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT + 2;
+    controller_hold_vendor_commands = 1;
+    hci_state = HCI_STATE_OFF;
+    num_commands_received = 0;
+    hci_power_control(HCI_POWER_ON);
+    controller_run();
+    CHECK_EQUAL(1 + HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT, num_commands_received);
+    int i;
+    for (i = 0; i < HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT; i++){
+        CHECK_EQUAL(SCRIPT_OPCODE(i), commands_received[1 + i]);
+    }
+
+    // Command Complete for unknown opcode or only reporting credits doesn't retire a script command
+    uint8_t status = 0;
+    controller_emit_command_complete(SCRIPT_OPCODE(SCRIPT_CMDS), &status, 1);
+    controller_emit_command_complete(0x0000, &status, 0);
+    controller_run();
+    CHECK_EQUAL(1 + HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT, num_commands_received);
+
+    // out-of-order completion retires the matching command, next script command is sent in order
+    controller_complete_held_command(1);
+    CHECK_EQUAL(2 + HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT, num_commands_received);
+    CHECK_EQUAL(SCRIPT_OPCODE(HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT), commands_received[1 + HCI_INIT_SCRIPT_MAX_CMDS_IN_FLIGHT]);
+    controller_complete_held_command(num_held_opcodes - 1);
+    controller_complete_held_command(0);
+    CHECK_EQUAL(1 + SCRIPT_CMDS, num_commands_received);
+    for (i = 0; i < SCRIPT_CMDS; i++){
+        CHECK_EQUAL(1, commands_received_with_opcode(SCRIPT_OPCODE(i)));
+        CHECK_EQUAL(SCRIPT_OPCODE(i), commands_received[1 + i]);
+    }
+
+    // init continues after the last script command completed
+    while (num_held_opcodes > 1){
+        controller_complete_held_command(num_held_opcodes - 1);
+    }
+    CHECK_EQUAL(0, commands_received_with_opcode(hci_read_bd_addr.opcode));
+    controller_complete_held_command(0);
+    CHECK_EQUAL(1, commands_received_with_opcode(hci_read_bd_addr.opcode));
+    CHECK_EQUAL(SCRIPT_CMDS, script_pos);
+    CHECK_EQUAL(HCI_STATE_WORKING, hci_state);
+}
+
+int main (int argc, const char * argv[]){
+    run_loop_init(RUN_LOOP_POSIX);
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include "hci.h"
+#include "hci_transport.h"
+
+// H4 transport on a pseudo terminal, the test writes controller packets to the master side and
+// calls the process function of the data source registered by the transport
+
+extern "C" hci_transport_t * hci_transport_h4_instance(void);
+
+static data_source_t * h4_data_source;
+static int packets_received;
+static int packets_received_in_batch;
+static int batch_active;
+static int batches;
+
+// run loop and HCI batch stubs
+
+void run_loop_add_data_source(data_source_t *ds){
+    h4_data_source = ds;
+}
+
+int run_loop_remove_data_source(data_source_t *ds){
+    h4_data_source = NULL;
+    return 0;
+}
+
+void hci_batch_begin(void){
+    CHECK(!batch_active);
+    batch_active = 1;
+}
+
+void hci_batch_end(void){
+    CHECK(batch_active);
+    batch_active = 0;
+    batches++;
+}
+
+static void packet_handler(uint8_t packet_type, uint8_t *packet, uint16_t size){
+    CHECK_EQUAL(HCI_EVENT_PACKET, packet_type);
+    CHECK_EQUAL(HCI_EVENT_COMMAND_COMPLETE, packet[0]);
+    packets_received++;
+    if (batch_active){
+        packets_received_in_batch++;
+    }
+}
+
+static int pty_master;
+static hci_transport_t * transport;
+static hci_uart_config_t config;
+
+static void controller_send_events(int num_events){
+    uint8_t event[] = { HCI_EVENT_PACKET, HCI_EVENT_COMMAND_COMPLETE, 4, 1, 0x03, 0x0c, 0x00 };
+    int i;
+    for (i = 0; i < num_events; i++){
+        CHECK_EQUAL(sizeof(event), (int) write(pty_master, event, sizeof(event)));
+    }
+    // wait until the pseudo terminal has passed the data on
+    struct pollfd pfd = { h4_data_source->fd, POLLIN, 0 };
+    CHECK_EQUAL(1, poll(&pfd, 1, 1000));
+    usleep(10000);
+}
+
+static void h4_process(void){
+    packets_received_in_batch = 0;
+    (*h4_data_source->process)(h4_data_source);
+}
+
+TEST_GROUP(H4){
+    void setup(){
+        packets_received = 0;
+        batch_active = 0;
+        batches = 0;
+        pty_master = posix_openpt(O_RDWR | O_NOCTTY);
+        CHECK(pty_master >= 0);
+        CHECK_EQUAL(0, grantpt(pty_master));
+        CHECK_EQUAL(0, unlockpt(pty_master));
+        config.device_name   = ptsname(pty_master);
+        config.baudrate_init = 115200;
+        config.baudrate_main = 0;
+        config.flowcontrol   = 0;
+        transport = hci_transport_h4_instance();
+        transport->register_packet_handler(&packet_handler);
+        CHECK_EQUAL(0, transport->open(&config));
+        CHECK(h4_data_source != NULL);
+        // drop HCI Reset sent by open
+        uint8_t buffer[16];
+        fcntl(pty_master, F_SETFL, O_NONBLOCK);
+        while (read(pty_master, buffer, sizeof(buffer)) > 0);
+    }
+    void teardown(){
+        transport->close(&config);
+        close(pty_master);
+    }
+};
+
+TEST(H4, PacketsPerWakeupBounded){
+    controller_send_events(10);
+    h4_process();
+    CHECK_EQUAL(1, batches);
+    CHECK_EQUAL(8, packets_received);
+    CHECK_EQUAL(8, packets_received_in_batch);
+
+    // remaining packets are delivered on the next wakeup
+    h4_process();
+    CHECK_EQUAL(2, batches);
+    CHECK_EQUAL(10, packets_received);
+    CHECK_EQUAL(2, packets_received_in_batch);
+
+    h4_process();
+    CHECK_EQUAL(10, packets_received);
+    CHECK(!batch_active);
+}
+
+TEST(H4, PartialPacketContinuesOnNextWakeup){
+    uint8_t event[] = { HCI_EVENT_PACKET, HCI_EVENT_COMMAND_COMPLETE, 4, 1, 0x03, 0x0c, 0x00 };
+    CHECK_EQUAL(4, (int) write(pty_master, event, 4));
+    usleep(10000);
+    h4_process();
+    CHECK_EQUAL(0, packets_received);
+    CHECK_EQUAL(3, (int) write(pty_master, &event[4], 3));
+    usleep(10000);
+    h4_process();
+    CHECK_EQUAL(1, packets_received);
+    CHECK_EQUAL(2, batches);
+}
+
+int main (int argc, const char * argv[]){
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
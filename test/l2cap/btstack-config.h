@@ -0,0 +1,14 @@
+// config.h created by hand for the BTstack L2CAP tests
+
+#ifndef __BTSTACK_CONFIG
+#define __BTSTACK_CONFIG
+
+#define USE_POSIX_RUN_LOOP
+#define HAVE_TIME
+#define HAVE_MALLOC
+#define HAVE_BZERO
+#define HCI_ACL_PAYLOAD_SIZE 1021
+// fewer handlers tracked than used by the tests
+#define L2CAP_BATCH_COMPLETE_MAX_HANDLERS 2
+
+#endif
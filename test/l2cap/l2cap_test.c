@@ -0,0 +1,225 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include <btstack/btstack.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include "btstack_memory.h"
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "remote_device_db.h"
+
+// emulated controller, events are queued and delivered by controller_run().
+// Outgoing connections are not completed, channels stay in l2cap_channels.
+
+#define QUEUE_SIZE 32
+#define TEST_PSM   0x1001
+
+typedef struct {
+    uint16_t size;
+    uint8_t  data[HCI_EVENT_BUFFER_SIZE];
+} queued_event_t;
+
+static queued_event_t queue[QUEUE_SIZE];
+static int queue_read_pos;
+static int queue_write_pos;
+
+static hci_transport_t controller_transport;
+static void (*host_packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size);
+static int create_connection_commands;
+static int stack_working;
+
+static bd_addr_t peer_addr = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x03 };
+
+// DAEMON_EVENT_HCI_BATCH_COMPLETE per channel packet handler
+static int batch_complete_events[3];
+
+static void controller_emit_event(uint8_t * event, uint16_t size){
+    queued_event_t * entry = &queue[queue_write_pos];
+    queue_write_pos = (queue_write_pos + 1) % QUEUE_SIZE;
+    entry->size = size;
+    memcpy(entry->data, event, size);
+}
+
+static void controller_handle_command(uint8_t * packet){
+    uint16_t opcode = READ_BT_16(packet, 0);
+    uint8_t event[5 + 9];
+    memset(event, 0, sizeof(event));
+
+    if (IS_COMMAND(packet, hci_create_connection)){
+        create_connection_commands++;
+        event[0] = HCI_EVENT_COMMAND_STATUS;
+        event[1] = 4;
+        event[3] = 1;
+        bt_store_16(event, 4, opcode);
+        controller_emit_event(event, 6);
+        return;
+    }
+
+    event[0] = HCI_EVENT_COMMAND_COMPLETE;
+    event[1] = 3 + 9;
+    event[2] = 1;
+    bt_store_16(event, 3, opcode);
+    if (IS_COMMAND(packet, hci_read_buffer_size)){
+        bt_store_16(event, 6, HCI_ACL_PAYLOAD_SIZE);
+        bt_store_16(event, 9, 4);
+    }
+    controller_emit_event(event, sizeof(event));
+}
+
+static int controller_send_packet(uint8_t packet_type, uint8_t * packet, int size){
+    uint8_t event[2];
+    event[0] = DAEMON_EVENT_HCI_PACKET_SENT;
+    event[1] = 0;
+    controller_emit_event(event, sizeof(event));
+    if (packet_type == HCI_COMMAND_DATA_PACKET){
+        controller_handle_command(packet);
+    }
+    return 0;
+}
+
+static int controller_can_send_packet_now(uint8_t packet_type){
+    return 1;
+}
+
+static int controller_open(void * config){
+    return 0;
+}
+
+static int controller_close(void * config){
+    return 0;
+}
+
+static void controller_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    host_packet_handler = handler;
+}
+
+static const char * controller_get_transport_name(void){
+    return "test";
+}
+
+static void controller_run(void){
+    while (queue_read_pos != queue_write_pos){
+        queued_event_t * entry = &queue[queue_read_pos];
+        queue_read_pos = (queue_read_pos + 1) % QUEUE_SIZE;
+        (*host_packet_handler)(HCI_EVENT_PACKET, entry->data, entry->size);
+    }
+}
+
+// event that is not handled by HCI and L2CAP
+static void controller_inquiry_complete(void){
+    uint8_t event[3];
+    event[0] = HCI_EVENT_INQUIRY_COMPLETE;
+    event[1] = 1;
+    event[2] = 0;
+    controller_emit_event(event, sizeof(event));
+    controller_run();
+}
+
+static void count_batch_complete(int handler, uint8_t packet_type, uint8_t * packet){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    if (packet[0] != DAEMON_EVENT_HCI_BATCH_COMPLETE) return;
+    batch_complete_events[handler]++;
+}
+
+static void channel_handler_a(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    count_batch_complete(0, packet_type, packet);
+}
+
+static void channel_handler_b(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    count_batch_complete(1, packet_type, packet);
+}
+
+static void channel_handler_c(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    count_batch_complete(2, packet_type, packet);
+}
+
+static void l2cap_packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    if (packet_type != HCI_EVENT_PACKET) return;
+    if (packet[0] != BTSTACK_EVENT_STATE) return;
+    stack_working = packet[2] == HCI_STATE_WORKING;
+}
+
+static void create_channel(btstack_packet_handler_t handler){
+    l2cap_create_channel_internal(NULL, handler, peer_addr, TEST_PSM, 100);
+    controller_run();
+}
+
+TEST_GROUP(L2CAP){
+    void setup(){
+        queue_read_pos = 0;
+        queue_write_pos = 0;
+        stack_working = 0;
+        memset(batch_complete_events, 0, sizeof(batch_complete_events));
+
+        controller_transport.open                    = controller_open;
+        controller_transport.close                   = controller_close;
+        controller_transport.send_packet             = controller_send_packet;
+        controller_transport.register_packet_handler = controller_register_packet_handler;
+        controller_transport.get_transport_name      = controller_get_transport_name;
+        controller_transport.set_baudrate            = NULL;
+        controller_transport.can_send_packet_now     = controller_can_send_packet_now;
+
+        btstack_memory_init();
+        hci_init(&controller_transport, NULL, NULL, &remote_device_db_memory);
+        l2cap_init();
+        l2cap_register_packet_handler(l2cap_packet_handler);
+        hci_power_control(HCI_POWER_ON);
+        controller_run();
+        CHECK(stack_working);
+        create_connection_commands = 0;
+    }
+    void teardown(){
+        hci_close();
+        queue_read_pos = queue_write_pos;
+    }
+};
+
+TEST(L2CAP, BatchCompleteOncePerHandler){
+    // more distinct handlers than L2CAP_BATCH_COMPLETE_MAX_HANDLERS, new channels are added at the head of the list
+    create_channel(channel_handler_a);
+    create_channel(channel_handler_b);
+    create_channel(channel_handler_c);
+    create_channel(channel_handler_b);
+    create_channel(channel_handler_c);
+    create_channel(channel_handler_a);
+    create_channel(channel_handler_a);
+
+    hci_batch_begin();
+    controller_inquiry_complete();
+    controller_inquiry_complete();
+    CHECK_EQUAL(0, batch_complete_events[0]);
+    hci_batch_end();
+    CHECK_EQUAL(1, batch_complete_events[0]);
+    CHECK_EQUAL(1, batch_complete_events[1]);
+    CHECK_EQUAL(1, batch_complete_events[2]);
+}
+
+TEST(L2CAP, BatchDefersRunToEnd){
+    create_channel(channel_handler_a);
+    CHECK_EQUAL(1, create_connection_commands);
+
+    // channel created while the batch is delivered, e.g. by a packet handler
+    bd_addr_t other_addr = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x04 };
+    hci_batch_begin();
+    controller_inquiry_complete();
+    l2cap_create_channel_internal(NULL, channel_handler_b, other_addr, TEST_PSM, 100);
+    controller_run();
+    CHECK_EQUAL(1, create_connection_commands);
+    hci_batch_end();
+    controller_run();
+    CHECK_EQUAL(2, create_connection_commands);
+    CHECK_EQUAL(1, batch_complete_events[0]);
+    CHECK_EQUAL(1, batch_complete_events[1]);
+}
+
+int main (int argc, const char * argv[]){
+    run_loop_init(RUN_LOOP_POSIX);
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,13 @@
+// config.h created by hand for the BTstack L2CAP ERTM tests
+
+#ifndef __BTSTACK_CONFIG
+#define __BTSTACK_CONFIG
+
+#define USE_POSIX_RUN_LOOP
+#define HAVE_TIME
+#define HAVE_MALLOC
+#define HAVE_BZERO
+#define HAVE_L2CAP_ERTM
+#define HCI_ACL_PAYLOAD_SIZE 1021
+
+#endif
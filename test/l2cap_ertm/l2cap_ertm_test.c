@@ -0,0 +1,582 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include <btstack/btstack.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include "btstack_memory.h"
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "remote_device_db.h"
+
+// emulated controller with a scripted peer that opens an ERTM channel to TEST_PSM.
+// Frames sent by the stack on the channel are recorded in peer_frames[].
+
+#define TEST_HANDLE   0x0001
+#define TEST_PSM      0x1001
+#define PEER_CID      0x0041
+#define PEER_MPS      16
+#define QUEUE_SIZE    64
+#define MAX_FRAMES    32
+
+#define SAR_UNSEGMENTED   0
+#define SAR_START         1
+#define SAR_END           2
+#define SAR_CONTINUATION  3
+
+#define SUPERVISORY_RR    0
+#define SUPERVISORY_REJ   1
+
+typedef struct {
+    uint8_t  to_peer;
+    uint8_t  type;
+    uint16_t size;
+    uint8_t  data[HCI_ACL_BUFFER_SIZE];
+} queued_packet_t;
+
+typedef struct {
+    uint16_t control;
+    uint16_t len;
+    uint8_t  payload[64];
+    int      fcs_ok;
+} peer_frame_t;
+
+static queued_packet_t queue[QUEUE_SIZE];
+static int queue_read_pos;
+static int queue_write_pos;
+
+static hci_transport_t controller_transport;
+static void (*host_packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size);
+static bd_addr_t peer_addr = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x02 };
+
+// peer state
+static uint8_t  peer_sig_id;
+static uint16_t peer_stack_cid;
+static uint8_t  peer_rx_window;     // tx window for the stack
+static uint8_t  peer_tx_window;     // returned in configure response, used for acks by the stack
+static int      peer_config_done;
+static peer_frame_t peer_frames[MAX_FRAMES];
+static int      peer_num_frames;
+
+// stack state
+static int      stack_working;
+static uint16_t local_cid;
+static uint8_t  ertm_buffer[4000];
+static uint8_t  sdu[256];
+static uint16_t sdu_len;
+static int      sdus_received;
+
+static uint16_t crc16(const uint8_t * data, uint16_t len){
+    uint16_t crc = 0;
+    while (len--){
+        crc ^= *data++;
+        int i;
+        for (i = 0; i < 8; i++){
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+static void queue_packet(int to_peer, uint8_t type, const uint8_t * data, uint16_t size){
+    queued_packet_t * packet = &queue[queue_write_pos];
+    queue_write_pos = (queue_write_pos + 1) % QUEUE_SIZE;
+    packet->to_peer = to_peer;
+    packet->type = type;
+    packet->size = size;
+    memcpy(packet->data, data, size);
+}
+
+// emulated controller
+
+static void controller_emit_event(uint8_t * event, uint16_t size){
+    queue_packet(0, HCI_EVENT_PACKET, event, size);
+}
+
+static void controller_emit_command_complete(uint16_t opcode, uint8_t * params, int params_len){
+    uint8_t event[5 + 16];
+    event[0] = HCI_EVENT_COMMAND_COMPLETE;
+    event[1] = 3 + params_len;
+    event[2] = 1;
+    bt_store_16(event, 3, opcode);
+    memcpy(&event[5], params, params_len);
+    controller_emit_event(event, 5 + params_len);
+}
+
+static void controller_emit_command_status(uint16_t opcode){
+    uint8_t event[6];
+    event[0] = HCI_EVENT_COMMAND_STATUS;
+    event[1] = 4;
+    event[2] = 0;
+    event[3] = 1;
+    bt_store_16(event, 4, opcode);
+    controller_emit_event(event, sizeof(event));
+}
+
+static void controller_handle_command(uint8_t * packet){
+    uint16_t opcode = READ_BT_16(packet, 0);
+    uint8_t params[16];
+    uint8_t event[16];
+    memset(params, 0, sizeof(params));
+
+    if (IS_COMMAND(packet, hci_read_buffer_size)){
+        bt_store_16(params, 1, HCI_ACL_PAYLOAD_SIZE);
+        bt_store_16(params, 4, 8);
+        controller_emit_command_complete(opcode, params, 8);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_local_supported_features)){
+        controller_emit_command_complete(opcode, params, 9);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_accept_connection_request)){
+        controller_emit_command_status(opcode);
+        event[0] = HCI_EVENT_CONNECTION_COMPLETE;
+        event[1] = 11;
+        event[2] = 0;
+        bt_store_16(event, 3, TEST_HANDLE);
+        bt_flip_addr(&event[5], peer_addr);
+        event[11] = 1;  // ACL
+        event[12] = 0;  // no encryption
+        controller_emit_event(event, 13);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_remote_supported_features_command)){
+        controller_emit_command_status(opcode);
+        return;
+    }
+    controller_emit_command_complete(opcode, params, 1);
+}
+
+static int controller_send_packet(uint8_t packet_type, uint8_t * packet, int size){
+    uint8_t event[7];
+    event[0] = DAEMON_EVENT_HCI_PACKET_SENT;
+    event[1] = 0;
+    controller_emit_event(event, 2);
+    switch (packet_type){
+        case HCI_COMMAND_DATA_PACKET:
+            controller_handle_command(packet);
+            break;
+        case HCI_ACL_DATA_PACKET:
+            queue_packet(1, packet_type, packet, size);
+            event[0] = HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS;
+            event[1] = 5;
+            event[2] = 1;
+            bt_store_16(event, 3, READ_ACL_CONNECTION_HANDLE(packet));
+            bt_store_16(event, 5, 1);
+            controller_emit_event(event, 7);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static int controller_can_send_packet_now(uint8_t packet_type){
+    return 1;
+}
+
+static int controller_open(void * config){
+    return 0;
+}
+
+static int controller_close(void * config){
+    return 0;
+}
+
+static void controller_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    host_packet_handler = handler;
+}
+
+static const char * controller_get_transport_name(void){
+    return "test";
+}
+
+// scripted peer
+
+static void peer_send_acl(uint16_t cid, const uint8_t * data, uint16_t len){
+    uint8_t packet[HCI_ACL_BUFFER_SIZE];
+    bt_store_16(packet, 0, TEST_HANDLE | (0x02 << 12));
+    bt_store_16(packet, 2, len + 4);
+    bt_store_16(packet, 4, len);
+    bt_store_16(packet, 6, cid);
+    memcpy(&packet[8], data, len);
+    queue_packet(0, HCI_ACL_DATA_PACKET, packet, len + 8);
+}
+
+static void peer_send_signaling(uint8_t code, uint8_t identifier, uint8_t * params, uint16_t len){
+    uint8_t command[4 + 32];
+    command[0] = code;
+    command[1] = identifier;
+    bt_store_16(command, 2, len);
+    memcpy(&command[4], params, len);
+    peer_send_acl(L2CAP_CID_SIGNALING, command, 4 + len);
+}
+
+static uint16_t peer_store_rfc_option(uint8_t * options, uint8_t tx_window){
+    options[0] = 4;
+    options[1] = 9;
+    options[2] = 3;     // Enhanced Retransmission Mode
+    options[3] = tx_window;
+    options[4] = 3;     // max transmit
+    bt_store_16(options, 5, 2000);
+    bt_store_16(options, 7, 12000);
+    bt_store_16(options, 9, PEER_MPS);
+    return 11;
+}
+
+static void peer_handle_signaling(uint8_t * command){
+    uint8_t params[32];
+    uint16_t pos;
+    switch (command[0]){
+        case CONNECTION_RESPONSE:
+            if (READ_BT_16(command, 8) != 0) break;
+            peer_stack_cid = READ_BT_16(command, 4);
+            bt_store_16(params, 0, peer_stack_cid);
+            bt_store_16(params, 2, 0);
+            pos = 4 + peer_store_rfc_option(&params[4], peer_rx_window);
+            peer_send_signaling(CONFIGURE_REQUEST, ++peer_sig_id, params, pos);
+            break;
+        case CONFIGURE_REQUEST:
+            bt_store_16(params, 0, peer_stack_cid);
+            bt_store_16(params, 2, 0);
+            bt_store_16(params, 4, 0);
+            pos = 6 + peer_store_rfc_option(&params[6], peer_tx_window);
+            peer_send_signaling(CONFIGURE_RESPONSE, command[1], params, pos);
+            peer_config_done |= 2;
+            break;
+        case CONFIGURE_RESPONSE:
+            peer_config_done |= 1;
+            break;
+        case INFORMATION_REQUEST:
+            bt_store_16(params, 0, READ_BT_16(command, 4));
+            bt_store_16(params, 2, 1);  // not supported
+            peer_send_signaling(INFORMATION_RESPONSE, command[1], params, 4);
+            break;
+        default:
+            break;
+    }
+}
+
+static void peer_handle_acl(uint8_t * packet, uint16_t size){
+    uint16_t cid = READ_L2CAP_CHANNEL_ID(packet);
+    uint16_t len = READ_L2CAP_LENGTH(packet);
+    if (cid == L2CAP_CID_SIGNALING){
+        uint16_t pos = 8;
+        while (pos < 8 + len){
+            peer_handle_signaling(&packet[pos]);
+            pos += 4 + READ_BT_16(packet, pos + 2);
+        }
+        return;
+    }
+    if (cid != PEER_CID || peer_num_frames >= MAX_FRAMES) return;
+    peer_frame_t * frame = &peer_frames[peer_num_frames++];
+    frame->control = READ_BT_16(packet, 8);
+    frame->len = len - 4;
+    memcpy(frame->payload, &packet[10], frame->len);
+    frame->fcs_ok = crc16(&packet[4], 4 + len - 2) == READ_BT_16(packet, 8 + len - 2);
+}
+
+static void controller_run(void){
+    while (queue_read_pos != queue_write_pos){
+        queued_packet_t * packet = &queue[queue_read_pos];
+        queue_read_pos = (queue_read_pos + 1) % QUEUE_SIZE;
+        if (packet->to_peer){
+            peer_handle_acl(packet->data, packet->size);
+        } else {
+            (*host_packet_handler)(packet->type, packet->data, packet->size);
+        }
+    }
+}
+
+static void peer_send_frame(uint16_t control, int sdu_length, const uint8_t * data, uint16_t len, int corrupt_fcs){
+    uint8_t packet[4 + 2 + 2 + 64 + 2];
+    uint16_t pos = 4;
+    bt_store_16(packet, pos, control);
+    pos += 2;
+    if (sdu_length >= 0){
+        bt_store_16(packet, pos, sdu_length);
+        pos += 2;
+    }
+    memcpy(&packet[pos], data, len);
+    pos += len;
+    bt_store_16(packet, 0, pos - 4 + 2);
+    bt_store_16(packet, 2, peer_stack_cid);
+    uint16_t fcs = crc16(packet, pos);
+    if (corrupt_fcs) fcs ^= 0x0001;
+    bt_store_16(packet, pos, fcs);
+    pos += 2;
+    peer_send_acl(peer_stack_cid, &packet[4], pos - 4);
+    controller_run();
+}
+
+static void peer_send_i_frame(uint8_t tx_seq, uint8_t req_seq, uint8_t sar, int sdu_length, const uint8_t * data, uint16_t len){
+    peer_send_frame((tx_seq << 1) | (req_seq << 8) | (sar << 14), sdu_length, data, len, 0);
+}
+
+static void peer_send_s_frame(uint8_t function, uint8_t req_seq){
+    peer_send_frame(1 | (function << 2) | (req_seq << 8), -1, NULL, 0, 0);
+}
+
+static int frame_is_i_frame(peer_frame_t * frame){
+    return (frame->control & 1) == 0;
+}
+
+static uint8_t frame_tx_seq(peer_frame_t * frame){
+    return (frame->control >> 1) & 0x3f;
+}
+
+static uint8_t frame_req_seq(peer_frame_t * frame){
+    return (frame->control >> 8) & 0x3f;
+}
+
+static uint8_t frame_sar(peer_frame_t * frame){
+    return frame->control >> 14;
+}
+
+static uint8_t frame_function(peer_frame_t * frame){
+    return (frame->control >> 2) & 3;
+}
+
+// stack side
+
+static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    l2cap_ertm_config_t config;
+    switch (packet_type){
+        case L2CAP_DATA_PACKET:
+            memcpy(sdu, packet, size);
+            sdu_len = size;
+            sdus_received++;
+            break;
+        case HCI_EVENT_PACKET:
+            switch (packet[0]){
+                case BTSTACK_EVENT_STATE:
+                    stack_working = packet[2] == HCI_STATE_WORKING;
+                    break;
+                case L2CAP_EVENT_INCOMING_CONNECTION:
+                    memset(&config, 0, sizeof(config));
+                    config.mode = L2CAP_CHANNEL_MODE_ENHANCED_RETRANSMISSION;
+                    config.mode_mandatory = 1;
+                    config.max_transmit = 3;
+                    config.retransmission_timeout_ms = 2000;
+                    config.monitor_timeout_ms = 12000;
+                    config.local_mtu = 200;
+                    config.num_tx_buffers = 4;
+                    config.use_fcs = 1;
+                    l2cap_accept_ertm_connection_internal(READ_BT_16(packet, 12), &config, ertm_buffer, sizeof(ertm_buffer));
+                    break;
+                case L2CAP_EVENT_CHANNEL_OPENED:
+                    if (packet[2] == 0){
+                        local_cid = READ_BT_16(packet, 13);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void l2cap_packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    packet_handler(packet_type, channel, packet, size);
+}
+
+static void stack_send(const char * data){
+    CHECK_EQUAL(0, l2cap_send_internal(local_cid, (uint8_t *) data, strlen(data)));
+    controller_run();
+}
+
+static void peer_open_channel(void){
+    uint8_t event[12];
+    event[0] = HCI_EVENT_CONNECTION_REQUEST;
+    event[1] = 10;
+    bt_flip_addr(&event[2], peer_addr);
+    memset(&event[8], 0, 3);
+    event[11] = 1;
+    queue_packet(0, HCI_EVENT_PACKET, event, sizeof(event));
+    controller_run();
+
+    uint8_t params[4];
+    bt_store_16(params, 0, TEST_PSM);
+    bt_store_16(params, 2, PEER_CID);
+    peer_send_signaling(CONNECTION_REQUEST, ++peer_sig_id, params, sizeof(params));
+    controller_run();
+    CHECK_EQUAL(3, peer_config_done);
+    CHECK(local_cid != 0);
+    peer_num_frames = 0;
+}
+
+TEST_GROUP(L2CAP_ERTM){
+    void setup(){
+        queue_read_pos = 0;
+        queue_write_pos = 0;
+        peer_sig_id = 0;
+        peer_stack_cid = 0;
+        peer_rx_window = 8;
+        peer_tx_window = 8;
+        peer_config_done = 0;
+        peer_num_frames = 0;
+        stack_working = 0;
+        local_cid = 0;
+        sdu_len = 0;
+        sdus_received = 0;
+
+        controller_transport.open                    = controller_open;
+        controller_transport.close                   = controller_close;
+        controller_transport.send_packet             = controller_send_packet;
+        controller_transport.register_packet_handler = controller_register_packet_handler;
+        controller_transport.get_transport_name      = controller_get_transport_name;
+        controller_transport.set_baudrate            = NULL;
+        controller_transport.can_send_packet_now     = controller_can_send_packet_now;
+
+        btstack_memory_init();
+        hci_init(&controller_transport, NULL, NULL, &remote_device_db_memory);
+        l2cap_init();
+        l2cap_register_packet_handler(l2cap_packet_handler);
+        l2cap_register_service_internal(NULL, packet_handler, TEST_PSM, 200, LEVEL_0);
+        hci_power_control(HCI_POWER_ON);
+        controller_run();
+        CHECK(stack_working);
+    }
+    void teardown(){
+        l2cap_unregister_service_internal(NULL, TEST_PSM);
+        hci_close();
+        queue_read_pos = queue_write_pos;
+    }
+};
+
+TEST(L2CAP_ERTM, Crc16){
+    // CRC-16/ARC check value
+    CHECK_EQUAL(0xbb3d, crc16((const uint8_t *) "123456789", 9));
+}
+
+TEST(L2CAP_ERTM, OutgoingFrameHasValidFcs){
+    peer_open_channel();
+    stack_send("hello");
+    CHECK_EQUAL(1, peer_num_frames);
+    CHECK(frame_is_i_frame(&peer_frames[0]));
+    CHECK(peer_frames[0].fcs_ok);
+    CHECK_EQUAL(0, frame_tx_seq(&peer_frames[0]));
+    CHECK_EQUAL(SAR_UNSEGMENTED, frame_sar(&peer_frames[0]));
+    CHECK_EQUAL(5, peer_frames[0].len);
+    CHECK_EQUAL(0, memcmp("hello", peer_frames[0].payload, 5));
+}
+
+TEST(L2CAP_ERTM, IncomingFrameWithBadFcsIsDropped){
+    peer_open_channel();
+    peer_send_frame(0 | (0 << 8), -1, (const uint8_t *) "abc", 3, 1);
+    CHECK_EQUAL(0, sdus_received);
+    peer_send_i_frame(0, 0, SAR_UNSEGMENTED, -1, (const uint8_t *) "abc", 3);
+    CHECK_EQUAL(1, sdus_received);
+    CHECK_EQUAL(3, sdu_len);
+    CHECK_EQUAL(0, memcmp("abc", sdu, 3));
+}
+
+TEST(L2CAP_ERTM, SduReassembly){
+    peer_open_channel();
+    peer_send_i_frame(0, 0, SAR_START, 12, (const uint8_t *) "0123", 4);
+    peer_send_i_frame(1, 0, SAR_CONTINUATION, -1, (const uint8_t *) "4567", 4);
+    CHECK_EQUAL(0, sdus_received);
+    peer_send_i_frame(2, 0, SAR_END, -1, (const uint8_t *) "89ab", 4);
+    CHECK_EQUAL(1, sdus_received);
+    CHECK_EQUAL(12, sdu_len);
+    CHECK_EQUAL(0, memcmp("0123456789ab", sdu, 12));
+}
+
+TEST(L2CAP_ERTM, SduSegmentation){
+    peer_open_channel();
+    // 30 bytes with remote MPS 16: start frame with SDU length and 14 bytes, end frame with 16 bytes
+    stack_send("abcdefghijklmnopqrstuvwxyz0123");
+    CHECK_EQUAL(2, peer_num_frames);
+    CHECK_EQUAL(SAR_START, frame_sar(&peer_frames[0]));
+    CHECK_EQUAL(30, READ_BT_16(peer_frames[0].payload, 0));
+    CHECK_EQUAL(0, memcmp("abcdefghijklmn", &peer_frames[0].payload[2], 14));
+    CHECK_EQUAL(SAR_END, frame_sar(&peer_frames[1]));
+    CHECK_EQUAL(0, memcmp("opqrstuvwxyz0123", peer_frames[1].payload, 16));
+    CHECK_EQUAL(1, frame_tx_seq(&peer_frames[1]));
+}
+
+TEST(L2CAP_ERTM, RejectOnSequenceGap){
+    peer_open_channel();
+    peer_send_i_frame(0, 0, SAR_UNSEGMENTED, -1, (const uint8_t *) "a", 1);
+    peer_send_i_frame(2, 0, SAR_UNSEGMENTED, -1, (const uint8_t *) "c", 1);
+    CHECK_EQUAL(1, sdus_received);
+    CHECK_EQUAL(1, peer_num_frames);
+    CHECK(!frame_is_i_frame(&peer_frames[0]));
+    CHECK_EQUAL(SUPERVISORY_REJ, frame_function(&peer_frames[0]));
+    CHECK_EQUAL(1, frame_req_seq(&peer_frames[0]));
+    // only one reject per gap
+    peer_send_i_frame(3, 0, SAR_UNSEGMENTED, -1, (const uint8_t *) "d", 1);
+    CHECK_EQUAL(1, peer_num_frames);
+}
+
+TEST(L2CAP_ERTM, RetransmitOnReject){
+    peer_open_channel();
+    stack_send("one");
+    stack_send("two");
+    CHECK_EQUAL(2, peer_num_frames);
+    peer_send_s_frame(SUPERVISORY_REJ, 0);
+    CHECK_EQUAL(4, peer_num_frames);
+    CHECK_EQUAL(0, frame_tx_seq(&peer_frames[2]));
+    CHECK_EQUAL(0, memcmp("one", peer_frames[2].payload, 3));
+    CHECK_EQUAL(1, frame_tx_seq(&peer_frames[3]));
+    CHECK_EQUAL(0, memcmp("two", peer_frames[3].payload, 3));
+    // acknowledged frames are not sent again
+    peer_send_s_frame(SUPERVISORY_REJ, 1);
+    CHECK_EQUAL(5, peer_num_frames);
+    CHECK_EQUAL(1, frame_tx_seq(&peer_frames[4]));
+}
+
+TEST(L2CAP_ERTM, TxWindow){
+    peer_rx_window = 2;
+    peer_open_channel();
+    stack_send("0");
+    stack_send("1");
+    stack_send("2");
+    stack_send("3");
+    CHECK_EQUAL(2, peer_num_frames);
+    CHECK(!l2cap_can_send_packet_now(local_cid));
+    peer_send_s_frame(SUPERVISORY_RR, 2);
+    CHECK_EQUAL(4, peer_num_frames);
+    CHECK_EQUAL(2, frame_tx_seq(&peer_frames[2]));
+    CHECK_EQUAL(3, frame_tx_seq(&peer_frames[3]));
+    peer_send_s_frame(SUPERVISORY_RR, 4);
+    CHECK(l2cap_can_send_packet_now(local_cid));
+}
+
+TEST(L2CAP_ERTM, AckAfterThreshold){
+    peer_tx_window = 4;
+    peer_open_channel();
+    // 3/4 of remote tx window
+    peer_send_i_frame(0, 0, SAR_UNSEGMENTED, -1, (const uint8_t *) "a", 1);
+    peer_send_i_frame(1, 0, SAR_UNSEGMENTED, -1, (const uint8_t *) "b", 1);
+    CHECK_EQUAL(0, peer_num_frames);
+    peer_send_i_frame(2, 0, SAR_UNSEGMENTED, -1, (const uint8_t *) "c", 1);
+    CHECK_EQUAL(1, peer_num_frames);
+    CHECK(!frame_is_i_frame(&peer_frames[0]));
+    CHECK_EQUAL(SUPERVISORY_RR, frame_function(&peer_frames[0]));
+    CHECK_EQUAL(3, frame_req_seq(&peer_frames[0]));
+}
+
+TEST(L2CAP_ERTM, AckPiggybackedOnIFrame){
+    peer_open_channel();
+    peer_send_i_frame(0, 0, SAR_UNSEGMENTED, -1, (const uint8_t *) "a", 1);
+    CHECK_EQUAL(0, peer_num_frames);
+    stack_send("b");
+    CHECK_EQUAL(1, peer_num_frames);
+    CHECK(frame_is_i_frame(&peer_frames[0]));
+    CHECK_EQUAL(1, frame_req_seq(&peer_frames[0]));
+}
+
+int main (int argc, const char * argv[]){
+    run_loop_init(RUN_LOOP_POSIX);
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
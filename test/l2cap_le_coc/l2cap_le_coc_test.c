@@ -0,0 +1,483 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include <btstack/btstack.h>
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+#include "btstack_memory.h"
+#include "hci.h"
+#include "hci_transport.h"
+#include "l2cap.h"
+#include "l2cap_signaling.h"
+#include "remote_device_db.h"
+
+// emulated controller with a scripted LE peer that opens channels to TEST_PSM over an LE connection.
+// K-frames sent by the stack are recorded in peer_frames[], signaling from the stack in peer_* variables.
+
+#define TEST_HANDLE   0x0040
+#define TEST_PSM      0x0080
+#define SECURE_PSM    0x0081
+#define PEER_CID      0x0041
+#define PEER_MTU      100
+#define PEER_MPS      23
+#define QUEUE_SIZE    64
+#define MAX_FRAMES    32
+
+typedef struct {
+    uint8_t  to_peer;
+    uint8_t  type;
+    uint16_t size;
+    uint8_t  data[HCI_ACL_BUFFER_SIZE];
+} queued_packet_t;
+
+typedef struct {
+    uint16_t len;
+    uint8_t  payload[64];
+} peer_frame_t;
+
+static queued_packet_t queue[QUEUE_SIZE];
+static int queue_read_pos;
+static int queue_write_pos;
+
+static hci_transport_t controller_transport;
+static void (*host_packet_handler)(uint8_t packet_type, uint8_t *packet, uint16_t size);
+static bd_addr_t peer_addr = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x03 };
+static int controller_busy;         // no outgoing ACL packets accepted
+static int controller_le_commands;  // pairing/encryption would show up as LE commands
+
+// peer state
+static uint8_t  peer_sig_id;
+static uint16_t peer_stack_cid;
+static uint16_t peer_result;
+static uint16_t peer_stack_mtu;
+static uint16_t peer_stack_mps;
+static uint16_t peer_credits_received;
+static int      peer_responses;
+static int      peer_disconnect_requests;
+static peer_frame_t peer_frames[MAX_FRAMES];
+static int      peer_num_frames;
+
+// stack state
+static int      stack_working;
+static int      incoming_connections;
+static uint16_t local_cid;
+static uint8_t  receive_buffer[64];
+static uint8_t  sdu[256];
+static uint16_t sdu_len;
+static int      sdus_received;
+
+static void queue_packet(int to_peer, uint8_t type, const uint8_t * data, uint16_t size){
+    queued_packet_t * packet = &queue[queue_write_pos];
+    queue_write_pos = (queue_write_pos + 1) % QUEUE_SIZE;
+    packet->to_peer = to_peer;
+    packet->type = type;
+    packet->size = size;
+    memcpy(packet->data, data, size);
+}
+
+// emulated controller
+
+static void controller_emit_event(uint8_t * event, uint16_t size){
+    queue_packet(0, HCI_EVENT_PACKET, event, size);
+}
+
+static void controller_emit_command_complete(uint16_t opcode, uint8_t * params, int params_len){
+    uint8_t event[5 + 16];
+    event[0] = HCI_EVENT_COMMAND_COMPLETE;
+    event[1] = 3 + params_len;
+    event[2] = 1;
+    bt_store_16(event, 3, opcode);
+    memcpy(&event[5], params, params_len);
+    controller_emit_event(event, 5 + params_len);
+}
+
+static void controller_handle_command(uint8_t * packet){
+    uint16_t opcode = READ_BT_16(packet, 0);
+    uint8_t params[16];
+    memset(params, 0, sizeof(params));
+
+    if ((opcode >> 10) == OGF_LE_CONTROLLER){
+        controller_le_commands++;
+    }
+    if (IS_COMMAND(packet, hci_read_buffer_size)){
+        bt_store_16(params, 1, HCI_ACL_PAYLOAD_SIZE);
+        bt_store_16(params, 4, 8);
+        controller_emit_command_complete(opcode, params, 8);
+        return;
+    }
+    if (IS_COMMAND(packet, hci_read_local_supported_features)){
+        controller_emit_command_complete(opcode, params, 9);
+        return;
+    }
+    controller_emit_command_complete(opcode, params, 1);
+}
+
+static int controller_send_packet(uint8_t packet_type, uint8_t * packet, int size){
+    uint8_t event[7];
+    event[0] = DAEMON_EVENT_HCI_PACKET_SENT;
+    event[1] = 0;
+    controller_emit_event(event, 2);
+    switch (packet_type){
+        case HCI_COMMAND_DATA_PACKET:
+            controller_handle_command(packet);
+            break;
+        case HCI_ACL_DATA_PACKET:
+            queue_packet(1, packet_type, packet, size);
+            event[0] = HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS;
+            event[1] = 5;
+            event[2] = 1;
+            bt_store_16(event, 3, READ_ACL_CONNECTION_HANDLE(packet));
+            bt_store_16(event, 5, 1);
+            controller_emit_event(event, 7);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static int controller_can_send_packet_now(uint8_t packet_type){
+    if (packet_type == HCI_ACL_DATA_PACKET && controller_busy) return 0;
+    return 1;
+}
+
+static int controller_open(void * config){
+    return 0;
+}
+
+static int controller_close(void * config){
+    return 0;
+}
+
+static void controller_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t *packet, uint16_t size)){
+    host_packet_handler = handler;
+}
+
+static const char * controller_get_transport_name(void){
+    return "test";
+}
+
+// scripted peer
+
+static void peer_send_acl(uint16_t cid, const uint8_t * data, uint16_t len){
+    uint8_t packet[HCI_ACL_BUFFER_SIZE];
+    bt_store_16(packet, 0, TEST_HANDLE | (0x02 << 12));
+    bt_store_16(packet, 2, len + 4);
+    bt_store_16(packet, 4, len);
+    bt_store_16(packet, 6, cid);
+    memcpy(&packet[8], data, len);
+    queue_packet(0, HCI_ACL_DATA_PACKET, packet, len + 8);
+}
+
+static void peer_send_signaling(uint8_t code, uint8_t identifier, uint8_t * params, uint16_t len){
+    uint8_t command[4 + 32];
+    command[0] = code;
+    command[1] = identifier;
+    bt_store_16(command, 2, len);
+    memcpy(&command[4], params, len);
+    peer_send_acl(L2CAP_CID_SIGNALING_LE, command, 4 + len);
+}
+
+static void peer_handle_signaling(uint8_t * command){
+    uint8_t params[4];
+    switch (command[0]){
+        case LE_CREDIT_BASED_CONNECTION_RESPONSE:
+            peer_responses++;
+            peer_stack_cid = READ_BT_16(command, 4);
+            peer_stack_mtu = READ_BT_16(command, 6);
+            peer_stack_mps = READ_BT_16(command, 8);
+            peer_result    = READ_BT_16(command, 12);
+            break;
+        case LE_FLOW_CONTROL_CREDIT:
+            peer_credits_received += READ_BT_16(command, 6);
+            break;
+        case DISCONNECTION_REQUEST:
+            peer_disconnect_requests++;
+            bt_store_16(params, 0, READ_BT_16(command, 4));
+            bt_store_16(params, 2, READ_BT_16(command, 6));
+            peer_send_signaling(DISCONNECTION_RESPONSE, command[1], params, sizeof(params));
+            break;
+        default:
+            break;
+    }
+}
+
+static void peer_handle_acl(uint8_t * packet, uint16_t size){
+    uint16_t cid = READ_L2CAP_CHANNEL_ID(packet);
+    uint16_t len = READ_L2CAP_LENGTH(packet);
+    if (cid == L2CAP_CID_SIGNALING_LE){
+        peer_handle_signaling(&packet[8]);
+        return;
+    }
+    if (cid != PEER_CID || peer_num_frames >= MAX_FRAMES) return;
+    peer_frame_t * frame = &peer_frames[peer_num_frames++];
+    frame->len = len;
+    memcpy(frame->payload, &packet[8], len);
+}
+
+static void controller_run(void){
+    while (queue_read_pos != queue_write_pos){
+        queued_packet_t * packet = &queue[queue_read_pos];
+        queue_read_pos = (queue_read_pos + 1) % QUEUE_SIZE;
+        if (packet->to_peer){
+            peer_handle_acl(packet->data, packet->size);
+        } else {
+            (*host_packet_handler)(packet->type, packet->data, packet->size);
+        }
+    }
+}
+
+// controller ready again, let the stack retry
+static void controller_resume(void){
+    uint8_t event[7];
+    controller_busy = 0;
+    event[0] = HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS;
+    event[1] = 5;
+    event[2] = 1;
+    bt_store_16(event, 3, TEST_HANDLE);
+    bt_store_16(event, 5, 0);
+    controller_emit_event(event, sizeof(event));
+    controller_run();
+}
+
+static void peer_connect(void){
+    uint8_t event[21];
+    memset(event, 0, sizeof(event));
+    event[0] = HCI_EVENT_LE_META;
+    event[1] = sizeof(event) - 2;
+    event[2] = HCI_SUBEVENT_LE_CONNECTION_COMPLETE;
+    event[3] = 0;
+    bt_store_16(event, 4, TEST_HANDLE);
+    event[6] = 1;   // slave
+    event[7] = 0;   // public address
+    bt_flip_addr(&event[8], peer_addr);
+    queue_packet(0, HCI_EVENT_PACKET, event, sizeof(event));
+    controller_run();
+}
+
+static void peer_request_channel(uint16_t psm){
+    uint8_t params[10];
+    bt_store_16(params, 0, psm);
+    bt_store_16(params, 2, PEER_CID);
+    bt_store_16(params, 4, PEER_MTU);
+    bt_store_16(params, 6, PEER_MPS);
+    bt_store_16(params, 8, 2);
+    peer_send_signaling(LE_CREDIT_BASED_CONNECTION_REQUEST, ++peer_sig_id, params, sizeof(params));
+    controller_run();
+}
+
+static void peer_send_k_frame(int sdu_length, const uint8_t * data, uint16_t len){
+    uint8_t frame[2 + 64];
+    uint16_t pos = 0;
+    if (sdu_length >= 0){
+        bt_store_16(frame, 0, sdu_length);
+        pos += 2;
+    }
+    memcpy(&frame[pos], data, len);
+    peer_send_acl(peer_stack_cid, frame, pos + len);
+    controller_run();
+}
+
+static void peer_send_credits(uint16_t credits){
+    uint8_t params[4];
+    bt_store_16(params, 0, PEER_CID);
+    bt_store_16(params, 2, credits);
+    peer_send_signaling(LE_FLOW_CONTROL_CREDIT, ++peer_sig_id, params, sizeof(params));
+    controller_run();
+}
+
+// stack side
+
+static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    switch (packet_type){
+        case L2CAP_DATA_PACKET:
+            memcpy(sdu, packet, size);
+            sdu_len = size;
+            sdus_received++;
+            break;
+        case HCI_EVENT_PACKET:
+            switch (packet[0]){
+                case BTSTACK_EVENT_STATE:
+                    stack_working = packet[2] == HCI_STATE_WORKING;
+                    break;
+                case L2CAP_EVENT_INCOMING_CONNECTION:
+                    incoming_connections++;
+                    l2cap_le_accept_connection_internal(READ_BT_16(packet, 12), receive_buffer, sizeof(receive_buffer));
+                    break;
+                case L2CAP_EVENT_CHANNEL_OPENED:
+                    if (packet[2] == 0){
+                        local_cid = READ_BT_16(packet, 13);
+                    }
+                    break;
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void l2cap_packet_handler(void * connection, uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size){
+    packet_handler(packet_type, channel, packet, size);
+}
+
+static void peer_open_channel(void){
+    peer_connect();
+    peer_request_channel(TEST_PSM);
+    CHECK_EQUAL(1, incoming_connections);
+    CHECK_EQUAL(1, peer_responses);
+    CHECK_EQUAL(L2CAP_LE_RESULT_SUCCESS, peer_result);
+    CHECK(local_cid != 0);
+}
+
+TEST_GROUP(L2CAP_LE_COC){
+    void setup(){
+        queue_read_pos = 0;
+        queue_write_pos = 0;
+        controller_busy = 0;
+        peer_sig_id = 0;
+        peer_stack_cid = 0;
+        peer_result = 0xffff;
+        peer_stack_mtu = 0;
+        peer_stack_mps = 0;
+        peer_credits_received = 0;
+        peer_responses = 0;
+        peer_disconnect_requests = 0;
+        peer_num_frames = 0;
+        stack_working = 0;
+        incoming_connections = 0;
+        local_cid = 0;
+        sdu_len = 0;
+        sdus_received = 0;
+
+        controller_transport.open                    = controller_open;
+        controller_transport.close                   = controller_close;
+        controller_transport.send_packet             = controller_send_packet;
+        controller_transport.register_packet_handler = controller_register_packet_handler;
+        controller_transport.get_transport_name      = controller_get_transport_name;
+        controller_transport.set_baudrate            = NULL;
+        controller_transport.can_send_packet_now     = controller_can_send_packet_now;
+
+        btstack_memory_init();
+        hci_init(&controller_transport, NULL, NULL, &remote_device_db_memory);
+        l2cap_init();
+        l2cap_register_packet_handler(l2cap_packet_handler);
+        l2cap_le_register_service_internal(NULL, packet_handler, TEST_PSM, LEVEL_0);
+        l2cap_le_register_service_internal(NULL, packet_handler, SECURE_PSM, LEVEL_2);
+        hci_power_control(HCI_POWER_ON);
+        controller_run();
+        CHECK(stack_working);
+        controller_le_commands = 0;
+    }
+    void teardown(){
+        l2cap_le_unregister_service_internal(NULL, TEST_PSM);
+        l2cap_le_unregister_service_internal(NULL, SECURE_PSM);
+        hci_close();
+        queue_read_pos = queue_write_pos;
+    }
+};
+
+TEST(L2CAP_LE_COC, AcceptAnnouncesReceiveBuffer){
+    peer_open_channel();
+    CHECK_EQUAL(sizeof(receive_buffer), peer_stack_mtu);
+    CHECK_EQUAL(sizeof(receive_buffer) + 2, peer_stack_mps);
+}
+
+TEST(L2CAP_LE_COC, UnknownPsmIsRejected){
+    peer_connect();
+    peer_request_channel(0x00f0);
+    CHECK_EQUAL(0, incoming_connections);
+    CHECK_EQUAL(1, peer_responses);
+    CHECK_EQUAL(L2CAP_LE_RESULT_LE_PSM_NOT_SUPPORTED, peer_result);
+}
+
+TEST(L2CAP_LE_COC, InsufficientSecurityIsRejectedWithoutPairing){
+    peer_connect();
+    peer_request_channel(SECURE_PSM);
+    CHECK_EQUAL(0, incoming_connections);
+    CHECK_EQUAL(1, peer_responses);
+    CHECK_EQUAL(L2CAP_LE_RESULT_INSUFFICIENT_AUTHENTICATION, peer_result);
+    CHECK_EQUAL(0, controller_le_commands);
+}
+
+TEST(L2CAP_LE_COC, SduIsSegmentedByRemoteMps){
+    uint8_t data[50];
+    int i;
+    for (i = 0; i < (int) sizeof(data); i++){
+        data[i] = i;
+    }
+    peer_open_channel();
+    CHECK_EQUAL(0, l2cap_le_send_data(local_cid, data, sizeof(data)));
+    controller_run();
+
+    // two credits, first K-frame starts with SDU length
+    CHECK_EQUAL(2, peer_num_frames);
+    CHECK_EQUAL(PEER_MPS, peer_frames[0].len);
+    CHECK_EQUAL(sizeof(data), READ_BT_16(peer_frames[0].payload, 0));
+    CHECK_EQUAL(0, memcmp(data, &peer_frames[0].payload[2], PEER_MPS - 2));
+    CHECK_EQUAL(PEER_MPS, peer_frames[1].len);
+    CHECK_EQUAL(0, memcmp(&data[PEER_MPS - 2], peer_frames[1].payload, PEER_MPS));
+
+    // next SDU is refused until the current one is sent
+    CHECK(l2cap_le_send_data(local_cid, data, 1) != 0);
+
+    peer_send_credits(1);
+    CHECK_EQUAL(3, peer_num_frames);
+    CHECK_EQUAL(sizeof(data) - (2 * PEER_MPS - 2), peer_frames[2].len);
+    CHECK_EQUAL(0, memcmp(&data[2 * PEER_MPS - 2], peer_frames[2].payload, peer_frames[2].len));
+}
+
+TEST(L2CAP_LE_COC, SduExceedingRemoteMtuIsRefused){
+    uint8_t data[PEER_MTU + 1];
+    memset(data, 0, sizeof(data));
+    peer_open_channel();
+    CHECK_EQUAL(L2CAP_DATA_LEN_EXCEEDS_REMOTE_MTU, l2cap_le_send_data(local_cid, data, sizeof(data)));
+    CHECK_EQUAL(0, peer_num_frames);
+}
+
+TEST(L2CAP_LE_COC, SduReassemblyAndCreditReturn){
+    peer_open_channel();
+    // 64 byte receive buffer with minimal K-frames: three initial credits, returned once half are used
+    peer_send_k_frame(30, (const uint8_t *) "0123456789012345678", 19);
+    CHECK_EQUAL(0, sdus_received);
+    CHECK_EQUAL(0, peer_credits_received);
+    peer_send_k_frame(-1, (const uint8_t *) "abcdefghijk", 11);
+    CHECK_EQUAL(1, sdus_received);
+    CHECK_EQUAL(30, sdu_len);
+    CHECK_EQUAL(0, memcmp("0123456789012345678abcdefghijk", sdu, 30));
+    CHECK_EQUAL(2, peer_credits_received);
+}
+
+TEST(L2CAP_LE_COC, KFrameWithoutCreditsDisconnects){
+    peer_open_channel();
+    // credits cannot be returned while the controller is busy, fourth K-frame exceeds the three initial credits
+    controller_busy = 1;
+    peer_send_k_frame(60, (const uint8_t *) "012345678901234567890", 21);
+    peer_send_k_frame(-1, (const uint8_t *) "01234567890123456789012", 23);
+    peer_send_k_frame(-1, (const uint8_t *) "0123456789012345", 16);
+    CHECK_EQUAL(1, sdus_received);
+    peer_send_k_frame(1, (const uint8_t *) "x", 1);
+    CHECK_EQUAL(1, sdus_received);
+    CHECK_EQUAL(0, peer_disconnect_requests);
+    controller_resume();
+    CHECK_EQUAL(0, peer_credits_received);
+    CHECK_EQUAL(1, peer_disconnect_requests);
+}
+
+TEST(L2CAP_LE_COC, SduLargerThanLocalMtuDisconnects){
+    peer_open_channel();
+    peer_send_k_frame(sizeof(receive_buffer) + 1, (const uint8_t *) "x", 1);
+    CHECK_EQUAL(0, sdus_received);
+    CHECK_EQUAL(1, peer_disconnect_requests);
+}
+
+int main (int argc, const char * argv[]){
+    run_loop_init(RUN_LOOP_POSIX);
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
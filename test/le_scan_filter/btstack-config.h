@@ -0,0 +1,12 @@
+// config.h created by hand for the BTstack LE scan filter tests
+
+#ifndef __BTSTACK_CONFIG
+#define __BTSTACK_CONFIG
+
+#define HAVE_BLE
+#define HAVE_TIME
+#define HAVE_BZERO
+#define HCI_ACL_PAYLOAD_SIZE 52
+#define LE_SCAN_FILTER_MAX_DEVICES 4
+
+#endif
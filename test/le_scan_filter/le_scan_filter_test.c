@@ -0,0 +1,163 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include <btstack/hci_cmds.h>
+#include <btstack/utils.h>
+#include "le_scan_filter.h"
+
+// advertising report event types
+#define ADV_IND  0
+#define SCAN_RSP 4
+
+// HCI stub
+static int (*hci_filter)(uint8_t * event, uint16_t size);
+
+extern "C" void le_central_set_advertising_report_filter(int (*filter)(uint8_t * event, uint16_t size)){
+    hci_filter = filter;
+}
+
+static uint8_t heart_rate_service[] = { 0x03, 0x03, 0x0d, 0x18 };   // 16-bit UUIDs: 0x180D
+static uint8_t battery_service[]    = { 0x03, 0x03, 0x0f, 0x18 };   // 16-bit UUIDs: 0x180F
+static uint8_t local_name[]         = { 0x04, 0x09, 'f', 'o', 'o' };
+
+static le_scan_filter_t filter;
+static uint8_t event[12 + 31];
+
+static uint16_t report(int event_type, int device, int8_t rssi, uint8_t * ad_data, int ad_len){
+    bd_addr_t addr = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x00 };
+    addr[5] = device;
+    event[0] = GAP_LE_ADVERTISING_REPORT;
+    event[1] = 10 + ad_len;
+    event[2] = event_type;
+    event[3] = 0;
+    bt_flip_addr(&event[4], addr);
+    event[10] = rssi;
+    event[11] = ad_len;
+    memcpy(&event[12], ad_data, ad_len);
+    return 12 + ad_len;
+}
+
+static int accept(int event_type, int device, int8_t rssi, uint8_t * ad_data, int ad_len){
+    uint16_t size = report(event_type, device, rssi, ad_data, ad_len);
+    return le_scan_filter_accept(&filter, event, size);
+}
+
+static int accept_adv(int device, uint8_t * ad_data, int ad_len){
+    return accept(ADV_IND, device, -60, ad_data, ad_len);
+}
+
+TEST_GROUP(LEScanFilter){
+    void setup(){
+        hci_filter = NULL;
+        le_scan_filter_init(&filter);
+    }
+};
+
+TEST(LEScanFilter, WithoutRulesAllPass){
+    int i;
+    for (i = 0; i < 3; i++){
+        CHECK(accept_adv(1, heart_rate_service, sizeof(heart_rate_service)));
+    }
+}
+
+TEST(LEScanFilter, Uuid16Rule){
+    CHECK_EQUAL(0, le_scan_filter_add_uuid16(&filter, 0x180d));
+    CHECK(accept_adv(1, heart_rate_service, sizeof(heart_rate_service)));
+    CHECK(!accept_adv(2, battery_service, sizeof(battery_service)));
+    CHECK(!accept_adv(3, local_name, sizeof(local_name)));
+
+    le_scan_filter_clear_rules(&filter);
+    CHECK(accept_adv(2, battery_service, sizeof(battery_service)));
+}
+
+TEST(LEScanFilter, AdTypeRule){
+    CHECK_EQUAL(0, le_scan_filter_add_ad_type(&filter, 0x09));
+    CHECK(accept_adv(1, local_name, sizeof(local_name)));
+    CHECK(!accept_adv(2, battery_service, sizeof(battery_service)));
+}
+
+TEST(LEScanFilter, ScanResponsePassesForMatchedDevice){
+    le_scan_filter_add_uuid16(&filter, 0x180d);
+    CHECK(accept_adv(1, heart_rate_service, sizeof(heart_rate_service)));
+    CHECK(accept(SCAN_RSP, 1, -60, local_name, sizeof(local_name)));
+
+    // advertisement of device 2 did not match
+    CHECK(!accept_adv(2, battery_service, sizeof(battery_service)));
+    CHECK(!accept(SCAN_RSP, 2, -60, local_name, sizeof(local_name)));
+}
+
+TEST(LEScanFilter, RateLimitDropsUnchangedReports){
+    le_scan_filter_set_rate_limit(&filter, 60000, 10);
+    CHECK(accept(ADV_IND, 1, -60, heart_rate_service, sizeof(heart_rate_service)));
+    CHECK(!accept(ADV_IND, 1, -60, heart_rate_service, sizeof(heart_rate_service)));
+    CHECK(!accept(ADV_IND, 1, -65, heart_rate_service, sizeof(heart_rate_service)));
+
+    // RSSI moved by delta
+    CHECK(accept(ADV_IND, 1, -70, heart_rate_service, sizeof(heart_rate_service)));
+    CHECK(!accept(ADV_IND, 1, -70, heart_rate_service, sizeof(heart_rate_service)));
+
+    // data changed
+    CHECK(accept(ADV_IND, 1, -70, battery_service, sizeof(battery_service)));
+
+    // scan responses are limited separately
+    CHECK(accept(SCAN_RSP, 1, -70, local_name, sizeof(local_name)));
+    CHECK(!accept(SCAN_RSP, 1, -70, local_name, sizeof(local_name)));
+
+    // other devices are not affected
+    CHECK(accept(ADV_IND, 2, -70, battery_service, sizeof(battery_service)));
+}
+
+TEST(LEScanFilter, RateLimitIntervalElapses){
+    le_scan_filter_set_rate_limit(&filter, 5, 0);
+    CHECK(accept_adv(1, heart_rate_service, sizeof(heart_rate_service)));
+    CHECK(!accept_adv(1, heart_rate_service, sizeof(heart_rate_service)));
+    usleep(10000);
+    CHECK(accept_adv(1, heart_rate_service, sizeof(heart_rate_service)));
+}
+
+TEST(LEScanFilter, LeastRecentlySeenDeviceIsReplaced){
+    le_scan_filter_set_rate_limit(&filter, 60000, 0);
+    int i;
+    for (i = 1; i <= LE_SCAN_FILTER_MAX_DEVICES; i++){
+        CHECK(accept_adv(i, heart_rate_service, sizeof(heart_rate_service)));
+    }
+    // device 1 seen again, device 2 is the least recently seen now
+    CHECK(!accept_adv(1, heart_rate_service, sizeof(heart_rate_service)));
+    CHECK(accept_adv(LE_SCAN_FILTER_MAX_DEVICES + 1, heart_rate_service, sizeof(heart_rate_service)));
+
+    // device 1 is still tracked, device 2 was forgotten
+    CHECK(!accept_adv(1, heart_rate_service, sizeof(heart_rate_service)));
+    CHECK(accept_adv(2, heart_rate_service, sizeof(heart_rate_service)));
+}
+
+TEST(LEScanFilter, FiltersAreIndependent){
+    le_scan_filter_t other;
+    le_scan_filter_init(&other);
+    le_scan_filter_add_uuid16(&filter, 0x180d);
+
+    uint16_t size = report(ADV_IND, 1, -60, battery_service, sizeof(battery_service));
+    CHECK(!le_scan_filter_accept(&filter, event, size));
+    CHECK(le_scan_filter_accept(&other, event, size));
+}
+
+TEST(LEScanFilter, RegisterInstallsFilterInHCI){
+    le_scan_filter_add_uuid16(&filter, 0x180d);
+    le_scan_filter_register(&filter);
+    CHECK(hci_filter != NULL);
+    uint16_t size = report(ADV_IND, 1, -60, battery_service, sizeof(battery_service));
+    CHECK(!hci_filter(event, size));
+    size = report(ADV_IND, 1, -60, heart_rate_service, sizeof(heart_rate_service));
+    CHECK(hci_filter(event, size));
+
+    le_scan_filter_register(NULL);
+    CHECK(hci_filter == NULL);
+}
+
+int main (int argc, const char * argv[]){
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,81 @@
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+#include <btstack/memory_pool.h>
+
+#define NUM_BLOCKS 3
+
+typedef struct {
+    void *  next;
+    uint8_t data[12];
+} test_block_t;
+
+static test_block_t  storage[NUM_BLOCKS];
+static memory_pool_t pool;
+
+TEST_GROUP(MemoryPool){
+    void setup(){
+        memory_pool_create(&pool, storage, NUM_BLOCKS, sizeof(test_block_t));
+    }
+};
+
+TEST(MemoryPool, CreateResetsCounters){
+    CHECK_EQUAL(0, pool.blocks_in_use);
+    CHECK_EQUAL(0, pool.max_blocks_in_use);
+    CHECK_EQUAL(0, pool.failed_allocations);
+}
+
+TEST(MemoryPool, GetFreeCountsBlocksInUse){
+    void * a = memory_pool_get(&pool);
+    void * b = memory_pool_get(&pool);
+    CHECK(a != NULL);
+    CHECK(b != NULL);
+    CHECK(a != b);
+    CHECK_EQUAL(2, pool.blocks_in_use);
+    memory_pool_free(&pool, a);
+    CHECK_EQUAL(1, pool.blocks_in_use);
+    memory_pool_free(&pool, b);
+    CHECK_EQUAL(0, pool.blocks_in_use);
+    CHECK_EQUAL(0, pool.failed_allocations);
+}
+
+TEST(MemoryPool, HighWaterMark){
+    void * a = memory_pool_get(&pool);
+    void * b = memory_pool_get(&pool);
+    CHECK_EQUAL(2, pool.max_blocks_in_use);
+    // freeing does not lower the high-water mark
+    memory_pool_free(&pool, b);
+    CHECK_EQUAL(2, pool.max_blocks_in_use);
+    // getting a block again below the mark keeps it
+    b = memory_pool_get(&pool);
+    CHECK_EQUAL(2, pool.max_blocks_in_use);
+    void * c = memory_pool_get(&pool);
+    CHECK_EQUAL(3, pool.max_blocks_in_use);
+    memory_pool_free(&pool, a);
+    memory_pool_free(&pool, b);
+    memory_pool_free(&pool, c);
+    CHECK_EQUAL(0, pool.blocks_in_use);
+    CHECK_EQUAL(3, pool.max_blocks_in_use);
+}
+
+TEST(MemoryPool, ExhaustedCountsFailedAllocations){
+    void * blocks[NUM_BLOCKS];
+    int i;
+    for (i = 0; i < NUM_BLOCKS; i++){
+        blocks[i] = memory_pool_get(&pool);
+        CHECK(blocks[i] != NULL);
+    }
+    CHECK(memory_pool_get(&pool) == NULL);
+    CHECK(memory_pool_get(&pool) == NULL);
+    CHECK_EQUAL(NUM_BLOCKS, pool.blocks_in_use);
+    CHECK_EQUAL(NUM_BLOCKS, pool.max_blocks_in_use);
+    CHECK_EQUAL(2, pool.failed_allocations);
+
+    // freed block can be reused
+    memory_pool_free(&pool, blocks[1]);
+    CHECK(memory_pool_get(&pool) == blocks[1]);
+    CHECK_EQUAL(2, pool.failed_allocations);
+}
+
+int main (int argc, const char * argv[]){
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,11 @@
+// config.h created by hand for the BTstack run loop tests
+
+#ifndef __BTSTACK_CONFIG
+#define __BTSTACK_CONFIG
+
+#define HAVE_TIME
+#define HAVE_BZERO
+#define USE_POSIX_RUN_LOOP
+#define HCI_ACL_PAYLOAD_SIZE 52
+
+#endif
@@ -0,0 +1,137 @@
+
+// *****************************************************************************
+//
+// test run loop data sources with a parked socket connection
+//
+// run_loop_execute does not return, each step is a timer that checks the
+// result of the previous one and the test exits with the number of failures
+//
+// usage: run_loop_test [posix|dispatch]
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <btstack/run_loop.h>
+#include <btstack/utils.h>
+
+#include "socket_connection.h"
+
+#define STEP_DELAY_MS 20
+
+// not in socket_connection.h, used by the daemon for accepted connections
+connection_t * socket_connection_register_new_connection(int fd);
+void socket_connection_free_connection(connection_t *conn);
+
+static int failures;
+static int step;
+static timer_source_t step_timer;
+
+static int sockets[2];
+static connection_t * connection;
+static int packets_received;
+static int busy;
+
+#define CHECK_EQUAL(expected, actual) check_equal(__LINE__, #actual, expected, actual)
+
+static void check_equal(int line, const char * what, int expected, int actual){
+    if (expected == actual) return;
+    printf("run_loop_test.c:%u: step %u: expected %s == %d, got %d\n", line, step, what, expected, actual);
+    failures++;
+}
+
+static int packet_handler(connection_t *conn, uint16_t packet_type, uint16_t channel, uint8_t *data, uint16_t length){
+    // connection count events
+    if (!conn) return 0;
+    packets_received++;
+    return busy;
+}
+
+static void send_packet(void){
+    uint8_t packet[7];
+    bt_store_16(packet, 0, 0x0001);
+    bt_store_16(packet, 2, 0);
+    bt_store_16(packet, 4, 1);
+    packet[6] = 0x42;
+    CHECK_EQUAL(sizeof(packet), (int) write(sockets[1], packet, sizeof(packet)));
+}
+
+static void step_handler(timer_source_t *ts){
+    switch (step){
+        case 0:
+            // dispatch of first packet fails -> connection parked
+            busy = 1;
+            send_packet();
+            break;
+        case 1:
+            CHECK_EQUAL(1, packets_received);
+            CHECK_EQUAL(1, socket_connection_has_parked_connections());
+            // parked connection does not read
+            send_packet();
+            break;
+        case 2:
+            CHECK_EQUAL(1, packets_received);
+            // retry succeeds -> connection resumed, second packet gets read
+            busy = 0;
+            socket_connection_retry_parked();
+            CHECK_EQUAL(2, packets_received);
+            CHECK_EQUAL(0, socket_connection_has_parked_connections());
+            break;
+        case 3:
+            CHECK_EQUAL(3, packets_received);
+            busy = 1;
+            send_packet();
+            break;
+        case 4:
+            CHECK_EQUAL(4, packets_received);
+            CHECK_EQUAL(1, socket_connection_has_parked_connections());
+            // remove suspended data source
+            socket_connection_free_connection(connection);
+            CHECK_EQUAL(0, socket_connection_has_parked_connections());
+            close(sockets[0]);
+            break;
+        case 5: {
+            // peer sees EOF only if the run loop released the fd, too
+            uint8_t buffer[1];
+            fcntl(sockets[1], F_SETFL, O_NONBLOCK);
+            CHECK_EQUAL(0, (int) read(sockets[1], buffer, sizeof(buffer)));
+            printf("run_loop_test: %u failures\n", failures);
+            exit(failures);
+        }
+        default:
+            break;
+    }
+    step++;
+    run_loop_set_timer(&step_timer, STEP_DELAY_MS);
+    run_loop_add_timer(&step_timer);
+}
+
+int main (int argc, const char * argv[]){
+    RUN_LOOP_TYPE type = RUN_LOOP_POSIX;
+    if (argc > 1 && strcmp(argv[1], "dispatch") == 0){
+        type = RUN_LOOP_DISPATCH;
+    }
+    run_loop_init(type);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets)){
+        printf("run_loop_test: socketpair failed, errno %u\n", errno);
+        return 1;
+    }
+    socket_connection_register_packet_callback(&packet_handler);
+    connection = socket_connection_register_new_connection(sockets[0]);
+
+    run_loop_set_timer_handler(&step_timer, &step_handler);
+    run_loop_set_timer(&step_timer, STEP_DELAY_MS);
+    run_loop_add_timer(&step_timer);
+    run_loop_execute();
+    return 1;
+}
@@ -0,0 +1,10 @@
+// config.h created by hand for the BTstack SDP server tests
+
+#ifndef __BTSTACK_CONFIG
+#define __BTSTACK_CONFIG
+
+#define HAVE_MALLOC
+#define HAVE_BZERO
+#define HCI_ACL_PAYLOAD_SIZE 1021
+
+#endif
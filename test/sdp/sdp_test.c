@@ -0,0 +1,527 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#include <btstack/hci_cmds.h>
+#include <btstack/sdp_util.h>
+#include "btstack_memory.h"
+#include "l2cap.h"
+#include "sdp.h"
+
+// SDP server on mocked L2CAP channels. Requests are passed to the packet handler registered by sdp_init(),
+// the last response sent on each channel is stored in its test_channel_t.
+
+// not in sdp.h
+service_record_item_t * sdp_get_record_for_handle(uint32_t handle);
+
+#define CID_A 0x0041
+#define CID_B 0x0042
+#define MAX_RECORDS 8
+
+typedef struct {
+    uint16_t mtu;
+    int      responses;
+    uint16_t response_len;
+    uint8_t  response[SDP_RESPONSE_BUFFER_SIZE];
+} test_channel_t;
+
+static test_channel_t channels[2];
+static btstack_packet_handler_t sdp_server_packet_handler;
+static int can_send_now;
+
+static uint32_t registered_handles[MAX_RECORDS];
+static int      num_registered;
+
+static uint8_t  request[256];
+static uint16_t request_len;
+static uint16_t transaction_id;
+
+static test_channel_t * channel_for_cid(uint16_t cid){
+    return cid == CID_A ? &channels[0] : &channels[1];
+}
+
+// L2CAP mock
+
+void l2cap_register_service_internal(void *connection, btstack_packet_handler_t packet_handler, uint16_t psm, uint16_t mtu, gap_security_level_t security_level){
+    sdp_server_packet_handler = packet_handler;
+}
+
+void l2cap_accept_connection_internal(uint16_t local_cid){
+}
+
+void l2cap_decline_connection_internal(uint16_t local_cid, uint8_t reason){
+}
+
+uint16_t l2cap_get_remote_mtu_for_local_cid(uint16_t local_cid){
+    return channel_for_cid(local_cid)->mtu;
+}
+
+int l2cap_can_send_packet_now(uint16_t local_cid){
+    return can_send_now;
+}
+
+int l2cap_send_internal(uint16_t local_cid, uint8_t *data, uint16_t len){
+    test_channel_t * channel = channel_for_cid(local_cid);
+    CHECK(len <= channel->mtu);
+    memcpy(channel->response, data, len);
+    channel->response_len = len;
+    channel->responses++;
+    return 0;
+}
+
+static void channel_event(uint16_t cid, uint8_t event_type){
+    uint8_t event[21];
+    memset(event, 0, sizeof(event));
+    event[0] = event_type;
+    event[1] = sizeof(event) - 2;
+    (*sdp_server_packet_handler)(HCI_EVENT_PACKET, cid, event, sizeof(event));
+}
+
+static void channel_open(uint16_t cid, uint16_t mtu){
+    test_channel_t * channel = channel_for_cid(cid);
+    memset(channel, 0, sizeof(test_channel_t));
+    channel->mtu = mtu;
+    channel_event(cid, L2CAP_EVENT_INCOMING_CONNECTION);
+    channel_event(cid, L2CAP_EVENT_CHANNEL_OPENED);
+}
+
+// records
+
+static uint32_t register_record(uint8_t * record){
+    uint32_t handle = sdp_register_service_internal(NULL, record);
+    CHECK(handle != 0);
+    registered_handles[num_registered++] = handle;
+    return handle;
+}
+
+static uint32_t register_spp_record(int rfcomm_channel, const char * name){
+    uint8_t record[200];
+    sdp_create_spp_service(record, rfcomm_channel, name);
+    return register_record(record);
+}
+
+// record with given service class in the public browse group and a version attribute
+static uint32_t register_class_record(uint16_t service_class, uint16_t version){
+    uint8_t record[64];
+    uint8_t * attribute;
+    de_create_sequence(record);
+    de_add_number(record, DE_UINT, DE_SIZE_16, SDP_ServiceClassIDList);
+    attribute = de_push_sequence(record);
+    de_add_number(attribute, DE_UUID, DE_SIZE_16, service_class);
+    de_pop_sequence(record, attribute);
+    de_add_number(record, DE_UINT, DE_SIZE_16, SDP_BrowseGroupList);
+    attribute = de_push_sequence(record);
+    de_add_number(attribute, DE_UUID, DE_SIZE_16, 0x1002);
+    de_pop_sequence(record, attribute);
+    de_add_number(record, DE_UINT, DE_SIZE_16, 0x0200);
+    de_add_number(record, DE_UINT, DE_SIZE_16, version);
+    return register_record(record);
+}
+
+static void unregister_record(uint32_t handle){
+    int i;
+    sdp_unregister_service_internal(NULL, handle);
+    for (i = 0; i < num_registered; i++){
+        if (registered_handles[i] != handle) continue;
+        registered_handles[i] = registered_handles[--num_registered];
+        break;
+    }
+}
+
+static uint8_t * record_for_handle(uint32_t handle){
+    service_record_item_t * item = sdp_get_record_for_handle(handle);
+    CHECK(item != NULL);
+    return item->service_record;
+}
+
+// data elements
+
+static void create_pattern(uint8_t * pattern, uint16_t uuid_a, uint16_t uuid_b){
+    de_create_sequence(pattern);
+    de_add_number(pattern, DE_UUID, DE_SIZE_16, uuid_a);
+    if (uuid_b){
+        de_add_number(pattern, DE_UUID, DE_SIZE_16, uuid_b);
+    }
+}
+
+static void attribute_list_add_id(uint8_t * list, uint16_t attribute_id){
+    de_add_number(list, DE_UINT, DE_SIZE_16, attribute_id);
+}
+
+static void attribute_list_add_range(uint8_t * list, uint16_t first, uint16_t last){
+    de_add_number(list, DE_UINT, DE_SIZE_32, (first << 16) | last);
+}
+
+// AttributeList as created by record traversal, @returns size
+static uint16_t expected_attribute_list(uint8_t * record, uint8_t * attribute_id_list, uint8_t * buffer){
+    uint16_t size;
+    sdp_filter_attributes_in_attributeIDList(record, attribute_id_list, 0, 0xffff, &size, &buffer[3]);
+    de_store_descriptor_with_len(buffer, DE_DES, DE_SIZE_VAR_16, size);
+    return 3 + size;
+}
+
+// AttributeLists for records in server order, i.e. last registered first, @returns size
+static uint16_t expected_attribute_lists(uint32_t * handles, int num_handles, uint8_t * attribute_id_list, uint8_t * buffer){
+    uint16_t size = 3;
+    int i;
+    for (i = 0; i < num_handles; i++){
+        size += expected_attribute_list(record_for_handle(handles[i]), attribute_id_list, &buffer[size]);
+    }
+    de_store_descriptor_with_len(buffer, DE_DES, DE_SIZE_VAR_16, size - 3);
+    return size;
+}
+
+// requests
+
+static void request_begin(uint8_t pdu_id){
+    request[0] = pdu_id;
+    net_store_16(request, 1, ++transaction_id);
+    request_len = 5;
+}
+
+static void request_add(uint8_t * data, uint16_t len){
+    memcpy(&request[request_len], data, len);
+    request_len += len;
+}
+
+static void request_add_16(uint16_t value){
+    net_store_16(request, request_len, value);
+    request_len += 2;
+}
+
+static void request_send(uint16_t cid){
+    net_store_16(request, 3, request_len - 5);
+    (*sdp_server_packet_handler)(L2CAP_DATA_PACKET, cid, request, request_len);
+}
+
+static void service_search_request(uint16_t cid, uint8_t * pattern){
+    uint8_t no_continuation = 0;
+    request_begin(SDP_ServiceSearchRequest);
+    request_add(pattern, de_get_len(pattern));
+    request_add_16(MAX_RECORDS);
+    request_add(&no_continuation, 1);
+    request_send(cid);
+}
+
+// @returns number of service record handles found
+static int service_search(uint16_t cid, uint8_t * pattern, uint32_t * handles){
+    service_search_request(cid, pattern);
+    uint8_t * response = channel_for_cid(cid)->response;
+    CHECK_EQUAL(SDP_ServiceSearchResponse, response[0]);
+    CHECK_EQUAL(transaction_id, READ_NET_16(response, 1));
+    int count = READ_NET_16(response, 7);
+    CHECK_EQUAL(count, READ_NET_16(response, 5));
+    int i;
+    for (i = 0; i < count; i++){
+        handles[i] = READ_NET_32(response, 9 + 4 * i);
+    }
+    CHECK_EQUAL(0, response[9 + 4 * count]);
+    return count;
+}
+
+// sends ServiceAttributeRequest if pattern is NULL, ServiceSearchAttributeRequest otherwise, and appends
+// the AttributeList(s) bytes of the response to data. continuation is updated from the response
+// @returns 1 if more continuation requests are needed
+static int attribute_request_part(uint16_t cid, uint32_t handle, uint8_t * pattern, uint8_t * attribute_id_list,
+                                  uint16_t max_bytes, uint8_t * continuation, uint8_t * data, uint16_t * data_len){
+    if (pattern){
+        request_begin(SDP_ServiceSearchAttributeRequest);
+        request_add(pattern, de_get_len(pattern));
+    } else {
+        request_begin(SDP_ServiceAttributeRequest);
+        net_store_32(request, request_len, handle);
+        request_len += 4;
+    }
+    request_add_16(max_bytes);
+    request_add(attribute_id_list, de_get_len(attribute_id_list));
+    request_add(continuation, 1 + continuation[0]);
+    request_send(cid);
+
+    uint8_t * response = channel_for_cid(cid)->response;
+    CHECK_EQUAL(pattern ? SDP_ServiceSearchAttributeResponse : SDP_ServiceAttributeResponse, response[0]);
+    CHECK_EQUAL(transaction_id, READ_NET_16(response, 1));
+    uint16_t byte_count = READ_NET_16(response, 5);
+    memcpy(&data[*data_len], &response[7], byte_count);
+    *data_len += byte_count;
+    uint8_t * response_continuation = &response[7 + byte_count];
+    memcpy(continuation, response_continuation, 1 + response_continuation[0]);
+    return continuation[0] != 0;
+}
+
+static void check_attribute_request(uint16_t mtu, uint32_t handle, uint8_t * pattern, uint8_t * attribute_id_list, uint8_t * expected, uint16_t expected_len){
+    uint8_t  continuation[17];
+    uint8_t  data[1000];
+    uint16_t data_len = 0;
+    channel_for_cid(CID_A)->mtu = mtu;
+    continuation[0] = 0;
+    while (attribute_request_part(CID_A, handle, pattern, attribute_id_list, 0xffff, continuation, data, &data_len));
+    CHECK_EQUAL(expected_len, data_len);
+    CHECK_EQUAL(0, memcmp(expected, data, expected_len));
+}
+
+TEST_GROUP(SDPServer){
+    void setup(){
+        btstack_memory_init();
+        sdp_init();
+        can_send_now = 1;
+        num_registered = 0;
+        transaction_id = 0;
+        channel_open(CID_A, L2CAP_DEFAULT_MTU);
+    }
+    void teardown(){
+        channel_event(CID_A, L2CAP_EVENT_CHANNEL_CLOSED);
+        channel_event(CID_B, L2CAP_EVENT_CHANNEL_CLOSED);
+        while (num_registered){
+            unregister_record(registered_handles[0]);
+        }
+    }
+};
+
+TEST(SDPServer, ServiceSearch){
+    uint32_t spp_handle = register_spp_record(1, "SPP");
+    uint32_t class_handle = register_class_record(0x1200, 1);
+    uint8_t pattern[20];
+    uint32_t handles[MAX_RECORDS];
+
+    create_pattern(pattern, 0x1101, 0);
+    CHECK_EQUAL(1, service_search(CID_A, pattern, handles));
+    CHECK_EQUAL(spp_handle, handles[0]);
+
+    create_pattern(pattern, 0x1200, 0);
+    CHECK_EQUAL(1, service_search(CID_A, pattern, handles));
+    CHECK_EQUAL(class_handle, handles[0]);
+
+    create_pattern(pattern, 0x1002, 0);
+    CHECK_EQUAL(2, service_search(CID_A, pattern, handles));
+    CHECK_EQUAL(class_handle, handles[0]);
+    CHECK_EQUAL(spp_handle, handles[1]);
+
+    // all UUIDs of the pattern have to be in the record
+    create_pattern(pattern, 0x1101, 0x0003);
+    CHECK_EQUAL(1, service_search(CID_A, pattern, handles));
+    CHECK_EQUAL(spp_handle, handles[0]);
+    create_pattern(pattern, 0x1101, 0x1200);
+    CHECK_EQUAL(0, service_search(CID_A, pattern, handles));
+
+    create_pattern(pattern, 0x1234, 0);
+    CHECK_EQUAL(0, service_search(CID_A, pattern, handles));
+}
+
+TEST(SDPServer, ServiceSearchUuidBitmapCollision){
+    uint32_t spp_handle = register_spp_record(1, "SPP");
+    service_record_item_t * item = sdp_get_record_for_handle(spp_handle);
+    uint8_t pattern[20];
+    uint32_t handles[MAX_RECORDS];
+
+    // UUID not in the record but with its bit set in the record bitmap
+    uint32_t uuid;
+    for (uuid = 0x1200; uuid <= 0xffff; uuid++){
+        uint32_t bitmap[2];
+        create_pattern(pattern, uuid, 0);
+        sdp_create_uuid_bitmap(pattern, bitmap);
+        if ((item->uuid_bitmap[0] & bitmap[0]) != bitmap[0]) continue;
+        if ((item->uuid_bitmap[1] & bitmap[1]) != bitmap[1]) continue;
+        break;
+    }
+    CHECK(uuid <= 0xffff);
+    CHECK_EQUAL(0, service_search(CID_A, pattern, handles));
+}
+
+TEST(SDPServer, AttributeRequestSortedList){
+    uint32_t handle = register_spp_record(1, "Serial Port Profile");
+    CHECK(sdp_get_record_for_handle(handle)->attribute_offsets != NULL);
+    uint8_t list[30];
+    de_create_sequence(list);
+    attribute_list_add_id(list, SDP_ServiceClassIDList);
+    attribute_list_add_range(list, SDP_ProtocolDescriptorList, SDP_LanguageBaseAttributeIDList);
+    attribute_list_add_id(list, 0x0100);
+
+    uint8_t expected[300];
+    uint16_t expected_len = expected_attribute_list(record_for_handle(handle), list, expected);
+    CHECK(expected_len > 40);
+    check_attribute_request(L2CAP_DEFAULT_MTU, handle, NULL, list, expected, expected_len);
+    check_attribute_request(24, handle, NULL, list, expected, expected_len);
+}
+
+TEST(SDPServer, AttributeRequestUnsortedOrOverlappingList){
+    uint32_t handle = register_spp_record(1, "Serial Port Profile");
+    uint8_t lists[3][30];
+    de_create_sequence(lists[0]);
+    attribute_list_add_id(lists[0], 0x0100);
+    attribute_list_add_id(lists[0], SDP_ServiceClassIDList);
+    de_create_sequence(lists[1]);
+    attribute_list_add_range(lists[1], SDP_ServiceRecordHandle, SDP_BrowseGroupList);
+    attribute_list_add_id(lists[1], SDP_ProtocolDescriptorList);
+    de_create_sequence(lists[2]);
+    attribute_list_add_range(lists[2], SDP_ProtocolDescriptorList, SDP_BluetoothProfileDescriptorList);
+    attribute_list_add_range(lists[2], SDP_ServiceClassIDList, SDP_BrowseGroupList);
+
+    // each attribute is reported once, in record order
+    int i;
+    for (i = 0; i < 3; i++){
+        uint8_t expected[300];
+        uint16_t expected_len = expected_attribute_list(record_for_handle(handle), lists[i], expected);
+        check_attribute_request(L2CAP_DEFAULT_MTU, handle, NULL, lists[i], expected, expected_len);
+        check_attribute_request(24, handle, NULL, lists[i], expected, expected_len);
+    }
+}
+
+TEST(SDPServer, ServiceSearchAttributeRequest){
+    uint32_t handles[2];
+    handles[1] = register_spp_record(1, "Serial Port Profile");
+    register_class_record(0x1200, 1);
+    handles[0] = register_spp_record(2, "Second Serial Port");
+    uint8_t pattern[20];
+    create_pattern(pattern, 0x1101, 0);
+    uint8_t lists[2][30];
+    de_create_sequence(lists[0]);
+    attribute_list_add_range(lists[0], SDP_ServiceClassIDList, SDP_ProtocolDescriptorList);
+    attribute_list_add_id(lists[0], 0x0100);
+    de_create_sequence(lists[1]);
+    attribute_list_add_id(lists[1], 0x0100);
+    attribute_list_add_range(lists[1], SDP_ServiceRecordHandle, SDP_ProtocolDescriptorList);
+
+    int i;
+    for (i = 0; i < 2; i++){
+        uint8_t expected[300];
+        uint16_t expected_len = expected_attribute_lists(handles, 2, lists[i], expected);
+        check_attribute_request(L2CAP_DEFAULT_MTU, 0, pattern, lists[i], expected, expected_len);
+        check_attribute_request(30, 0, pattern, lists[i], expected, expected_len);
+    }
+}
+
+TEST(SDPServer, TwoConnectionsInterleaved){
+    uint32_t handles[4];
+    handles[3] = register_class_record(0x1200, 1);
+    handles[2] = register_spp_record(1, "Serial Port Profile");
+    handles[1] = register_class_record(0x1200, 2);
+    handles[0] = register_spp_record(2, "Second Serial Port");
+    channel_open(CID_B, 40);
+    channel_for_cid(CID_A)->mtu = 30;
+    uint8_t pattern[20];
+    create_pattern(pattern, 0x1002, 0);
+    uint8_t list[20];
+    de_create_sequence(list);
+    attribute_list_add_range(list, 0x0000, 0xffff);
+
+    uint8_t expected[500];
+    uint16_t expected_len = expected_attribute_lists(handles, 4, list, expected);
+
+    // continuation requests on both connections alternate
+    uint8_t  continuation_a[17], continuation_b[17];
+    uint8_t  data_a[500], data_b[500];
+    uint16_t data_a_len = 0, data_b_len = 0;
+    int more_a = 1, more_b = 1;
+    continuation_a[0] = 0;
+    continuation_b[0] = 0;
+    while (more_a || more_b){
+        if (more_a){
+            more_a = attribute_request_part(CID_A, 0, pattern, list, 0xffff, continuation_a, data_a, &data_a_len);
+        }
+        if (more_b){
+            more_b = attribute_request_part(CID_B, 0, pattern, list, 0xffff, continuation_b, data_b, &data_b_len);
+        }
+    }
+    CHECK(channel_for_cid(CID_B)->responses > 2);
+    CHECK(channel_for_cid(CID_A)->responses > channel_for_cid(CID_B)->responses);
+    CHECK_EQUAL(expected_len, data_a_len);
+    CHECK_EQUAL(0, memcmp(expected, data_a, expected_len));
+    CHECK_EQUAL(expected_len, data_b_len);
+    CHECK_EQUAL(0, memcmp(expected, data_b, expected_len));
+}
+
+TEST(SDPServer, PendingResponsesPerConnection){
+    uint32_t spp_handle = register_spp_record(1, "SPP");
+    uint32_t class_handle = register_class_record(0x1200, 1);
+    channel_open(CID_B, L2CAP_DEFAULT_MTU);
+    uint8_t pattern_a[20], pattern_b[20];
+    create_pattern(pattern_a, 0x1101, 0);
+    create_pattern(pattern_b, 0x1200, 0);
+
+    can_send_now = 0;
+    service_search_request(CID_A, pattern_a);
+    service_search_request(CID_B, pattern_b);
+    CHECK_EQUAL(0, channel_for_cid(CID_A)->responses);
+    CHECK_EQUAL(0, channel_for_cid(CID_B)->responses);
+
+    // one pending response is sent per DAEMON_EVENT_HCI_PACKET_SENT
+    can_send_now = 1;
+    channel_event(0, DAEMON_EVENT_HCI_PACKET_SENT);
+    CHECK_EQUAL(1, channel_for_cid(CID_A)->responses + channel_for_cid(CID_B)->responses);
+    channel_event(0, DAEMON_EVENT_HCI_PACKET_SENT);
+    CHECK_EQUAL(1, channel_for_cid(CID_A)->responses);
+    CHECK_EQUAL(1, channel_for_cid(CID_B)->responses);
+    CHECK_EQUAL(1, READ_NET_16(channel_for_cid(CID_A)->response, 1));
+    CHECK_EQUAL(spp_handle, READ_NET_32(channel_for_cid(CID_A)->response, 9));
+    CHECK_EQUAL(2, READ_NET_16(channel_for_cid(CID_B)->response, 1));
+    CHECK_EQUAL(class_handle, READ_NET_32(channel_for_cid(CID_B)->response, 9));
+}
+
+// ServiceSearchAttributeRequest for all attributes of the records in the public browse group. the first response
+// only contains the first record, its continuation state refers to the record at index 1
+static void request_first_record(uint8_t * pattern, uint8_t * list, uint8_t * continuation){
+    uint8_t  data[300];
+    uint16_t data_len = 0;
+    create_pattern(pattern, 0x1002, 0);
+    de_create_sequence(list);
+    attribute_list_add_range(list, 0x0000, 0xffff);
+    uint16_t first_len = expected_attribute_list(record_for_handle(registered_handles[num_registered-1]), list, data);
+    continuation[0] = 0;
+    CHECK(attribute_request_part(CID_A, 0, pattern, list, 3 + first_len + 1, continuation, data, &data_len));
+    CHECK_EQUAL(3 + first_len, data_len);
+    CHECK_EQUAL(4, continuation[0]);
+    CHECK_EQUAL(1, READ_NET_16(continuation, 1));
+    CHECK_EQUAL(0, READ_NET_16(continuation, 3));
+}
+
+static void check_continuation(uint8_t * pattern, uint8_t * list, uint8_t * continuation, uint32_t * handles, int num_handles){
+    uint8_t  expected[300];
+    uint16_t expected_len = 0;
+    int i;
+    for (i = 0; i < num_handles; i++){
+        expected_len += expected_attribute_list(record_for_handle(handles[i]), list, &expected[expected_len]);
+    }
+    uint8_t  data[300];
+    uint16_t data_len = 0;
+    CHECK(!attribute_request_part(CID_A, 0, pattern, list, 0xffff, continuation, data, &data_len));
+    CHECK_EQUAL(expected_len, data_len);
+    CHECK_EQUAL(0, memcmp(expected, data, expected_len));
+}
+
+TEST(SDPServer, ContinuationAfterRegister){
+    uint32_t handles[3];
+    handles[2] = register_class_record(0x1200, 1);
+    handles[1] = register_class_record(0x1200, 2);
+    handles[0] = register_class_record(0x1200, 3);
+    uint8_t pattern[20];
+    uint8_t list[20];
+    uint8_t continuation[17];
+    request_first_record(pattern, list, continuation);
+
+    // new record is added in front, index 1 now refers to the record already sent
+    register_class_record(0x1200, 4);
+    check_continuation(pattern, list, continuation, handles, 3);
+}
+
+TEST(SDPServer, ContinuationAfterRemove){
+    uint32_t handles[3];
+    handles[2] = register_class_record(0x1200, 1);
+    handles[1] = register_class_record(0x1200, 2);
+    handles[0] = register_class_record(0x1200, 3);
+    uint8_t pattern[20];
+    uint8_t list[20];
+    uint8_t continuation[17];
+    request_first_record(pattern, list, continuation);
+
+    // record at index 1 is removed, index 1 now refers to the last record
+    unregister_record(handles[1]);
+    check_continuation(pattern, list, continuation, &handles[2], 1);
+}
+
+int main (int argc, const char * argv[]){
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -0,0 +1,210 @@
+
+// *****************************************************************************
+//
+// test sdp client sessions and single query API with L2CAP stubs
+//
+// *****************************************************************************
+
+#include "btstack-config.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack/hci_cmds.h>
+#include <btstack/run_loop.h>
+
+#include "l2cap.h"
+#include "sdp.h"
+#include "sdp_client.h"
+#include "sdp_parser.h"
+
+#include "CppUTest/TestHarness.h"
+#include "CppUTest/CommandLineTestRunner.h"
+
+#define TEST_CID   0x0041
+#define LEGACY_CID 0x0042
+
+void sdp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+static bd_addr_t remote = { 0x00, 0x1b, 0xdc, 0x0b, 0xe0, 0x04 };
+static uint8_t   des_service_search_pattern[] = { 0x35, 0x03, 0x19, 0x11, 0x01 };
+static uint8_t   des_attribute_id_list[] = { 0x35, 0x05, 0x0A, 0x00, 0x00, 0xff, 0xff };
+
+// L2CAP stub
+static uint8_t  outgoing_buffer[HCI_ACL_BUFFER_SIZE];
+static int      channels_created;
+static int      channels_disconnected;
+static uint16_t disconnected_cid;
+static int      requests_sent;
+static uint16_t request_transaction_id;
+
+// query results
+static int      queries_complete;
+static uint8_t  query_status;
+
+extern "C" int l2cap_can_send_packet_now(uint16_t local_cid){
+    return 1;
+}
+
+extern "C" int l2cap_reserve_packet_buffer(void){
+    return 1;
+}
+
+extern "C" void l2cap_release_packet_buffer(void){
+}
+
+extern "C" uint8_t * l2cap_get_outgoing_buffer(void){
+    return outgoing_buffer;
+}
+
+extern "C" int l2cap_send_prepared(uint16_t local_cid, uint16_t len){
+    requests_sent++;
+    request_transaction_id = READ_NET_16(outgoing_buffer, 1);
+    return 0;
+}
+
+extern "C" uint16_t l2cap_max_mtu(void){
+    return 672;
+}
+
+extern "C" void l2cap_create_channel_internal(void * connection, btstack_packet_handler_t packet_handler, bd_addr_t address, uint16_t psm, uint16_t mtu){
+    channels_created++;
+}
+
+extern "C" void l2cap_disconnect_internal(uint16_t local_cid, uint8_t reason){
+    channels_disconnected++;
+    disconnected_cid = local_cid;
+}
+
+static void emit_channel_opened(uint8_t status, uint16_t cid){
+    uint8_t event[21];
+    memset(event, 0, sizeof(event));
+    event[0] = L2CAP_EVENT_CHANNEL_OPENED;
+    event[1] = sizeof(event) - 2;
+    event[2] = status;
+    bt_flip_addr(&event[3], remote);
+    bt_store_16(event, 11, PSM_SDP);
+    bt_store_16(event, 13, cid);
+    bt_store_16(event, 17, 672);
+    sdp_packet_handler(HCI_EVENT_PACKET, cid, event, sizeof(event));
+}
+
+static void emit_channel_closed(uint16_t cid){
+    uint8_t event[4];
+    event[0] = L2CAP_EVENT_CHANNEL_CLOSED;
+    event[1] = 2;
+    bt_store_16(event, 2, cid);
+    sdp_packet_handler(HCI_EVENT_PACKET, cid, event, sizeof(event));
+}
+
+// complete ServiceSearchAttributeResponse with an empty attribute list
+static void emit_response(uint16_t cid){
+    uint8_t pdu[10];
+    pdu[0] = SDP_ServiceSearchAttributeResponse;
+    net_store_16(pdu, 1, request_transaction_id);
+    net_store_16(pdu, 3, 5);
+    net_store_16(pdu, 5, 2);
+    pdu[7] = 0x35;
+    pdu[8] = 0x00;
+    pdu[9] = 0;
+    sdp_packet_handler(L2CAP_DATA_PACKET, cid, pdu, sizeof(pdu));
+}
+
+static void handle_query_event(sdp_query_event_t * event){
+    if (event->type != SDP_QUERY_COMPLETE) return;
+    queries_complete++;
+    query_status = ((sdp_query_complete_event_t *) event)->status;
+}
+
+static sdp_client_session_t session;
+static sdp_client_query_t   query;
+
+TEST_GROUP(SDPClientSession){
+    void setup(){
+        channels_created = 0;
+        channels_disconnected = 0;
+        disconnected_cid = 0;
+        requests_sent = 0;
+        queries_complete = 0;
+        query_status = 0xff;
+        sdp_parser_init();
+        sdp_parser_register_callback(handle_query_event);
+        sdp_client_session_init(&session, remote);
+    }
+    void teardown(){
+        sdp_client_session_close(&session);
+    }
+};
+
+TEST(SDPClientSession, QueryCompletes){
+    sdp_client_session_query(&session, &query, des_service_search_pattern, des_attribute_id_list, handle_query_event);
+    CHECK_EQUAL(1, channels_created);
+    emit_channel_opened(0, TEST_CID);
+    CHECK_EQUAL(1, requests_sent);
+    emit_response(TEST_CID);
+    CHECK_EQUAL(1, queries_complete);
+    CHECK_EQUAL(0, query_status);
+}
+
+TEST(SDPClientSession, CloseUnlinksSession){
+    sdp_client_session_query(&session, &query, des_service_search_pattern, des_attribute_id_list, handle_query_event);
+    emit_channel_opened(0, TEST_CID);
+    sdp_client_session_close(&session);
+    CHECK_EQUAL(1, queries_complete);
+    CHECK_EQUAL(SDP_QUERY_INCOMPLETE, query_status);
+    CHECK_EQUAL(1, channels_disconnected);
+    CHECK_EQUAL(TEST_CID, disconnected_cid);
+
+    // session memory can be reused right away, late events for the old channel are ignored
+    memset(&session, 0x55, sizeof(session));
+    emit_response(TEST_CID);
+    emit_channel_closed(TEST_CID);
+    CHECK_EQUAL(1, queries_complete);
+
+    sdp_client_session_init(&session, remote);
+    sdp_client_session_query(&session, &query, des_service_search_pattern, des_attribute_id_list, handle_query_event);
+    CHECK_EQUAL(2, channels_created);
+}
+
+TEST(SDPClientSession, CloseWhileConnecting){
+    sdp_client_session_query(&session, &query, des_service_search_pattern, des_attribute_id_list, handle_query_event);
+    sdp_client_session_close(&session);
+    CHECK_EQUAL(1, queries_complete);
+    CHECK_EQUAL(SDP_QUERY_INCOMPLETE, query_status);
+    CHECK_EQUAL(0, channels_disconnected);
+
+    // channel opened for the closed session is released
+    emit_channel_opened(0, TEST_CID);
+    CHECK_EQUAL(1, channels_disconnected);
+    CHECK_EQUAL(TEST_CID, disconnected_cid);
+    CHECK_EQUAL(0, requests_sent);
+}
+
+TEST(SDPClientSession, SingleQueryRefusedWhileBusy){
+    CHECK(sdp_client_ready());
+    CHECK_EQUAL(0, sdp_client_query(remote, des_service_search_pattern, des_attribute_id_list));
+    CHECK(!sdp_client_ready());
+    CHECK_EQUAL(BTSTACK_BUSY, sdp_client_query(remote, des_service_search_pattern, des_attribute_id_list));
+
+    emit_channel_opened(0, LEGACY_CID);
+    CHECK_EQUAL(1, requests_sent);
+    emit_response(LEGACY_CID);
+    CHECK_EQUAL(1, queries_complete);
+    CHECK_EQUAL(0, query_status);
+    CHECK(sdp_client_ready());
+
+    // channel is kept open for the next query
+    CHECK_EQUAL(0, sdp_client_query(remote, des_service_search_pattern, des_attribute_id_list));
+    CHECK_EQUAL(1, channels_created);
+    CHECK_EQUAL(2, requests_sent);
+    emit_response(LEGACY_CID);
+    CHECK_EQUAL(2, queries_complete);
+    emit_channel_closed(LEGACY_CID);
+}
+
+int main (int argc, const char * argv[]){
+    run_loop_init(RUN_LOOP_POSIX);
+    return CommandLineTestRunner::RunAllTests(argc, argv);
+}
@@ -82,7 +82,12 @@ static uint8_t  sdp_test_record_list[] = { 0x36, 0x02, 0xE7, 0x35, 0x48,
 };
 
 // dummy function to allow compile without the stack
-extern "C" void sdp_client_query(bd_addr_t remote, uint8_t * des_serviceSearchPattern, uint8_t * des_attributeIDList){
+extern "C" int sdp_client_query(bd_addr_t remote, uint8_t * des_serviceSearchPattern, uint8_t * des_attributeIDList){
+    return 0;
+}
+
+extern "C" int sdp_client_ready(void){
+    return 1;
 }
 
 // for test purposes
@@ -17,7 +17,10 @@ static void (*event_packet_handler) (void * connection, uint8_t packet_type, uin
 static uint8_t packet_buffer[256];
 static uint16_t packet_buffer_len = 0;
 
-static uint8_t aes128_cyphertext[16];
+// results of le encrypt commands not reported yet, oldest first
+#define AES128_PENDING_MAX 8
+static uint8_t aes128_cyphertext[AES128_PENDING_MAX][16];
+static int     aes128_pending;
 
 
 uint8_t * mock_packet_buffer(void){
@@ -59,11 +62,22 @@ void mock_simulate_hci_event(uint8_t * packet, uint16_t size){
 	}
 }
 
+int mock_aes128_pending(void){
+	return aes128_pending;
+}
+
+void mock_aes128_clear(void){
+	aes128_pending = 0;
+}
+
 void aes128_report_result(){
+	if (!aes128_pending) return;
 	uint8_t le_enc_result[22];
 	uint8_t enc1_data[] = { 0x0e, 0x14, 0x01, 0x17, 0x20, 0x00 };
 	memcpy (le_enc_result, enc1_data, 6);
-	swap128(aes128_cyphertext, &le_enc_result[6]);
+	swap128(aes128_cyphertext[0], &le_enc_result[6]);
+	aes128_pending--;
+	memmove(aes128_cyphertext[0], aes128_cyphertext[1], aes128_pending * 16);
 	mock_simulate_hci_event(&le_enc_result[0], sizeof(le_enc_result));
 }
 
@@ -104,6 +118,20 @@ void mock_simulate_connected(){
 	mock_simulate_hci_event((uint8_t *)&packet, sizeof(packet));
 }
 
+// peer address derived from handle
+void mock_simulate_connected_with_handle(uint16_t handle){
+    uint8_t packet[] = { 0x3e, 0x13, 0x01, 0x00, 0x40, 0x00, 0x01, 0x01, 0x18, 0x12, 0x5e, 0x68, 0xc9, 0x73, 0x18, 0x00, 0x00, 0x00, 0x48, 0x00, 0x05};
+	bt_store_16(packet, 4, handle);
+	packet[8] = handle & 0xff;
+	mock_simulate_hci_event((uint8_t *)&packet, sizeof(packet));
+}
+
+void mock_simulate_disconnected(uint16_t handle){
+	uint8_t packet[] = { HCI_EVENT_DISCONNECTION_COMPLETE, 4, 0x00, 0x00, 0x00, 0x13 };
+	bt_store_16(packet, 3, handle);
+	mock_simulate_hci_event((uint8_t *)&packet, sizeof(packet));
+}
+
 void att_init_connection(att_connection_t * att_connection){
     att_connection->mtu = 23;
     att_connection->encryption_key_size = 0;
@@ -147,9 +175,11 @@ int hci_send_cmd(const hci_cmd_t *cmd, ...){
  		swap128(plaintext_flipped, plaintext);
 	    // printf("le_encrypt txt ");
 	    // hexdump(plaintext, 16);
-	    aes128_calc_cyphertext(key, plaintext, aes128_cyphertext);
+	    if (aes128_pending < AES128_PENDING_MAX){
+		    aes128_calc_cyphertext(key, plaintext, aes128_cyphertext[aes128_pending++]);
+	    }
 	    // printf("le_encrypt res ");
-	    // hexdump(aes128_cyphertext, 16);
+	    // hexdump(aes128_cyphertext[aes128_pending-1], 16);
 	}
 	return 0;
 }
@@ -206,3 +236,15 @@ int hci_non_flushable_packet_boundary_flag_supported(){
 
 void l2cap_run(void){
 }
+
+int hci_can_send_command_packet_now(void){
+	return 1;
+}
+
+int hci_batch_active(void){
+	return 0;
+}
+
+int l2cap_can_send_fixed_channel_packet_now(uint16_t handle){
+	return packet_buffer_len == 0;
+}
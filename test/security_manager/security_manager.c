@@ -111,6 +111,10 @@ void mock_simulate_connected();
 uint8_t * mock_packet_buffer(void);
 uint16_t mock_packet_buffer_len(void);
 void mock_clear_packet_buffer(void);
+void mock_simulate_connected_with_handle(uint16_t handle);
+void mock_simulate_disconnected(uint16_t handle);
+int  mock_aes128_pending(void);
+void mock_aes128_clear(void);
 
 
 void CHECK_EQUAL_ARRAY(uint8_t * expected, uint8_t * actual, int size){
@@ -132,7 +136,6 @@ void CHECK_EQUAL_ARRAY(uint8_t * expected, uint8_t * actual, int size){
 TEST_GROUP(GATTClient){
 	void setup(){
 	    btstack_memory_init();
-	    run_loop_init(RUN_LOOP_POSIX);
 	    sm_init();
 	    sm_set_io_capabilities(IO_CAPABILITY_NO_INPUT_NO_OUTPUT);
 	    sm_set_authentication_requirements( SM_AUTHREQ_BONDING ); 
@@ -275,7 +278,78 @@ TEST_GROUP(GATTClient){
 TEST(GATTClient, TestScanning){
 }
 
+// RFC 4493 test vectors
+static uint8_t cmac_key[] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static uint8_t cmac_message[] = {
+    0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+    0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+    0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, };
+static uint8_t cmac_tag_16[] = { 0x07, 0x0a, 0x16, 0xb4, 0x6b, 0x4d, 0x41, 0x44 };
+static uint8_t cmac_tag_40[] = { 0xdf, 0xa6, 0x67, 0x47, 0xde, 0x9a, 0xe6, 0x30 };
+
+#define CON_HANDLE_A 0x40
+#define CON_HANDLE_B 0x41
+
+static uint8_t cmac_hash_a[8];
+static uint8_t cmac_hash_b[8];
+static int     cmac_done;
+
+static void cmac_done_handler(uint16_t con_handle, uint8_t hash[8]){
+    memcpy(con_handle == CON_HANDLE_A ? cmac_hash_a : cmac_hash_b, hash, 8);
+    cmac_done++;
+}
+
+static void report_all_aes128_results(void){
+    while (mock_aes128_pending()){
+        aes128_report_result();
+    }
+}
+
+TEST_GROUP(SecurityManagerConcurrency){
+    void setup(){
+        btstack_memory_init();
+        mock_aes128_clear();
+        sm_init();
+        mock_simulate_hci_state_working();
+        report_all_aes128_results();
+        mock_clear_packet_buffer();
+        mock_simulate_connected_with_handle(CON_HANDLE_A);
+        mock_simulate_connected_with_handle(CON_HANDLE_B);
+        cmac_done = 0;
+    }
+};
+
+TEST(SecurityManagerConcurrency, CMACOnTwoConnections){
+    CHECK(sm_cmac_ready(CON_HANDLE_A));
+    sm_cmac_start(CON_HANDLE_A, cmac_key, 16, cmac_message, &cmac_done_handler);
+    sm_cmac_start(CON_HANDLE_B, cmac_key, sizeof(cmac_message), cmac_message, &cmac_done_handler);
+    CHECK(!sm_cmac_ready(CON_HANDLE_A));
+    CHECK(!sm_cmac_ready(CON_HANDLE_B));
+    // second connection doesn't wait for the first one
+    CHECK_EQUAL(2, mock_aes128_pending());
+
+    report_all_aes128_results();
+    CHECK_EQUAL(2, cmac_done);
+    CHECK_EQUAL_ARRAY(cmac_tag_16, cmac_hash_a, 8);
+    CHECK_EQUAL_ARRAY(cmac_tag_40, cmac_hash_b, 8);
+    CHECK(sm_cmac_ready(CON_HANDLE_A));
+    CHECK(sm_cmac_ready(CON_HANDLE_B));
+}
+
+TEST(SecurityManagerConcurrency, DisconnectDropsPendingResult){
+    sm_cmac_start(CON_HANDLE_A, cmac_key, 16, cmac_message, &cmac_done_handler);
+    sm_cmac_start(CON_HANDLE_B, cmac_key, 16, cmac_message, &cmac_done_handler);
+    mock_simulate_disconnected(CON_HANDLE_A);
+    CHECK(!sm_cmac_ready(CON_HANDLE_A));
+
+    report_all_aes128_results();
+    CHECK_EQUAL(1, cmac_done);
+    CHECK_EQUAL_ARRAY(cmac_tag_16, cmac_hash_b, 8);
+}
+
 int main (int argc, const char * argv[]){
+    // run loop can be initialized only once
+    run_loop_init(RUN_LOOP_POSIX);
     hci_dump_open("hci_dump.pklg", HCI_DUMP_PACKETLOGGER);
     return CommandLineTestRunner::RunAllTests(argc, argv);
 }
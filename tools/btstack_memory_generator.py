@@ -7,7 +7,7 @@ code_template = """
 // MARK: STRUCT_TYPE
 #ifdef POOL_COUNT
 #if POOL_COUNT > 0
-static STRUCT_TYPE STRUCT_NAME_storage[POOL_COUNT];
+BTSTACK_MEMORY_STORAGE(STRUCT_TYPE, STRUCT_NAME_storage, POOL_COUNT);
 static memory_pool_t STRUCT_NAME_pool;
 STRUCT_NAME_t * btstack_memory_STRUCT_NAME_get(void){
     return memory_pool_get(&STRUCT_NAME_pool);
@@ -37,7 +37,11 @@ void btstack_memory_STRUCT_NAME_free(STRUCT_NAME_t *STRUCT_NAME){
 """
 
 init_template = """#if POOL_COUNT > 0
-    memory_pool_create(&STRUCT_NAME_pool, STRUCT_NAME_storage, POOL_COUNT, sizeof(STRUCT_TYPE));
+    memory_pool_create(&STRUCT_NAME_pool, STRUCT_NAME_storage, POOL_COUNT, BTSTACK_MEMORY_BLOCK_SIZE(STRUCT_TYPE));
+#endif"""
+
+dump_template = """#if POOL_COUNT > 0
+    BTSTACK_MEMORY_DUMP_POOL(STRUCT_NAME, POOL_COUNT);
 #endif"""
 
 def replacePlaceholder(template, struct_name):
@@ -47,7 +51,7 @@ def replacePlaceholder(template, struct_name):
     snippet = template.replace("STRUCT_TYPE", struct_type).replace("STRUCT_NAME", struct_name).replace("POOL_COUNT", pool_count)
     return snippet
     
-list_of_structs = [ "hci_connection", "l2cap_service", "l2cap_channel", "rfcomm_multiplexer", "rfcomm_service", "rfcomm_channel", "db_mem_device_name", "db_mem_device_link_key", "db_mem_service", "gatt_client", "bnep_service", "bnep_channel"]
+list_of_structs = [ "hci_connection", "l2cap_service", "l2cap_channel", "rfcomm_multiplexer", "rfcomm_service", "rfcomm_channel", "db_mem_device_name", "db_mem_device_link_key", "db_mem_service", "sdp_server_connection", "gatt_client", "gatt_client_request", "sm_connection", "bnep_service", "bnep_channel"]
 
 print "// header file"
 for struct_name in list_of_structs:
@@ -63,4 +67,10 @@ for struct_name in list_of_structs:
     print replacePlaceholder(init_template, struct_name)
 print "}"
 
+print "// dump"
+print "void btstack_memory_dump(void){"
+for struct_name in list_of_structs:
+    print replacePlaceholder(dump_template, struct_name)
+print "}"
+
     